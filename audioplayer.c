@@ -1,13 +1,40 @@
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t for fseeko/ftello on 32-bit hosts too
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #ifdef __APPLE__
 #include <AudioToolbox/AudioToolbox.h>
 #endif
 
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
 // WAV header structure (minimal for PCM)
 typedef struct {
     char chunk_id[4]; // "RIFF"
@@ -23,394 +50,5339 @@ typedef struct {
     uint16_t bits_per_sample; // e.g., 8, 16, 24, 32
 } WavHeader;
 
-// Playback state (platform-agnostic)
+// Header written for output files: the canonical 44 bytes plus a 28-byte chunk right
+// after WAVE that is JUNK, or ds64 once the data outgrows 32-bit sizes (RF64, EBU
+// Tech 3306), so a file can be finalized either way without moving its data
+#define WAV_HEADER_BYTES 80
+#define DS64_SIZE 28
+
+// One chunk of a WAV file, indexed when the file is opened so nothing is rescanned
+typedef struct {
+    char id[4];
+    uint64_t offset; // File position of the chunk's payload
+    uint64_t size; // Payload bytes, from ds64 when the header field holds 0xFFFFFFFF
+} WavChunk;
+
+// Streaming reader: a thread prefetches the data chunk into a fixed set of buffers
+#define STREAM_BUFFER_COUNT 2
+#define STREAM_BUFFER_FRAMES 65536
+
+typedef struct {
+    FILE *file; // Positioned inside the data chunk, owned by the reader
+    uint8_t *buffers[STREAM_BUFFER_COUNT]; // Prefetch buffers
+    uint32_t lengths[STREAM_BUFFER_COUNT]; // Valid bytes in each filled buffer
+    atomic_int filled[STREAM_BUFFER_COUNT]; // 1 while a buffer belongs to the consumer
+    uint32_t buffer_size; // Capacity of each buffer, a whole number of frames
+    uint64_t remaining; // Bytes of the data chunk not yet read, UINT64_MAX up to the end of input (reader thread only)
+    uint32_t block_align;
+    int pipe; // Forward-only input (stdin or a pipe): read as it arrives, whole frames at a time
+    uint32_t read_index; // Buffer being consumed (consumer only)
+    uint32_t read_pos; // Position inside that buffer (consumer only)
+    atomic_int done; // Reader reached the end of the data chunk
+    atomic_int stop; // Ask the reader to exit
+    pthread_t thread;
+    int thread_running; // 0 once a restart after a seek has failed
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} StreamReader;
+
+// FLAC file (RFC 9639), decoded from a shared mapping of the whole file
+typedef struct {
+    uint64_t offset; // File position of the frame
+    uint64_t first_sample;
+} FlacFrame;
+
+typedef struct {
+    uint8_t *base; // Mapped file
+    size_t size;
+    uint64_t audio_offset; // File position of the first frame
+    uint32_t min_block; // Block sizes in samples, from STREAMINFO
+    uint32_t max_block;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t bits_per_sample; // As coded, 4-32
+    uint32_t container_bytes; // Bytes per decoded sample: 2, 3 or 4
+    uint32_t shift; // Left shift from the coded width up to the container
+    uint64_t total_samples; // Per channel
+    uint64_t (*seek_points)[2]; // SEEKTABLE sample number and frame offset pairs
+    uint32_t seek_count;
+    FlacFrame *frames; // Every frame, once flac_index_frames has run
+    uint32_t frame_count;
+    // Sequential decoding for playback: one frame at a time, so memory stays bounded
+    int32_t *planar; // max_block samples per channel
+    uint8_t *pcm; // Current frame, interleaved in the container format
+    uint32_t pcm_frames;
+    uint32_t pcm_pos;
+    uint64_t next_offset; // File position of the next frame to decode
+    uint64_t next_sample;
+} FlacFile;
+
+// Lock-free single-producer/single-consumer ring of device-format frames
+#define RING_DEFAULT_FRAMES 16384
+#define PRODUCER_CHUNK_FRAMES 1024
+
+typedef struct {
+    uint8_t *data; // capacity * frame_size bytes
+    uint32_t capacity; // Frames, a power of two
+    uint32_t frame_size; // Bytes per device frame
+    atomic_uint write_pos; // Frames written, advanced by the producer only
+    atomic_uint read_pos; // Frames read, advanced by the consumer only
+} FrameRing;
+
+// Sample encodings the converters read and write
+typedef enum {
+    SAMPLE_U8, // 8-bit unsigned integer
+    SAMPLE_S16, // 16-bit signed integer
+    SAMPLE_S24, // 24-bit signed integer, packed in 3 bytes
+    SAMPLE_S32, // 32-bit signed integer
+    SAMPLE_F32, // 32-bit IEEE float
+    SAMPLE_FORMAT_COUNT
+} SampleFormat;
+
+static const char *const sample_format_names[SAMPLE_FORMAT_COUNT] = { "u8", "s16", "s24", "s32", "f32" };
+static const uint32_t sample_format_bytes[SAMPLE_FORMAT_COUNT] = { 1, 2, 3, 4, 4 };
+
+// Channel mappings with their own specialized converters
+typedef enum {
+    LAYOUT_MONO, // 1 -> 1
+    LAYOUT_STEREO, // 2 -> 2
+    LAYOUT_MONO_TO_STEREO, // 1 -> 2
+    LAYOUT_COPY, // N -> N
+    LAYOUT_MONO_UP, // 1 -> N, mono copied to every channel
+    LAYOUT_TRUNCATE, // N -> M < N, first M channels kept
+    LAYOUT_EXTEND, // N -> M > N, extra channels get the average of the inputs
+    LAYOUT_COUNT
+} ChannelLayout;
+
+// WAVE_FORMAT_EXTENSIBLE speaker positions; channels appear in bit order
+enum {
+    SPEAKER_FL = 1 << 0, // Front left
+    SPEAKER_FR = 1 << 1, // Front right
+    SPEAKER_FC = 1 << 2, // Front centre
+    SPEAKER_LFE = 1 << 3, // Low frequency effects
+    SPEAKER_BL = 1 << 4, // Back left
+    SPEAKER_BR = 1 << 5, // Back right
+    SPEAKER_FLC = 1 << 6, // Front left of centre
+    SPEAKER_FRC = 1 << 7, // Front right of centre
+    SPEAKER_BC = 1 << 8, // Back centre
+    SPEAKER_SL = 1 << 9, // Side left
+    SPEAKER_SR = 1 << 10, // Side right
+    SPEAKER_TC = 1 << 11, // Top centre
+    SPEAKER_TFL = 1 << 12, // Top front left
+    SPEAKER_TFC = 1 << 13, // Top front centre
+    SPEAKER_TFR = 1 << 14, // Top front right
+    SPEAKER_TBL = 1 << 15, // Top back left
+    SPEAKER_TBC = 1 << 16, // Top back centre
+    SPEAKER_TBR = 1 << 17, // Top back right
+};
+
+// Channel mixing for layouts without a specialized converter: each output frame
+// is gains x input frame, with the matrix built once per stream
+#define MIX_MAX_CHANNELS 18 // One per speaker position
+#define MIX_LANES 24 // Gains per column, padded to whole 8-float vectors
+
+typedef struct {
+    uint32_t in_channels;
+    uint32_t out_channels;
+    uint32_t columns; // Inputs that reach at least one output
+    uint32_t column_input[MIX_MAX_CHANNELS]; // Input channel feeding each column
+    float gains[MIX_MAX_CHANNELS][MIX_LANES]; // Per column, the gain into each output channel
+} ChannelMatrix;
+
+// Cascaded biquad EQ over interleaved float frames, in transposed direct form II
+#define EQ_MAX_BANDS 16
+
+typedef struct {
+    uint32_t bands;
+    uint32_t channels; // Up to MIX_MAX_CHANNELS
+    float coeffs[EQ_MAX_BANDS][5]; // b0, b1, b2, a1, a2, normalized so a0 = 1
+    float state[EQ_MAX_BANDS][2][MIX_LANES]; // Per band and channel, padded to whole vectors
+} BiquadCascade;
+
+// Block kernels between packed samples and float, one set per instruction set
+typedef void (*DecodeFn)(const uint8_t *src, float *dst, size_t samples);
+typedef void (*EncodeFn)(const float *src, uint8_t *dst, size_t samples);
+// Resampler filter row: dst[c] = coeffs . history[c * stride ...] for each channel;
+// taps is a multiple of 8
+typedef void (*FirFn)(const float *coeffs, const float *history, size_t stride, uint32_t channels, size_t taps,
+                      float *dst);
+// Channel matrix; may store up to 8 floats past the last output frame
+typedef void (*MixFn)(const ChannelMatrix *matrix, const float *src, float *dst, size_t frames);
+// Biquad cascade in place over interleaved frames, carrying its state across calls
+typedef void (*BiquadFn)(BiquadCascade *eq, float *samples, size_t frames);
+// Per-channel minimum, maximum and sum of squares of interleaved frames, for up to MIX_MAX_CHANNELS
+typedef void (*PeakFn)(const float *samples, uint32_t channels, size_t frames, float *min, float *max, float *squares);
+
+#define PCM_KERNEL_SETS_MAX 3 // scalar plus at most two vector sets per architecture
+
+typedef struct {
+    const char *name;
+    DecodeFn decode[SAMPLE_FORMAT_COUNT];
+    EncodeFn encode[SAMPLE_FORMAT_COUNT]; // No u8 encoder, outputs are 16 bits or wider
+    FirFn fir;
+    MixFn mix;
+    BiquadFn biquad;
+    PeakFn peaks;
+} PcmKernels;
+
+struct Converter;
+typedef void (*ConvertFn)(const struct Converter *conv, const uint8_t *src, uint8_t *dst, uint32_t frames);
+
+// Conversion from the WAV format to the device format, selected once per stream
+typedef struct Converter {
+    ConvertFn fn; // Specialized routine for this format pair and layout
+    uint32_t in_channels;
+    uint32_t out_channels;
+    float mix_scale; // 1 / in_channels, for LAYOUT_EXTEND
+    DecodeFn decode; // Block kernels for layouts where channels pass straight through,
+    EncodeFn encode; // and for matrix mixing
+    MixFn mix;
+    ChannelMatrix matrix;
+    uint32_t in_sample_bytes;
+    uint32_t out_sample_bytes;
+} Converter;
+
+// Polyphase windowed-sinc resampling between the decode and encode stages
+#define RESAMPLE_MAX_PHASES 1024 // Ratios needing more phases use the nearest one
+#define RESAMPLE_CHUNK_FRAMES 1024 // Input frames decoded per refill
+
+typedef enum {
+    RESAMPLE_LOW,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_HIGH,
+    RESAMPLE_QUALITY_COUNT
+} ResampleQuality;
+
+static const char *const resample_quality_names[RESAMPLE_QUALITY_COUNT] = { "low", "medium", "high" };
+
+// Taps per output frame (before widening for downsampling), passband edge as a
+// fraction of the lower Nyquist rate, and Kaiser window beta (stopband depth)
+static const struct {
+    uint32_t taps;
+    float rolloff;
+    float beta;
+} resample_quality_params[RESAMPLE_QUALITY_COUNT] = {
+    { 16, 0.85f, 6.0f }, // ~60 dB
+    { 32, 0.91f, 8.5f }, // ~85 dB
+    { 64, 0.95f, 11.0f }, // ~110 dB
+};
+
+// Filter bank for one rate ratio and quality, built once and shared by every
+// stream that needs it
+typedef struct ResampleBank {
+    uint32_t up; // Output rate / gcd
+    uint32_t down; // Input rate / gcd
+    ResampleQuality quality;
+    uint32_t phases; // Rows: one per output phase, at most RESAMPLE_MAX_PHASES
+    uint32_t taps; // Coefficients per row, a multiple of 8
+    float *coeffs; // phases * taps
+    struct ResampleBank *next;
+} ResampleBank;
+
+typedef struct {
+    const ResampleBank *bank;
+    uint32_t input_rate; // Track rate the bank converts from
+    uint32_t channels;
+    float *history; // Planar input frames, one run of capacity frames per channel
+    uint32_t capacity;
+    uint32_t length; // Valid frames in history
+    uint32_t index; // First history frame under the next output's filter window
+    uint32_t phase; // Output position past index, in 1/up input frames
+    int flushed; // Zero tail appended after the last input frame
+    float *input; // Interleaved decoded input, RESAMPLE_CHUNK_FRAMES frames
+    float *output; // Interleaved resampled frames, PRODUCER_CHUNK_FRAMES frames
+    EncodeFn encode; // Resampled float to the device format
+} Resampler;
+
+// Effects applied to whole blocks of float frames at the output rate, between the
+// converter (or resampler) and the device format: gain, EQ bands, then the limiter
+#define EFFECTS_GAIN_SMOOTHING 0.02 // Seconds for a gain change to settle by 1/e
+
+typedef enum {
+    EQ_PEAK,
+    EQ_LOWSHELF,
+    EQ_HIGHSHELF,
+    EQ_LOWPASS,
+    EQ_HIGHPASS,
+    EQ_TYPE_COUNT
+} EqType;
+
+static const char *const eq_type_names[EQ_TYPE_COUNT] = { "peak", "lowshelf", "highshelf", "lowpass", "highpass" };
+
+// Effects as read from the --effects file, independent of the output format
+typedef struct {
+    double gain_db;
+    uint32_t bands;
+    struct {
+        EqType type;
+        double hz;
+        double db; // Boost or cut, unused by lowpass and highpass
+        double q;
+    } eq[EQ_MAX_BANDS];
+    int limiter;
+    double ceiling_db;
+    double lookahead_ms;
+    double release_ms; // Time for the limiter gain to recover by 1/e
+} EffectsConfig;
+
+typedef struct EffectChain {
+    uint32_t channels;
+    float *block; // PRODUCER_CHUNK_FRAMES frames processed in place
+    EncodeFn encode; // Processed float to the device format
+    BiquadFn biquad;
+    _Atomic float gain_target; // Linear; set by the transport while playing
+    float gain; // Reached at the end of the last block
+    float gain_decay; // Per-frame smoothing factor towards gain_target
+    BiquadCascade eq;
+    // Lookahead limiter: the minimum gain over the next lookahead + 1 frames, released
+    // exponentially and averaged over as many frames, so the gain is already down by the
+    // time a peak leaves the delay line
+    uint32_t lookahead; // Delay in frames, 0 without a limiter
+    float ceiling;
+    float release;
+    float *delay; // Interleaved, lookahead + 1 frames
+    float *window; // Released gains of the last lookahead + 1 frames
+    double window_sum;
+    float envelope;
+    float *queue_gain; // Ascending candidates for the window minimum, a ring of lookahead + 1
+    uint64_t *queue_frame;
+    uint32_t queue_head;
+    uint32_t queue_count;
+    uint64_t frames_in; // Frames pushed into the delay line, tail silence included
+    uint64_t real_in; // Frames of audio pushed
+    uint64_t frames_out;
+} EffectChain;
+
+// Callback load histogram: render time in millionths of the playback time of the
+// frames rendered, with a last bucket for callbacks that missed their deadline
+#define RENDER_LOAD_BUCKETS 12
+static const uint32_t render_load_limits[RENDER_LOAD_BUCKETS - 1] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 750000, 1000000
+};
+
+// Output thread telemetry: preallocated, written with relaxed atomics by the device
+// thread only and read by the main thread for reports
+typedef struct {
+    atomic_ullong callbacks; // Device callbacks rendered
+    atomic_ullong frames; // Frames the device asked for
+    atomic_ullong busy_ns; // Time spent rendering them
+    atomic_ullong deadline_ns; // Playback time of those frames
+    atomic_uint peak_load; // Slowest callback, in millionths of its deadline
+    atomic_uint underruns; // Callbacks that found the ring short and padded with silence
+    atomic_uint short_buffers; // Callbacks that returned fewer frames than asked (end of data)
+    atomic_uint xruns; // Underruns reported by the device itself
+    atomic_ullong load_histogram[RENDER_LOAD_BUCKETS];
+} RenderStats;
+
+// Plain copy of RenderStats taken by the reporting thread
+typedef struct {
+    uint64_t callbacks;
+    uint64_t frames;
+    uint64_t busy_ns;
+    uint64_t deadline_ns;
+    uint32_t peak_load;
+    uint32_t underruns;
+    uint32_t short_buffers;
+    uint32_t xruns;
+    uint64_t load_histogram[RENDER_LOAD_BUCKETS];
+} RenderStatsSnapshot;
+
+// How each WAV file's data chunk is read (FLAC files are always mapped)
+typedef enum {
+    SOURCE_LOAD, // Read whole into memory
+    SOURCE_STREAM, // Prefetched in the background
+    SOURCE_MAP // Shared memory mapping
+} TrackSource;
+
+// One WAV file: its format, where its data comes from and how far it has been converted
 typedef struct {
-    uint8_t *audio_data; // Raw PCM data
-    uint32_t data_size; // Total size of audio data
-    uint32_t offset; // Current position in audio data
+    const char *filename;
+    uint32_t index; // Position in the playlist
+    uint8_t *audio_data; // Raw PCM data (NULL when streaming, points into the mapping when mapped)
+    StreamReader *stream; // Prefetching reader (NULL when fully loaded)
+    FlacFile *flac; // FLAC decoder (NULL for WAV files); audio_data stays NULL
+    uint8_t *mapped_base; // Start of the file mapping (NULL unless memory-mapped)
+    size_t mapped_size; // Length of the file mapping
+    uint64_t advised_offset; // Data offset up to which read-ahead has been requested
+    uint32_t advise_window; // Bytes of read-ahead requested at a time
+    WavChunk *chunks; // Every chunk in the file, in file order
+    uint32_t chunk_count;
+    uint64_t data_offset; // File position of the first sample frame
+    uint64_t data_size; // Total size of audio data
+    uint64_t offset; // Current position in audio data
+    uint32_t block_align; // Bytes per sample frame
     uint32_t sample_rate; // For timing calculations
     uint16_t num_channels; // WAV file channels
+    uint32_t channel_mask; // Speaker positions from WAVE_FORMAT_EXTENSIBLE, 0 if not given
     uint16_t bits_per_sample; // WAV file bits per sample
-    uint16_t output_channels; // Device output channels
     uint16_t is_float; // 1 for float PCM, 0 for integer
-    uint16_t output_bits_per_channel; // Device bits per channel
-    uint16_t output_is_float; // 1 for float output, 0 for integer
-} PlaybackState;
+    float duration; // Seconds
+    struct RenderedAsset *asset; // Pre-rendered frames audio_data points into (NULL unless pre-rendered)
+    Converter converter; // WAV to device format conversion (to float when resampling)
+} Track;
 
-#ifdef __APPLE__
-// macOS-specific callback for Core Audio
-static OSStatus audioCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags,
-                              const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber,
-                              UInt32 inNumberFrames, AudioBufferList *ioData) {
-    PlaybackState *state = (PlaybackState *)inRefCon;
-    AudioBuffer *buffer = &ioData->mBuffers[0];
+// Mixer: many in-memory tracks summed into one float bus in the device callback.
+// Voice slots are preallocated; the main thread fills a free slot and posts commands
+// through a single-producer, single-consumer queue, which the output drains at the
+// start of each buffer, so the output never allocates or locks
+#define MIXER_MAX_VOICES 64
+#define MIXER_QUEUE_SIZE 256 // Commands in flight, a power of two
+#define MIXER_BLOCK_FRAMES 1024 // Bus frames summed at a time
 
-    // Log callback invocation
-    printf("Callback: frames=%u, offset=%u/%u\n", inNumberFrames, state->offset, state->data_size);
+// Who owns a voice slot: the main thread while free or done, the output while queued or playing
+typedef enum {
+    VOICE_FREE,
+    VOICE_QUEUED, // Loaded, its start command posted
+    VOICE_PLAYING,
+    VOICE_DONE // Finished or stopped; the track is still open until the slot is reused
+} VoiceState;
 
-    if (state->offset >= state->data_size) {
-        buffer->mDataByteSize = 0; // Signal end of data
-        return noErr;
-    }
+typedef enum {
+    MIXER_START,
+    MIXER_STOP, // Fade out over one block
+    MIXER_GAIN, // New gain and pan, ramped over one block
+    MIXER_STOP_ALL
+} MixerCommandType;
 
-    // Calculate bytes to copy
-    uint32_t input_bytes_per_frame = state->num_channels * (state->bits_per_sample / 8);
-    uint32_t output_bytes_per_frame = state->output_channels * (state->output_bits_per_channel / 8);
-    uint32_t input_bytes_to_copy = inNumberFrames * input_bytes_per_frame;
-    if (state->offset + input_bytes_to_copy > state->data_size) {
-        input_bytes_to_copy = state->data_size - state->offset;
-        inNumberFrames = input_bytes_to_copy / input_bytes_per_frame;
-    }
+typedef struct {
+    MixerCommandType type;
+    uint32_t voice;
+    float gain; // Linear
+    float pan; // -1 left to 1 right, only for stereo buses
+} MixerCommand;
+
+typedef struct {
+    Track track; // Whole file in memory, its converter decoding to float at the bus channel count
+    atomic_int state; // VoiceState
+    uint64_t frames;
+    uint64_t position; // Next frame to mix
+    float gain; // Last gain and pan posted, kept by the main thread
+    float pan;
+    // Output side
+    float current[MIX_MAX_CHANNELS]; // Per-channel gains at the end of the last block
+    float target[MIX_MAX_CHANNELS];
+    int stopping;
+} MixerVoice;
 
-    // Convert PCM to device format, with channel mapping
-    uint32_t samples_per_channel = inNumberFrames;
-    uint16_t out_channels = state->output_channels;
-    uint16_t in_channels = state->num_channels;
+typedef struct Mixer {
+    MixerVoice voices[MIXER_MAX_VOICES];
+    MixerCommand queue[MIXER_QUEUE_SIZE];
+    atomic_uint queue_head; // Written by the main thread
+    atomic_uint queue_tail; // Written by the output
+    uint32_t channels;
+    EncodeFn encode; // Bus to the device format
+    float *bus; // MIXER_BLOCK_FRAMES frames
+    float *scratch; // One voice's converted block
+    uint32_t active[MIXER_MAX_VOICES]; // Playing voices, in start order
+    uint32_t active_count;
+    atomic_uint started; // Voices started so far
+    atomic_uint peak_active; // Most voices playing at once
+} Mixer;
 
-    // Convert input to float for intermediate processing
-    float *temp_buffer = malloc(samples_per_channel * in_channels * sizeof(float));
-    if (!temp_buffer) {
-        printf("Error: Callback memory allocation failed\n");
-        buffer->mDataByteSize = 0;
-        return noErr;
-    }
+// Files to play back to back through one output stream
+typedef struct {
+    char **files;
+    uint32_t *roots; // Per file, length of the directory argument it was found under (0 for none)
+    uint32_t count;
+    uint32_t capacity;
+} Playlist;
 
-    if (state->is_float) {
-        // 32-bit float PCM
-        float *src = (float *)(state->audio_data + state->offset);
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < in_channels; ch++) {
-                temp_buffer[i * in_channels + ch] = src[i * in_channels + ch];
-            }
+// Output format negotiated between the player and a backend
+typedef struct {
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits_per_channel;
+    uint16_t is_float;
+} OutputFormat;
+
+// Playback state (platform-agnostic)
+typedef struct {
+    Track track; // File being converted (the producer's once started)
+    Track next; // Following playlist entry, opened ahead by the preload thread
+    int next_ready; // next holds an open track (read only after joining the preload thread)
+    Playlist playlist;
+    uint32_t next_index; // Playlist entry the preload thread tries next
+    TrackSource source;
+    const WavHeader *raw_input; // Format of raw PCM on stdin, NULL when it carries a WAV stream
+    int stdin_input; // A playlist entry is "-": stdin carries audio, not commands
+    int prerender; // Convert each track whole into the output format before it plays
+    pthread_t preload; // Opens and buffers the next track while the current one plays
+    int preload_running;
+    uint16_t output_channels; // Device output channels
+    uint16_t output_bits_per_channel; // Device bits per channel
+    uint16_t output_is_float; // 1 for float output, 0 for integer
+    uint32_t output_sample_rate; // Device sample rate
+    FrameRing ring; // Converted frames waiting for the output
+    uint32_t ring_frames; // Requested ring depth in frames (0 for the default)
+    Resampler *resampler; // NULL when the input and output rates match
+    ResampleQuality resample_quality;
+    const EffectsConfig *effects_config; // NULL to leave frames untouched
+    EffectChain *effects; // Built from effects_config for the output format
+    int mix; // Play every playlist file at once through the mixer instead of in turn
+    Mixer *mixer; // Replaces the ring as what the output reads while mixing
+    pthread_t producer; // Thread that decodes and converts into the ring
+    int producer_running;
+    atomic_int producer_stop; // Ask the producer to exit
+    StreamReader *stream_waiting; // Stream the producer sleeps on, woken by stop_producer (under control_lock)
+    atomic_int input_done; // Producer has converted the last input frame
+    atomic_int finished; // Output has consumed the last frame
+    int wake_fd; // Write end of the main thread's wakeup pipe, told once finished is set (-1 for none)
+    // Transport: the output applies pause and flushes at its next buffer, the producer
+    // applies seeks between chunks and otherwise waits on control_cond
+    atomic_int paused; // Output plays silence and holds its place in the ring
+    atomic_int stopping; // Stopped before the end, so outputs drop what they hold
+    pthread_mutex_t control_lock;
+    pthread_cond_t control_cond; // Wakes the producer for a seek or stop
+    int control_ready; // control_lock and control_cond are initialized
+    atomic_int seek_pending; // seek_seconds is waiting for the producer
+    double seek_seconds; // Target, or offset from the playing position when seek_relative
+    int seek_relative;
+    atomic_int flush_pending; // Ring frames before flush_pos were converted before a seek
+    atomic_uint flush_pos;
+    RenderStats stats; // Device thread timing and underrun counters
+    float stats_interval; // Seconds between stats reports while playing (0 for none)
+    const char *stats_path; // JSON file rewritten with each report (NULL for none)
+    const char *control_path; // UNIX socket taking transport commands (NULL for none)
+} PlaybackState;
+
+// Reader thread, pipe input: read straight into the buffer, handing it over as soon
+// as it ends on a whole frame rather than when it is full, so a live source is only
+// as late as the pipe. Polls so a stop is seen while the writer is quiet
+static size_t stream_read_pipe(StreamReader *stream, uint8_t *buffer, uint32_t size) {
+    int fd = fileno(stream->file);
+    size_t length = 0;
+    while (length < size && !atomic_load(&stream->stop)) {
+        struct pollfd ready = { .fd = fd, .events = POLLIN };
+        int events = poll(&ready, 1, 100);
+        if (events < 0 && errno != EINTR) {
+            break;
         }
-    } else if (state->bits_per_sample == 8) {
-        // 8-bit unsigned integer PCM
-        uint8_t *src = (uint8_t *)(state->audio_data + state->offset);
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < in_channels; ch++) {
-                temp_buffer[i * in_channels + ch] = (src[i * in_channels + ch] - 128) / 128.0f;
-            }
+        if (events <= 0) {
+            continue;
         }
-    } else if (state->bits_per_sample == 16) {
-        // 16-bit signed integer PCM
-        int16_t *src = (int16_t *)(state->audio_data + state->offset);
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < in_channels; ch++) {
-                temp_buffer[i * in_channels + ch] = src[i * in_channels + ch] / 32768.0f;
-            }
+        ssize_t n = read(fd, buffer + length, size - length);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-    } else if (state->bits_per_sample == 24) {
-        // 24-bit signed integer PCM
-        uint8_t *src = state->audio_data + state->offset;
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < in_channels; ch++) {
-                int32_t val = (int32_t)(src[i * input_bytes_per_frame + ch * 3]) |
-                              (int32_t)(src[i * input_bytes_per_frame + ch * 3 + 1] << 8) |
-                              (int32_t)((int8_t)src[i * input_bytes_per_frame + ch * 3 + 2] << 16);
-                temp_buffer[i * in_channels + ch] = val / 8388608.0f;
-            }
+        if (n <= 0) {
+            break; // End of input; a trailing partial frame is dropped by the consumer
         }
-    } else if (state->bits_per_sample == 32) {
-        // 32-bit signed integer PCM
-        int32_t *src = (int32_t *)(state->audio_data + state->offset);
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < in_channels; ch++) {
-                temp_buffer[i * in_channels + ch] = src[i * in_channels + ch] / 2147483648.0f;
-            }
+        length += (size_t)n;
+        if (length % stream->block_align == 0) {
+            break;
         }
-    } else {
-        // Unsupported bit depth
-        printf("Warning: Unsupported bit depth %u, outputting silence\n", state->bits_per_sample);
-        memset(temp_buffer, 0, samples_per_channel * in_channels * sizeof(float));
-    }
-
-    // Convert float to device format with channel mapping
-    if (state->output_is_float) {
-        // Float output
-        float *dst = (float *)buffer->mData;
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < out_channels; ch++) {
-                float sample = 0.0f;
-                if (ch < in_channels) {
-                    sample = temp_buffer[i * in_channels + ch];
-                } else if (in_channels == 1) {
-                    sample = temp_buffer[i];
-                } else {
-                    for (uint16_t in_ch = 0; in_ch < in_channels; in_ch++) {
-                        sample += temp_buffer[i * in_channels + in_ch] / in_channels;
-                    }
-                }
-                dst[i * out_channels + ch] = sample;
-            }
-        }
-    } else if (state->output_bits_per_channel == 16) {
-        // 16-bit integer output
-        int16_t *dst = (int16_t *)buffer->mData;
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < out_channels; ch++) {
-                float sample = 0.0f;
-                if (ch < in_channels) {
-                    sample = temp_buffer[i * in_channels + ch];
-                } else if (in_channels == 1) {
-                    sample = temp_buffer[i];
-                } else {
-                    for (uint16_t in_ch = 0; in_ch < in_channels; in_ch++) {
-                        sample += temp_buffer[i * in_channels + in_ch] / in_channels;
-                    }
-                }
-                // Clip to [-1.0, 1.0] and scale to 16-bit
-                if (sample > 1.0f) sample = 1.0f;
-                if (sample < -1.0f) sample = -1.0f;
-                dst[i * out_channels + ch] = (int16_t)(sample * 32767.0f);
-            }
-        }
-    } else if (state->output_bits_per_channel == 24) {
-        // 24-bit integer output
-        uint8_t *dst = (uint8_t *)buffer->mData;
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < out_channels; ch++) {
-                float sample = 0.0f;
-                if (ch < in_channels) {
-                    sample = temp_buffer[i * in_channels + ch];
-                } else if (in_channels == 1) {
-                    sample = temp_buffer[i];
-                } else {
-                    for (uint16_t in_ch = 0; in_ch < in_channels; in_ch++) {
-                        sample += temp_buffer[i * in_channels + in_ch] / in_channels;
-                    }
-                }
-                if (sample > 1.0f) sample = 1.0f;
-                if (sample < -1.0f) sample = -1.0f;
-                int32_t val = (int32_t)(sample * 8388607.0f);
-                dst[i * output_bytes_per_frame + ch * 3] = val & 0xFF;
-                dst[i * output_bytes_per_frame + ch * 3 + 1] = (val >> 8) & 0xFF;
-                dst[i * output_bytes_per_frame + ch * 3 + 2] = (val >> 16) & 0xFF;
-            }
-        }
-    } else if (state->output_bits_per_channel == 32) {
-        // 32-bit integer output
-        int32_t *dst = (int32_t *)buffer->mData;
-        for (uint32_t i = 0; i < samples_per_channel; i++) {
-            for (uint16_t ch = 0; ch < out_channels; ch++) {
-                float sample = 0.0f;
-                if (ch < in_channels) {
-                    sample = temp_buffer[i * in_channels + ch];
-                } else if (in_channels == 1) {
-                    sample = temp_buffer[i];
-                } else {
-                    for (uint16_t in_ch = 0; in_ch < in_channels; in_ch++) {
-                        sample += temp_buffer[i * in_channels + in_ch] / in_channels;
-                    }
-                }
-                if (sample > 1.0f) sample = 1.0f;
-                if (sample < -1.0f) sample = -1.0f;
-                dst[i * out_channels + ch] = (int32_t)(sample * 2147483647.0f);
+    }
+    return length;
+}
+
+// Reader thread: fill buffers in order as the consumer hands them back
+static void *stream_reader_thread(void *arg) {
+    StreamReader *stream = (StreamReader *)arg;
+    uint32_t index = 0;
+
+    while (stream->remaining > 0) {
+        pthread_mutex_lock(&stream->lock);
+        while (atomic_load(&stream->filled[index]) && !atomic_load(&stream->stop)) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        pthread_mutex_unlock(&stream->lock);
+        if (atomic_load(&stream->stop)) {
+            break;
+        }
+
+        uint32_t to_read = stream->remaining < stream->buffer_size ? (uint32_t)stream->remaining : stream->buffer_size;
+        size_t bytes_read = stream->pipe ? stream_read_pipe(stream, stream->buffers[index], to_read)
+                                         : fread(stream->buffers[index], 1, to_read, stream->file);
+        if (bytes_read == 0) {
+            if (stream->remaining != UINT64_MAX && !atomic_load(&stream->stop)) {
+                printf("Warning: Data chunk ended early (%llu bytes missing)\n", (unsigned long long)stream->remaining);
             }
+            break;
         }
-    } else {
-        // Unsupported output bit depth
-        printf("Warning: Unsupported output bit depth %u, outputting silence\n", state->output_bits_per_channel);
-        memset(buffer->mData, 0, inNumberFrames * output_bytes_per_frame);
+        stream->lengths[index] = (uint32_t)bytes_read;
+        if (stream->remaining != UINT64_MAX) {
+            stream->remaining -= bytes_read;
+        }
+        pthread_mutex_lock(&stream->lock);
+        atomic_store_explicit(&stream->filled[index], 1, memory_order_release);
+        pthread_cond_signal(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+        index = (index + 1) % STREAM_BUFFER_COUNT;
     }
 
-    free(temp_buffer);
-    buffer->mDataByteSize = inNumberFrames * output_bytes_per_frame;
-    state->offset += input_bytes_to_copy;
+    pthread_mutex_lock(&stream->lock);
+    atomic_store_explicit(&stream->done, 1, memory_order_release);
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
 
-    return noErr;
+// Start prefetching the data chunk; takes ownership of file
+static StreamReader *stream_open(FILE *file, uint64_t data_size, uint32_t block_align, int pipe) {
+    StreamReader *stream = calloc(1, sizeof(StreamReader));
+    if (!stream) {
+        return NULL;
+    }
+    stream->file = file;
+    stream->remaining = data_size;
+    stream->block_align = block_align;
+    stream->pipe = pipe;
+    stream->buffer_size = STREAM_BUFFER_FRAMES * block_align;
+    stream->buffers[0] = malloc((size_t)stream->buffer_size * STREAM_BUFFER_COUNT);
+    if (!stream->buffers[0]) {
+        free(stream);
+        return NULL;
+    }
+    for (int i = 1; i < STREAM_BUFFER_COUNT; i++) {
+        stream->buffers[i] = stream->buffers[0] + (size_t)i * stream->buffer_size;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (pthread_create(&stream->thread, NULL, stream_reader_thread, stream) != 0) {
+        pthread_cond_destroy(&stream->cond);
+        pthread_mutex_destroy(&stream->lock);
+        free(stream->buffers[0]);
+        free(stream);
+        return NULL;
+    }
+    stream->thread_running = 1;
+    return stream;
 }
-#endif
 
-// Read and parse WAV file (platform-agnostic)
-static int read_wav_file(const char *filename, PlaybackState *state, float *duration) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        printf("Error: Cannot open file %s\n", filename);
-        return 1;
+// Stop the reader thread and release its buffers and file
+static void stream_close(StreamReader *stream) {
+    pthread_mutex_lock(&stream->lock);
+    atomic_store(&stream->stop, 1);
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    if (stream->thread_running) {
+        pthread_join(stream->thread, NULL);
     }
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+    fclose(stream->file);
+    free(stream->buffers[0]);
+    free(stream);
+}
 
-    // Read RIFF header
-    char riff_id[4];
-    uint32_t riff_size;
-    char format[4];
-    if (fread(riff_id, 4, 1, file) != 1 || fread(&riff_size, 4, 1, file) != 1 ||
-        fread(format, 4, 1, file) != 1) {
-        printf("Error: Failed to read RIFF header\n");
-        fclose(file);
-        return 1;
+// Consumer side: restart the reader at file position with remaining bytes of data
+// left, dropping whatever it had prefetched. Costs one read at the new position
+static int stream_seek(StreamReader *stream, uint64_t position, uint64_t remaining) {
+    pthread_mutex_lock(&stream->lock);
+    atomic_store(&stream->stop, 1);
+    pthread_cond_signal(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    if (stream->thread_running) {
+        pthread_join(stream->thread, NULL);
     }
-    if (strncmp(riff_id, "RIFF", 4) != 0 || strncmp(format, "WAVE", 4) != 0) {
-        printf("Error: Not a valid WAV file\n");
-        fclose(file);
+    for (int i = 0; i < STREAM_BUFFER_COUNT; i++) {
+        atomic_store(&stream->filled[i], 0);
+    }
+    stream->read_index = 0;
+    stream->read_pos = 0;
+    stream->remaining = fseeko(stream->file, (off_t)position, SEEK_SET) == 0 ? remaining : 0;
+    atomic_store(&stream->done, 0);
+    atomic_store(&stream->stop, 0);
+    stream->thread_running = pthread_create(&stream->thread, NULL, stream_reader_thread, stream) == 0;
+    if (!stream->thread_running) {
+        atomic_store(&stream->done, 1); // Reads as the end of the data from here on
         return 1;
     }
-    printf("RIFF chunk: size=%u, format=WAVE\n", riff_size);
+    return 0;
+}
 
-    // Read fmt chunk
-    WavHeader header = {0};
-    if (fread(header.subchunk1_id, 4, 1, file) != 1 || fread(&header.subchunk1_size, 4, 1, file) != 1) {
-        printf("Error: Failed to read fmt chunk header\n");
-        fclose(file);
-        return 1;
+// Consumer side: contiguous bytes ready in the current buffer, 0 if the reader is behind
+static uint32_t stream_peek(StreamReader *stream, const uint8_t **data) {
+    uint32_t index = stream->read_index;
+    if (!atomic_load_explicit(&stream->filled[index], memory_order_acquire)) {
+        return 0;
     }
-    if (strncmp(header.subchunk1_id, "fmt ", 4) != 0) {
-        printf("Error: fmt chunk not found\n");
-        fclose(file);
-        return 1;
+    *data = stream->buffers[index] + stream->read_pos;
+    return stream->lengths[index] - stream->read_pos;
+}
+
+// Consumer side: mark bytes as used, handing the buffer back once it is drained
+static void stream_consume(StreamReader *stream, uint32_t bytes) {
+    uint32_t index = stream->read_index;
+    stream->read_pos += bytes;
+    if (stream->read_pos >= stream->lengths[index]) {
+        stream->read_pos = 0;
+        stream->read_index = (index + 1) % STREAM_BUFFER_COUNT;
+        // Under the lock, so the reader cannot miss it between its check and its wait
+        pthread_mutex_lock(&stream->lock);
+        atomic_store_explicit(&stream->filled[index], 0, memory_order_release);
+        pthread_cond_signal(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
     }
-    printf("fmt chunk: size=%u\n", header.subchunk1_size);
+}
 
-    // Read fmt data
-    if (fread(&header.audio_format, 2, 1, file) != 1 || fread(&header.num_channels, 2, 1, file) != 1 ||
-        fread(&header.sample_rate, 4, 1, file) != 1 || fread(&header.byte_rate, 4, 1, file) != 1 ||
-        fread(&header.block_align, 2, 1, file) != 1 || fread(&header.bits_per_sample, 2, 1, file) != 1) {
-        printf("Error: Failed to read fmt chunk data\n");
-        fclose(file);
-        return 1;
+// Consumer side: 1 when the reader has finished and every buffer is drained
+static int stream_finished(StreamReader *stream) {
+    return atomic_load_explicit(&stream->done, memory_order_acquire) &&
+           !atomic_load_explicit(&stream->filled[stream->read_index], memory_order_acquire);
+}
+
+// Consumer side: sleep until the current buffer is filled, the reader finishes or
+// *cancel is set; whoever sets *cancel wakes it with stream_wake
+static void stream_wait(StreamReader *stream, atomic_int *cancel) {
+    pthread_mutex_lock(&stream->lock);
+    while (!atomic_load(&stream->filled[stream->read_index]) && !atomic_load(&stream->done) && !atomic_load(cancel)) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
     }
-    state->is_float = 0;
-    if (header.audio_format == 1) {
-        // PCM (integer)
-        if (header.bits_per_sample % 8 != 0) {
-            printf("Error: Bits per sample %u must be a multiple of 8\n", header.bits_per_sample);
-            fclose(file);
-            return 1;
-        }
-    } else if (header.audio_format == 3 && header.bits_per_sample == 32) {
-        // IEEE Float (32-bit float)
-        state->is_float = 1;
-    } else {
-        printf("Error: Only PCM or 32-bit float WAV files are supported (audio_format=%u)\n", header.audio_format);
-        fclose(file);
-        return 1;
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static void stream_wake(StreamReader *stream) {
+    pthread_mutex_lock(&stream->lock);
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Keep the kernel's read-ahead a window ahead of the playback position and drop
+// pages already played so the mapping's resident size stays bounded
+static void advise_mapping(Track *track) {
+    if (!track->mapped_base || track->advised_offset >= track->data_size ||
+        track->offset + track->advise_window / 2 < track->advised_offset) {
+        return;
     }
-    if (header.num_channels < 1) {
-        printf("Error: Invalid number of channels %u\n", header.num_channels);
-        fclose(file);
-        return 1;
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t data_start = (uintptr_t)track->audio_data;
+
+    // Pages fully behind the playback position
+    uintptr_t played_end = (data_start + track->offset) & ~(page_size - 1);
+    uintptr_t map_start = (uintptr_t)track->mapped_base;
+    if (played_end > map_start) {
+        madvise((void *)map_start, played_end - map_start, MADV_DONTNEED);
     }
-    if (header.sample_rate < 8000 || header.sample_rate > 96000) {
-        printf("Error: Sample rate %u Hz is not supported (must be 8000–96000 Hz)\n", header.sample_rate);
-        fclose(file);
-        return 1;
+
+    // Next window ahead of what has already been requested
+    uint64_t end = track->advised_offset + track->advise_window;
+    if (end > track->data_size) {
+        end = track->data_size;
     }
-    if (header.byte_rate != header.sample_rate * header.num_channels * (header.bits_per_sample / 8)) {
-        printf("Error: Invalid byte rate %u (expected %u)\n", header.byte_rate,
-               header.sample_rate * header.num_channels * (header.bits_per_sample / 8));
-        fclose(file);
-        return 1;
+    uintptr_t ahead_start = (data_start + track->advised_offset) & ~(page_size - 1);
+    madvise((void *)ahead_start, data_start + end - ahead_start, MADV_WILLNEED);
+    track->advised_offset = end;
+}
+
+// Sample loads: the i-th sample of a frame as float in [-1, 1)
+static inline float load_u8(const uint8_t *p, uint32_t i) {
+    return (p[i] - 128) * (1.0f / 128.0f);
+}
+
+static inline float load_s16(const uint8_t *p, uint32_t i) {
+    int16_t v;
+    memcpy(&v, p + i * 2, 2);
+    return v * (1.0f / 32768.0f);
+}
+
+static inline float load_s24(const uint8_t *p, uint32_t i) {
+    p += i * 3;
+    int32_t v = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+    return v * (1.0f / 8388608.0f);
+}
+
+static inline float load_s32(const uint8_t *p, uint32_t i) {
+    int32_t v;
+    memcpy(&v, p + i * 4, 4);
+    return v * (1.0f / 2147483648.0f);
+}
+
+static inline float load_f32(const uint8_t *p, uint32_t i) {
+    float v;
+    memcpy(&v, p + i * 4, 4);
+    return v;
+}
+
+// Clip to [-1, 1] before an integer store; the selects compile to min/max
+// instructions rather than branches (fminf/fmaxf can end up as libm calls)
+static inline float clip_unit(float x) {
+    x = x < 1.0f ? x : 1.0f;
+    return x > -1.0f ? x : -1.0f;
+}
+
+// Sample stores: x must already be in [-1, 1] for the integer formats
+static inline void store_s16(uint8_t *p, uint32_t i, float x) {
+    int16_t v = (int16_t)(x * 32767.0f);
+    memcpy(p + i * 2, &v, 2);
+}
+
+static inline void store_s24(uint8_t *p, uint32_t i, float x) {
+    int32_t v = (int32_t)(x * 8388607.0f);
+    p += i * 3;
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+}
+
+static inline void store_s32(uint8_t *p, uint32_t i, float x) {
+    // 1.0f * 2147483647.0f rounds up to 2^31, so cap at the largest float below it
+    float scaled = x * 2147483647.0f;
+    int32_t v = (int32_t)(scaled < 2147483520.0f ? scaled : 2147483520.0f);
+    memcpy(p + i * 4, &v, 4);
+}
+
+static inline void store_f32(uint8_t *p, uint32_t i, float x) {
+    memcpy(p + i * 4, &x, 4);
+}
+
+// Integer inputs already load into [-1, 1), so only float input needs clipping,
+// and only on its way to an integer output (float output passes overs through)
+#define UNIT_RANGE_u8 1
+#define UNIT_RANGE_s16 1
+#define UNIT_RANGE_s24 1
+#define UNIT_RANGE_s32 1
+#define UNIT_RANGE_f32 0
+#define CLIP_s16(x) clip_unit(x)
+#define CLIP_s24(x) clip_unit(x)
+#define CLIP_s32(x) clip_unit(x)
+#define CLIP_f32(x) (x)
+#define STORE(IN, OUT, p, i, x) store_##OUT(p, i, UNIT_RANGE_##IN ? (x) : CLIP_##OUT(x))
+
+#define BYTES_u8 1
+#define BYTES_s16 2
+#define BYTES_s24 3
+#define BYTES_s32 4
+#define BYTES_f32 4
+
+// Frame loops, one per layout. IN_CH/OUT_CH are literals for the fixed layouts so
+// the channel loops unroll; nothing inside a frame branches or divides
+#define CONVERT_LOOP(IN, OUT, IN_CH, OUT_CH, BODY)                               \
+    const uint32_t in_stride = (IN_CH) * BYTES_##IN;                             \
+    const uint32_t out_stride = (OUT_CH) * BYTES_##OUT;                          \
+    (void)conv;                                                                  \
+    for (uint32_t i = 0; i < frames; i++, src += in_stride, dst += out_stride) { \
+        BODY                                                                     \
     }
-    if (header.block_align != header.num_channels * (header.bits_per_sample / 8)) {
-        printf("Error: Invalid block align %u (expected %u)\n", header.block_align,
-               header.num_channels * (header.bits_per_sample / 8));
-        fclose(file);
-        return 1;
+
+#define CONVERT_BODY_COPY(IN, OUT, CH)               \
+    for (uint32_t ch = 0; ch < (CH); ch++) {         \
+        STORE(IN, OUT, dst, ch, load_##IN(src, ch)); \
     }
 
-    // Skip extra fmt data if subchunk1_size > 16
-    if (header.subchunk1_size > 16) {
-        fseek(file, header.subchunk1_size - 16, SEEK_CUR);
+#define CONVERT_BODY_SPREAD(IN, OUT, CH)     \
+    float x = load_##IN(src, 0);             \
+    for (uint32_t ch = 0; ch < (CH); ch++) { \
+        STORE(IN, OUT, dst, ch, x);          \
     }
 
-    // Find data chunk
-    char chunk_id[4];
-    uint32_t chunk_size;
-    while (fread(chunk_id, 4, 1, file) == 1 && fread(&chunk_size, 4, 1, file) == 1) {
-        printf("Chunk: id=%c%c%c%c, size=%u, file_pos=%ld\n",
-               chunk_id[0], chunk_id[1], chunk_id[2], chunk_id[3], chunk_size, ftell(file) - 8);
-        if (strncmp(chunk_id, "data", 4) == 0) {
-            state->data_size = chunk_size;
-            break;
-        }
-        fseek(file, chunk_size, SEEK_CUR); // Skip chunk
+#define CONVERT_BODY_EXTEND(IN, OUT, IN_CH, OUT_CH)    \
+    float sum = 0.0f;                                  \
+    for (uint32_t ch = 0; ch < (IN_CH); ch++) {        \
+        float x = load_##IN(src, ch);                  \
+        STORE(IN, OUT, dst, ch, x);                    \
+        sum += x;                                      \
+    }                                                  \
+    float average = sum * conv->mix_scale;             \
+    for (uint32_t ch = (IN_CH); ch < (OUT_CH); ch++) { \
+        STORE(IN, OUT, dst, ch, average);              \
     }
-    if (strncmp(chunk_id, "data", 4) != 0) {
-        printf("Error: Could not find data chunk\n");
-        fclose(file);
-        return 1;
+
+#define DEFINE_CONVERTERS(IN, OUT)                                                                                               \
+    static void convert_##IN##_##OUT##_mono(const Converter *conv, const uint8_t *restrict src, uint8_t *restrict dst,           \
+                                            uint32_t frames) {                                                                   \
+        CONVERT_LOOP(IN, OUT, 1, 1, CONVERT_BODY_COPY(IN, OUT, 1))                                                               \
+    }                                                                                                                            \
+    static void convert_##IN##_##OUT##_stereo(const Converter *conv, const uint8_t *restrict src, uint8_t *restrict dst,         \
+                                              uint32_t frames) {                                                                 \
+        CONVERT_LOOP(IN, OUT, 2, 2, CONVERT_BODY_COPY(IN, OUT, 2))                                                               \
+    }                                                                                                                            \
+    static void convert_##IN##_##OUT##_mono_to_stereo(const Converter *conv, const uint8_t *restrict src, uint8_t *restrict dst, \
+                                                      uint32_t frames) {                                                         \
+        CONVERT_LOOP(IN, OUT, 1, 2, CONVERT_BODY_SPREAD(IN, OUT, 2))                                                             \
+    }                                                                                                                            \
+    static void convert_##IN##_##OUT##_copy(const Converter *conv, const uint8_t *restrict src, uint8_t *restrict dst,           \
+                                            uint32_t frames) {                                                                   \
+        const uint32_t channels = conv->in_channels;                                                                             \
+        CONVERT_LOOP(IN, OUT, channels, channels, CONVERT_BODY_COPY(IN, OUT, channels))                                          \
+    }                                                                                                                            \
+    static void convert_##IN##_##OUT##_mono_up(const Converter *conv, const uint8_t *restrict src, uint8_t *restrict dst,        \
+                                               uint32_t frames) {                                                                \
+        const uint32_t out_channels = conv->out_channels;                                                                        \
+        CONVERT_LOOP(IN, OUT, 1, out_channels, CONVERT_BODY_SPREAD(IN, OUT, out_channels))                                       \
+    }                                                                                                                            \
+    static void convert_##IN##_##OUT##_truncate(const Converter *conv, const uint8_t *restrict src, uint8_t *restrict dst,       \
+                                                uint32_t frames) {                                                               \
+        const uint32_t in_channels = conv->in_channels, out_channels = conv->out_channels;                                       \
+        CONVERT_LOOP(IN, OUT, in_channels, out_channels, CONVERT_BODY_COPY(IN, OUT, out_channels))                               \
+    }                                                                                                                            \
+    static void convert_##IN##_##OUT##_extend(const Converter *conv, const uint8_t *restrict src, uint8_t *restrict dst,         \
+                                              uint32_t frames) {                                                                 \
+        const uint32_t in_channels = conv->in_channels, out_channels = conv->out_channels;                                       \
+        CONVERT_LOOP(IN, OUT, in_channels, out_channels, CONVERT_BODY_EXTEND(IN, OUT, in_channels, out_channels))                \
     }
 
-    // Print WAV info
-    printf("WAV Info:\n");
-    printf("  Sample Rate: %u Hz\n", header.sample_rate);
-    printf("  Channels: %u\n", header.num_channels);
-    printf("  Bits per Sample: %u\n", header.bits_per_sample);
-    printf("  Format: %s\n", state->is_float ? "Float" : "Integer PCM");
-    printf("  Byte Rate: %u bytes/s\n", header.byte_rate);
-    printf("  Block Align: %u bytes\n", header.block_align);
-    printf("  Data Size: %u bytes\n", state->data_size);
-    printf("  Duration: %.2f seconds\n", (float)state->data_size / header.byte_rate);
+#define DEFINE_CONVERTERS_FROM(IN) \
+    DEFINE_CONVERTERS(IN, s16)     \
+    DEFINE_CONVERTERS(IN, s24)     \
+    DEFINE_CONVERTERS(IN, s32)     \
+    DEFINE_CONVERTERS(IN, f32)
 
-    // Read audio data
-    state->audio_data = malloc(state->data_size);
-    if (!state->audio_data) {
-        printf("Error: Memory allocation failed\n");
-        fclose(file);
-        return 1;
+DEFINE_CONVERTERS_FROM(u8)
+DEFINE_CONVERTERS_FROM(s16)
+DEFINE_CONVERTERS_FROM(s24)
+DEFINE_CONVERTERS_FROM(s32)
+DEFINE_CONVERTERS_FROM(f32)
+
+#define CONVERTER_LAYOUTS(IN, OUT)                                                                       \
+    { convert_##IN##_##OUT##_mono, convert_##IN##_##OUT##_stereo, convert_##IN##_##OUT##_mono_to_stereo, \
+      convert_##IN##_##OUT##_copy, convert_##IN##_##OUT##_mono_up, convert_##IN##_##OUT##_truncate,      \
+      convert_##IN##_##OUT##_extend }
+
+#define CONVERTER_OUTPUTS(IN) \
+    { CONVERTER_LAYOUTS(IN, s16), CONVERTER_LAYOUTS(IN, s24), CONVERTER_LAYOUTS(IN, s32), CONVERTER_LAYOUTS(IN, f32) }
+
+// Indexed by [input format][output format - SAMPLE_S16][layout]
+static const ConvertFn converter_table[SAMPLE_FORMAT_COUNT][SAMPLE_FORMAT_COUNT - SAMPLE_S16][LAYOUT_COUNT] = {
+    CONVERTER_OUTPUTS(u8),
+    CONVERTER_OUTPUTS(s16),
+    CONVERTER_OUTPUTS(s24),
+    CONVERTER_OUTPUTS(s32),
+    CONVERTER_OUTPUTS(f32),
+};
+
+// Block decode/encode kernels between packed PCM and float, used wherever
+// channels pass straight through. Encoders clip exactly like the scalar stores
+// so every implementation produces bit-identical output
+static void decode_u8_scalar(const uint8_t *src, float *dst, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[i] = load_u8(src, (uint32_t)i);
     }
-    size_t bytes_read = fread(state->audio_data, 1, state->data_size, file);
-    if (bytes_read != state->data_size) {
-        printf("Error: Failed to read audio data (%zu bytes read, expected %u)\n",
-               bytes_read, state->data_size);
-        free(state->audio_data);
-        fclose(file);
-        return 1;
+}
+
+static void decode_s16_scalar(const uint8_t *src, float *dst, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[i] = load_s16(src, (uint32_t)i);
     }
-    fclose(file);
+}
 
-    // Initialize playback state
-    state->offset = 0;
-    state->sample_rate = header.sample_rate;
-    state->num_channels = header.num_channels;
-    state->bits_per_sample = header.bits_per_sample;
-    state->output_channels = header.num_channels; // Default, updated by platform
-    state->output_bits_per_channel = 16; // Default, updated by platform
-    state->output_is_float = 0; // Default, updated by platform
-    *duration = (float)state->data_size / header.byte_rate;
+static void decode_s24_scalar(const uint8_t *src, float *dst, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[i] = load_s24(src, (uint32_t)i);
+    }
+}
 
-    return 0;
+static void decode_s32_scalar(const uint8_t *src, float *dst, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        dst[i] = load_s32(src, (uint32_t)i);
+    }
 }
 
-// Platform-specific audio playback
-static int play_audio(PlaybackState *state, float duration) {
-#ifdef __APPLE__
-    // macOS: Use Core Audio
-    AudioComponentInstance audioUnit;
-    AudioComponentDescription desc = {
-        .componentType = kAudioUnitType_Output,
-        .componentSubType = kAudioUnitSubType_DefaultOutput,
-        .componentManufacturer = kAudioUnitManufacturer_Apple,
-        .componentFlags = 0,
-        .componentFlagsMask = 0
-    };
+static void decode_f32(const uint8_t *src, float *dst, size_t samples) {
+    memcpy(dst, src, samples * sizeof(float));
+}
 
-    AudioComponent comp = AudioComponentFindNext(NULL, &desc);
-    if (!comp) {
-        printf("Error: Cannot find audio component\n");
-        free(state->audio_data);
-        return 1;
+static void encode_s16_scalar(const float *src, uint8_t *dst, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        store_s16(dst, (uint32_t)i, clip_unit(src[i]));
     }
-    OSStatus err = AudioComponentInstanceNew(comp, &audioUnit);
-    if (err != noErr) {
-        printf("Error: Failed to create audio unit instance (%d)\n", err);
-        free(state->audio_data);
-        return 1;
+}
+
+static void encode_s24_scalar(const float *src, uint8_t *dst, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        store_s24(dst, (uint32_t)i, clip_unit(src[i]));
     }
-    err = AudioUnitInitialize(audioUnit);
-    if (err != noErr) {
-        printf("Error: Failed to initialize audio unit (%d)\n", err);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
-        return 1;
+}
+
+static void encode_s32_scalar(const float *src, uint8_t *dst, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        store_s32(dst, (uint32_t)i, clip_unit(src[i]));
     }
+}
 
-    // Query device's preferred format
-    AudioStreamBasicDescription device_asbd = {0};
-    UInt32 size = sizeof(device_asbd);
-    err = AudioUnitGetProperty(audioUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 0, &device_asbd, &size);
-    if (err != noErr) {
-        printf("Warning: Failed to get device stream format (%d), using default format\n", err);
-        device_asbd.mSampleRate = 48000.0;
+static void encode_f32(const float *src, uint8_t *dst, size_t samples) {
+    memcpy(dst, src, samples * sizeof(float));
+}
+
+// Four partial sums per channel, so the compiler can keep them in one vector
+static void fir_scalar(const float *coeffs, const float *history, size_t stride, uint32_t channels, size_t taps,
+                       float *dst) {
+    for (uint32_t c = 0; c < channels; c++, history += stride) {
+        float sum0 = 0.0f, sum1 = 0.0f, sum2 = 0.0f, sum3 = 0.0f;
+        for (size_t j = 0; j < taps; j += 4) {
+            sum0 += coeffs[j] * history[j];
+            sum1 += coeffs[j + 1] * history[j + 1];
+            sum2 += coeffs[j + 2] * history[j + 2];
+            sum3 += coeffs[j + 3] * history[j + 3];
+        }
+        dst[c] = (sum0 + sum1) + (sum2 + sum3);
+    }
+}
+
+// Columns are summed in order with separate multiplies and adds, which the vector
+// kernels repeat lane by lane
+static void mix_scalar(const ChannelMatrix *matrix, const float *src, float *dst, size_t frames) {
+    for (size_t f = 0; f < frames; f++, src += matrix->in_channels, dst += matrix->out_channels) {
+        for (uint32_t o = 0; o < matrix->out_channels; o++) {
+            float sum = 0.0f;
+            for (uint32_t c = 0; c < matrix->columns; c++) {
+                sum += matrix->gains[c][o] * src[matrix->column_input[c]];
+            }
+            dst[o] = sum;
+        }
+    }
+}
+
+// Filter state decaying through silence would reach denormals, which are slow on
+// most CPUs; below -300 dB it is as good as zero
+static void biquad_flush_denormals(BiquadCascade *eq) {
+    for (uint32_t b = 0; b < eq->bands; b++) {
+        for (uint32_t c = 0; c < eq->channels; c++) {
+            for (int z = 0; z < 2; z++) {
+                if (fabsf(eq->state[b][z][c]) < 1e-15f) {
+                    eq->state[b][z][c] = 0.0f;
+                }
+            }
+        }
+    }
+}
+
+// Every band for one channel, then the next; the vector kernels run the same
+// operations in the same order with channels in lanes
+static void biquad_scalar(BiquadCascade *eq, float *samples, size_t frames) {
+    for (size_t f = 0; f < frames; f++, samples += eq->channels) {
+        for (uint32_t c = 0; c < eq->channels; c++) {
+            float x = samples[c];
+            for (uint32_t b = 0; b < eq->bands; b++) {
+                const float *k = eq->coeffs[b];
+                float y = k[0] * x + eq->state[b][0][c];
+                eq->state[b][0][c] = k[1] * x - k[3] * y + eq->state[b][1][c];
+                eq->state[b][1][c] = k[2] * x - k[4] * y;
+                x = y;
+            }
+            samples[c] = x;
+        }
+    }
+    biquad_flush_denormals(eq);
+}
+
+// Same comparisons as the vector min and max instructions, so results match exactly
+static void peaks_scalar(const float *samples, uint32_t channels, size_t frames, float *min, float *max,
+                         float *squares) {
+    for (uint32_t c = 0; c < channels; c++) {
+        float low = INFINITY, high = -INFINITY, sum = 0.0f;
+        for (size_t f = 0; f < frames; f++) {
+            float x = samples[f * channels + c];
+            low = x < low ? x : low;
+            high = x > high ? x : high;
+            sum += x * x;
+        }
+        min[c] = low;
+        max[c] = high;
+        squares[c] = sum;
+    }
+}
+
+static const PcmKernels pcm_kernels_scalar = {
+    "scalar",
+    { decode_u8_scalar, decode_s16_scalar, decode_s24_scalar, decode_s32_scalar, decode_f32 },
+    { NULL, encode_s16_scalar, encode_s24_scalar, encode_s32_scalar, encode_f32 },
+    fir_scalar,
+    mix_scalar,
+    biquad_scalar,
+    peaks_scalar,
+};
+
+// Kernels selected by pcm_kernels_init
+static const PcmKernels *pcm_kernels = &pcm_kernels_scalar;
+
+#if defined(__x86_64__)
+// SSE2 is the x86-64 baseline, so these need no dispatch check there
+static void decode_u8_sse2(const uint8_t *src, float *dst, size_t samples) {
+    const __m128 scale = _mm_set1_ps(1.0f / 128.0f);
+    const __m128i bias = _mm_set1_epi32(128);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i q0 = _mm_sub_epi32(_mm_unpacklo_epi16(lo, zero), bias);
+        __m128i q1 = _mm_sub_epi32(_mm_unpackhi_epi16(lo, zero), bias);
+        __m128i q2 = _mm_sub_epi32(_mm_unpacklo_epi16(hi, zero), bias);
+        __m128i q3 = _mm_sub_epi32(_mm_unpackhi_epi16(hi, zero), bias);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(q0), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(q1), scale));
+        _mm_storeu_ps(dst + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(q2), scale));
+        _mm_storeu_ps(dst + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(q3), scale));
+    }
+    decode_u8_scalar(src + i, dst + i, samples - i);
+}
+
+static void decode_s16_sse2(const uint8_t *src, float *dst, size_t samples) {
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        // Duplicate each 16-bit sample into a 32-bit lane, then shift to sign-extend
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    decode_s16_scalar(src + i * 2, dst + i, samples - i);
+}
+
+static void decode_s24_sse2(const uint8_t *src, float *dst, size_t samples) {
+    const __m128 scale = _mm_set1_ps(1.0f / 8388608.0f);
+    size_t i = 0;
+    // Each 32-bit load takes one byte of the next sample, so stop a sample early
+    for (; i + 5 <= samples; i += 4) {
+        const uint8_t *p = src + i * 3;
+        int32_t w[4];
+        memcpy(&w[0], p, 4);
+        memcpy(&w[1], p + 3, 4);
+        memcpy(&w[2], p + 6, 4);
+        memcpy(&w[3], p + 9, 4);
+        __m128i v = _mm_loadu_si128((const __m128i *)w);
+        v = _mm_srai_epi32(_mm_slli_epi32(v, 8), 8);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+    }
+    decode_s24_scalar(src + i * 3, dst + i, samples - i);
+}
+
+static void decode_s32_sse2(const uint8_t *src, float *dst, size_t samples) {
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+    }
+    decode_s32_scalar(src + i * 4, dst + i, samples - i);
+}
+
+// minps/maxps return the second operand for NaN, matching clip_unit
+static inline __m128 clip_unit_sse2(__m128 x) {
+    return _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(1.0f)), _mm_set1_ps(-1.0f));
+}
+
+static void encode_s16_sse2(const float *src, uint8_t *dst, size_t samples) {
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i a = _mm_cvttps_epi32(_mm_mul_ps(clip_unit_sse2(_mm_loadu_ps(src + i)), scale));
+        __m128i b = _mm_cvttps_epi32(_mm_mul_ps(clip_unit_sse2(_mm_loadu_ps(src + i + 4)), scale));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(a, b));
+    }
+    encode_s16_scalar(src + i, dst + i * 2, samples - i);
+}
+
+static void encode_s24_sse2(const float *src, uint8_t *dst, size_t samples) {
+    const __m128 scale = _mm_set1_ps(8388607.0f);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32_t v[4];
+        _mm_storeu_si128((__m128i *)v, _mm_cvttps_epi32(_mm_mul_ps(clip_unit_sse2(_mm_loadu_ps(src + i)), scale)));
+        uint8_t *p = dst + i * 3;
+        for (int k = 0; k < 4; k++) {
+            p[k * 3] = v[k] & 0xFF;
+            p[k * 3 + 1] = (v[k] >> 8) & 0xFF;
+            p[k * 3 + 2] = (v[k] >> 16) & 0xFF;
+        }
+    }
+    encode_s24_scalar(src + i, dst + i * 3, samples - i);
+}
+
+static void encode_s32_sse2(const float *src, uint8_t *dst, size_t samples) {
+    const __m128 scale = _mm_set1_ps(2147483647.0f);
+    const __m128 cap = _mm_set1_ps(2147483520.0f);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128 x = _mm_min_ps(_mm_mul_ps(clip_unit_sse2(_mm_loadu_ps(src + i)), scale), cap);
+        _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_cvttps_epi32(x));
+    }
+    encode_s32_scalar(src + i, dst + i * 4, samples - i);
+}
+
+// Channels in pairs: each coefficient load feeds two accumulators, and the two
+// horizontal sums share their shuffles
+static void fir_sse2(const float *coeffs, const float *history, size_t stride, uint32_t channels, size_t taps,
+                     float *dst) {
+    uint32_t c = 0;
+    for (; c + 2 <= channels; c += 2) {
+        const float *x0 = history + c * stride, *x1 = x0 + stride;
+        __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+        for (size_t j = 0; j < taps; j += 4) {
+            __m128 k = _mm_loadu_ps(coeffs + j);
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(k, _mm_loadu_ps(x0 + j)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(k, _mm_loadu_ps(x1 + j)));
+        }
+        __m128 pairs = _mm_add_ps(_mm_unpacklo_ps(sum0, sum1), _mm_unpackhi_ps(sum0, sum1));
+        _mm_storel_pi((__m64 *)(dst + c), _mm_add_ps(pairs, _mm_movehl_ps(pairs, pairs)));
+    }
+    if (c < channels) {
+        const float *x0 = history + c * stride;
+        __m128 sum = _mm_setzero_ps();
+        for (size_t j = 0; j < taps; j += 4) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(coeffs + j), _mm_loadu_ps(x0 + j)));
+        }
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        _mm_store_ss(dst + c, _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1)));
+    }
+}
+
+// Broadcast each input and accumulate its column of gains, one or two vectors of outputs per frame
+static void mix_sse2(const ChannelMatrix *matrix, const float *src, float *dst, size_t frames) {
+    if (matrix->out_channels > 8) {
+        mix_scalar(matrix, src, dst, frames);
+        return;
+    }
+    for (size_t f = 0; f < frames; f++, src += matrix->in_channels, dst += matrix->out_channels) {
+        __m128 lo = _mm_setzero_ps();
+        __m128 hi = _mm_setzero_ps();
+        for (uint32_t c = 0; c < matrix->columns; c++) {
+            __m128 x = _mm_set1_ps(src[matrix->column_input[c]]);
+            lo = _mm_add_ps(lo, _mm_mul_ps(x, _mm_loadu_ps(matrix->gains[c])));
+            hi = _mm_add_ps(hi, _mm_mul_ps(x, _mm_loadu_ps(matrix->gains[c] + 4)));
+        }
+        _mm_storeu_ps(dst, lo);
+        _mm_storeu_ps(dst + 4, hi); // Spills into the next frame, which overwrites it
+    }
+}
+
+// Four channels per vector; stereo, the common case, loads and stores half a vector
+static void biquad_sse2(BiquadCascade *eq, float *samples, size_t frames) {
+    uint32_t channels = eq->channels, bands = eq->bands;
+    __m128 k[EQ_MAX_BANDS][5];
+    for (uint32_t b = 0; b < bands; b++) {
+        for (int i = 0; i < 5; i++) {
+            k[b][i] = _mm_set1_ps(eq->coeffs[b][i]);
+        }
+    }
+    for (uint32_t group = 0; group < channels; group += 4) {
+        uint32_t lanes = channels - group < 4 ? channels - group : 4;
+        __m128 z1[EQ_MAX_BANDS], z2[EQ_MAX_BANDS];
+        for (uint32_t b = 0; b < bands; b++) {
+            z1[b] = _mm_loadu_ps(&eq->state[b][0][group]);
+            z2[b] = _mm_loadu_ps(&eq->state[b][1][group]);
+        }
+        float *p = samples + group;
+        for (size_t f = 0; f < frames; f++, p += channels) {
+            float partial[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            __m128 x;
+            if (lanes == 4) {
+                x = _mm_loadu_ps(p);
+            } else if (lanes == 2) {
+                x = _mm_castpd_ps(_mm_load_sd((const double *)p));
+            } else {
+                memcpy(partial, p, lanes * sizeof(float));
+                x = _mm_loadu_ps(partial);
+            }
+            for (uint32_t b = 0; b < bands; b++) {
+                __m128 y = _mm_add_ps(_mm_mul_ps(k[b][0], x), z1[b]);
+                z1[b] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(k[b][1], x), _mm_mul_ps(k[b][3], y)), z2[b]);
+                z2[b] = _mm_sub_ps(_mm_mul_ps(k[b][2], x), _mm_mul_ps(k[b][4], y));
+                x = y;
+            }
+            if (lanes == 4) {
+                _mm_storeu_ps(p, x);
+            } else if (lanes == 2) {
+                _mm_store_sd((double *)p, _mm_castps_pd(x));
+            } else {
+                _mm_storeu_ps(partial, x);
+                memcpy(p, partial, lanes * sizeof(float));
+            }
+        }
+        for (uint32_t b = 0; b < bands; b++) {
+            _mm_storeu_ps(&eq->state[b][0][group], z1[b]);
+            _mm_storeu_ps(&eq->state[b][1][group], z2[b]);
+        }
+    }
+    biquad_flush_denormals(eq);
+}
+
+// Whole vectors over the interleaved samples: the channel pattern repeats every
+// period floats, a multiple of four, so each accumulator lane keeps one channel
+static void peaks_sse2(const float *samples, uint32_t channels, size_t frames, float *min, float *max,
+                       float *squares) {
+    uint32_t period = channels % 4 == 0 ? channels : channels % 2 == 0 ? channels * 2 : channels * 4;
+    uint32_t vectors = period / 4;
+    __m128 low[MIX_MAX_CHANNELS], high[MIX_MAX_CHANNELS], sum[MIX_MAX_CHANNELS];
+    for (uint32_t v = 0; v < vectors; v++) {
+        low[v] = _mm_set1_ps(INFINITY);
+        high[v] = _mm_set1_ps(-INFINITY);
+        sum[v] = _mm_setzero_ps();
+    }
+    size_t groups = frames * channels / period;
+    const float *p = samples;
+    for (size_t g = 0; g < groups; g++, p += period) {
+        for (uint32_t v = 0; v < vectors; v++) {
+            __m128 x = _mm_loadu_ps(p + v * 4);
+            low[v] = _mm_min_ps(x, low[v]);
+            high[v] = _mm_max_ps(x, high[v]);
+            sum[v] = _mm_add_ps(sum[v], _mm_mul_ps(x, x));
+        }
+    }
+    for (uint32_t c = 0; c < channels; c++) {
+        min[c] = INFINITY;
+        max[c] = -INFINITY;
+        squares[c] = 0.0f;
+    }
+    for (uint32_t v = 0; v < vectors; v++) {
+        float lanes[3][4];
+        _mm_storeu_ps(lanes[0], low[v]);
+        _mm_storeu_ps(lanes[1], high[v]);
+        _mm_storeu_ps(lanes[2], sum[v]);
+        for (uint32_t l = 0; l < 4; l++) {
+            uint32_t c = (v * 4 + l) % channels;
+            min[c] = lanes[0][l] < min[c] ? lanes[0][l] : min[c];
+            max[c] = lanes[1][l] > max[c] ? lanes[1][l] : max[c];
+            squares[c] += lanes[2][l];
+        }
+    }
+    // Frames past the last whole period
+    for (size_t i = groups * period; i < frames * channels; i++) {
+        uint32_t c = (uint32_t)(i % channels);
+        float x = samples[i];
+        min[c] = x < min[c] ? x : min[c];
+        max[c] = x > max[c] ? x : max[c];
+        squares[c] += x * x;
+    }
+}
+
+static const PcmKernels pcm_kernels_sse2 = {
+    "sse2",
+    { decode_u8_sse2, decode_s16_sse2, decode_s24_sse2, decode_s32_sse2, decode_f32 },
+    { NULL, encode_s16_sse2, encode_s24_sse2, encode_s32_sse2, encode_f32 },
+    fir_sse2,
+    mix_sse2,
+    biquad_sse2,
+    peaks_sse2,
+};
+
+// AVX2 versions are compiled for the target regardless of -m flags and only
+// selected after a CPUID check
+#define AVX2_FN __attribute__((target("avx2")))
+
+AVX2_FN static void decode_u8_avx2(const uint8_t *src, float *dst, size_t samples) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 128.0f);
+    const __m256i bias = _mm256_set1_epi32(128);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(v, bias)), scale));
+    }
+    decode_u8_scalar(src + i, dst + i, samples - i);
+}
+
+AVX2_FN static void decode_s16_avx2(const uint8_t *src, float *dst, size_t samples) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i * 2)));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i * 2 + 16)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+        _mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+    }
+    decode_s16_scalar(src + i * 2, dst + i, samples - i);
+}
+
+AVX2_FN static void decode_s24_avx2(const uint8_t *src, float *dst, size_t samples) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 8388608.0f);
+    // Move each packed 3-byte sample into the top of a 32-bit lane
+    const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                             -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    size_t i = 0;
+    // The second 16-byte load reaches 4 bytes past the 8 samples, so keep 2 in reserve
+    for (; i + 10 <= samples; i += 8) {
+        const uint8_t *p = src + i * 3;
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                            _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+        v = _mm256_srai_epi32(_mm256_shuffle_epi8(v, shuffle), 8);
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+    decode_s24_scalar(src + i * 3, dst + i, samples - i);
+}
+
+AVX2_FN static void decode_s32_avx2(const uint8_t *src, float *dst, size_t samples) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+    }
+    decode_s32_scalar(src + i * 4, dst + i, samples - i);
+}
+
+AVX2_FN static inline __m256 clip_unit_avx2(__m256 x) {
+    return _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(1.0f)), _mm256_set1_ps(-1.0f));
+}
+
+AVX2_FN static void encode_s16_avx2(const float *src, uint8_t *dst, size_t samples) {
+    const __m256 scale = _mm256_set1_ps(32767.0f);
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        __m256i a = _mm256_cvttps_epi32(_mm256_mul_ps(clip_unit_avx2(_mm256_loadu_ps(src + i)), scale));
+        __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(clip_unit_avx2(_mm256_loadu_ps(src + i + 8)), scale));
+        // packs works per 128-bit lane, so put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2), packed);
+    }
+    encode_s16_scalar(src + i, dst + i * 2, samples - i);
+}
+
+AVX2_FN static void encode_s24_avx2(const float *src, uint8_t *dst, size_t samples) {
+    const __m256 scale = _mm256_set1_ps(8388607.0f);
+    // Keep the low 3 bytes of each 32-bit lane, packed into the first 12 bytes of the lane
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+    // The second 16-byte store spills 4 bytes past the 8 samples, so keep 2 in reserve
+    for (; i + 10 <= samples; i += 8) {
+        __m256i v = _mm256_cvttps_epi32(_mm256_mul_ps(clip_unit_avx2(_mm256_loadu_ps(src + i)), scale));
+        v = _mm256_shuffle_epi8(v, shuffle);
+        uint8_t *p = dst + i * 3;
+        _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *)(p + 12), _mm256_extracti128_si256(v, 1));
+    }
+    encode_s24_scalar(src + i, dst + i * 3, samples - i);
+}
+
+AVX2_FN static void encode_s32_avx2(const float *src, uint8_t *dst, size_t samples) {
+    const __m256 scale = _mm256_set1_ps(2147483647.0f);
+    const __m256 cap = _mm256_set1_ps(2147483520.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256 x = _mm256_min_ps(_mm256_mul_ps(clip_unit_avx2(_mm256_loadu_ps(src + i)), scale), cap);
+        _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_cvttps_epi32(x));
+    }
+    encode_s32_scalar(src + i, dst + i * 4, samples - i);
+}
+
+// No FMA: it is a separate CPUID bit, and plain mul/add keeps AVX2 the only requirement
+AVX2_FN static void fir_avx2(const float *coeffs, const float *history, size_t stride, uint32_t channels,
+                             size_t taps, float *dst) {
+    uint32_t c = 0;
+    for (; c + 2 <= channels; c += 2) {
+        const float *x0 = history + c * stride, *x1 = x0 + stride;
+        __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+        for (size_t j = 0; j < taps; j += 8) {
+            __m256 k = _mm256_loadu_ps(coeffs + j);
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(k, _mm256_loadu_ps(x0 + j)));
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(k, _mm256_loadu_ps(x1 + j)));
+        }
+        __m256 pairs = _mm256_hadd_ps(sum0, sum1);
+        __m128 halves = _mm_add_ps(_mm256_castps256_ps128(pairs), _mm256_extractf128_ps(pairs, 1));
+        _mm_storel_pi((__m64 *)(dst + c), _mm_hadd_ps(halves, halves));
+    }
+    if (c < channels) {
+        const float *x0 = history + c * stride;
+        __m256 sum = _mm256_setzero_ps();
+        for (size_t j = 0; j < taps; j += 8) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(coeffs + j), _mm256_loadu_ps(x0 + j)));
+        }
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+        half = _mm_hadd_ps(half, half);
+        _mm_store_ss(dst + c, _mm_hadd_ps(half, half));
+    }
+}
+
+AVX2_FN static void mix_avx2(const ChannelMatrix *matrix, const float *src, float *dst, size_t frames) {
+    if (matrix->out_channels > 8) {
+        mix_scalar(matrix, src, dst, frames);
+        return;
+    }
+    const uint32_t in_channels = matrix->in_channels, out_channels = matrix->out_channels;
+    size_t f = 0;
+    if (out_channels <= 4) {
+        // Two frames per vector: low half for frame f, high half for frame f + 1
+        for (; f + 2 <= frames; f += 2, src += 2 * in_channels, dst += 2 * out_channels) {
+            __m256 sum = _mm256_setzero_ps();
+            for (uint32_t c = 0; c < matrix->columns; c++) {
+                uint32_t input = matrix->column_input[c];
+                __m256 x = _mm256_set_m128(_mm_set1_ps(src[in_channels + input]), _mm_set1_ps(src[input]));
+                __m128 g = _mm_loadu_ps(matrix->gains[c]);
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(x, _mm256_set_m128(g, g)));
+            }
+            _mm_storeu_ps(dst, _mm256_castps256_ps128(sum));
+            _mm_storeu_ps(dst + out_channels, _mm256_extractf128_ps(sum, 1));
+        }
+    }
+    for (; f < frames; f++, src += in_channels, dst += out_channels) {
+        __m256 sum = _mm256_setzero_ps();
+        for (uint32_t c = 0; c < matrix->columns; c++) {
+            __m256 x = _mm256_set1_ps(src[matrix->column_input[c]]);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(x, _mm256_loadu_ps(matrix->gains[c])));
+        }
+        _mm256_storeu_ps(dst, sum); // Spills into the next frame, which overwrites it
+    }
+}
+
+static const PcmKernels pcm_kernels_avx2 = {
+    "avx2",
+    { decode_u8_avx2, decode_s16_avx2, decode_s24_avx2, decode_s32_avx2, decode_f32 },
+    { NULL, encode_s16_avx2, encode_s24_avx2, encode_s32_avx2, encode_f32 },
+    fir_avx2,
+    mix_avx2,
+    biquad_sse2, // Channels seldom fill eight lanes, and each frame depends on the last
+    peaks_sse2, // Bound by memory bandwidth already
+};
+#endif
+
+#if defined(__aarch64__)
+// NEON is part of the AArch64 baseline
+static void decode_u8_neon(const uint8_t *src, float *dst, size_t samples) {
+    const float32x4_t scale = vdupq_n_f32(1.0f / 128.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t v = vreinterpretq_s16_u16(vsubq_u16(vmovl_u8(vld1_u8(src + i)), vdupq_n_u16(128)));
+        vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+        vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+    }
+    decode_u8_scalar(src + i, dst + i, samples - i);
+}
+
+static void decode_s16_neon(const uint8_t *src, float *dst, size_t samples) {
+    const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t v = vreinterpretq_s16_u8(vld1q_u8(src + i * 2));
+        vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+        vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+    }
+    decode_s16_scalar(src + i * 2, dst + i, samples - i);
+}
+
+static void decode_s24_neon(const uint8_t *src, float *dst, size_t samples) {
+    const float32x4_t scale = vdupq_n_f32(1.0f / 8388608.0f);
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        // De-interleave 16 packed samples into low, middle and high byte planes
+        uint8x16x3_t b = vld3q_u8(src + i * 3);
+        uint16x8_t low_lo = vreinterpretq_u16_u8(vzip1q_u8(b.val[0], b.val[1]));
+        uint16x8_t low_hi = vreinterpretq_u16_u8(vzip2q_u8(b.val[0], b.val[1]));
+        int16x8_t high_lo = vmovl_s8(vget_low_s8(vreinterpretq_s8_u8(b.val[2])));
+        int16x8_t high_hi = vmovl_s8(vget_high_s8(vreinterpretq_s8_u8(b.val[2])));
+        int32x4_t v0 = vorrq_s32(vshll_n_s16(vget_low_s16(high_lo), 16),
+                                 vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(low_lo))));
+        int32x4_t v1 = vorrq_s32(vshll_n_s16(vget_high_s16(high_lo), 16),
+                                 vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(low_lo))));
+        int32x4_t v2 = vorrq_s32(vshll_n_s16(vget_low_s16(high_hi), 16),
+                                 vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(low_hi))));
+        int32x4_t v3 = vorrq_s32(vshll_n_s16(vget_high_s16(high_hi), 16),
+                                 vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(low_hi))));
+        vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(v0), scale));
+        vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(v1), scale));
+        vst1q_f32(dst + i + 8, vmulq_f32(vcvtq_f32_s32(v2), scale));
+        vst1q_f32(dst + i + 12, vmulq_f32(vcvtq_f32_s32(v3), scale));
+    }
+    decode_s24_scalar(src + i * 3, dst + i, samples - i);
+}
+
+static void decode_s32_neon(const uint8_t *src, float *dst, size_t samples) {
+    const float32x4_t scale = vdupq_n_f32(1.0f / 2147483648.0f);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        int32x4_t v = vreinterpretq_s32_u8(vld1q_u8(src + i * 4));
+        vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(v), scale));
+    }
+    decode_s32_scalar(src + i * 4, dst + i, samples - i);
+}
+
+// vminq/vmaxq propagate NaN, so select explicitly to match clip_unit
+static inline float32x4_t clip_unit_neon(float32x4_t x) {
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t minus_one = vdupq_n_f32(-1.0f);
+    x = vbslq_f32(vcltq_f32(x, one), x, one);
+    return vbslq_f32(vcgtq_f32(x, minus_one), x, minus_one);
+}
+
+static void encode_s16_neon(const float *src, uint8_t *dst, size_t samples) {
+    const float32x4_t scale = vdupq_n_f32(32767.0f);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        int32x4_t a = vcvtq_s32_f32(vmulq_f32(clip_unit_neon(vld1q_f32(src + i)), scale));
+        int32x4_t b = vcvtq_s32_f32(vmulq_f32(clip_unit_neon(vld1q_f32(src + i + 4)), scale));
+        vst1q_u8(dst + i * 2, vreinterpretq_u8_s16(vcombine_s16(vqmovn_s32(a), vqmovn_s32(b))));
+    }
+    encode_s16_scalar(src + i, dst + i * 2, samples - i);
+}
+
+static void encode_s24_neon(const float *src, uint8_t *dst, size_t samples) {
+    const float32x4_t scale = vdupq_n_f32(8388607.0f);
+    size_t i = 0;
+    for (; i + 16 <= samples; i += 16) {
+        uint8x16_t v[4];
+        for (int k = 0; k < 4; k++) {
+            int32x4_t q = vcvtq_s32_f32(vmulq_f32(clip_unit_neon(vld1q_f32(src + i + k * 4)), scale));
+            v[k] = vreinterpretq_u8_s32(q);
+        }
+        // Split the little-endian lanes into byte planes and store them re-interleaved
+        uint8x16_t even01 = vuzp1q_u8(v[0], v[1]), even23 = vuzp1q_u8(v[2], v[3]);
+        uint8x16_t odd01 = vuzp2q_u8(v[0], v[1]), odd23 = vuzp2q_u8(v[2], v[3]);
+        uint8x16x3_t b;
+        b.val[0] = vuzp1q_u8(even01, even23);
+        b.val[1] = vuzp1q_u8(odd01, odd23);
+        b.val[2] = vuzp2q_u8(even01, even23);
+        vst3q_u8(dst + i * 3, b);
+    }
+    encode_s24_scalar(src + i, dst + i * 3, samples - i);
+}
+
+static void encode_s32_neon(const float *src, uint8_t *dst, size_t samples) {
+    const float32x4_t scale = vdupq_n_f32(2147483647.0f);
+    const float32x4_t cap = vdupq_n_f32(2147483520.0f);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        float32x4_t x = vmulq_f32(clip_unit_neon(vld1q_f32(src + i)), scale);
+        x = vbslq_f32(vcltq_f32(x, cap), x, cap);
+        vst1q_u8(dst + i * 4, vreinterpretq_u8_s32(vcvtq_s32_f32(x)));
+    }
+    encode_s32_scalar(src + i, dst + i * 4, samples - i);
+}
+
+static void fir_neon(const float *coeffs, const float *history, size_t stride, uint32_t channels, size_t taps,
+                     float *dst) {
+    uint32_t c = 0;
+    for (; c + 2 <= channels; c += 2) {
+        const float *x0 = history + c * stride, *x1 = x0 + stride;
+        float32x4_t sum0 = vdupq_n_f32(0.0f), sum1 = vdupq_n_f32(0.0f);
+        for (size_t j = 0; j < taps; j += 4) {
+            float32x4_t k = vld1q_f32(coeffs + j);
+            sum0 = vfmaq_f32(sum0, k, vld1q_f32(x0 + j));
+            sum1 = vfmaq_f32(sum1, k, vld1q_f32(x1 + j));
+        }
+        dst[c] = vaddvq_f32(sum0);
+        dst[c + 1] = vaddvq_f32(sum1);
+    }
+    if (c < channels) {
+        const float *x0 = history + c * stride;
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        for (size_t j = 0; j < taps; j += 4) {
+            sum = vfmaq_f32(sum, vld1q_f32(coeffs + j), vld1q_f32(x0 + j));
+        }
+        dst[c] = vaddvq_f32(sum);
+    }
+}
+
+static void mix_neon(const ChannelMatrix *matrix, const float *src, float *dst, size_t frames) {
+    if (matrix->out_channels > 8) {
+        mix_scalar(matrix, src, dst, frames);
+        return;
+    }
+    for (size_t f = 0; f < frames; f++, src += matrix->in_channels, dst += matrix->out_channels) {
+        float32x4_t lo = vdupq_n_f32(0.0f);
+        float32x4_t hi = vdupq_n_f32(0.0f);
+        for (uint32_t c = 0; c < matrix->columns; c++) {
+            float32x4_t x = vdupq_n_f32(src[matrix->column_input[c]]);
+            lo = vaddq_f32(lo, vmulq_f32(x, vld1q_f32(matrix->gains[c])));
+            hi = vaddq_f32(hi, vmulq_f32(x, vld1q_f32(matrix->gains[c] + 4)));
+        }
+        vst1q_f32(dst, lo);
+        vst1q_f32(dst + 4, hi); // Spills into the next frame, which overwrites it
+    }
+}
+
+static void biquad_neon(BiquadCascade *eq, float *samples, size_t frames) {
+    uint32_t channels = eq->channels, bands = eq->bands;
+    for (uint32_t group = 0; group < channels; group += 4) {
+        uint32_t lanes = channels - group < 4 ? channels - group : 4;
+        float32x4_t z1[EQ_MAX_BANDS], z2[EQ_MAX_BANDS];
+        for (uint32_t b = 0; b < bands; b++) {
+            z1[b] = vld1q_f32(&eq->state[b][0][group]);
+            z2[b] = vld1q_f32(&eq->state[b][1][group]);
+        }
+        float *p = samples + group;
+        for (size_t f = 0; f < frames; f++, p += channels) {
+            float partial[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            float32x4_t x;
+            if (lanes == 4) {
+                x = vld1q_f32(p);
+            } else if (lanes == 2) {
+                x = vcombine_f32(vld1_f32(p), vdup_n_f32(0.0f));
+            } else {
+                memcpy(partial, p, lanes * sizeof(float));
+                x = vld1q_f32(partial);
+            }
+            for (uint32_t b = 0; b < bands; b++) {
+                const float *k = eq->coeffs[b];
+                float32x4_t y = vaddq_f32(vmulq_n_f32(x, k[0]), z1[b]);
+                z1[b] = vaddq_f32(vsubq_f32(vmulq_n_f32(x, k[1]), vmulq_n_f32(y, k[3])), z2[b]);
+                z2[b] = vsubq_f32(vmulq_n_f32(x, k[2]), vmulq_n_f32(y, k[4]));
+                x = y;
+            }
+            if (lanes == 4) {
+                vst1q_f32(p, x);
+            } else if (lanes == 2) {
+                vst1_f32(p, vget_low_f32(x));
+            } else {
+                vst1q_f32(partial, x);
+                memcpy(p, partial, lanes * sizeof(float));
+            }
+        }
+        for (uint32_t b = 0; b < bands; b++) {
+            vst1q_f32(&eq->state[b][0][group], z1[b]);
+            vst1q_f32(&eq->state[b][1][group], z2[b]);
+        }
+    }
+    biquad_flush_denormals(eq);
+}
+
+static void peaks_neon(const float *samples, uint32_t channels, size_t frames, float *min, float *max,
+                       float *squares) {
+    uint32_t period = channels % 4 == 0 ? channels : channels % 2 == 0 ? channels * 2 : channels * 4;
+    uint32_t vectors = period / 4;
+    float32x4_t low[MIX_MAX_CHANNELS], high[MIX_MAX_CHANNELS], sum[MIX_MAX_CHANNELS];
+    for (uint32_t v = 0; v < vectors; v++) {
+        low[v] = vdupq_n_f32(INFINITY);
+        high[v] = vdupq_n_f32(-INFINITY);
+        sum[v] = vdupq_n_f32(0.0f);
+    }
+    size_t groups = frames * channels / period;
+    const float *p = samples;
+    for (size_t g = 0; g < groups; g++, p += period) {
+        for (uint32_t v = 0; v < vectors; v++) {
+            float32x4_t x = vld1q_f32(p + v * 4);
+            low[v] = vminq_f32(x, low[v]);
+            high[v] = vmaxq_f32(x, high[v]);
+            sum[v] = vaddq_f32(sum[v], vmulq_f32(x, x));
+        }
+    }
+    for (uint32_t c = 0; c < channels; c++) {
+        min[c] = INFINITY;
+        max[c] = -INFINITY;
+        squares[c] = 0.0f;
+    }
+    for (uint32_t v = 0; v < vectors; v++) {
+        float lanes[3][4];
+        vst1q_f32(lanes[0], low[v]);
+        vst1q_f32(lanes[1], high[v]);
+        vst1q_f32(lanes[2], sum[v]);
+        for (uint32_t l = 0; l < 4; l++) {
+            uint32_t c = (v * 4 + l) % channels;
+            min[c] = lanes[0][l] < min[c] ? lanes[0][l] : min[c];
+            max[c] = lanes[1][l] > max[c] ? lanes[1][l] : max[c];
+            squares[c] += lanes[2][l];
+        }
+    }
+    for (size_t i = groups * period; i < frames * channels; i++) {
+        uint32_t c = (uint32_t)(i % channels);
+        float x = samples[i];
+        min[c] = x < min[c] ? x : min[c];
+        max[c] = x > max[c] ? x : max[c];
+        squares[c] += x * x;
+    }
+}
+
+static const PcmKernels pcm_kernels_neon = {
+    "neon",
+    { decode_u8_neon, decode_s16_neon, decode_s24_neon, decode_s32_neon, decode_f32 },
+    { NULL, encode_s16_neon, encode_s24_neon, encode_s32_neon, encode_f32 },
+    fir_neon,
+    mix_neon,
+    biquad_neon,
+    peaks_neon,
+};
+#endif
+
+// Kernel sets this build can run, best last
+static const PcmKernels *pcm_kernel_sets(const PcmKernels **sets) {
+    int count = 0;
+    sets[count++] = &pcm_kernels_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets[count++] = &pcm_kernels_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sets[count++] = &pcm_kernels_avx2;
+    }
+#elif defined(__aarch64__)
+    sets[count++] = &pcm_kernels_neon;
+#endif
+    sets[count] = NULL;
+    return sets[count - 1];
+}
+
+// Select the decode/encode kernels once at startup: the best the CPU supports,
+// or the one named (e.g. "scalar" to compare against the reference)
+static int pcm_kernels_init(const char *name) {
+    const PcmKernels *sets[PCM_KERNEL_SETS_MAX + 1];
+    const PcmKernels *best = pcm_kernel_sets(sets);
+    if (!name) {
+        pcm_kernels = best;
+        return 0;
+    }
+    for (int i = 0; sets[i]; i++) {
+        if (strcmp(sets[i]->name, name) == 0) {
+            pcm_kernels = sets[i];
+            return 0;
+        }
+    }
+    printf("Error: Kernels '%s' are not available on this CPU (have:", name);
+    for (int i = 0; sets[i]; i++) {
+        printf(" %s", sets[i]->name);
+    }
+    printf(")\n");
+    return 1;
+}
+
+// Run every available kernel set over the same edge-case-heavy input and compare
+// the output with the scalar reference byte for byte; returns the mismatch count
+static int pcm_kernels_check(void) {
+    enum { SAMPLES = 4099 }; // Odd length exercises every scalar tail
+    static uint8_t packed[SAMPLES * 4], reference[SAMPLES * 4], output[SAMPLES * 4];
+    static float floats[SAMPLES], decoded[SAMPLES], expected[SAMPLES];
+    const float edges[] = { 0.0f, -0.0f, 1.0f, -1.0f, 1.5f, -1.5f, 0.99999994f, -0.99999994f,
+                            1e-30f, 1e30f, -1e30f, 0.5f, -0.5f, NAN, INFINITY, -INFINITY };
+    uint32_t seed = 12345;
+    for (int i = 0; i < SAMPLES; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        packed[i * 4] = seed >> 24;
+        packed[i * 4 + 1] = seed >> 16;
+        packed[i * 4 + 2] = seed >> 8;
+        packed[i * 4 + 3] = seed;
+        floats[i] = i < (int)(sizeof(edges) / sizeof(edges[0])) ? edges[i]
+                                                               : (float)(int32_t)seed / 1073741824.0f;
+    }
+
+    const PcmKernels *sets[PCM_KERNEL_SETS_MAX + 1];
+    pcm_kernel_sets(sets);
+    int mismatches = 0;
+    for (int s = 1; sets[s]; s++) {
+        for (int format = SAMPLE_U8; format < SAMPLE_FORMAT_COUNT; format++) {
+            pcm_kernels_scalar.decode[format](packed, expected, SAMPLES);
+            sets[s]->decode[format](packed, decoded, SAMPLES);
+            int ok = memcmp(expected, decoded, sizeof(decoded)) == 0;
+            if (format != SAMPLE_U8) {
+                size_t bytes = (size_t)SAMPLES * (format == SAMPLE_S16 ? 2 : format == SAMPLE_S24 ? 3 : 4);
+                pcm_kernels_scalar.encode[format](floats, reference, SAMPLES);
+                sets[s]->encode[format](floats, output, SAMPLES);
+                ok = ok && memcmp(reference, output, bytes) == 0;
+            }
+            printf("  %-6s %-4s %s\n", sets[s]->name, sample_format_names[format], ok ? "ok" : "MISMATCH");
+            mismatches += !ok;
+        }
+
+        // Filter rows sum in a different order, so compare within rounding error
+        int ok = 1;
+        for (uint32_t channels = 1; channels <= 3; channels++) {
+            for (size_t taps = 8; taps <= 512; taps += 8) {
+                const float *coeffs = floats + 16; // Past the NaN and infinity edge cases
+                const float *history = floats + 16 + taps;
+                float sums[3], reference_sums[3];
+                sets[s]->fir(coeffs, history, taps, channels, taps, sums);
+                fir_scalar(coeffs, history, taps, channels, taps, reference_sums);
+                for (uint32_t c = 0; c < channels; c++) {
+                    float magnitude = 0.0f;
+                    for (size_t j = 0; j < taps; j++) {
+                        magnitude += fabsf(coeffs[j] * history[c * taps + j]);
+                    }
+                    ok = ok && fabsf(sums[c] - reference_sums[c]) <= magnitude * 1e-6f;
+                }
+            }
+        }
+        printf("  %-6s %-4s %s\n", sets[s]->name, "fir", ok ? "ok" : "MISMATCH");
+        mismatches += !ok;
+
+        // Channel matrices of every output width, including the scalar fallback past 8
+        static ChannelMatrix matrix;
+        ok = 1;
+        for (uint32_t out = 1; out <= 12; out++) {
+            matrix = (ChannelMatrix){ .in_channels = 6, .out_channels = out, .columns = 5 };
+            for (uint32_t c = 0; c < matrix.columns; c++) {
+                matrix.column_input[c] = (c * 2 + 1) % matrix.in_channels;
+                for (uint32_t o = 0; o < out; o++) {
+                    matrix.gains[c][o] = floats[16 + c * MIX_LANES + o];
+                }
+            }
+            size_t frames = (SAMPLES - 16) / 12; // Room for 12 outputs a frame plus a vector's spill
+            mix_scalar(&matrix, floats + 16, expected, frames);
+            sets[s]->mix(&matrix, floats + 16, decoded, frames);
+            for (size_t i = 0; i < frames * out; i++) {
+                ok = ok && fabsf(decoded[i] - expected[i]) <= fabsf(expected[i]) * 1e-6f + 1e-6f;
+            }
+        }
+        printf("  %-6s %-4s %s\n", sets[s]->name, "mix", ok ? "ok" : "MISMATCH");
+        mismatches += !ok;
+
+        // Stable cascades of every channel count up to the widest, in two calls so the
+        // state carries over; a compiler may fuse multiply-adds differently per kernel
+        static BiquadCascade eq, reference_eq;
+        ok = 1;
+        for (uint32_t channels = 1; channels <= MIX_MAX_CHANNELS; channels++) {
+            eq = (BiquadCascade){ .bands = 1 + channels % EQ_MAX_BANDS, .channels = channels };
+            for (uint32_t b = 0; b < eq.bands; b++) {
+                double radius = 0.5 + 0.45 * b / eq.bands, theta = 0.3 + 0.2 * b;
+                eq.coeffs[b][0] = 0.5f + floats[16 + b] * 0.25f;
+                eq.coeffs[b][1] = floats[32 + b] * 0.5f;
+                eq.coeffs[b][2] = floats[48 + b] * 0.5f;
+                eq.coeffs[b][3] = (float)(-2.0 * radius * cos(theta));
+                eq.coeffs[b][4] = (float)(radius * radius);
+            }
+            reference_eq = eq;
+            size_t frames = (SAMPLES - 16) / channels;
+            size_t split = frames / 3;
+            memcpy(expected, floats + 16, frames * channels * sizeof(float));
+            memcpy(decoded, floats + 16, frames * channels * sizeof(float));
+            biquad_scalar(&reference_eq, expected, split);
+            biquad_scalar(&reference_eq, expected + split * channels, frames - split);
+            sets[s]->biquad(&eq, decoded, split);
+            sets[s]->biquad(&eq, decoded + split * channels, frames - split);
+            for (size_t i = 0; i < frames * channels; i++) {
+                ok = ok && fabsf(decoded[i] - expected[i]) <= fabsf(expected[i]) * 1e-4f + 1e-5f;
+            }
+        }
+        printf("  %-6s %-4s %s\n", sets[s]->name, "eq", ok ? "ok" : "MISMATCH");
+        mismatches += !ok;
+
+        // Peaks of every channel count and a ragged tail; sums of squares add in another order
+        ok = 1;
+        for (uint32_t channels = 1; channels <= MIX_MAX_CHANNELS; channels++) {
+            float min[MIX_MAX_CHANNELS], max[MIX_MAX_CHANNELS], squares[MIX_MAX_CHANNELS];
+            float reference_min[MIX_MAX_CHANNELS], reference_max[MIX_MAX_CHANNELS];
+            float reference_squares[MIX_MAX_CHANNELS];
+            size_t frames = (SAMPLES - 16) / channels - channels % 3;
+            peaks_scalar(floats + 16, channels, frames, reference_min, reference_max, reference_squares);
+            sets[s]->peaks(floats + 16, channels, frames, min, max, squares);
+            for (uint32_t c = 0; c < channels; c++) {
+                ok = ok && min[c] == reference_min[c] && max[c] == reference_max[c] &&
+                     fabsf(squares[c] - reference_squares[c]) <= reference_squares[c] * 1e-5f;
+            }
+        }
+        printf("  %-6s %-4s %s\n", sets[s]->name, "peak", ok ? "ok" : "MISMATCH");
+        mismatches += !ok;
+    }
+    return mismatches;
+}
+
+// Channels pass straight through: decode to float and encode again in blocks
+// with the vector kernels
+#define CONVERT_BLOCK_SAMPLES 1024
+
+static void convert_block_copy(const Converter *conv, const uint8_t *src, uint8_t *dst, uint32_t frames) {
+    float block[CONVERT_BLOCK_SAMPLES];
+    size_t samples = (size_t)frames * conv->in_channels;
+    while (samples > 0) {
+        size_t count = samples < CONVERT_BLOCK_SAMPLES ? samples : CONVERT_BLOCK_SAMPLES;
+        conv->decode(src, block, count);
+        conv->encode(block, dst, count);
+        src += count * conv->in_sample_bytes;
+        dst += count * conv->out_sample_bytes;
+        samples -= count;
+    }
+}
+
+// Input already in the output format: nothing to convert
+static void convert_block_passthrough(const Converter *conv, const uint8_t *src, uint8_t *dst, uint32_t frames) {
+    memcpy(dst, src, (size_t)frames * conv->in_channels * conv->in_sample_bytes);
+}
+
+// Any other channel mapping: decode, apply the gain matrix, encode, in blocks
+static void convert_block_mix(const Converter *conv, const uint8_t *src, uint8_t *dst, uint32_t frames) {
+    float input[CONVERT_BLOCK_SAMPLES];
+    float output[CONVERT_BLOCK_SAMPLES + 8]; // Mix kernels may store 8 floats past the last frame
+    uint32_t widest = conv->in_channels > conv->out_channels ? conv->in_channels : conv->out_channels;
+    uint32_t block_frames = CONVERT_BLOCK_SAMPLES / widest;
+    while (frames > 0) {
+        uint32_t count = frames < block_frames ? frames : block_frames;
+        conv->decode(src, input, (size_t)count * conv->in_channels);
+        conv->mix(&conv->matrix, input, output, count);
+        conv->encode(output, dst, (size_t)count * conv->out_channels);
+        src += (size_t)count * conv->in_channels * conv->in_sample_bytes;
+        dst += (size_t)count * conv->out_channels * conv->out_sample_bytes;
+        frames -= count;
+    }
+}
+
+// Map bit depth and float flag to a sample format, -1 if there is no converter for it
+static int sample_format_of(uint16_t bits_per_sample, uint16_t is_float) {
+    if (is_float) {
+        return bits_per_sample == 32 ? SAMPLE_F32 : -1;
+    }
+    switch (bits_per_sample) {
+    case 8: return SAMPLE_U8;
+    case 16: return SAMPLE_S16;
+    case 24: return SAMPLE_S24;
+    case 32: return SAMPLE_S32;
+    default: return -1;
+    }
+}
+
+// Pick the channel layout for a channel count pair
+static ChannelLayout channel_layout_of(uint32_t in_channels, uint32_t out_channels) {
+    if (in_channels == out_channels) {
+        return in_channels == 1 ? LAYOUT_MONO : in_channels == 2 ? LAYOUT_STEREO : LAYOUT_COPY;
+    }
+    if (in_channels == 1) {
+        return out_channels == 2 ? LAYOUT_MONO_TO_STEREO : LAYOUT_MONO_UP;
+    }
+    return in_channels > out_channels ? LAYOUT_TRUNCATE : LAYOUT_EXTEND;
+}
+
+// Speaker positions assumed for a channel count when the file gives none
+static uint32_t default_channel_mask(uint32_t channels) {
+    switch (channels) {
+    case 1: return SPEAKER_FC;
+    case 2: return SPEAKER_FL | SPEAKER_FR;
+    case 3: return SPEAKER_FL | SPEAKER_FR | SPEAKER_FC;
+    case 4: return SPEAKER_FL | SPEAKER_FR | SPEAKER_BL | SPEAKER_BR;
+    case 5: return SPEAKER_FL | SPEAKER_FR | SPEAKER_FC | SPEAKER_BL | SPEAKER_BR;
+    case 6: return SPEAKER_FL | SPEAKER_FR | SPEAKER_FC | SPEAKER_LFE | SPEAKER_BL | SPEAKER_BR; // 5.1
+    case 7: return SPEAKER_FL | SPEAKER_FR | SPEAKER_FC | SPEAKER_LFE | SPEAKER_BC | SPEAKER_SL | SPEAKER_SR;
+    case 8: return SPEAKER_FL | SPEAKER_FR | SPEAKER_FC | SPEAKER_LFE | SPEAKER_BL | SPEAKER_BR | SPEAKER_SL |
+                   SPEAKER_SR; // 7.1
+    default: return 0;
+    }
+}
+
+// Speaker of each channel: the mask's bits in order, 0 for channels past them
+static void channel_positions(uint32_t mask, uint32_t channels, uint32_t *positions) {
+    for (uint32_t ch = 0; ch < channels; ch++) {
+        positions[ch] = mask & -mask; // Lowest remaining bit
+        mask &= mask - 1;
+    }
+}
+
+// Add weight of an input speaker into gains (one per output channel), folding it
+// onto the nearest speakers the output has, with ITU-R BS.775 -3 dB coefficients
+static void mix_route(float *gains, const uint32_t *out_positions, uint32_t out_channels, uint32_t out_mask,
+                      uint32_t speaker, float weight) {
+    const float h = 0.70710678f;
+    if (out_mask & speaker) {
+        for (uint32_t o = 0; o < out_channels; o++) {
+            if (out_positions[o] == speaker) {
+                gains[o] += weight;
+            }
+        }
+        return;
+    }
+    switch (speaker) {
+    case SPEAKER_FC:
+        if ((out_mask & (SPEAKER_FL | SPEAKER_FR)) == (SPEAKER_FL | SPEAKER_FR)) {
+            mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FL, weight * h);
+            mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FR, weight * h);
+        }
+        break;
+    case SPEAKER_FL:
+    case SPEAKER_FR:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FC, weight * h);
+        break;
+    case SPEAKER_FLC:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FL, weight);
+        break;
+    case SPEAKER_FRC:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FR, weight);
+        break;
+    case SPEAKER_BL:
+    case SPEAKER_SL: {
+        uint32_t twin = speaker == SPEAKER_BL ? SPEAKER_SL : SPEAKER_BL;
+        if (out_mask & twin) {
+            mix_route(gains, out_positions, out_channels, out_mask, twin, weight);
+        } else {
+            mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FL, weight * h);
+        }
+        break;
+    }
+    case SPEAKER_BR:
+    case SPEAKER_SR: {
+        uint32_t twin = speaker == SPEAKER_BR ? SPEAKER_SR : SPEAKER_BR;
+        if (out_mask & twin) {
+            mix_route(gains, out_positions, out_channels, out_mask, twin, weight);
+        } else {
+            mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FR, weight * h);
+        }
+        break;
+    }
+    case SPEAKER_BC:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_BL, weight * h);
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_BR, weight * h);
+        break;
+    case SPEAKER_TFL:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FL, weight * h);
+        break;
+    case SPEAKER_TFR:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FR, weight * h);
+        break;
+    case SPEAKER_TFC:
+    case SPEAKER_TC:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_FC, weight * h);
+        break;
+    case SPEAKER_TBL:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_BL, weight * h);
+        break;
+    case SPEAKER_TBR:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_BR, weight * h);
+        break;
+    case SPEAKER_TBC:
+        mix_route(gains, out_positions, out_channels, out_mask, SPEAKER_BC, weight * h);
+        break;
+    default:
+        break; // LFE is dropped when the output has no subwoofer
+    }
+}
+
+// Build the gain matrix between two speaker layouts. Channels without a position
+// (or any channel, if either layout is unknown) pass straight through to the
+// output channel with the same index
+static void channel_matrix_init(ChannelMatrix *matrix, uint32_t in_channels, uint32_t in_mask,
+                                uint32_t out_channels, uint32_t out_mask) {
+    uint32_t in_positions[MIX_MAX_CHANNELS];
+    uint32_t out_positions[MIX_MAX_CHANNELS];
+    float gains[MIX_MAX_CHANNELS][MIX_MAX_CHANNELS] = { { 0 } }; // [input][output]
+    if (in_mask == 0 || out_mask == 0) {
+        in_mask = out_mask = 0; // No common frame of reference: map by index
+    }
+    channel_positions(in_mask, in_channels, in_positions);
+    channel_positions(out_mask, out_channels, out_positions);
+
+    for (uint32_t i = 0; i < in_channels; i++) {
+        if (in_positions[i] == 0) {
+            if (i < out_channels && out_positions[i] == 0) {
+                gains[i][i] = 1.0f;
+            }
+        } else if (in_mask == SPEAKER_FC && !(out_mask & SPEAKER_FC)) {
+            // Mono plays at full level on both front speakers
+            mix_route(gains[i], out_positions, out_channels, out_mask, SPEAKER_FL, 1.0f);
+            mix_route(gains[i], out_positions, out_channels, out_mask, SPEAKER_FR, 1.0f);
+        } else {
+            mix_route(gains[i], out_positions, out_channels, out_mask, in_positions[i], 1.0f);
+        }
+    }
+
+    // Scale down so no output can exceed full scale when every input is at full scale
+    float peak = 0.0f;
+    for (uint32_t o = 0; o < out_channels; o++) {
+        float sum = 0.0f;
+        for (uint32_t i = 0; i < in_channels; i++) {
+            sum += gains[i][o];
+        }
+        peak = sum > peak ? sum : peak;
+    }
+    float scale = peak > 1.0f ? 1.0f / peak : 1.0f;
+
+    *matrix = (ChannelMatrix){ .in_channels = in_channels, .out_channels = out_channels };
+    for (uint32_t i = 0; i < in_channels; i++) {
+        int used = 0;
+        for (uint32_t o = 0; o < out_channels; o++) {
+            used |= gains[i][o] != 0.0f;
+        }
+        if (used) {
+            for (uint32_t o = 0; o < out_channels; o++) {
+                matrix->gains[matrix->columns][o] = gains[i][o] * scale;
+            }
+            matrix->column_input[matrix->columns++] = i;
+        }
+    }
+}
+
+// Select the converter for the negotiated output format
+static int converter_init(Converter *conv, const Track *track, const PlaybackState *state) {
+    int in_format = sample_format_of(track->bits_per_sample, track->is_float);
+    // The resampler, the effects and the mixer take float frames and encode to the device format themselves
+    int out_format = state->resampler || state->effects || state->mixer
+                         ? SAMPLE_F32
+                         : sample_format_of(state->output_bits_per_channel, state->output_is_float);
+    if (in_format < 0) {
+        printf("Error: Unsupported bit depth %u\n", track->bits_per_sample);
+        return 1;
+    }
+    if (out_format < SAMPLE_S16) {
+        printf("Error: Unsupported output bit depth %u\n", state->output_bits_per_channel);
+        return 1;
+    }
+    ChannelLayout layout = channel_layout_of(track->num_channels, state->output_channels);
+    uint32_t in_mask = track->channel_mask ? track->channel_mask : default_channel_mask(track->num_channels);
+    uint32_t out_mask = default_channel_mask(state->output_channels);
+    conv->in_channels = track->num_channels;
+    conv->out_channels = state->output_channels;
+    conv->mix_scale = 1.0f / track->num_channels;
+    conv->fn = converter_table[in_format][out_format - SAMPLE_S16][layout];
+    conv->decode = pcm_kernels->decode[in_format];
+    conv->encode = pcm_kernels->encode[out_format];
+    conv->in_sample_bytes = sample_format_bytes[in_format];
+    conv->out_sample_bytes = sample_format_bytes[out_format];
+    conv->mix = pcm_kernels->mix;
+    int same_speakers = track->num_channels == state->output_channels && in_mask == out_mask;
+    if (!same_speakers && layout != LAYOUT_MONO_TO_STEREO && track->num_channels <= MIX_MAX_CHANNELS &&
+        state->output_channels <= MIX_MAX_CHANNELS) {
+        // Up/downmix between speaker layouts; only counts past 18 channels fall back to truncate/extend
+        channel_matrix_init(&conv->matrix, track->num_channels, in_mask, state->output_channels, out_mask);
+        conv->fn = convert_block_mix;
+    } else if (same_speakers && in_format == out_format) {
+        conv->fn = convert_block_passthrough; // Pre-rendered tracks, or files already in the output format
+    } else if (pcm_kernels != &pcm_kernels_scalar &&
+               (layout == LAYOUT_MONO || layout == LAYOUT_STEREO || layout == LAYOUT_COPY)) {
+        conv->fn = convert_block_copy; // Same output as the fused converter, vectorized
+    }
+    return 0;
+}
+
+// Convert frames from the WAV format to the device format, with channel mapping
+static void convert_frames(PlaybackState *state, const uint8_t *in, void *out, uint32_t frames) {
+    state->track.converter.fn(&state->track.converter, in, (uint8_t *)out, frames);
+}
+
+// Zeroth-order modified Bessel function of the first kind, for the Kaiser window
+static double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 64 && term > sum * 1e-12; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static uint32_t gcd_u32(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static ResampleBank *resample_banks; // Every bank built so far, kept until exit
+static pthread_mutex_t resample_banks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find or build the filter bank for an up/down ratio. Row r holds the taps that
+// produce an output r/phases of an input frame past the window's centre sample,
+// each row normalized to unity gain at DC
+static const ResampleBank *resample_bank_get(uint32_t up, uint32_t down, ResampleQuality quality) {
+    pthread_mutex_lock(&resample_banks_lock);
+    ResampleBank *bank = resample_banks;
+    while (bank && !(bank->up == up && bank->down == down && bank->quality == quality)) {
+        bank = bank->next;
+    }
+    if (bank) {
+        pthread_mutex_unlock(&resample_banks_lock);
+        return bank;
+    }
+
+    // Downsampling lowers the cutoff, which widens the sinc; widen the window with it
+    double ratio = down > up ? (double)down / up : 1.0;
+    double cutoff = resample_quality_params[quality].rolloff / ratio;
+    double beta = resample_quality_params[quality].beta;
+    uint32_t taps = ((uint32_t)ceil(resample_quality_params[quality].taps * ratio) + 7) & ~7u;
+    uint32_t phases = up < RESAMPLE_MAX_PHASES ? up : RESAMPLE_MAX_PHASES;
+
+    bank = calloc(1, sizeof(ResampleBank));
+    float *coeffs = malloc((size_t)phases * taps * sizeof(float));
+    if (!bank || !coeffs) {
+        free(bank);
+        free(coeffs);
+        pthread_mutex_unlock(&resample_banks_lock);
+        return NULL;
+    }
+    double half = taps / 2.0;
+    double window_scale = 1.0 / bessel_i0(beta);
+    for (uint32_t r = 0; r < phases; r++) {
+        float *row = coeffs + (size_t)r * taps;
+        double frac = (double)r / phases;
+        double sum = 0.0;
+        for (uint32_t j = 0; j < taps; j++) {
+            double t = frac + half - 1.0 - j; // Distance from the output to tap j, in input frames
+            double x = t / half;
+            double window = x * x < 1.0 ? bessel_i0(beta * sqrt(1.0 - x * x)) * window_scale : 0.0;
+            double sinc = t == 0.0 ? 1.0 : sin(M_PI * cutoff * t) / (M_PI * cutoff * t);
+            row[j] = (float)(cutoff * sinc * window);
+            sum += row[j];
+        }
+        for (uint32_t j = 0; j < taps; j++) {
+            row[j] = (float)(row[j] / sum);
+        }
+    }
+    bank->up = up;
+    bank->down = down;
+    bank->quality = quality;
+    bank->phases = phases;
+    bank->taps = taps;
+    bank->coeffs = coeffs;
+    bank->next = resample_banks;
+    resample_banks = bank;
+    pthread_mutex_unlock(&resample_banks_lock);
+    return bank;
+}
+
+static void resampler_free(Resampler *rs) {
+    if (rs) {
+        free(rs->history);
+        free(rs->input);
+        free(rs->output);
+        free(rs);
+    }
+}
+
+// Set up resampling from the file rate to the output rate; the converter then
+// decodes to float at the output channel count and the resampler encodes
+static int resampler_init(PlaybackState *state) {
+    int out_format = sample_format_of(state->output_bits_per_channel, state->output_is_float);
+    if (out_format < SAMPLE_S16) {
+        printf("Error: Unsupported output bit depth %u\n", state->output_bits_per_channel);
+        return 1;
+    }
+    uint32_t g = gcd_u32(state->track.sample_rate, state->output_sample_rate);
+    const ResampleBank *bank = resample_bank_get(state->output_sample_rate / g, state->track.sample_rate / g,
+                                                 state->resample_quality);
+    Resampler *rs = calloc(1, sizeof(Resampler));
+    if (!bank || !rs) {
+        printf("Error: Memory allocation failed\n");
+        free(rs);
+        return 1;
+    }
+    rs->bank = bank;
+    rs->input_rate = state->track.sample_rate;
+    rs->channels = state->output_channels;
+    rs->capacity = RESAMPLE_CHUNK_FRAMES + bank->taps;
+    rs->history = calloc((size_t)rs->capacity * rs->channels, sizeof(float));
+    rs->input = malloc((size_t)RESAMPLE_CHUNK_FRAMES * rs->channels * sizeof(float));
+    rs->output = malloc((size_t)PRODUCER_CHUNK_FRAMES * rs->channels * sizeof(float));
+    if (!rs->history || !rs->input || !rs->output) {
+        printf("Error: Memory allocation failed\n");
+        resampler_free(rs);
+        return 1;
+    }
+    // Leading silence so the first output is centred on the first input frame
+    rs->length = bank->taps / 2 - 1;
+    rs->encode = pcm_kernels->encode[state->effects ? SAMPLE_F32 : out_format];
+    state->resampler = rs;
+    return 0;
+}
+
+// Append interleaved frames (or silence for NULL) to the planar history
+static void resampler_append(Resampler *rs, const float *src, uint32_t frames) {
+    for (uint32_t c = 0; c < rs->channels; c++) {
+        float *dst = rs->history + (size_t)c * rs->capacity + rs->length;
+        for (uint32_t i = 0; i < frames; i++) {
+            dst[i] = src ? src[(size_t)i * rs->channels + c] : 0.0f;
+        }
+    }
+    rs->length += frames;
+}
+
+// Drop history frames that no future output window reaches
+static void resampler_compact(Resampler *rs) {
+    if (rs->index == 0) {
+        return;
+    }
+    for (uint32_t c = 0; c < rs->channels; c++) {
+        float *history = rs->history + (size_t)c * rs->capacity;
+        memmove(history, history + rs->index, (size_t)(rs->length - rs->index) * sizeof(float));
+    }
+    rs->length -= rs->index;
+    rs->index = 0;
+}
+
+// Forget the history, as at the start of a track, so a seek resamples from silence
+static void resampler_reset(Resampler *rs) {
+    memset(rs->history, 0, (size_t)rs->capacity * rs->channels * sizeof(float));
+    rs->length = rs->bank->taps / 2 - 1;
+    rs->index = 0;
+    rs->phase = 0;
+    rs->flushed = 0;
+}
+
+// Compute up to max_frames interleaved outputs while the history covers their windows
+static uint32_t resampler_run(Resampler *rs, float *dst, uint32_t max_frames) {
+    const ResampleBank *bank = rs->bank;
+    const FirFn fir = pcm_kernels->fir;
+    uint32_t step = bank->down / bank->up;
+    uint32_t step_phase = bank->down % bank->up;
+    uint32_t frames = 0;
+    while (frames < max_frames && rs->index + bank->taps <= rs->length) {
+        uint32_t row = bank->phases == bank->up ? rs->phase
+                                                : (uint32_t)((uint64_t)rs->phase * bank->phases / bank->up);
+        const float *coeffs = bank->coeffs + (size_t)row * bank->taps;
+        fir(coeffs, rs->history + rs->index, rs->capacity, rs->channels, bank->taps, dst);
+        dst += rs->channels;
+        frames++;
+        rs->index += step;
+        rs->phase += step_phase;
+        if (rs->phase >= bank->up) {
+            rs->phase -= bank->up;
+            rs->index++;
+        }
+    }
+    return frames;
+}
+
+// RBJ cookbook coefficients for one band at the output rate, normalized by a0
+static void biquad_design(float *coeffs, EqType type, double hz, double db, double q, uint32_t rate) {
+    double a = pow(10.0, db / 40.0);
+    double w0 = 2.0 * M_PI * hz / rate;
+    double cosw = cos(w0);
+    double alpha = sin(w0) / (2.0 * q);
+    double shelf = 2.0 * sqrt(a) * alpha;
+    double b[3], den[3];
+    switch (type) {
+    case EQ_PEAK:
+        b[0] = 1.0 + alpha * a, b[1] = -2.0 * cosw, b[2] = 1.0 - alpha * a;
+        den[0] = 1.0 + alpha / a, den[1] = -2.0 * cosw, den[2] = 1.0 - alpha / a;
+        break;
+    case EQ_LOWSHELF:
+        b[0] = a * ((a + 1.0) - (a - 1.0) * cosw + shelf);
+        b[1] = 2.0 * a * ((a - 1.0) - (a + 1.0) * cosw);
+        b[2] = a * ((a + 1.0) - (a - 1.0) * cosw - shelf);
+        den[0] = (a + 1.0) + (a - 1.0) * cosw + shelf;
+        den[1] = -2.0 * ((a - 1.0) + (a + 1.0) * cosw);
+        den[2] = (a + 1.0) + (a - 1.0) * cosw - shelf;
+        break;
+    case EQ_HIGHSHELF:
+        b[0] = a * ((a + 1.0) + (a - 1.0) * cosw + shelf);
+        b[1] = -2.0 * a * ((a - 1.0) + (a + 1.0) * cosw);
+        b[2] = a * ((a + 1.0) + (a - 1.0) * cosw - shelf);
+        den[0] = (a + 1.0) - (a - 1.0) * cosw + shelf;
+        den[1] = 2.0 * ((a - 1.0) - (a + 1.0) * cosw);
+        den[2] = (a + 1.0) - (a - 1.0) * cosw - shelf;
+        break;
+    case EQ_LOWPASS:
+        b[0] = (1.0 - cosw) / 2.0, b[1] = 1.0 - cosw, b[2] = (1.0 - cosw) / 2.0;
+        den[0] = 1.0 + alpha, den[1] = -2.0 * cosw, den[2] = 1.0 - alpha;
+        break;
+    default:
+        b[0] = (1.0 + cosw) / 2.0, b[1] = -(1.0 + cosw), b[2] = (1.0 + cosw) / 2.0;
+        den[0] = 1.0 + alpha, den[1] = -2.0 * cosw, den[2] = 1.0 - alpha;
+        break;
+    }
+    coeffs[0] = (float)(b[0] / den[0]);
+    coeffs[1] = (float)(b[1] / den[0]);
+    coeffs[2] = (float)(b[2] / den[0]);
+    coeffs[3] = (float)(den[1] / den[0]);
+    coeffs[4] = (float)(den[2] / den[0]);
+}
+
+// Read an effects file, one effect per line, # starting a comment:
+//   gain DB
+//   eq peak HZ DB Q | eq lowshelf|highshelf HZ DB [Q] | eq lowpass|highpass HZ [Q]
+//   limiter CEILING_DB [LOOKAHEAD_MS [RELEASE_MS]]
+static int effects_load(const char *path, EffectsConfig *config) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Error: Cannot open effects file %s\n", path);
+        return 1;
+    }
+    *config = (EffectsConfig){ 0 };
+    char line[256];
+    int err = 0;
+    for (uint32_t number = 1; !err && fgets(line, sizeof(line), file); number++) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *words[6];
+        int count = 0, extra = 0;
+        for (char *word = strtok(line, " \t\r\n"); word; word = strtok(NULL, " \t\r\n")) {
+            if (count < 6) {
+                words[count++] = word;
+            } else {
+                extra = 1;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        double values[4];
+        int numbers = 0;
+        for (int i = strcmp(words[0], "eq") == 0 ? 2 : 1; i < count && !err; i++) {
+            char *end;
+            err = numbers == 4;
+            if (!err) {
+                values[numbers] = strtod(words[i], &end);
+                err = *end != '\0' || !isfinite(values[numbers]);
+                numbers++;
+            }
+        }
+        if (err || extra) {
+            err = 1;
+        } else if (strcmp(words[0], "gain") == 0 && numbers == 1) {
+            config->gain_db += values[0];
+        } else if (strcmp(words[0], "limiter") == 0 && numbers >= 1 && numbers <= 3) {
+            config->limiter = 1;
+            config->ceiling_db = values[0];
+            config->lookahead_ms = numbers > 1 ? values[1] : 5.0;
+            config->release_ms = numbers > 2 ? values[2] : 50.0;
+            err = config->ceiling_db > 0 || config->lookahead_ms < 0 || config->lookahead_ms > 100 ||
+                  config->release_ms <= 0;
+        } else if (strcmp(words[0], "eq") == 0 && count >= 2 && config->bands < EQ_MAX_BANDS) {
+            int type = 0;
+            while (type < EQ_TYPE_COUNT && strcmp(words[1], eq_type_names[type]) != 0) {
+                type++;
+            }
+            // Gain first for peaks and shelves, Q optional except for peaks
+            int has_db = type == EQ_PEAK || type == EQ_LOWSHELF || type == EQ_HIGHSHELF;
+            int required = has_db ? 2 + (type == EQ_PEAK) : 1;
+            if (type == EQ_TYPE_COUNT || numbers < required || numbers > 2 + has_db) {
+                err = 1;
+            } else {
+                uint32_t b = config->bands++;
+                config->eq[b].type = (EqType)type;
+                config->eq[b].hz = values[0];
+                config->eq[b].db = has_db ? values[1] : 0.0;
+                config->eq[b].q = numbers > 1 + has_db ? values[1 + has_db] : M_SQRT1_2;
+                err = config->eq[b].hz <= 0 || config->eq[b].q <= 0;
+            }
+        } else {
+            err = 1;
+        }
+        if (err) {
+            printf("Error: %s:%u: Expected gain DB, eq TYPE HZ [DB] [Q] (at most %d) or limiter CEILING_DB "
+                   "[LOOKAHEAD_MS [RELEASE_MS]]\n", path, number, EQ_MAX_BANDS);
+        }
+    }
+    fclose(file);
+    return err;
+}
+
+static void effects_free(EffectChain *fx) {
+    if (fx) {
+        free(fx->block);
+        free(fx->delay);
+        free(fx->window);
+        free(fx->queue_gain);
+        free(fx->queue_frame);
+        free(fx);
+    }
+}
+
+// Clear filter and limiter state, as at the start of playback, so a seek does not
+// ring on with the audio before it
+static void effects_reset(EffectChain *fx) {
+    memset(fx->eq.state, 0, sizeof(fx->eq.state));
+    fx->gain = atomic_load(&fx->gain_target);
+    if (fx->lookahead > 0) {
+        uint32_t length = fx->lookahead + 1;
+        memset(fx->delay, 0, (size_t)length * fx->channels * sizeof(float));
+        for (uint32_t i = 0; i < length; i++) {
+            fx->window[i] = 1.0f;
+        }
+        fx->window_sum = length;
+        fx->envelope = 1.0f;
+        fx->queue_head = 0;
+        fx->queue_count = 0;
+        fx->frames_in = 0;
+        fx->real_in = 0;
+        fx->frames_out = 0;
+    }
+}
+
+// Build the chain for the output format; frames then reach the encoder as float
+static int effects_init(PlaybackState *state) {
+    const EffectsConfig *config = state->effects_config;
+    int out_format = sample_format_of(state->output_bits_per_channel, state->output_is_float);
+    if (out_format < SAMPLE_S16) {
+        printf("Error: Unsupported output bit depth %u\n", state->output_bits_per_channel);
+        return 1;
+    }
+    if (state->output_channels > MIX_MAX_CHANNELS) {
+        printf("Error: Effects support at most %d output channels\n", MIX_MAX_CHANNELS);
+        return 1;
+    }
+    uint32_t rate = state->output_sample_rate;
+    for (uint32_t b = 0; b < config->bands; b++) {
+        if (config->eq[b].hz >= rate / 2.0) {
+            printf("Error: EQ band at %.0f Hz is past the %u Hz Nyquist frequency\n", config->eq[b].hz, rate / 2);
+            return 1;
+        }
+    }
+    EffectChain *fx = calloc(1, sizeof(EffectChain));
+    if (!fx) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    fx->channels = state->output_channels;
+    fx->encode = pcm_kernels->encode[out_format];
+    fx->biquad = pcm_kernels->biquad;
+    atomic_store(&fx->gain_target, (float)pow(10.0, config->gain_db / 20.0));
+    fx->gain_decay = (float)exp(-1.0 / (EFFECTS_GAIN_SMOOTHING * rate));
+    fx->eq.bands = config->bands;
+    fx->eq.channels = fx->channels;
+    for (uint32_t b = 0; b < config->bands; b++) {
+        biquad_design(fx->eq.coeffs[b], config->eq[b].type, config->eq[b].hz, config->eq[b].db, config->eq[b].q,
+                      rate);
+    }
+    fx->block = malloc((size_t)PRODUCER_CHUNK_FRAMES * fx->channels * sizeof(float));
+    int err = fx->block == NULL;
+    if (config->limiter) {
+        fx->lookahead = (uint32_t)lrint(config->lookahead_ms * rate / 1000.0);
+        fx->lookahead = fx->lookahead ? fx->lookahead : 1;
+        fx->ceiling = (float)pow(10.0, config->ceiling_db / 20.0);
+        fx->release = (float)exp(-1000.0 / (config->release_ms * rate));
+        uint32_t length = fx->lookahead + 1;
+        fx->delay = malloc((size_t)length * fx->channels * sizeof(float));
+        fx->window = malloc(length * sizeof(float));
+        fx->queue_gain = malloc(length * sizeof(float));
+        fx->queue_frame = malloc(length * sizeof(uint64_t));
+        err |= !fx->delay || !fx->window || !fx->queue_gain || !fx->queue_frame;
+    }
+    if (err) {
+        printf("Error: Memory allocation failed\n");
+        effects_free(fx);
+        return 1;
+    }
+    effects_reset(fx);
+    state->effects = fx;
+    return 0;
+}
+
+// Push one frame (silence for NULL) through the limiter; returns the frame leaving
+// the delay line, scaled, once it holds audio, otherwise NULL
+static const float *limiter_push(EffectChain *fx, const float *frame) {
+    uint32_t channels = fx->channels, length = fx->lookahead + 1;
+    uint64_t n = fx->frames_in++;
+    float *slot = fx->delay + (size_t)(n % length) * channels;
+    float peak = 0.0f;
+    if (frame) {
+        for (uint32_t c = 0; c < channels; c++) {
+            slot[c] = frame[c];
+            peak = fabsf(frame[c]) > peak ? fabsf(frame[c]) : peak;
+        }
+        fx->real_in++;
+    } else {
+        memset(slot, 0, channels * sizeof(float));
+    }
+    // Sliding minimum over frames [n - lookahead, n]: a queue of ascending gains
+    float target = peak > fx->ceiling ? fx->ceiling / peak : 1.0f;
+    while (fx->queue_count > 0 && fx->queue_gain[(fx->queue_head + fx->queue_count - 1) % length] >= target) {
+        fx->queue_count--;
+    }
+    uint32_t tail = (fx->queue_head + fx->queue_count++) % length;
+    fx->queue_gain[tail] = target;
+    fx->queue_frame[tail] = n;
+    if (fx->queue_frame[fx->queue_head] + length <= n) {
+        fx->queue_head = (fx->queue_head + 1) % length;
+        fx->queue_count--;
+    }
+    // Instant attack and exponential release, never above the window minimum, then
+    // averaged over the window so every gain reaching a peak is at most its own
+    float minimum = fx->queue_gain[fx->queue_head];
+    fx->envelope = minimum < fx->envelope ? minimum : minimum + (fx->envelope - minimum) * fx->release;
+    uint32_t w = (uint32_t)(n % length);
+    fx->window_sum += (double)fx->envelope - fx->window[w];
+    fx->window[w] = fx->envelope;
+    if (n < fx->lookahead || fx->frames_out == fx->real_in) {
+        return NULL;
+    }
+    fx->frames_out++;
+    float gain = (float)(fx->window_sum / length);
+    gain = gain < 1.0f ? gain : 1.0f;
+    float *out = fx->delay + (size_t)((n + 1) % length) * channels;
+    for (uint32_t c = 0; c < channels; c++) {
+        out[c] *= gain;
+    }
+    return out;
+}
+
+// Run frames of fx->block through the chain in place; returns the frames ready in
+// fx->block, fewer than given while the limiter's delay line fills
+static uint32_t effects_process(EffectChain *fx, uint32_t frames) {
+    uint32_t channels = fx->channels;
+    float *samples = fx->block;
+    float target = atomic_load_explicit(&fx->gain_target, memory_order_relaxed);
+    if (fx->gain != target || target != 1.0f) {
+        // Linear ramp to where the one-pole smoother would be after this block
+        float end = target + (fx->gain - target) * powf(fx->gain_decay, (float)frames);
+        end = fabsf(end - target) < 1e-6f ? target : end;
+        float step = (end - fx->gain) / frames;
+        for (uint32_t f = 0; f < frames; f++) {
+            float gain = fx->gain + step * (f + 1);
+            for (uint32_t c = 0; c < channels; c++) {
+                samples[(size_t)f * channels + c] *= gain;
+            }
+        }
+        fx->gain = end;
+    }
+    if (fx->eq.bands > 0) {
+        fx->biquad(&fx->eq, samples, frames);
+    }
+    if (fx->lookahead == 0) {
+        return frames;
+    }
+    uint32_t ready = 0;
+    for (uint32_t f = 0; f < frames; f++) {
+        const float *out = limiter_push(fx, samples + (size_t)f * channels);
+        if (out) {
+            memcpy(samples + (size_t)ready++ * channels, out, channels * sizeof(float));
+        }
+    }
+    return ready;
+}
+
+// After the last input: the frames still in the limiter's delay line, up to
+// max_frames into fx->block; 0 once it is empty
+static uint32_t effects_drain(EffectChain *fx, uint32_t max_frames) {
+    uint32_t ready = 0;
+    while (fx->lookahead > 0 && ready < max_frames && fx->frames_out < fx->real_in) {
+        const float *out = limiter_push(fx, NULL);
+        if (out) {
+            memcpy(fx->block + (size_t)ready++ * fx->channels, out, fx->channels * sizeof(float));
+        }
+    }
+    return ready;
+}
+
+// Allocate a ring of at least frames frames (rounded up to a power of two)
+static int ring_init(FrameRing *ring, uint32_t frames, uint32_t frame_size) {
+    uint32_t capacity = 1;
+    while (capacity < frames) {
+        capacity <<= 1;
+    }
+    ring->data = malloc((size_t)capacity * frame_size);
+    if (!ring->data) {
+        return 1;
+    }
+    ring->capacity = capacity;
+    ring->frame_size = frame_size;
+    atomic_init(&ring->write_pos, 0);
+    atomic_init(&ring->read_pos, 0);
+    return 0;
+}
+
+// Producer side: contiguous free frames starting at *region
+static uint32_t ring_write_region(FrameRing *ring, uint8_t **region) {
+    uint32_t write = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    uint32_t read = atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+    uint32_t space = ring->capacity - (write - read);
+    uint32_t index = write & (ring->capacity - 1);
+    uint32_t contiguous = ring->capacity - index;
+    *region = ring->data + (size_t)index * ring->frame_size;
+    return space < contiguous ? space : contiguous;
+}
+
+// Producer side: publish frames written into the region
+static void ring_commit(FrameRing *ring, uint32_t frames) {
+    uint32_t write = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    atomic_store_explicit(&ring->write_pos, write + frames, memory_order_release);
+}
+
+// Consumer side: copy up to frames frames into dst, returns the number copied
+static uint32_t ring_read(FrameRing *ring, uint8_t *dst, uint32_t frames) {
+    uint32_t read = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+    uint32_t write = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+    uint32_t available = write - read;
+    if (frames > available) {
+        frames = available;
+    }
+    uint32_t index = read & (ring->capacity - 1);
+    uint32_t first = ring->capacity - index;
+    if (first > frames) {
+        first = frames;
+    }
+    memcpy(dst, ring->data + (size_t)index * ring->frame_size, (size_t)first * ring->frame_size);
+    memcpy(dst + (size_t)first * ring->frame_size, ring->data, (size_t)(frames - first) * ring->frame_size);
+    atomic_store_explicit(&ring->read_pos, read + frames, memory_order_release);
+    return frames;
+}
+
+// Check a parsed fmt chunk describes audio the player can convert
+static int wav_check_format(Track *track, const WavHeader *header) {
+    track->is_float = 0;
+    if (header->audio_format == 1) {
+        // PCM (integer)
+        if (header->bits_per_sample % 8 != 0) {
+            printf("Error: Bits per sample %u must be a multiple of 8\n", header->bits_per_sample);
+            return 1;
+        }
+    } else if (header->audio_format == 3 && header->bits_per_sample == 32) {
+        // IEEE Float (32-bit float)
+        track->is_float = 1;
+    } else {
+        printf("Error: Only PCM or 32-bit float WAV files are supported (audio_format=%u)\n", header->audio_format);
+        return 1;
+    }
+    if (header->num_channels < 1) {
+        printf("Error: Invalid number of channels %u\n", header->num_channels);
+        return 1;
+    }
+    if (header->sample_rate < 8000 || header->sample_rate > 96000) {
+        printf("Error: Sample rate %u Hz is not supported (must be 8000–96000 Hz)\n", header->sample_rate);
+        return 1;
+    }
+    if (header->byte_rate != header->sample_rate * header->num_channels * (header->bits_per_sample / 8)) {
+        printf("Error: Invalid byte rate %u (expected %u)\n", header->byte_rate,
+               header->sample_rate * header->num_channels * (header->bits_per_sample / 8));
+        return 1;
+    }
+    if (header->block_align != header->num_channels * (header->bits_per_sample / 8)) {
+        printf("Error: Invalid block align %u (expected %u)\n", header->block_align,
+               header->num_channels * (header->bits_per_sample / 8));
+        return 1;
+    }
+    track->block_align = header->block_align;
+    return 0;
+}
+
+// Print the format and take it over into the track, reading from the start of the data
+static void wav_set_format(Track *track, const WavHeader *header) {
+    printf("WAV Info:\n");
+    printf("  Sample Rate: %u Hz\n", header->sample_rate);
+    printf("  Channels: %u\n", header->num_channels);
+    printf("  Bits per Sample: %u\n", header->bits_per_sample);
+    printf("  Format: %s\n", track->is_float ? "Float" : "Integer PCM");
+    printf("  Byte Rate: %u bytes/s\n", header->byte_rate);
+    printf("  Block Align: %u bytes\n", header->block_align);
+    if (track->data_size == UINT64_MAX) {
+        printf("  Data Size: unknown, up to the end of the input\n");
+    } else {
+        printf("  Data Size: %llu bytes\n", (unsigned long long)track->data_size);
+        printf("  Duration: %.2f seconds\n", (float)track->data_size / header->byte_rate);
+    }
+
+    // Initialize the track's read position and format
+    track->offset = 0;
+    track->sample_rate = header->sample_rate;
+    track->num_channels = header->num_channels;
+    track->bits_per_sample = header->bits_per_sample;
+    track->duration = track->data_size == UINT64_MAX ? 0.0f : (float)track->data_size / header->byte_rate;
+}
+
+// Parse RIFF and fmt headers, leaving file positioned at the start of the data chunk
+static int read_wav_header(FILE *file, Track *track, WavHeader *header) {
+    // Read RIFF header; RF64 and BW64 files keep their 64-bit sizes in a ds64 chunk
+    char riff_id[4];
+    uint32_t riff_size;
+    char format[4];
+    if (fread(riff_id, 4, 1, file) != 1 || fread(&riff_size, 4, 1, file) != 1 ||
+        fread(format, 4, 1, file) != 1) {
+        printf("Error: Failed to read RIFF header\n");
+        return 1;
+    }
+    int rf64 = strncmp(riff_id, "RF64", 4) == 0 || strncmp(riff_id, "BW64", 4) == 0;
+    if ((!rf64 && strncmp(riff_id, "RIFF", 4) != 0) || strncmp(format, "WAVE", 4) != 0) {
+        printf("Error: Not a valid WAV file\n");
+        return 1;
+    }
+    printf("%.4s chunk: size=%u, format=WAVE\n", riff_id, riff_size);
+
+    // ds64 comes first: the RIFF and data sizes, then sizes for any other chunk over 4 GB
+    uint64_t ds64_data_size = 0;
+    WavChunk ds64_table[8];
+    uint32_t ds64_entries = 0;
+    if (rf64) {
+        char ds64_id[4];
+        uint32_t ds64_size, table_length;
+        uint64_t riff_size64, sample_count;
+        if (fread(ds64_id, 4, 1, file) != 1 || fread(&ds64_size, 4, 1, file) != 1 ||
+            strncmp(ds64_id, "ds64", 4) != 0 || ds64_size < DS64_SIZE || fread(&riff_size64, 8, 1, file) != 1 ||
+            fread(&ds64_data_size, 8, 1, file) != 1 || fread(&sample_count, 8, 1, file) != 1 ||
+            fread(&table_length, 4, 1, file) != 1) {
+            printf("Error: %.4s file without a valid ds64 chunk\n", riff_id);
+            return 1;
+        }
+        printf("ds64 chunk: riff_size=%llu, data_size=%llu, sample_count=%llu\n", (unsigned long long)riff_size64,
+               (unsigned long long)ds64_data_size, (unsigned long long)sample_count);
+        for (uint32_t i = 0; i < table_length && DS64_SIZE + 12 * (i + 1) <= ds64_size && ds64_entries < 8; i++) {
+            WavChunk *entry = &ds64_table[ds64_entries];
+            if (fread(entry->id, 4, 1, file) != 1 || fread(&entry->size, 8, 1, file) != 1) {
+                break;
+            }
+            ds64_entries++;
+        }
+        fseeko(file, 20 + (off_t)ds64_size + (ds64_size & 1), SEEK_SET);
+    }
+
+    // Index every chunk once, jumping over payloads, so opening and seeking cost the
+    // same whatever the size of the data chunk
+    free(track->chunks);
+    track->chunks = NULL;
+    track->chunk_count = 0;
+    uint32_t capacity = 0;
+    char chunk_id[4];
+    uint32_t chunk_size;
+    off_t position = ftello(file);
+    while (position >= 0 && fseeko(file, position, SEEK_SET) == 0 && fread(chunk_id, 4, 1, file) == 1 &&
+           fread(&chunk_size, 4, 1, file) == 1) {
+        uint64_t size = chunk_size;
+        if (rf64 && chunk_size == UINT32_MAX) {
+            if (strncmp(chunk_id, "data", 4) == 0) {
+                size = ds64_data_size;
+            }
+            for (uint32_t i = 0; i < ds64_entries; i++) {
+                if (strncmp(chunk_id, ds64_table[i].id, 4) == 0) {
+                    size = ds64_table[i].size;
+                }
+            }
+        }
+        if (track->chunk_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            WavChunk *chunks = realloc(track->chunks, capacity * sizeof(WavChunk));
+            if (!chunks) {
+                printf("Error: Memory allocation failed\n");
+                return 1;
+            }
+            track->chunks = chunks;
+        }
+        WavChunk *chunk = &track->chunks[track->chunk_count++];
+        memcpy(chunk->id, chunk_id, 4);
+        chunk->offset = (uint64_t)position + 8;
+        chunk->size = size;
+        printf("Chunk: id=%.4s, size=%llu, file_pos=%lld\n", chunk_id, (unsigned long long)size,
+               (long long)position);
+        position += 8 + (off_t)size + (off_t)(size & 1); // Chunks are padded to even sizes
+    }
+    const WavChunk *fmt = NULL, *data = NULL;
+    for (uint32_t i = 0; i < track->chunk_count; i++) {
+        if (!fmt && strncmp(track->chunks[i].id, "fmt ", 4) == 0) {
+            fmt = &track->chunks[i];
+        }
+        if (!data && strncmp(track->chunks[i].id, "data", 4) == 0) {
+            data = &track->chunks[i];
+        }
+    }
+
+    // Read fmt chunk
+    *header = (WavHeader){0};
+    if (!fmt) {
+        printf("Error: fmt chunk not found\n");
+        return 1;
+    }
+    memcpy(header->subchunk1_id, fmt->id, 4);
+    header->subchunk1_size = (uint32_t)fmt->size;
+    fseeko(file, (off_t)fmt->offset, SEEK_SET);
+
+    // Read fmt data
+    if (fread(&header->audio_format, 2, 1, file) != 1 || fread(&header->num_channels, 2, 1, file) != 1 ||
+        fread(&header->sample_rate, 4, 1, file) != 1 || fread(&header->byte_rate, 4, 1, file) != 1 ||
+        fread(&header->block_align, 2, 1, file) != 1 || fread(&header->bits_per_sample, 2, 1, file) != 1) {
+        printf("Error: Failed to read fmt chunk data\n");
+        return 1;
+    }
+    // WAVE_FORMAT_EXTENSIBLE: the real format tag leads the sub-format GUID, and the
+    // channel mask gives each channel's speaker position
+    track->channel_mask = 0;
+    if (header->audio_format == 0xFFFE) {
+        uint16_t extension_size, valid_bits;
+        uint32_t channel_mask;
+        uint16_t sub_format;
+        uint8_t guid_rest[14];
+        if (header->subchunk1_size < 40 || fread(&extension_size, 2, 1, file) != 1 ||
+            fread(&valid_bits, 2, 1, file) != 1 || fread(&channel_mask, 4, 1, file) != 1 ||
+            fread(&sub_format, 2, 1, file) != 1 || fread(guid_rest, 14, 1, file) != 1) {
+            printf("Error: Failed to read WAVE_FORMAT_EXTENSIBLE fields\n");
+            return 1;
+        }
+        header->audio_format = sub_format;
+        track->channel_mask = channel_mask;
+        printf("Extensible format: sub_format=%u, valid_bits=%u, channel_mask=0x%x\n", sub_format, valid_bits,
+               channel_mask);
+    }
+    if (wav_check_format(track, header) != 0) {
+        return 1;
+    }
+
+    // Position the file at the data chunk found by the index
+    if (!data) {
+        printf("Error: Could not find data chunk\n");
+        return 1;
+    }
+    track->data_offset = data->offset;
+    track->data_size = data->size;
+    if (fseeko(file, (off_t)data->offset, SEEK_SET) != 0) {
+        printf("Error: Cannot seek to the data chunk\n");
+        return 1;
+    }
+
+    wav_set_format(track, header);
+    return 0;
+}
+
+// Read and parse WAV file (platform-agnostic)
+static int read_wav_file(const char *filename, Track *track) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printf("Error: Cannot open file %s\n", filename);
+        return 1;
+    }
+
+    WavHeader header;
+    if (read_wav_header(file, track, &header) != 0) {
+        fclose(file);
+        return 1;
+    }
+
+    // Read audio data
+    track->audio_data = malloc(track->data_size);
+    if (!track->audio_data) {
+        printf("Error: Memory allocation failed\n");
+        fclose(file);
+        return 1;
+    }
+    size_t bytes_read = fread(track->audio_data, 1, track->data_size, file);
+    if (bytes_read != track->data_size) {
+        printf("Error: Failed to read audio data (%zu bytes read, expected %llu)\n",
+               bytes_read, (unsigned long long)track->data_size);
+        free(track->audio_data);
+        track->audio_data = NULL;
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    return 0;
+}
+
+// Open WAV file for streaming: only the headers are read up front, the reader
+// thread prefetches the data chunk while playback consumes it
+static int open_wav_stream(const char *filename, Track *track) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printf("Error: Cannot open file %s\n", filename);
+        return 1;
+    }
+
+    WavHeader header;
+    if (read_wav_header(file, track, &header) != 0) {
+        fclose(file);
+        return 1;
+    }
+
+    track->stream = stream_open(file, track->data_size, header.block_align, 0);
+    if (!track->stream) {
+        printf("Error: Failed to start stream reader\n");
+        fclose(file);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Read exactly size bytes from a descriptor that may hand them over a piece at a time
+static int read_fully(int fd, void *buffer, size_t size) {
+    uint8_t *p = buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+// Pass over bytes of input that cannot seek
+static int skip_fully(int fd, uint64_t size) {
+    uint8_t scratch[4096];
+    while (size > 0) {
+        size_t n = size < sizeof(scratch) ? (size_t)size : sizeof(scratch);
+        if (read_fully(fd, scratch, n) != 0) {
+            return 1;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+// Parse RIFF and fmt headers from input that cannot seek, front to back, leaving fd
+// at the first sample frame. A data chunk of size 0 or 0xFFFFFFFF (a writer that
+// cannot go back to fill it in) runs to the end of the input: data_size UINT64_MAX
+static int read_wav_header_forward(int fd, Track *track, WavHeader *header) {
+    uint8_t riff[12];
+    if (read_fully(fd, riff, sizeof(riff)) != 0) {
+        printf("Error: Failed to read RIFF header\n");
+        return 1;
+    }
+    int rf64 = memcmp(riff, "RF64", 4) == 0 || memcmp(riff, "BW64", 4) == 0;
+    if ((!rf64 && memcmp(riff, "RIFF", 4) != 0) || memcmp(riff + 8, "WAVE", 4) != 0) {
+        printf("Error: Not a valid WAV file\n");
+        return 1;
+    }
+    *header = (WavHeader){0};
+    uint64_t ds64_data_size = 0;
+    int have_fmt = 0;
+    for (;;) {
+        uint8_t chunk[8];
+        uint32_t size;
+        if (read_fully(fd, chunk, sizeof(chunk)) != 0) {
+            printf("Error: Could not find data chunk\n");
+            return 1;
+        }
+        memcpy(&size, chunk + 4, 4);
+        printf("Chunk: id=%.4s, size=%u\n", (const char *)chunk, size);
+        if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt) {
+                printf("Error: fmt chunk not found\n");
+                return 1;
+            }
+            uint64_t data_size = rf64 && size == UINT32_MAX ? ds64_data_size : size;
+            track->data_size = data_size == 0 || (!rf64 && size == UINT32_MAX) ? UINT64_MAX : data_size;
+            return wav_check_format(track, header);
+        }
+        if (memcmp(chunk, "ds64", 4) == 0 && size >= DS64_SIZE) {
+            uint8_t ds64[DS64_SIZE];
+            if (read_fully(fd, ds64, sizeof(ds64)) != 0 || skip_fully(fd, size - DS64_SIZE + (size & 1)) != 0) {
+                printf("Error: %.4s input without a valid ds64 chunk\n", (const char *)riff);
+                return 1;
+            }
+            memcpy(&ds64_data_size, ds64 + 8, 8);
+        } else if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+            // Everything up to the WAVE_FORMAT_EXTENSIBLE sub-format is kept
+            uint8_t fmt[26] = {0};
+            uint32_t kept = size < sizeof(fmt) ? size : (uint32_t)sizeof(fmt);
+            if (read_fully(fd, fmt, kept) != 0 || skip_fully(fd, size - kept + (size & 1)) != 0) {
+                printf("Error: Failed to read fmt chunk data\n");
+                return 1;
+            }
+            memcpy(header->subchunk1_id, chunk, 4);
+            header->subchunk1_size = size;
+            memcpy(&header->audio_format, fmt, 2);
+            memcpy(&header->num_channels, fmt + 2, 2);
+            memcpy(&header->sample_rate, fmt + 4, 4);
+            memcpy(&header->byte_rate, fmt + 8, 4);
+            memcpy(&header->block_align, fmt + 12, 2);
+            memcpy(&header->bits_per_sample, fmt + 14, 2);
+            track->channel_mask = 0;
+            if (header->audio_format == 0xFFFE) {
+                if (size < 40) {
+                    printf("Error: Failed to read WAVE_FORMAT_EXTENSIBLE fields\n");
+                    return 1;
+                }
+                memcpy(&track->channel_mask, fmt + 20, 4);
+                memcpy(&header->audio_format, fmt + 24, 2);
+            }
+            have_fmt = 1;
+        } else if (skip_fully(fd, (uint64_t)size + (size & 1)) != 0) {
+            printf("Error: Could not find data chunk\n");
+            return 1;
+        }
+    }
+}
+
+// Open standard input for streaming: a WAV stream parsed front to back, or raw PCM
+// in the format given on the command line. The reader thread takes the data as it
+// arrives; nothing can seek
+static int open_stdin_stream(Track *track, const WavHeader *raw) {
+    WavHeader header;
+    if (raw) {
+        header = *raw;
+        track->data_size = UINT64_MAX;
+        track->channel_mask = 0;
+        if (wav_check_format(track, &header) != 0) {
+            return 1;
+        }
+    } else if (read_wav_header_forward(STDIN_FILENO, track, &header) != 0) {
+        return 1;
+    }
+    wav_set_format(track, &header);
+#ifdef F_SETPIPE_SZ
+    // A deeper pipe lets each read take more at once; only a hint, so failure is fine
+    fcntl(STDIN_FILENO, F_SETPIPE_SZ, 1 << 20);
+#endif
+
+    // The reader owns a duplicate, so closing it leaves stdin itself alone
+    int fd = dup(STDIN_FILENO);
+    FILE *file = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    if (!file) {
+        printf("Error: Cannot read standard input\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    track->stream = stream_open(file, track->data_size, header.block_align, 1);
+    if (!track->stream) {
+        printf("Error: Failed to start stream reader\n");
+        fclose(file);
+        return 1;
+    }
+    return 0;
+}
+
+// Map WAV file into memory: audio_data points straight at the data chunk in the
+// page cache, so nothing is copied and concurrent players share the same pages
+static int map_wav_file(const char *filename, Track *track) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printf("Error: Cannot open file %s\n", filename);
+        return 1;
+    }
+
+    WavHeader header;
+    if (read_wav_header(file, track, &header) != 0) {
+        fclose(file);
+        return 1;
+    }
+    uint64_t data_offset = track->data_offset;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        printf("Error: Cannot stat file %s\n", filename);
+        fclose(file);
+        return 1;
+    }
+    if (data_offset + track->data_size > (uint64_t)st.st_size) {
+        uint64_t present = (uint64_t)st.st_size > data_offset ? (uint64_t)st.st_size - data_offset : 0;
+        printf("Warning: Data chunk is truncated, playing the %llu bytes present\n", (unsigned long long)present);
+        track->data_size = present;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    fclose(file); // The mapping stays valid after the descriptor is closed
+    if (base == MAP_FAILED) {
+        printf("Error: Failed to map file %s\n", filename);
+        return 1;
+    }
+    track->mapped_base = base;
+    track->mapped_size = (size_t)st.st_size;
+    track->audio_data = track->mapped_base + data_offset;
+
+    // Playback reads front to back; prefetch about two seconds at a time
+    madvise(track->mapped_base, track->mapped_size, MADV_SEQUENTIAL);
+    track->advise_window = header.byte_rate * 2;
+    track->advised_offset = 0;
+    track->duration = (float)track->data_size / header.byte_rate; // After truncation
+    advise_mapping(track);
+    return 0;
+}
+
+// FLAC decoding. Frames are found from their sync codes, checked with the header
+// CRC-8 and the running sample number, and verified with the frame CRC-16
+typedef struct {
+    uint64_t first_sample;
+    uint32_t block_size;
+    uint32_t header_size; // Bytes before the first subframe
+    uint32_t channel_assignment; // 0-7 independent, 8 left/side, 9 side/right, 10 mid/side
+} FlacFrameHeader;
+
+// Big-endian bit reader over a frame; reads past the end see zeros and are caught
+// by the CRC and length checks at the end of the frame
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos; // Next byte to load
+    uint64_t cache; // Unread bits, most significant first
+    uint32_t count; // Valid bits in cache
+} FlacBits;
+
+static uint16_t flac_crc16_table[256];
+static pthread_once_t flac_crc16_once = PTHREAD_ONCE_INIT;
+
+static void flac_crc16_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc << 1) ^ (crc & 0x8000 ? 0x8005 : 0);
+        }
+        flac_crc16_table[i] = (uint16_t)crc;
+    }
+}
+
+static inline void flac_refill(FlacBits *b) {
+    if (b->pos + 8 <= b->size) {
+        // Load as many whole bytes as fit; the bits below count are the stream's next
+        // bits too, so loading them again later changes nothing
+        uint64_t word;
+        memcpy(&word, b->data + b->pos, 8);
+        b->cache |= __builtin_bswap64(word) >> b->count;
+        b->pos += (63 - b->count) >> 3;
+        b->count |= 56;
+    } else {
+        while (b->count <= 55) {
+            uint64_t byte = b->pos < b->size ? b->data[b->pos] : 0;
+            b->cache |= byte << (56 - b->count);
+            b->pos++;
+            b->count += 8;
+        }
+    }
+}
+
+static inline uint32_t flac_bits(FlacBits *b, uint32_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    if (b->count < n) {
+        flac_refill(b);
+    }
+    uint32_t value = (uint32_t)(b->cache >> (64 - n));
+    b->cache <<= n;
+    b->count -= n;
+    return value;
+}
+
+static inline int32_t flac_signed(FlacBits *b, uint32_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    return (int32_t)(flac_bits(b, n) << (32 - n)) >> (32 - n);
+}
+
+// Count zeros up to the next 1 bit; 1 if the frame runs out first
+static inline int flac_unary(FlacBits *b, uint32_t *value) {
+    uint32_t zeros = 0;
+    if (b->count < 32) {
+        flac_refill(b);
+    }
+    for (;;) {
+        if (b->cache) {
+            uint32_t leading = (uint32_t)__builtin_clzll(b->cache);
+            if (leading < b->count) {
+                b->cache <<= leading + 1;
+                b->count -= leading + 1;
+                *value = zeros + leading;
+                return 0;
+            }
+        }
+        zeros += b->count;
+        b->cache <<= b->count;
+        b->count = 0;
+        if (b->pos > b->size + 8) {
+            return 1;
+        }
+        flac_refill(b);
+    }
+}
+
+// Rice-coded residual after the warm-up samples
+static int flac_residual(FlacBits *b, int32_t *dst, uint32_t block_size, uint32_t order) {
+    uint32_t method = flac_bits(b, 2);
+    if (method > 1) {
+        return 1;
+    }
+    uint32_t parameter_bits = method ? 5 : 4;
+    uint32_t escape = method ? 31 : 15;
+    uint32_t partition_order = flac_bits(b, 4);
+    uint32_t partition_size = block_size >> partition_order;
+    if ((partition_size << partition_order) != block_size || partition_size < order) {
+        return 1;
+    }
+    uint32_t i = order;
+    for (uint32_t partition = 0; partition < (1u << partition_order); partition++) {
+        uint32_t end = (partition + 1) * partition_size;
+        uint32_t k = flac_bits(b, parameter_bits);
+        if (k == escape) {
+            uint32_t width = flac_bits(b, 5);
+            for (; i < end; i++) {
+                dst[i] = flac_signed(b, width);
+            }
+            continue;
+        }
+        for (; i < end; i++) {
+            uint32_t quotient;
+            if (flac_unary(b, &quotient)) {
+                return 1;
+            }
+            uint32_t value = (quotient << k) | flac_bits(b, k);
+            dst[i] = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+        }
+    }
+    return 0;
+}
+
+// Undo a fixed polynomial predictor. Unsigned arithmetic wraps, which is exact here:
+// every result fits in 32 bits even where the intermediate terms do not
+static void flac_fixed_restore(int32_t *samples, uint32_t count, uint32_t order) {
+    uint32_t *s = (uint32_t *)samples;
+    switch (order) {
+    case 1:
+        for (uint32_t i = 1; i < count; i++) {
+            s[i] += s[i - 1];
+        }
+        break;
+    case 2:
+        for (uint32_t i = 2; i < count; i++) {
+            s[i] += 2 * s[i - 1] - s[i - 2];
+        }
+        break;
+    case 3:
+        for (uint32_t i = 3; i < count; i++) {
+            s[i] += 3 * s[i - 1] - 3 * s[i - 2] + s[i - 3];
+        }
+        break;
+    case 4:
+        for (uint32_t i = 4; i < count; i++) {
+            s[i] += 4 * s[i - 1] - 6 * s[i - 2] + 4 * s[i - 3] - s[i - 4];
+        }
+        break;
+    }
+}
+
+// Undo a quantized LPC predictor; wide when the sums can overflow 32 bits
+static void flac_lpc_restore(int32_t *s, uint32_t count, const int32_t *coefs, uint32_t order, uint32_t shift,
+                             int wide) {
+    if (!wide) {
+        for (uint32_t i = order; i < count; i++) {
+            int32_t sum = 0;
+            for (uint32_t j = 0; j < order; j++) {
+                sum += coefs[j] * s[i - 1 - j];
+            }
+            s[i] += sum >> shift;
+        }
+        return;
+    }
+    for (uint32_t i = order; i < count; i++) {
+        int64_t sum = 0;
+        for (uint32_t j = 0; j < order; j++) {
+            sum += (int64_t)coefs[j] * s[i - 1 - j];
+        }
+        s[i] = (int32_t)(s[i] + (sum >> shift));
+    }
+}
+
+static int flac_subframe(FlacBits *b, int32_t *dst, uint32_t block_size, uint32_t bits) {
+    if (flac_bits(b, 1) != 0) {
+        return 1;
+    }
+    uint32_t type = flac_bits(b, 6);
+    uint32_t wasted = 0;
+    if (flac_bits(b, 1)) {
+        if (flac_unary(b, &wasted) || wasted + 1 >= bits) {
+            return 1;
+        }
+        wasted++;
+        bits -= wasted;
+    }
+    if (bits > 32) {
+        return 1; // Side channel of 32-bit audio
+    }
+
+    if (type == 0) {
+        int32_t value = flac_signed(b, bits);
+        for (uint32_t i = 0; i < block_size; i++) {
+            dst[i] = value;
+        }
+    } else if (type == 1) {
+        for (uint32_t i = 0; i < block_size; i++) {
+            dst[i] = flac_signed(b, bits);
+        }
+    } else if (type >= 8 && type <= 12) {
+        uint32_t order = type - 8;
+        if (order > block_size) {
+            return 1;
+        }
+        for (uint32_t i = 0; i < order; i++) {
+            dst[i] = flac_signed(b, bits);
+        }
+        if (flac_residual(b, dst, block_size, order) != 0) {
+            return 1;
+        }
+        flac_fixed_restore(dst, block_size, order);
+    } else if (type >= 32) {
+        uint32_t order = type - 31;
+        if (order > block_size) {
+            return 1;
+        }
+        for (uint32_t i = 0; i < order; i++) {
+            dst[i] = flac_signed(b, bits);
+        }
+        uint32_t precision = flac_bits(b, 4) + 1;
+        int32_t shift = flac_signed(b, 5);
+        if (precision == 16 || shift < 0) {
+            return 1;
+        }
+        int32_t coefs[32];
+        for (uint32_t i = 0; i < order; i++) {
+            coefs[i] = flac_signed(b, precision);
+        }
+        if (flac_residual(b, dst, block_size, order) != 0) {
+            return 1;
+        }
+        int wide = bits + precision + (31 - __builtin_clz(order)) > 32;
+        flac_lpc_restore(dst, block_size, coefs, order, (uint32_t)shift, wide);
+    } else {
+        return 1;
+    }
+
+    if (wasted) {
+        for (uint32_t i = 0; i < block_size; i++) {
+            dst[i] = (int32_t)((uint32_t)dst[i] << wasted);
+        }
+    }
+    return 0;
+}
+
+// Parse and check the frame header at offset: sync code, reserved bits, CRC-8, and
+// agreement with STREAMINFO, which is how false sync codes in audio data are rejected
+static int flac_frame_header(const FlacFile *flac, uint64_t offset, FlacFrameHeader *header) {
+    static const uint32_t rates[12] = { 0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100,
+                                        48000, 96000 };
+    static const uint32_t widths[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+    uint8_t p[16] = { 0 }; // Longest possible header
+    size_t available = flac->size - offset;
+    memcpy(p, flac->base + offset, available < sizeof(p) ? available : sizeof(p));
+    if (p[0] != 0xFF || (p[1] & 0xFE) != 0xF8 || (p[3] & 1)) {
+        return 1;
+    }
+    uint32_t block_code = p[2] >> 4, rate_code = p[2] & 15, channel_code = p[3] >> 4, width_code = (p[3] >> 1) & 7;
+    if (block_code == 0 || rate_code == 15 || channel_code > 10 || width_code == 3) {
+        return 1;
+    }
+
+    // Frame or sample number, coded like UTF-8
+    uint64_t number = p[4];
+    uint32_t extra;
+    if (number < 0x80) {
+        extra = 0;
+    } else if ((number & 0xE0) == 0xC0) {
+        number &= 0x1F, extra = 1;
+    } else if ((number & 0xF0) == 0xE0) {
+        number &= 0x0F, extra = 2;
+    } else if ((number & 0xF8) == 0xF0) {
+        number &= 0x07, extra = 3;
+    } else if ((number & 0xFC) == 0xF8) {
+        number &= 0x03, extra = 4;
+    } else if ((number & 0xFE) == 0xFC) {
+        number &= 0x01, extra = 5;
+    } else if (number == 0xFE) {
+        number = 0, extra = 6;
+    } else {
+        return 1;
+    }
+    uint32_t at = 5;
+    for (uint32_t i = 0; i < extra; i++, at++) {
+        if ((p[at] & 0xC0) != 0x80) {
+            return 1;
+        }
+        number = (number << 6) | (p[at] & 0x3F);
+    }
+
+    uint32_t block_size;
+    if (block_code == 1) {
+        block_size = 192;
+    } else if (block_code <= 5) {
+        block_size = 576u << (block_code - 2);
+    } else if (block_code == 6) {
+        block_size = p[at++] + 1u;
+    } else if (block_code == 7) {
+        block_size = ((uint32_t)p[at] << 8 | p[at + 1]) + 1;
+        at += 2;
+    } else {
+        block_size = 256u << (block_code - 8);
+    }
+    uint32_t rate = rate_code < 12 ? rates[rate_code] : 0;
+    if (rate_code == 12) {
+        rate = p[at++] * 1000u;
+    } else if (rate_code == 13) {
+        rate = (uint32_t)p[at] << 8 | p[at + 1];
+        at += 2;
+    } else if (rate_code == 14) {
+        rate = ((uint32_t)p[at] << 8 | p[at + 1]) * 10;
+        at += 2;
+    }
+    if (at + 1 > available) {
+        return 1;
+    }
+    uint8_t crc = 0;
+    for (uint32_t i = 0; i < at; i++) {
+        crc ^= p[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (uint8_t)((crc << 1) ^ (crc & 0x80 ? 0x07 : 0));
+        }
+    }
+    if (crc != p[at]) {
+        return 1;
+    }
+
+    uint32_t channels = channel_code < 8 ? channel_code + 1 : 2;
+    uint32_t width = width_code ? widths[width_code] : flac->bits_per_sample;
+    if (channels != flac->channels || width != flac->bits_per_sample || (rate && rate != flac->sample_rate) ||
+        block_size > flac->max_block) {
+        return 1;
+    }
+    header->first_sample = (p[1] & 1) ? number : number * flac->max_block; // Variable or fixed blocking
+    header->block_size = block_size;
+    header->header_size = at + 1;
+    header->channel_assignment = channel_code;
+    return 0;
+}
+
+// Find the next frame header at or after offset whose first sample is within
+// [first, last]; 1 if there is none
+static int flac_find_frame(const FlacFile *flac, uint64_t offset, uint64_t first, uint64_t last, uint64_t *found,
+                           FlacFrameHeader *header) {
+    const uint8_t *p = flac->base + offset;
+    const uint8_t *end = flac->base + flac->size;
+    while (p + 1 < end && (p = memchr(p, 0xFF, (size_t)(end - p - 1))) != NULL) {
+        if ((p[1] & 0xFE) == 0xF8 && flac_frame_header(flac, (uint64_t)(p - flac->base), header) == 0 &&
+            header->first_sample >= first && header->first_sample <= last) {
+            *found = (uint64_t)(p - flac->base);
+            return 0;
+        }
+        p++;
+    }
+    return 1;
+}
+
+// Decode the frame at offset into flac->max_block samples per channel of planar;
+// end receives the position after the frame. 1 for a damaged frame
+static int flac_decode_frame(const FlacFile *flac, uint64_t offset, int32_t *planar, FlacFrameHeader *header,
+                             uint64_t *end) {
+    if (flac_frame_header(flac, offset, header) != 0) {
+        return 1;
+    }
+    FlacBits b = { .data = flac->base + offset, .size = flac->size - offset, .pos = header->header_size };
+    uint32_t stride = flac->max_block;
+    uint32_t assignment = header->channel_assignment;
+    for (uint32_t ch = 0; ch < flac->channels; ch++) {
+        // The side channel carries one extra bit
+        int side = (assignment == 8 && ch == 1) || (assignment == 9 && ch == 0) || (assignment == 10 && ch == 1);
+        if (flac_subframe(&b, planar + (size_t)ch * stride, header->block_size, flac->bits_per_sample + side) != 0) {
+            return 1;
+        }
+    }
+
+    // The frame ends at the next byte boundary, followed by its CRC-16
+    size_t length = (b.pos * 8 - b.count + 7) / 8;
+    if (length + 2 > b.size) {
+        return 1;
+    }
+    pthread_once(&flac_crc16_once, flac_crc16_init);
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc = (uint16_t)(crc << 8) ^ flac_crc16_table[(crc >> 8) ^ b.data[i]];
+    }
+    if (crc != ((uint16_t)b.data[length] << 8 | b.data[length + 1])) {
+        return 1;
+    }
+    *end = offset + length + 2;
+
+    int32_t *left = planar, *right = planar + stride;
+    uint32_t n = header->block_size;
+    if (assignment == 8) {
+        for (uint32_t i = 0; i < n; i++) {
+            right[i] = left[i] - right[i];
+        }
+    } else if (assignment == 9) {
+        for (uint32_t i = 0; i < n; i++) {
+            left[i] += right[i];
+        }
+    } else if (assignment == 10) {
+        for (uint32_t i = 0; i < n; i++) {
+            int32_t mid = (int32_t)((uint32_t)left[i] << 1) | (right[i] & 1);
+            left[i] = (mid + right[i]) >> 1;
+            right[i] = (mid - right[i]) >> 1;
+        }
+    }
+    return 0;
+}
+
+// Interleave count samples per channel, starting at first, into the container format
+static void flac_interleave(const FlacFile *flac, const int32_t *planar, uint32_t first, uint32_t count,
+                            uint8_t *dst) {
+    uint32_t channels = flac->channels, shift = flac->shift;
+    for (uint32_t ch = 0; ch < channels; ch++) {
+        const int32_t *src = planar + (size_t)ch * flac->max_block + first;
+        switch (flac->container_bytes) {
+        case 2: {
+            int16_t *out = (int16_t *)dst + ch;
+            for (uint32_t i = 0; i < count; i++) {
+                out[(size_t)i * channels] = (int16_t)((uint32_t)src[i] << shift);
+            }
+            break;
+        }
+        case 3: {
+            uint8_t *out = dst + ch * 3;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t value = (uint32_t)src[i] << shift;
+                out[(size_t)i * channels * 3] = (uint8_t)value;
+                out[(size_t)i * channels * 3 + 1] = (uint8_t)(value >> 8);
+                out[(size_t)i * channels * 3 + 2] = (uint8_t)(value >> 16);
+            }
+            break;
+        }
+        default: {
+            int32_t *out = (int32_t *)dst + ch;
+            for (uint32_t i = 0; i < count; i++) {
+                out[(size_t)i * channels] = (int32_t)((uint32_t)src[i] << shift);
+            }
+            break;
+        }
+        }
+    }
+}
+
+// Record every frame's position by walking sync codes, each frame's header leading
+// to the next by sample number. Needed for random access; costs a scan of the file
+static int flac_index_frames(FlacFile *flac) {
+    if (flac->frames) {
+        return 0;
+    }
+    uint64_t offset = flac->audio_offset, sample = 0;
+    uint32_t capacity = 0;
+    FlacFrameHeader header;
+    while ((flac->total_samples == 0 || sample < flac->total_samples) &&
+           flac_find_frame(flac, offset, sample, sample, &offset, &header) == 0) {
+        if (flac->frame_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            FlacFrame *frames = realloc(flac->frames, capacity * sizeof(FlacFrame));
+            if (!frames) {
+                printf("Error: Memory allocation failed\n");
+                return 1;
+            }
+            flac->frames = frames;
+        }
+        flac->frames[flac->frame_count++] = (FlacFrame){ .offset = offset, .first_sample = sample };
+        sample += header.block_size;
+        offset += header.header_size;
+    }
+    if (flac->total_samples && sample < flac->total_samples) {
+        printf("Warning: FLAC frames end at sample %llu of %llu\n", (unsigned long long)sample,
+               (unsigned long long)flac->total_samples);
+    }
+    flac->total_samples = sample < flac->total_samples || flac->total_samples == 0 ? sample : flac->total_samples;
+    return 0;
+}
+
+// Index of the last indexed frame starting at or before sample (0 when none does)
+static uint32_t flac_frame_at(const FlacFile *flac, uint64_t sample) {
+    uint32_t low = 0, high = flac->frame_count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (flac->frames[mid].first_sample <= sample) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Decode samples [first, end) into dst through the frame index. Independent of the
+// sequential reader, so threads can decode different ranges of one file at once;
+// planar is scratch for max_block samples per channel
+static int flac_decode_range(const FlacFile *flac, uint64_t first, uint64_t end, int32_t *planar, uint8_t *dst) {
+    uint32_t low = flac_frame_at(flac, first);
+    uint32_t frame_bytes = flac->channels * flac->container_bytes;
+    for (uint32_t f = low; first < end && f < flac->frame_count; f++) {
+        FlacFrameHeader header;
+        uint64_t frame_end;
+        if (flac_decode_frame(flac, flac->frames[f].offset, planar, &header, &frame_end) != 0) {
+            printf("Error: Damaged FLAC frame at byte %llu\n", (unsigned long long)flac->frames[f].offset);
+            return 1;
+        }
+        uint32_t from = (uint32_t)(first - header.first_sample);
+        uint64_t count = header.block_size - from;
+        count = count < end - first ? count : end - first;
+        flac_interleave(flac, planar, from, (uint32_t)count, dst);
+        dst += count * frame_bytes;
+        first += count;
+    }
+    return first < end;
+}
+
+typedef struct {
+    const FlacFile *flac;
+    uint64_t first; // Samples [first, end), on frame boundaries
+    uint64_t end;
+    uint8_t *dst;
+    int32_t *planar;
+    int err;
+    pthread_t thread;
+} FlacRangeJob;
+
+static void *flac_range_thread(void *arg) {
+    FlacRangeJob *job = (FlacRangeJob *)arg;
+    job->err = flac_decode_range(job->flac, job->first, job->end, job->planar, job->dst);
+    return NULL;
+}
+
+// Decode the whole file into dst on up to threads threads, each taking an even
+// share of the frames; the index is built first if it is missing
+static int flac_decode_parallel(FlacFile *flac, uint8_t *dst, uint32_t threads) {
+    if (flac_index_frames(flac) != 0) {
+        return 1;
+    }
+    threads = threads < flac->frame_count ? threads : flac->frame_count;
+    threads = threads ? threads : 1;
+    FlacRangeJob *jobs = calloc(threads, sizeof(FlacRangeJob));
+    if (!jobs) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    uint32_t frame_bytes = flac->channels * flac->container_bytes;
+    int err = 0;
+    for (uint32_t t = 0; t < threads; t++) {
+        uint32_t begin = (uint32_t)((uint64_t)flac->frame_count * t / threads);
+        uint32_t stop = (uint32_t)((uint64_t)flac->frame_count * (t + 1) / threads);
+        jobs[t].flac = flac;
+        jobs[t].first = flac->frame_count ? flac->frames[begin].first_sample : 0;
+        jobs[t].end = stop < flac->frame_count ? flac->frames[stop].first_sample : flac->total_samples;
+        jobs[t].dst = dst + jobs[t].first * frame_bytes;
+        jobs[t].planar = malloc((size_t)flac->max_block * flac->channels * sizeof(int32_t));
+        err |= jobs[t].planar == NULL;
+    }
+    uint32_t started = 0;
+    for (uint32_t t = 1; !err && t < threads; t++, started++) {
+        if (pthread_create(&jobs[t].thread, NULL, flac_range_thread, &jobs[t]) != 0) {
+            break;
+        }
+    }
+    // This thread takes the first share, and any whose thread could not start
+    for (uint32_t t = 0; !err && t < threads; t = t ? t + 1 : started + 1) {
+        flac_range_thread(&jobs[t]);
+    }
+    for (uint32_t t = 1; t <= started; t++) {
+        pthread_join(jobs[t].thread, NULL);
+    }
+    if (!err) {
+        for (uint32_t t = 0; t < threads; t++) {
+            err |= jobs[t].err;
+        }
+    } else {
+        printf("Error: Memory allocation failed\n");
+    }
+    for (uint32_t t = 0; t < threads; t++) {
+        free(jobs[t].planar);
+    }
+    free(jobs);
+    return err;
+}
+
+// Playback: decode the next frame into flac->pcm; 1 at the end of the stream. A
+// damaged frame is skipped by resynchronizing on the next valid header
+static int flac_read_frame(FlacFile *flac) {
+    flac->pcm_frames = flac->pcm_pos = 0;
+    while (flac->next_sample < flac->total_samples && flac->next_offset < flac->size) {
+        FlacFrameHeader header;
+        uint64_t end;
+        if (flac_decode_frame(flac, flac->next_offset, flac->planar, &header, &end) != 0) {
+            printf("Warning: Damaged FLAC frame at byte %llu, skipping\n", (unsigned long long)flac->next_offset);
+            uint64_t offset;
+            if (flac_find_frame(flac, flac->next_offset + 1, flac->next_sample + 1,
+                                flac->next_sample + 16 * (uint64_t)flac->max_block, &offset, &header) != 0) {
+                return 1;
+            }
+            flac->next_offset = offset;
+            flac->next_sample = header.first_sample;
+            continue;
+        }
+        uint64_t left = flac->total_samples - header.first_sample;
+        flac->pcm_frames = header.block_size < left ? header.block_size : (uint32_t)left;
+        flac_interleave(flac, flac->planar, 0, flac->pcm_frames, flac->pcm);
+        flac->next_offset = end;
+        flac->next_sample = header.first_sample + header.block_size;
+        return 0;
+    }
+    return 1;
+}
+
+// Position the sequential reader at sample: start from the frame index or the
+// nearest SEEKTABLE point, then walk frame headers to the frame holding it
+static int flac_seek(FlacFile *flac, uint64_t sample) {
+    if (sample >= flac->total_samples) {
+        flac->next_sample = flac->total_samples;
+        flac->pcm_frames = flac->pcm_pos = 0;
+        return 0;
+    }
+    uint64_t offset = flac->audio_offset, first = 0;
+    if (flac->frame_count > 0) {
+        uint32_t f = flac_frame_at(flac, sample);
+        if (flac->frames[f].first_sample <= sample) {
+            offset = flac->frames[f].offset;
+            first = flac->frames[f].first_sample;
+        }
+    }
+    for (uint32_t i = 0; !flac->frames && i < flac->seek_count && flac->seek_points[i][0] <= sample; i++) {
+        offset = flac->audio_offset + flac->seek_points[i][1];
+        first = flac->seek_points[i][0];
+    }
+    FlacFrameHeader header;
+    for (;;) {
+        if (flac_find_frame(flac, offset, first, first, &offset, &header) != 0) {
+            return 1;
+        }
+        if (sample < first + header.block_size) {
+            break;
+        }
+        first += header.block_size;
+        offset += header.header_size;
+    }
+    flac->next_offset = offset;
+    flac->next_sample = first;
+    if (flac_read_frame(flac) != 0) {
+        return 1;
+    }
+    flac->pcm_pos = (uint32_t)(sample - first);
+    return 0;
+}
+
+static void flac_close(FlacFile *flac) {
+    munmap(flac->base, flac->size);
+    free(flac->seek_points);
+    free(flac->frames);
+    free(flac->planar);
+    free(flac->pcm);
+    free(flac);
+}
+
+static uint64_t read_be(const uint8_t *p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+// Check for the fLaC marker without parsing anything
+static int is_flac_file(const char *filename) {
+    char marker[4];
+    FILE *file = fopen(filename, "rb");
+    int flac = file && fread(marker, 4, 1, file) == 1 && memcmp(marker, "fLaC", 4) == 0;
+    if (file) {
+        fclose(file);
+    }
+    return flac;
+}
+
+// Read the metadata blocks of the stream at flac->base and set up sequential
+// decoding from the first frame; verbose lists the blocks as they are found
+static int flac_parse(FlacFile *flac, int verbose) {
+    static const char *const block_names[7] = { "STREAMINFO", "PADDING", "APPLICATION", "SEEKTABLE",
+                                                "VORBIS_COMMENT", "CUESHEET", "PICTURE" };
+    // Metadata blocks: STREAMINFO first, then any others, the last one flagged
+    uint64_t offset = 4;
+    int have_info = 0;
+    for (int last = 0; !last;) {
+        if (offset + 4 > flac->size) {
+            printf("Error: FLAC metadata is truncated\n");
+            return 1;
+        }
+        const uint8_t *block = flac->base + offset;
+        uint32_t type = block[0] & 0x7F, length = (uint32_t)read_be(block + 1, 3);
+        last = block[0] >> 7;
+        if (offset + 4 + length > flac->size) {
+            printf("Error: FLAC metadata is truncated\n");
+            return 1;
+        }
+        if (verbose) {
+            printf("Metadata: %s, size=%u\n", type < 7 ? block_names[type] : "unknown", length);
+        }
+        const uint8_t *body = block + 4;
+        if (type == 0 && length >= 34) {
+            uint64_t packed = read_be(body + 10, 8);
+            flac->min_block = (uint32_t)read_be(body, 2);
+            flac->max_block = (uint32_t)read_be(body + 2, 2);
+            flac->sample_rate = (uint32_t)(packed >> 44);
+            flac->channels = (uint32_t)((packed >> 41) & 7) + 1;
+            flac->bits_per_sample = (uint32_t)((packed >> 36) & 31) + 1;
+            flac->total_samples = packed & 0xFFFFFFFFFull;
+            have_info = 1;
+        } else if (type == 3 && !flac->seek_points) {
+            flac->seek_points = malloc((length / 18 + 1) * sizeof(*flac->seek_points));
+            if (!flac->seek_points) {
+                printf("Error: Memory allocation failed\n");
+                return 1;
+            }
+            for (uint32_t i = 0; i < length / 18; i++) {
+                uint64_t sample = read_be(body + i * 18, 8);
+                if (sample != UINT64_MAX) { // Placeholder points are skipped
+                    flac->seek_points[flac->seek_count][0] = sample;
+                    flac->seek_points[flac->seek_count][1] = read_be(body + i * 18 + 8, 8);
+                    flac->seek_count++;
+                }
+            }
+        }
+        offset += 4 + length;
+    }
+    flac->audio_offset = offset;
+
+    if (!have_info || flac->max_block < 16 || flac->min_block > flac->max_block || flac->bits_per_sample < 4) {
+        printf("Error: Invalid FLAC STREAMINFO\n");
+        return 1;
+    }
+    if (flac->sample_rate < 8000 || flac->sample_rate > 96000) {
+        printf("Error: Sample rate %u Hz is not supported (must be 8000–96000 Hz)\n", flac->sample_rate);
+        return 1;
+    }
+    flac->container_bytes = flac->bits_per_sample <= 16 ? 2 : flac->bits_per_sample <= 24 ? 3 : 4;
+    flac->shift = flac->container_bytes * 8 - flac->bits_per_sample;
+    flac->planar = malloc((size_t)flac->max_block * flac->channels * sizeof(int32_t));
+    flac->pcm = malloc((size_t)flac->max_block * flac->channels * flac->container_bytes);
+    if (!flac->planar || !flac->pcm) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    if (flac->total_samples == 0 && flac_index_frames(flac) != 0) {
+        return 1; // Length not in STREAMINFO: count the frames
+    }
+    flac->next_offset = flac->audio_offset;
+    return 0;
+}
+
+// Map a FLAC file and read its metadata; samples decode to the smallest PCM container
+// that holds them, left-justified, and play through the same converter as WAV
+static int open_flac_file(const char *filename, Track *track) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Error: Cannot open file %s\n", filename);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    void *base = st.st_size > 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Error: Failed to map file %s\n", filename);
+        return 1;
+    }
+    FlacFile *flac = calloc(1, sizeof(FlacFile));
+    if (!flac) {
+        munmap(base, (size_t)st.st_size);
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    flac->base = base;
+    flac->size = (size_t)st.st_size;
+    track->flac = flac; // track_close releases it from here on
+
+    if (flac_parse(flac, 1) != 0) {
+        return 1;
+    }
+    uint32_t block_align = flac->channels * flac->container_bytes;
+    madvise(flac->base, flac->size, MADV_SEQUENTIAL);
+
+    // FLAC's channel orders for 1-8 channels are the WAV defaults, so no mask is needed
+    track->sample_rate = flac->sample_rate;
+    track->num_channels = (uint16_t)flac->channels;
+    track->channel_mask = 0;
+    track->bits_per_sample = (uint16_t)(flac->container_bytes * 8);
+    track->is_float = 0;
+    track->block_align = block_align;
+    track->data_offset = flac->audio_offset;
+    track->data_size = flac->total_samples * block_align;
+    track->offset = 0;
+    track->duration = (float)flac->total_samples / flac->sample_rate;
+
+    printf("FLAC Info:\n");
+    printf("  Sample Rate: %u Hz\n", flac->sample_rate);
+    printf("  Channels: %u\n", flac->channels);
+    printf("  Bits per Sample: %u (decoded to %u)\n", flac->bits_per_sample, track->bits_per_sample);
+    printf("  Block Size: %u-%u samples\n", flac->min_block, flac->max_block);
+    printf("  Seek Points: %u\n", flac->seek_count);
+    printf("  Total Samples: %llu\n", (unsigned long long)flac->total_samples);
+    printf("  Compression: %.1f%%\n",
+           track->data_size ? 100.0 * (flac->size - flac->audio_offset) / track->data_size : 0.0);
+    printf("  Duration: %.2f seconds\n", track->duration);
+    return 0;
+}
+
+static int playlist_add(Playlist *list, const char *file) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        char **files = realloc(list->files, capacity * sizeof(char *));
+        if (files) {
+            list->files = files;
+        }
+        uint32_t *roots = files ? realloc(list->roots, capacity * sizeof(uint32_t)) : NULL;
+        if (!roots) {
+            printf("Error: Memory allocation failed\n");
+            return 1;
+        }
+        list->roots = roots;
+        list->capacity = capacity;
+    }
+    list->roots[list->count] = 0;
+    list->files[list->count] = strdup(file);
+    if (!list->files[list->count]) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    list->count++;
+    return 0;
+}
+
+// Append an M3U playlist: one path per line, # lines are comments or #EXT tags,
+// and relative paths are relative to the playlist's own directory
+static int playlist_load_m3u(Playlist *list, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Error: Cannot open playlist %s\n", path);
+        return 1;
+    }
+    const char *slash = strrchr(path, '/');
+    int directory_length = slash ? (int)(slash - path + 1) : 0;
+    char line[4096];
+    char entry[8192];
+    int err = 0;
+    for (int first = 1; !err && fgets(line, sizeof(line), file); first = 0) {
+        char *name = line;
+        if (first && strncmp(name, "\xEF\xBB\xBF", 3) == 0) {
+            name += 3; // UTF-8 byte order mark
+        }
+        name[strcspn(name, "\r\n")] = '\0';
+        if (name[0] == '\0' || name[0] == '#') {
+            continue;
+        }
+        if (name[0] == '/') {
+            err = playlist_add(list, name);
+        } else {
+            snprintf(entry, sizeof(entry), "%.*s%s", directory_length, path, name);
+            err = playlist_add(list, entry);
+        }
+    }
+    fclose(file);
+    return err;
+}
+
+static void playlist_free(Playlist *list) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        free(list->files[i]);
+    }
+    free(list->files);
+    free(list->roots);
+    *list = (Playlist){0};
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Append a directory's .wav and .flac files and, recursively, its subdirectories in name order.
+// Symbolic links are followed to files only, so link loops cannot recurse forever
+static int playlist_add_directory(Playlist *list, const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        printf("Error: Cannot open directory %s\n", path);
+        return 1;
+    }
+    Playlist names = {0};
+    struct dirent *item;
+    int err = 0;
+    while (!err && (item = readdir(dir)) != NULL) {
+        if (item->d_name[0] != '.') {
+            err = playlist_add(&names, item->d_name);
+        }
+    }
+    closedir(dir);
+    if (names.count > 1) {
+        qsort(names.files, names.count, sizeof(char *), compare_names);
+    }
+    size_t path_length = strlen(path);
+    const char *separator = path_length > 0 && path[path_length - 1] == '/' ? "" : "/";
+    char entry[8192];
+    for (uint32_t i = 0; !err && i < names.count; i++) {
+        snprintf(entry, sizeof(entry), "%s%s%s", path, separator, names.files[i]);
+        struct stat st;
+        if (lstat(entry, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            err = playlist_add_directory(list, entry);
+            continue;
+        }
+        size_t length = strlen(entry);
+        int audio = (length > 4 && strcasecmp(entry + length - 4, ".wav") == 0) ||
+                    (length > 5 && strcasecmp(entry + length - 5, ".flac") == 0);
+        if (audio &&
+            (S_ISREG(st.st_mode) || (S_ISLNK(st.st_mode) && stat(entry, &st) == 0 && S_ISREG(st.st_mode)))) {
+            err = playlist_add(list, entry);
+        }
+    }
+    playlist_free(&names);
+    return err;
+}
+
+// Add a command line argument: an M3U playlist or a directory is expanded, anything
+// else is a WAV or FLAC file
+static int playlist_add_argument(Playlist *list, const char *arg) {
+    size_t length = strlen(arg);
+    if ((length > 4 && strcasecmp(arg + length - 4, ".m3u") == 0) ||
+        (length > 5 && strcasecmp(arg + length - 5, ".m3u8") == 0)) {
+        return playlist_load_m3u(list, arg);
+    }
+    struct stat st;
+    if (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+        uint32_t first = list->count;
+        int err = playlist_add_directory(list, arg);
+        uint32_t root = (uint32_t)length + (arg[length - 1] == '/' ? 0 : 1);
+        for (uint32_t i = first; i < list->count; i++) {
+            list->roots[i] = root;
+        }
+        return err;
+    }
+    return playlist_add(list, arg);
+}
+
+static uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (uint64_t)((end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec));
+}
+
+static int64_t stat_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Pre-rendering: each track converted whole, once, into the output format (rate,
+// channels and sample format) before it plays, and kept in a cache shared by every
+// track and mixer voice, keyed by the file and the format. Playing it again costs no
+// conversion: the producer copies the rendered frames into the ring as they are, and
+// the mixer sums them straight into its bus. Renders no track holds stay for replay
+// until they outgrow RENDER_CACHE_BYTES, least recently used going first. Only
+// clips up to RENDER_ASSET_BYTES rendered are held whole; longer tracks, and in a
+// playlist any track that needs resampling (so it keeps its gapless join through
+// the resampler), are converted as they play
+#define RENDER_CACHE_BYTES (256ull << 20)
+#define RENDER_ASSET_BYTES (32ull << 20)
+
+typedef struct RenderedAsset {
+    char *path;
+    uint64_t file_size; // With the mtime, the file it was rendered from
+    int64_t mtime_ns;
+    OutputFormat format;
+    ResampleQuality quality;
+    uint8_t *data;
+    uint64_t size; // Bytes of whole frames in data
+    uint32_t refs; // Tracks holding it
+    uint64_t used; // Cache clock at the last lookup
+    struct RenderedAsset *next;
+} RenderedAsset;
+
+// Every field is guarded by lock; the rendering itself runs outside it
+typedef struct {
+    pthread_mutex_t lock;
+    RenderedAsset *assets;
+    uint64_t bytes; // Held by every render, in use or not
+    uint64_t clock;
+    uint32_t renders;
+    uint32_t replays;
+} RenderCache;
+
+static RenderCache render_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Drop unused renders, oldest first, until the cache fits in limit bytes (lock held)
+static void render_cache_trim(uint64_t limit) {
+    while (render_cache.bytes > limit) {
+        RenderedAsset **oldest = NULL;
+        for (RenderedAsset **a = &render_cache.assets; *a; a = &(*a)->next) {
+            if ((*a)->refs == 0 && (!oldest || (*a)->used < (*oldest)->used)) {
+                oldest = a;
+            }
+        }
+        if (!oldest) {
+            return;
+        }
+        RenderedAsset *asset = *oldest;
+        *oldest = asset->next;
+        render_cache.bytes -= asset->size;
+        free(asset->data);
+        free(asset->path);
+        free(asset);
+    }
+}
+
+// A render of path as it is now in format, with a reference taken; NULL if there is none (lock held)
+static RenderedAsset *render_cache_find(const char *path, const struct stat *st, const OutputFormat *format,
+                                        ResampleQuality quality) {
+    for (RenderedAsset *asset = render_cache.assets; asset; asset = asset->next) {
+        if (strcmp(asset->path, path) == 0 && asset->file_size == (uint64_t)st->st_size &&
+            asset->mtime_ns == stat_mtime_ns(st) && memcmp(&asset->format, format, sizeof(*format)) == 0 &&
+            asset->quality == quality) {
+            asset->refs++;
+            asset->used = ++render_cache.clock;
+            return asset;
+        }
+    }
+    return NULL;
+}
+
+static void render_cache_release(RenderedAsset *asset) {
+    pthread_mutex_lock(&render_cache.lock);
+    asset->refs--;
+    render_cache_trim(RENDER_CACHE_BYTES);
+    pthread_mutex_unlock(&render_cache.lock);
+}
+
+// Release whichever audio source the track was opened with
+static void track_close(Track *track) {
+    if (track->asset) {
+        render_cache_release(track->asset);
+        track->asset = NULL;
+        track->audio_data = NULL; // Pointed into the render
+    }
+    if (track->stream) {
+        stream_close(track->stream);
+        track->stream = NULL;
+    }
+    if (track->mapped_base) {
+        munmap(track->mapped_base, track->mapped_size);
+        track->mapped_base = NULL;
+        track->audio_data = NULL; // Pointed into the mapping
+    }
+    free(track->audio_data);
+    track->audio_data = NULL;
+    free(track->chunks);
+    track->chunks = NULL;
+    track->chunk_count = 0;
+    if (track->flac) {
+        flac_close(track->flac);
+        track->flac = NULL;
+    }
+}
+
+// Open one WAV file the way the player was asked to read it. FLAC files are always
+// mapped and decoded a frame at a time, whatever the source
+static int open_track(Track *track, const char *filename, TrackSource source) {
+    *track = (Track){ .filename = filename };
+    int err;
+    if (is_flac_file(filename)) {
+        err = open_flac_file(filename, track);
+    } else if (source == SOURCE_STREAM) {
+        err = open_wav_stream(filename, track);
+    } else if (source == SOURCE_MAP) {
+        err = map_wav_file(filename, track);
+    } else {
+        err = read_wav_file(filename, track);
+    }
+    if (err) {
+        track_close(track);
+    }
+    return err;
+}
+
+// Move the track to a sample frame. The data chunk's position comes from the index
+// built at open time and frames have a fixed size, so this is arithmetic plus, for
+// streams, one read at the new position; nothing between is scanned or decoded
+static int track_seek(Track *track, uint64_t frame) {
+    if (track->stream && track->stream->pipe) {
+        return 1; // Whatever has been read is gone
+    }
+    uint64_t frames = track->data_size / track->block_align;
+    track->offset = (frame < frames ? frame : frames) * track->block_align;
+    if (track->flac) {
+        return flac_seek(track->flac, frame);
+    }
+    if (track->stream) {
+        return stream_seek(track->stream, track->data_offset + track->offset, track->data_size - track->offset);
+    }
+    if (track->mapped_base) {
+        track->advised_offset = track->offset;
+        advise_mapping(track);
+    }
+    return 0;
+}
+
+// Point *src at up to limit frames of an opened or mapped track for a front-to-back
+// pass, decoding FLAC a frame at a time; 0 at the end
+static uint32_t track_next_block(Track *track, const uint8_t **src, uint32_t limit) {
+    if (track->flac) {
+        FlacFile *flac = track->flac;
+        if (flac->pcm_pos == flac->pcm_frames && flac_read_frame(flac) != 0) {
+            return 0;
+        }
+        uint32_t frames = flac->pcm_frames - flac->pcm_pos;
+        frames = frames < limit ? frames : limit;
+        *src = flac->pcm + (size_t)flac->pcm_pos * track->block_align;
+        flac->pcm_pos += frames;
+        return frames;
+    }
+    uint64_t frames = (track->data_size - track->offset) / track->block_align;
+    frames = frames < limit ? frames : limit;
+    *src = track->audio_data + track->offset;
+    track->offset += frames * track->block_align;
+    return (uint32_t)frames;
+}
+
+// Open the next playlist entry that parses into track, skipping ones that fail
+static int open_next_track(PlaybackState *state, Track *track) {
+    while (state->next_index < state->playlist.count) {
+        uint32_t index = state->next_index++;
+        const char *filename = state->playlist.files[index];
+        if (strcmp(filename, "-") == 0) {
+            *track = (Track){ .filename = filename };
+            if (open_stdin_stream(track, state->raw_input) == 0) {
+                track->index = index;
+                return 0;
+            }
+            track_close(track);
+        } else if (open_track(track, filename, state->source) == 0) {
+            track->index = index;
+            return 0;
+        }
+        if (state->playlist.count > 1) {
+            printf("Warning: Skipping %s\n", filename);
+        }
+    }
+    return 1;
+}
+
+static void prerender_track(PlaybackState *state, Track *track);
+
+// Preload thread: open the next track so its headers are parsed and its first data
+// is buffered (or the whole of it pre-rendered) before the producer reaches the end
+// of the current one
+static void *preload_thread(void *arg) {
+    PlaybackState *state = (PlaybackState *)arg;
+    state->next_ready = open_next_track(state, &state->next) == 0;
+    if (state->next_ready && state->prerender) {
+        prerender_track(state, &state->next);
+    }
+    return NULL;
+}
+
+static void start_preload(PlaybackState *state) {
+    if (state->next_index >= state->playlist.count) {
+        return;
+    }
+    if (pthread_create(&state->preload, NULL, preload_thread, state) == 0) {
+        state->preload_running = 1;
+    } else {
+        preload_thread(state); // No thread to spare: open it now instead
+    }
+}
+
+// Wait for the preload thread, which has usually finished long before
+static void wait_preload(PlaybackState *state) {
+    if (state->preload_running) {
+        pthread_join(state->preload, NULL);
+        state->preload_running = 0;
+    }
+}
+
+// Set up conversion for the current track: keep the resampler while it converts
+// from this rate, otherwise replace it (or drop it once the rates match)
+static int track_converter_init(PlaybackState *state) {
+    Resampler *rs = state->resampler;
+    if (rs && (rs->flushed || rs->input_rate != state->track.sample_rate)) {
+        resampler_free(rs);
+        state->resampler = NULL;
+    }
+    if (!state->resampler && state->track.sample_rate != state->output_sample_rate) {
+        if (resampler_init(state) != 0) {
+            return 1;
+        }
+        const ResampleBank *bank = state->resampler->bank;
+        printf("Resampling: %u -> %u Hz (%u/%u, %u phases x %u taps, %s quality)\n", state->track.sample_rate,
+               state->output_sample_rate, bank->up, bank->down, bank->phases, bank->taps,
+               resample_quality_names[state->resample_quality]);
+    }
+    return converter_init(&state->track.converter, &state->track, state);
+}
+
+// Producer: make the preloaded track current, 0 once the playlist is exhausted.
+// Its frames follow the last frame of the previous track with no gap
+static int next_track(PlaybackState *state) {
+    wait_preload(state);
+    if (!state->next_ready || atomic_load(&state->producer_stop)) {
+        return 0;
+    }
+    track_close(&state->track);
+    state->track = state->next;
+    state->next_ready = 0;
+    printf("Track %u/%u: %s (%.2f seconds)\n", state->track.index + 1, state->playlist.count,
+           state->track.filename, state->track.duration);
+    start_preload(state);
+    return track_converter_init(state) == 0;
+}
+
+// Producer: point *src at up to max_frames contiguous input frames, 0 once the input is exhausted
+static uint32_t next_input(PlaybackState *state, const uint8_t **src, uint32_t max_frames) {
+    Track *track = &state->track;
+    uint32_t input_bytes_per_frame = track->num_channels * (track->bits_per_sample / 8);
+
+    if (track->flac) {
+        FlacFile *flac = track->flac;
+        if (flac->pcm_pos == flac->pcm_frames && flac_read_frame(flac) != 0) {
+            return 0;
+        }
+        *src = flac->pcm + (size_t)flac->pcm_pos * input_bytes_per_frame;
+        uint32_t frames = flac->pcm_frames - flac->pcm_pos;
+        return frames < max_frames ? frames : max_frames;
+    }
+    if (track->stream) {
+        for (;;) {
+            uint32_t available = stream_peek(track->stream, src);
+            if (available == 0) {
+                if (stream_finished(track->stream) || atomic_load(&state->producer_stop)) {
+                    return 0;
+                }
+                // Reader is behind, the ring covers the wait. Published so that
+                // stop_producer can wake it, and the stream stays open until it is withdrawn
+                if (state->control_ready) {
+                    pthread_mutex_lock(&state->control_lock);
+                    state->stream_waiting = track->stream;
+                    pthread_mutex_unlock(&state->control_lock);
+                }
+                stream_wait(track->stream, &state->producer_stop);
+                if (state->control_ready) {
+                    pthread_mutex_lock(&state->control_lock);
+                    state->stream_waiting = NULL;
+                    pthread_mutex_unlock(&state->control_lock);
+                }
+                continue;
+            }
+            uint32_t frames = available / input_bytes_per_frame;
+            if (frames == 0) {
+                // Trailing partial frame of a truncated file
+                stream_consume(track->stream, available);
+                track->offset += available;
+                continue;
+            }
+            return frames < max_frames ? frames : max_frames;
+        }
+    }
+
+    uint64_t frames = (track->data_size - track->offset) / input_bytes_per_frame;
+    *src = track->audio_data + track->offset;
+    return frames < max_frames ? (uint32_t)frames : max_frames;
+}
+
+// Producer: mark frames returned by next_input as converted
+static void consume_input(PlaybackState *state, uint32_t frames) {
+    Track *track = &state->track;
+    uint32_t bytes = frames * track->num_channels * (track->bits_per_sample / 8);
+    track->offset += bytes;
+    if (track->flac) {
+        track->flac->pcm_pos += frames;
+    } else if (track->stream) {
+        stream_consume(track->stream, bytes);
+    } else {
+        advise_mapping(track);
+    }
+}
+
+// Producer: resample up to max_frames output frames into dst, decoding more
+// input whenever the filter window runs past the buffered history
+static uint32_t resample_frames(PlaybackState *state, uint8_t *dst, uint32_t max_frames) {
+    Resampler *rs = state->resampler;
+    uint32_t frames;
+    while ((frames = resampler_run(rs, rs->output, max_frames)) == 0) {
+        if (rs->flushed) {
+            return 0;
+        }
+        resampler_compact(rs);
+        const uint8_t *src;
+        uint32_t space = rs->capacity - rs->length;
+        uint32_t input = next_input(state, &src, space < RESAMPLE_CHUNK_FRAMES ? space : RESAMPLE_CHUNK_FRAMES);
+        if (input == 0) {
+            // A next track at the same rate carries on through the same filter history
+            wait_preload(state);
+            if (state->next_ready && state->next.sample_rate == rs->input_rate && next_track(state)) {
+                continue;
+            }
+            // Otherwise trailing silence lets the last outputs see a full window
+            resampler_append(rs, NULL, rs->bank->taps / 2);
+            rs->flushed = 1;
+            continue;
+        }
+        convert_frames(state, src, rs->input, input);
+        consume_input(state, input);
+        resampler_append(rs, rs->input, input);
+    }
+    rs->encode(rs->output, dst, (size_t)frames * rs->channels);
+    return frames;
+}
+
+// Producer: convert up to max_frames frames into dst, moving on through the
+// playlist; 0 once the last track is exhausted
+static uint32_t convert_input(PlaybackState *state, uint8_t *dst, uint32_t max_frames) {
+    for (;;) {
+        uint32_t frames;
+        if (state->resampler) {
+            frames = resample_frames(state, dst, max_frames);
+        } else {
+            const uint8_t *src;
+            frames = next_input(state, &src, max_frames);
+            if (frames > 0) {
+                convert_frames(state, src, dst, frames);
+                consume_input(state, frames);
+            }
+        }
+        if (frames > 0 || !next_track(state)) {
+            return frames;
+        }
+    }
+}
+
+// Producer: up to max_frames output frames into dst, through the effects when
+// there are any; 0 once the last track is exhausted and the effects drained
+static uint32_t produce_frames(PlaybackState *state, uint8_t *dst, uint32_t max_frames) {
+    EffectChain *fx = state->effects;
+    if (!fx) {
+        return convert_input(state, dst, max_frames);
+    }
+    max_frames = max_frames < PRODUCER_CHUNK_FRAMES ? max_frames : PRODUCER_CHUNK_FRAMES;
+    for (;;) {
+        uint32_t frames = convert_input(state, (uint8_t *)fx->block, max_frames);
+        if (frames > 0) {
+            frames = effects_process(fx, frames);
+        } else if ((frames = effects_drain(fx, max_frames)) == 0) {
+            return 0;
+        }
+        if (frames > 0) {
+            fx->encode(fx->block, dst, (size_t)frames * fx->channels);
+            return frames;
+        }
+    }
+}
+
+// Producer: apply a posted seek to the track being converted. The frames already in
+// the ring are flushed by the output at its next buffer, and conversion restarts
+// from the new position straight after them
+static void producer_seek(PlaybackState *state) {
+    pthread_mutex_lock(&state->control_lock);
+    double seconds = state->seek_seconds;
+    int relative = state->seek_relative;
+    atomic_store(&state->seek_pending, 0);
+    pthread_mutex_unlock(&state->control_lock);
+
+    Track *track = &state->track;
+    uint64_t frames = track->data_size / track->block_align;
+    double target = seconds * track->sample_rate;
+    if (relative) {
+        // Playing position: converted input less what the ring still holds
+        uint32_t read_pos = atomic_load(&state->flush_pending) ? atomic_load(&state->flush_pos)
+                                                                : atomic_load(&state->ring.read_pos);
+        uint32_t buffered = atomic_load(&state->ring.write_pos) - read_pos;
+        target += (double)(track->offset / track->block_align) -
+                  (double)buffered * track->sample_rate / state->output_sample_rate;
+    }
+    uint64_t frame = target <= 0 ? 0 : target >= frames ? frames : (uint64_t)target;
+    if (track_seek(track, frame) != 0) {
+        printf("Error: Cannot seek in %s\n", track->filename);
+        return;
+    }
+    if (state->resampler) {
+        resampler_reset(state->resampler);
+    }
+    if (state->effects) {
+        effects_reset(state->effects);
+    }
+    atomic_store(&state->input_done, 0);
+    atomic_store(&state->flush_pos, atomic_load(&state->ring.write_pos));
+    atomic_store_explicit(&state->flush_pending, 1, memory_order_release);
+    printf("Seek: %.2f of %.2f seconds\n", (double)frame / track->sample_rate, track->duration);
+}
+
+// Producer: top up the ring, returns 1 once the whole input has been converted
+static int producer_fill(PlaybackState *state) {
+    if (atomic_load_explicit(&state->seek_pending, memory_order_acquire)) {
+        producer_seek(state);
+    }
+    for (;;) {
+        uint8_t *region;
+        uint32_t space = ring_write_region(&state->ring, &region);
+        if (space == 0) {
+            return 0;
+        }
+        if (space > PRODUCER_CHUNK_FRAMES) {
+            space = PRODUCER_CHUNK_FRAMES;
+        }
+        uint32_t frames = produce_frames(state, region, space);
+        if (frames == 0) {
+            atomic_store_explicit(&state->input_done, 1, memory_order_release);
+            return 1;
+        }
+        ring_commit(&state->ring, frames);
+    }
+}
+
+// Producer thread: top up the ring, then sleep while a quarter of it drains. Once the
+// input is exhausted it only wakes for a seek or to stop
+static void *producer_thread(void *arg) {
+    PlaybackState *state = (PlaybackState *)arg;
+    uint64_t nap = (uint64_t)state->ring.capacity * 250000000u / state->output_sample_rate;
+    uint64_t flush_nap = (uint64_t)PRODUCER_CHUNK_FRAMES * 250000000u / state->output_sample_rate;
+    pthread_mutex_lock(&state->control_lock);
+    while (!atomic_load(&state->producer_stop)) {
+        pthread_mutex_unlock(&state->control_lock);
+        int done = producer_fill(state);
+        pthread_mutex_lock(&state->control_lock);
+        if (atomic_load(&state->seek_pending) || atomic_load(&state->producer_stop)) {
+            continue;
+        }
+        if (done) {
+            pthread_cond_wait(&state->control_cond, &state->control_lock);
+            continue;
+        }
+        // After a seek the ring is still full of frames the output is about to drop,
+        // so come back within a fraction of its next buffer to refill it
+        uint64_t wait = atomic_load(&state->flush_pending) ? flush_nap : nap;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(wait / 1000000000u);
+        deadline.tv_nsec += (long)(wait % 1000000000u);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&state->control_cond, &state->control_lock, &deadline);
+    }
+    pthread_mutex_unlock(&state->control_lock);
+    return NULL;
+}
+
+// Render the whole of an opened track into the format, through the same converter
+// and resampler as playback, failing past RENDER_ASSET_BYTES; the track is left at
+// an undefined position
+static int render_track(Track *track, const OutputFormat *format, ResampleQuality quality, uint8_t **data,
+                        uint64_t *size) {
+    PlaybackState scratch = { 0 };
+    scratch.output_channels = format->channels;
+    scratch.output_bits_per_channel = format->bits_per_channel;
+    scratch.output_is_float = format->is_float;
+    scratch.output_sample_rate = format->sample_rate;
+    scratch.resample_quality = quality;
+    scratch.track = *track; // Borrows the data, mapping or decoder
+    if (track_seek(&scratch.track, 0) != 0 || track_converter_init(&scratch) != 0) {
+        resampler_free(scratch.resampler);
+        return 1;
+    }
+    uint32_t frame_size = format->channels * (format->bits_per_channel / 8);
+    uint64_t capacity = track->data_size / track->block_align * format->sample_rate / track->sample_rate +
+                        PRODUCER_CHUNK_FRAMES; // Room for the resampler's tail
+    uint64_t done = 0;
+    uint8_t *buffer = NULL;
+    int err = 0;
+    for (;;) {
+        if (done + PRODUCER_CHUNK_FRAMES > capacity || !buffer) {
+            capacity = done + PRODUCER_CHUNK_FRAMES > capacity ? capacity * 2 : capacity;
+            uint8_t *grown = realloc(buffer, (size_t)capacity * frame_size);
+            if (!grown) {
+                err = 1;
+                break;
+            }
+            buffer = grown;
+        }
+        uint32_t frames = produce_frames(&scratch, buffer + done * frame_size, PRODUCER_CHUNK_FRAMES);
+        if (frames == 0) {
+            break;
+        }
+        done += frames;
+        if (done * frame_size > RENDER_ASSET_BYTES) {
+            err = 1; // Longer than its header said
+            break;
+        }
+    }
+    resampler_free(scratch.resampler);
+    if (err) {
+        free(buffer);
+        return 1;
+    }
+    *data = buffer;
+    *size = done * frame_size;
+    return 0;
+}
+
+// Swap an opened track for its render in the output format (the mixer's float bus
+// format when mixing), from the cache or rendered now, keeping its position. Streams
+// are never held whole, and a track that cannot be rendered plays as it is
+static void prerender_track(PlaybackState *state, Track *track) {
+    struct stat st;
+    if (track->stream || track->asset || stat(track->filename, &st) != 0) {
+        return;
+    }
+    // Rendered alone, a resampled track would start and end on its own silence
+    // instead of joining the next one through the resampler; mixer voices never join
+    if (!state->mix && track->sample_rate != state->output_sample_rate) {
+        return;
+    }
+    OutputFormat format = { state->output_sample_rate, state->output_channels, state->output_bits_per_channel,
+                            state->output_is_float };
+    if (state->mix) {
+        format.bits_per_channel = 32;
+        format.is_float = 1;
+    }
+    uint64_t estimate = track->data_size / track->block_align * format.sample_rate / track->sample_rate *
+                        format.channels * (format.bits_per_channel / 8);
+    if (estimate == 0 || estimate > RENDER_ASSET_BYTES) {
+        return; // Too long to hold whole, or of unknown length
+    }
+    pthread_mutex_lock(&render_cache.lock);
+    RenderedAsset *asset = render_cache_find(track->filename, &st, &format, state->resample_quality);
+    render_cache.replays += asset != NULL;
+    pthread_mutex_unlock(&render_cache.lock);
+
+    if (!asset) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        RenderedAsset *rendered = calloc(1, sizeof(RenderedAsset));
+        char *path = strdup(track->filename);
+        uint8_t *data = NULL;
+        uint64_t size = 0;
+        if (!rendered || !path || render_track(track, &format, state->resample_quality, &data, &size) != 0) {
+            printf("Warning: Cannot pre-render %s, converting it as it plays\n", track->filename);
+            free(rendered);
+            free(path);
+            track_seek(track, track->offset / track->block_align);
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        *rendered = (RenderedAsset){ .path = path, .file_size = (uint64_t)st.st_size, .mtime_ns = stat_mtime_ns(&st),
+                                     .format = format, .quality = state->resample_quality, .data = data,
+                                     .size = size, .refs = 1 };
+        pthread_mutex_lock(&render_cache.lock);
+        // Another thread may have rendered the same file meanwhile
+        asset = render_cache_find(track->filename, &st, &format, state->resample_quality);
+        if (asset) {
+            render_cache.replays++;
+        } else {
+            asset = rendered;
+            asset->used = ++render_cache.clock;
+            asset->next = render_cache.assets;
+            render_cache.assets = asset;
+            render_cache.bytes += size;
+            render_cache.renders++;
+            render_cache_trim(RENDER_CACHE_BYTES);
+        }
+        pthread_mutex_unlock(&render_cache.lock);
+        if (asset != rendered) {
+            free(data);
+            free(path);
+            free(rendered);
+        } else {
+            printf("Pre-rendered %s: %u Hz, %u channels, %u-bit %s, %.1f MB in %.1f ms\n", track->filename,
+                   format.sample_rate, format.channels, format.bits_per_channel, format.is_float ? "float" : "integer",
+                   size / 1e6, elapsed_ns(&start, &end) / 1e6);
+        }
+    }
+
+    uint32_t frame_size = format.channels * (format.bits_per_channel / 8);
+    uint64_t frames = asset->size / frame_size;
+    uint64_t position = track->offset / track->block_align * format.sample_rate / track->sample_rate;
+    Track rendered = { .filename = track->filename, .index = track->index, .asset = asset,
+                       .audio_data = asset->data, .data_size = asset->size, .block_align = frame_size,
+                       .sample_rate = format.sample_rate, .num_channels = format.channels,
+                       .bits_per_sample = format.bits_per_channel, .is_float = format.is_float,
+                       .duration = (float)frames / format.sample_rate };
+    rendered.offset = (position < frames ? position : frames) * frame_size;
+    track->asset = NULL;
+    track_close(track);
+    *track = rendered;
+}
+
+// Mixer: the main thread's side
+
+static void mixer_free(Mixer *mixer) {
+    if (mixer) {
+        for (uint32_t v = 0; v < MIXER_MAX_VOICES; v++) {
+            track_close(&mixer->voices[v].track);
+        }
+        free(mixer->bus);
+        free(mixer->scratch);
+        free(mixer);
+    }
+}
+
+static int mixer_init(PlaybackState *state) {
+    int out_format = sample_format_of(state->output_bits_per_channel, state->output_is_float);
+    if (out_format < SAMPLE_S16) {
+        printf("Error: Unsupported output bit depth %u\n", state->output_bits_per_channel);
+        return 1;
+    }
+    if (state->output_channels > MIX_MAX_CHANNELS) {
+        printf("Error: The mixer supports at most %d output channels\n", MIX_MAX_CHANNELS);
+        return 1;
+    }
+    Mixer *mixer = calloc(1, sizeof(Mixer));
+    if (!mixer) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    mixer->channels = state->output_channels;
+    mixer->encode = pcm_kernels->encode[out_format];
+    mixer->bus = malloc((size_t)MIXER_BLOCK_FRAMES * mixer->channels * sizeof(float));
+    // Converters may store up to 8 floats past the last frame
+    mixer->scratch = malloc(((size_t)MIXER_BLOCK_FRAMES * mixer->channels + 8) * sizeof(float));
+    if (!mixer->bus || !mixer->scratch) {
+        printf("Error: Memory allocation failed\n");
+        mixer_free(mixer);
+        return 1;
+    }
+    state->mixer = mixer;
+    return 0;
+}
+
+// Post a command, 1 if the queue is full
+static int mixer_post(Mixer *mixer, MixerCommand command) {
+    uint32_t head = atomic_load_explicit(&mixer->queue_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&mixer->queue_tail, memory_order_acquire) == MIXER_QUEUE_SIZE) {
+        return 1;
+    }
+    mixer->queue[head & (MIXER_QUEUE_SIZE - 1)] = command;
+    atomic_store_explicit(&mixer->queue_head, head + 1, memory_order_release);
+    return 0;
+}
+
+// A free slot, closing the track a finished voice left in it; -1 if every voice is busy
+static int mixer_claim(Mixer *mixer) {
+    for (uint32_t v = 0; v < MIXER_MAX_VOICES; v++) {
+        int voice_state = atomic_load_explicit(&mixer->voices[v].state, memory_order_acquire);
+        if (voice_state == VOICE_FREE || voice_state == VOICE_DONE) {
+            track_close(&mixer->voices[v].track);
+            atomic_store_explicit(&mixer->voices[v].state, VOICE_FREE, memory_order_relaxed);
+            return (int)v;
+        }
+    }
+    return -1;
+}
+
+// Start the loaded track in slot v from its current position
+static int mixer_start(Mixer *mixer, uint32_t v, float gain, float pan) {
+    MixerVoice *voice = &mixer->voices[v];
+    voice->frames = voice->track.data_size / voice->track.block_align;
+    voice->position = voice->track.offset / voice->track.block_align;
+    voice->gain = gain;
+    voice->pan = pan;
+    atomic_store_explicit(&voice->state, VOICE_QUEUED, memory_order_relaxed);
+    if (mixer_post(mixer, (MixerCommand){ MIXER_START, v, gain, pan }) != 0) {
+        atomic_store(&voice->state, VOICE_DONE);
+        printf("Error: Mixer command queue is full\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Start the track just opened in slot v, decoding it whole first if it is FLAC;
+// the track is closed again on failure
+static int mixer_load(PlaybackState *state, uint32_t v, float gain, float pan) {
+    Mixer *mixer = state->mixer;
+    Track *track = &mixer->voices[v].track;
+    int err = 0;
+    if (state->prerender) {
+        prerender_track(state, track); // Resampled to the mix rate on the way
+    }
+    if (track->flac) {
+        // Decoded up front, so the output only ever copies
+        FlacFile *flac = track->flac;
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        err = flac_index_frames(flac) != 0;
+        track->data_size = flac->total_samples * track->block_align;
+        track->audio_data = err ? NULL : malloc(track->data_size ? track->data_size : 1);
+        if (!err && !track->audio_data) {
+            printf("Error: Memory allocation failed\n");
+            err = 1;
+        }
+        err = err || flac_decode_parallel(flac, track->audio_data, cores > 0 ? (uint32_t)cores : 1) != 0;
+        flac_close(flac);
+        track->flac = NULL;
+    }
+    if (!err && track->sample_rate != state->output_sample_rate) {
+        printf("Error: %s is %u Hz, the mix runs at %u Hz\n", track->filename, track->sample_rate,
+               state->output_sample_rate);
+        err = 1;
+    }
+    if (err || converter_init(&track->converter, track, state) != 0 || mixer_start(mixer, v, gain, pan) != 0) {
+        track_close(track);
+        return 1;
+    }
+    printf("Voice %u: %s (%.2f seconds)\n", v + 1, track->filename, track->duration);
+    return 0;
+}
+
+// Load a file whole into a free voice and start it; returns the voice, or -1
+static int mixer_add(PlaybackState *state, const char *filename, float gain, float pan) {
+    int v = mixer_claim(state->mixer);
+    if (v < 0) {
+        printf("Error: All %d mixer voices are playing\n", MIXER_MAX_VOICES);
+        return -1;
+    }
+    Track *track = &state->mixer->voices[v].track;
+    if (open_track(track, filename, state->source == SOURCE_MAP ? SOURCE_MAP : SOURCE_LOAD) != 0 ||
+        mixer_load(state, (uint32_t)v, gain, pan) != 0) {
+        return -1;
+    }
+    return v;
+}
+
+// Start every playlist file at once: the first track, already open (and perhaps
+// seeked), moves into voice 1, leaving its format in state->track
+static int mixer_start_playlist(PlaybackState *state) {
+    if (mixer_init(state) != 0) {
+        return 1;
+    }
+    Track *first = &state->mixer->voices[0].track;
+    *first = state->track;
+    state->track.audio_data = NULL;
+    state->track.stream = NULL;
+    state->track.flac = NULL;
+    state->track.mapped_base = NULL;
+    state->track.chunks = NULL;
+    if (mixer_load(state, 0, 1.0f, 0.0f) != 0) {
+        return 1;
+    }
+    while (state->next_index < state->playlist.count) {
+        const char *filename = state->playlist.files[state->next_index++];
+        if (mixer_add(state, filename, 1.0f, 0.0f) < 0) {
+            printf("Warning: Skipping %s\n", filename);
+        }
+    }
+    return 0;
+}
+
+// Mixer: the output's side
+
+// Per-channel gains for a gain and pan; pan keeps the centre at unity and turns one
+// side down along a quarter cosine
+static void mixer_channel_gains(const Mixer *mixer, float gain, float pan, float *gains) {
+    for (uint32_t c = 0; c < mixer->channels; c++) {
+        gains[c] = gain;
+    }
+    if (mixer->channels == 2) {
+        pan = pan < -1.0f ? -1.0f : pan > 1.0f ? 1.0f : pan;
+        gains[pan > 0.0f ? 0 : 1] *= cosf(fabsf(pan) * (float)M_PI_2);
+    }
+}
+
+static void mixer_apply(Mixer *mixer, const MixerCommand *command) {
+    MixerVoice *voice = &mixer->voices[command->voice];
+    int playing = atomic_load_explicit(&voice->state, memory_order_relaxed) == VOICE_PLAYING;
+    switch (command->type) {
+    case MIXER_START:
+        mixer_channel_gains(mixer, command->gain, command->pan, voice->target);
+        memcpy(voice->current, voice->target, sizeof(voice->target));
+        voice->stopping = 0;
+        mixer->active[mixer->active_count++] = command->voice;
+        atomic_store_explicit(&voice->state, VOICE_PLAYING, memory_order_relaxed);
+        atomic_fetch_add_explicit(&mixer->started, 1, memory_order_relaxed);
+        if (mixer->active_count > atomic_load_explicit(&mixer->peak_active, memory_order_relaxed)) {
+            atomic_store_explicit(&mixer->peak_active, mixer->active_count, memory_order_relaxed);
+        }
+        break;
+    case MIXER_GAIN:
+        if (playing && !voice->stopping) {
+            mixer_channel_gains(mixer, command->gain, command->pan, voice->target);
+        }
+        break;
+    case MIXER_STOP:
+        if (playing) {
+            memset(voice->target, 0, sizeof(voice->target));
+            voice->stopping = 1;
+        }
+        break;
+    case MIXER_STOP_ALL:
+        for (uint32_t i = 0; i < mixer->active_count; i++) {
+            MixerVoice *active = &mixer->voices[mixer->active[i]];
+            memset(active->target, 0, sizeof(active->target));
+            active->stopping = 1;
+        }
+        break;
+    }
+}
+
+// bus += src * gains, ramping linearly from the current gains to the targets
+static void mixer_accumulate(float *bus, const float *src, uint32_t channels, uint32_t frames, float *current,
+                             const float *target) {
+    if (memcmp(current, target, channels * sizeof(float)) == 0) {
+        if (channels == 2) {
+            float left = target[0], right = target[1];
+            for (uint32_t f = 0; f < frames; f++) {
+                bus[2 * f] += src[2 * f] * left;
+                bus[2 * f + 1] += src[2 * f + 1] * right;
+            }
+            return;
+        }
+        for (uint32_t f = 0; f < frames; f++) {
+            for (uint32_t c = 0; c < channels; c++) {
+                bus[(size_t)f * channels + c] += src[(size_t)f * channels + c] * target[c];
+            }
+        }
+        return;
+    }
+    for (uint32_t c = 0; c < channels; c++) {
+        float step = (target[c] - current[c]) / frames;
+        for (uint32_t f = 0; f < frames; f++) {
+            bus[(size_t)f * channels + c] += src[(size_t)f * channels + c] * (current[c] + step * (f + 1));
+        }
+        current[c] = target[c];
+    }
+}
+
+// Sum every playing voice into dst in the device format. Returns 0, rendering
+// nothing, once no voice is playing and no command is waiting
+static uint32_t mixer_render(Mixer *mixer, uint8_t *dst, uint32_t frames, uint32_t frame_size) {
+    uint32_t head = atomic_load_explicit(&mixer->queue_head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&mixer->queue_tail, memory_order_relaxed);
+    if (head == tail && mixer->active_count == 0) {
+        return 0;
+    }
+    for (; tail != head; tail++) {
+        mixer_apply(mixer, &mixer->queue[tail & (MIXER_QUEUE_SIZE - 1)]);
+    }
+    atomic_store_explicit(&mixer->queue_tail, tail, memory_order_release);
+
+    uint32_t channels = mixer->channels;
+    for (uint32_t done = 0; done < frames;) {
+        uint32_t block = frames - done < MIXER_BLOCK_FRAMES ? frames - done : MIXER_BLOCK_FRAMES;
+        memset(mixer->bus, 0, (size_t)block * channels * sizeof(float));
+        for (uint32_t i = 0; i < mixer->active_count;) {
+            MixerVoice *voice = &mixer->voices[mixer->active[i]];
+            Track *track = &voice->track;
+            uint64_t left = voice->frames - voice->position;
+            uint32_t count = left < block ? (uint32_t)left : block;
+            if (count > 0) {
+                const uint8_t *src = track->audio_data + voice->position * track->block_align;
+                if (!track->asset) {
+                    track->converter.fn(&track->converter, src, (uint8_t *)mixer->scratch, count);
+                    src = (const uint8_t *)mixer->scratch;
+                }
+                // Pre-rendered voices are in the bus format already
+                mixer_accumulate(mixer->bus, (const float *)src, channels, count, voice->current, voice->target);
+                voice->position += count;
+            }
+            if (voice->position == voice->frames || voice->stopping) {
+                // The slot goes back to the main thread; keep the start order of the rest
+                memmove(&mixer->active[i], &mixer->active[i + 1], (mixer->active_count - i - 1) * sizeof(uint32_t));
+                mixer->active_count--;
+                atomic_store_explicit(&voice->state, VOICE_DONE, memory_order_release);
+                continue;
+            }
+            i++;
+        }
+        mixer->encode(mixer->bus, dst + (size_t)done * frame_size, (size_t)block * channels);
+        done += block;
+    }
+    return frames;
+}
+
+// Allocate the ring for the negotiated output format and prime it; with threaded
+// set a producer thread keeps it topped up, otherwise the caller runs producer_fill
+static int start_producer(PlaybackState *state, int threaded) {
+    uint32_t frame_size = state->output_channels * (state->output_bits_per_channel / 8);
+    uint32_t frames = state->ring_frames ? state->ring_frames : RING_DEFAULT_FRAMES;
+    if (frames < PRODUCER_CHUNK_FRAMES) {
+        frames = PRODUCER_CHUNK_FRAMES;
+    }
+    if (state->effects_config && !state->effects) {
+        if (effects_init(state) != 0) {
+            return 1;
+        }
+        const EffectsConfig *config = state->effects_config;
+        printf("Effects: gain %+.1f dB, %u EQ bands", config->gain_db, config->bands);
+        if (state->effects->lookahead > 0) {
+            printf(", limiter %.1f dB (%.1f ms lookahead, %.0f ms release)", config->ceiling_db,
+                   state->effects->lookahead * 1000.0 / state->output_sample_rate, config->release_ms);
+        }
+        printf("\n");
+    }
+
+    atomic_store(&state->producer_stop, 0);
+    atomic_store(&state->input_done, 0);
+    atomic_store(&state->finished, 0);
+    atomic_store(&state->paused, 0);
+    atomic_store(&state->stopping, 0);
+    atomic_store(&state->seek_pending, 0);
+    atomic_store(&state->flush_pending, 0);
+    pthread_mutex_init(&state->control_lock, NULL);
+    pthread_cond_init(&state->control_cond, NULL);
+    state->stream_waiting = NULL;
+    state->control_ready = 1;
+    if (state->mix) {
+        // The output mixes straight from memory, so there is nothing to convert ahead
+        state->ring.frame_size = frame_size;
+        atomic_store(&state->input_done, 1);
+        return mixer_start_playlist(state);
+    }
+
+    if (state->prerender) {
+        prerender_track(state, &state->track);
+    }
+    if (track_converter_init(state) != 0) {
+        return 1;
+    }
+    if (ring_init(&state->ring, frames, frame_size) != 0) {
+        printf("Error: Failed to allocate playback ring\n");
+        return 1;
+    }
+    printf("Ring: %u frames (%.1f ms)\n", state->ring.capacity,
+           state->ring.capacity * 1000.0 / state->output_sample_rate);
+    start_preload(state); // Opens the next track while this one primes the ring
+    producer_fill(state);
+    if (!threaded) {
+        return 0; // The caller converts inline
+    }
+    // Started even when everything fit in the ring, since a seek needs converting again
+    if (pthread_create(&state->producer, NULL, producer_thread, state) != 0) {
+        printf("Error: Failed to start producer thread\n");
+        return 1;
+    }
+    state->producer_running = 1;
+    return 0;
+}
+
+// Stop the producer thread and free the ring
+static void stop_producer(PlaybackState *state) {
+    if (state->producer_running) {
+        pthread_mutex_lock(&state->control_lock);
+        atomic_store(&state->producer_stop, 1);
+        pthread_cond_signal(&state->control_cond);
+        if (state->stream_waiting) {
+            stream_wake(state->stream_waiting);
+        }
+        pthread_mutex_unlock(&state->control_lock);
+        pthread_join(state->producer, NULL);
+        state->producer_running = 0;
+    }
+    if (state->control_ready) {
+        pthread_cond_destroy(&state->control_cond);
+        pthread_mutex_destroy(&state->control_lock);
+        state->control_ready = 0;
+    }
+    free(state->ring.data);
+    state->ring.data = NULL;
+    resampler_free(state->resampler);
+    state->resampler = NULL;
+    effects_free(state->effects);
+    state->effects = NULL;
+    mixer_free(state->mixer);
+    state->mixer = NULL;
+}
+
+// Stop converting and release every open track
+static void release_audio_data(PlaybackState *state) {
+    stop_producer(state);
+    wait_preload(state);
+    track_close(&state->track);
+    if (state->next_ready) {
+        track_close(&state->next);
+        state->next_ready = 0;
+    }
+}
+
+// The output has played the last frame: tell the main thread, once, so it sleeps
+// until the end instead of polling
+static void output_finished(PlaybackState *state) {
+    if (!atomic_exchange(&state->finished, 1) && state->wake_fd >= 0) {
+        ssize_t written = write(state->wake_fd, "f", 1);
+        (void)written;
+    }
+}
+
+// Pull side shared by every output: copy converted frames out of the ring,
+// padding with silence if the producer fell behind. Returns fewer frames than
+// requested only at the end of playback. No locks, allocation or I/O, so it is
+// safe to call from a realtime audio thread
+static uint32_t render_output(PlaybackState *state, uint8_t *dst, uint32_t frames) {
+    uint32_t frame_size = state->ring.frame_size;
+
+    // Drop what was converted before a seek; only this side moves read_pos. Taking the
+    // flag in one step keeps a seek made meanwhile pending, and read_pos only moves
+    // forward, as frames from after the seek may already have been read past flush_pos
+    int flushed = atomic_exchange_explicit(&state->flush_pending, 0, memory_order_acq_rel);
+    if (flushed) {
+        uint32_t flush_pos = atomic_load(&state->flush_pos);
+        uint32_t read_pos = atomic_load_explicit(&state->ring.read_pos, memory_order_relaxed);
+        if ((int32_t)(flush_pos - read_pos) > 0) {
+            atomic_store_explicit(&state->ring.read_pos, flush_pos, memory_order_release);
+        }
+    }
+    if (atomic_load_explicit(&state->paused, memory_order_relaxed)) {
+        memset(dst, 0, (size_t)frames * frame_size);
+        return frames;
+    }
+    if (state->mixer) {
+        if (mixer_render(state->mixer, dst, frames, frame_size) == 0) {
+            output_finished(state);
+            return 0;
+        }
+        return frames;
+    }
+
+    // Read input_done before the ring so a short read after it really is the end
+    int input_done = atomic_load_explicit(&state->input_done, memory_order_acquire);
+    uint32_t copied = ring_read(&state->ring, dst, frames);
+    if (copied < frames) {
+        if (input_done) {
+            output_finished(state);
+            return copied;
+        }
+        // Producer fell behind: pad with silence and count it, unless it is still
+        // converting from the position just seeked to
+        memset(dst + copied * frame_size, 0, (frames - copied) * frame_size);
+        if (!flushed) {
+            atomic_fetch_add_explicit(&state->stats.underruns, 1, memory_order_relaxed);
+        }
+    }
+    return frames;
+}
+
+#if defined(__APPLE__) || defined(HAVE_ALSA)
+// render_output for device threads: times each call against the playback time of the
+// frames asked for. Only clock reads and relaxed atomics, so it is safe on the audio thread
+static uint32_t render_device(PlaybackState *state, uint8_t *dst, uint32_t frames) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t rendered = render_output(state, dst, frames);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    RenderStats *stats = &state->stats;
+    uint64_t busy = elapsed_ns(&start, &end);
+    uint64_t deadline = (uint64_t)frames * 1000000000u / state->output_sample_rate;
+    uint64_t load = deadline ? busy * 1000000u / deadline : 0; // Millionths of the deadline
+    uint32_t bucket = 0;
+    while (bucket < RENDER_LOAD_BUCKETS - 1 && load >= render_load_limits[bucket]) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&stats->callbacks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->frames, frames, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->busy_ns, busy, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->deadline_ns, deadline, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->load_histogram[bucket], 1, memory_order_relaxed);
+    if (load > atomic_load_explicit(&stats->peak_load, memory_order_relaxed)) {
+        // Single writer, so no compare-and-swap needed
+        atomic_store_explicit(&stats->peak_load, load > UINT32_MAX ? UINT32_MAX : (uint32_t)load,
+                              memory_order_relaxed);
+    }
+    if (rendered < frames) {
+        atomic_fetch_add_explicit(&stats->short_buffers, 1, memory_order_relaxed);
+    }
+    return rendered;
+}
+#endif
+
+// Output backend. Device backends pull frames from their own audio thread through
+// render_output once started; sinks without a clock take frames pushed by
+// render_offline as fast as they can be converted
+typedef struct OutputBackend {
+    const char *name;
+    const char *description;
+    // Open the output; format holds the requested format on entry and the format
+    // the output will take on return
+    int (*open)(struct OutputBackend *backend, OutputFormat *format);
+    // Pull model: start calling render_output (NULL for push-model sinks)
+    int (*start)(struct OutputBackend *backend, PlaybackState *state);
+    // Push model: consume count frames in the negotiated format
+    int (*write)(struct OutputBackend *backend, const uint8_t *frames, uint32_t count);
+    void (*close)(struct OutputBackend *backend);
+    const char *path; // Target file, for sinks that write one
+    OutputFormat format; // Negotiated by open
+    uint32_t period_frames; // Device buffering hints, 0 for the backend default;
+    uint32_t buffer_frames; // open stores what the device actually granted
+    void *handle; // Backend-private state
+} OutputBackend;
+
+#ifdef __APPLE__
+// macOS-specific callback for Core Audio: only copies converted frames out of the ring
+static OSStatus audioCallback(void *inRefCon, AudioUnitRenderActionFlags *ioActionFlags,
+                              const AudioTimeStamp *inTimeStamp, UInt32 inBusNumber,
+                              UInt32 inNumberFrames, AudioBufferList *ioData) {
+    PlaybackState *state = (PlaybackState *)inRefCon;
+    AudioBuffer *buffer = &ioData->mBuffers[0];
+    uint32_t frames = render_device(state, (uint8_t *)buffer->mData, inNumberFrames);
+    buffer->mDataByteSize = frames * state->ring.frame_size; // Short at the end of data
+    return noErr;
+}
+
+// Core Audio: default output unit, streaming in the device's own format
+static int coreaudio_open(OutputBackend *backend, OutputFormat *format) {
+    AudioComponentInstance audioUnit;
+    AudioComponentDescription desc = {
+        .componentType = kAudioUnitType_Output,
+        .componentSubType = kAudioUnitSubType_DefaultOutput,
+        .componentManufacturer = kAudioUnitManufacturer_Apple,
+        .componentFlags = 0,
+        .componentFlagsMask = 0
+    };
+
+    AudioComponent comp = AudioComponentFindNext(NULL, &desc);
+    if (!comp) {
+        printf("Error: Cannot find audio component\n");
+        return 1;
+    }
+    OSStatus err = AudioComponentInstanceNew(comp, &audioUnit);
+    if (err != noErr) {
+        printf("Error: Failed to create audio unit instance (%d)\n", err);
+        return 1;
+    }
+    err = AudioUnitInitialize(audioUnit);
+    if (err != noErr) {
+        printf("Error: Failed to initialize audio unit (%d)\n", err);
+        AudioComponentInstanceDispose(audioUnit);
+        return 1;
+    }
+
+    // Query device's preferred format
+    AudioStreamBasicDescription device_asbd = {0};
+    UInt32 size = sizeof(device_asbd);
+    err = AudioUnitGetProperty(audioUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 0, &device_asbd, &size);
+    if (err != noErr) {
+        printf("Warning: Failed to get device stream format (%d), using default format\n", err);
+        device_asbd.mSampleRate = 48000.0;
         device_asbd.mChannelsPerFrame = 2;
         device_asbd.mBitsPerChannel = 16;
         device_asbd.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
@@ -419,162 +5391,3740 @@ static int play_audio(PlaybackState *state, float duration) {
         device_asbd.mFramesPerPacket = 1;
         device_asbd.mFormatID = kAudioFormatLinearPCM;
     }
-    printf("Device ASBD: sample_rate=%.0f, channels=%u, bits=%u, bytes_per_frame=%u, format=%s\n",
-           device_asbd.mSampleRate, device_asbd.mChannelsPerFrame, device_asbd.mBitsPerChannel,
-           device_asbd.mBytesPerFrame, (device_asbd.mFormatFlags & kAudioFormatFlagIsFloat) ? "float" :
-                                       (device_asbd.mFormatFlags & kAudioFormatFlagIsSignedInteger) ? "signed integer" : "unsigned integer");
+    printf("Device ASBD: sample_rate=%.0f, channels=%u, bits=%u, bytes_per_frame=%u, format=%s\n",
+           device_asbd.mSampleRate, device_asbd.mChannelsPerFrame, device_asbd.mBitsPerChannel,
+           device_asbd.mBytesPerFrame, (device_asbd.mFormatFlags & kAudioFormatFlagIsFloat) ? "float" :
+                                       (device_asbd.mFormatFlags & kAudioFormatFlagIsSignedInteger) ? "signed integer" : "unsigned integer");
+
+    // Validate device format
+    if (device_asbd.mFormatID != kAudioFormatLinearPCM) {
+        printf("Error: Device format is not linear PCM\n");
+        AudioUnitUninitialize(audioUnit);
+        AudioComponentInstanceDispose(audioUnit);
+        return 1;
+    }
+    if (!(device_asbd.mFormatFlags & kAudioFormatFlagIsFloat) &&
+        !(device_asbd.mFormatFlags & kAudioFormatFlagIsSignedInteger)) {
+        printf("Error: Device format must be float or signed integer\n");
+        AudioUnitUninitialize(audioUnit);
+        AudioComponentInstanceDispose(audioUnit);
+        return 1;
+    }
+    if (device_asbd.mBitsPerChannel != 16 && device_asbd.mBitsPerChannel != 24 && device_asbd.mBitsPerChannel != 32) {
+        printf("Error: Unsupported device bit depth %u\n", device_asbd.mBitsPerChannel);
+        AudioUnitUninitialize(audioUnit);
+        AudioComponentInstanceDispose(audioUnit);
+        return 1;
+    }
+
+    // Set stream format to match device
+    AudioStreamBasicDescription asbd = {
+        .mSampleRate = device_asbd.mSampleRate,
+        .mFormatID = kAudioFormatLinearPCM,
+        .mFormatFlags = device_asbd.mFormatFlags,
+        .mBitsPerChannel = device_asbd.mBitsPerChannel,
+        .mChannelsPerFrame = device_asbd.mChannelsPerFrame,
+        .mFramesPerPacket = 1,
+        .mBytesPerFrame = device_asbd.mChannelsPerFrame * (device_asbd.mBitsPerChannel / 8),
+        .mBytesPerPacket = device_asbd.mChannelsPerFrame * (device_asbd.mBitsPerChannel / 8)
+    };
+    format->sample_rate = (uint32_t)asbd.mSampleRate;
+    format->channels = asbd.mChannelsPerFrame;
+    format->bits_per_channel = asbd.mBitsPerChannel;
+    format->is_float = (asbd.mFormatFlags & kAudioFormatFlagIsFloat) ? 1 : 0;
+    printf("ASBD: sample_rate=%.0f, channels=%u, bits=%u, bytes_per_frame=%u, format=%s\n",
+           asbd.mSampleRate, asbd.mChannelsPerFrame, asbd.mBitsPerChannel, asbd.mBytesPerFrame,
+           format->is_float ? "float" : "signed integer");
+
+    err = AudioUnitSetProperty(audioUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 0, &asbd, sizeof(asbd));
+    if (err != noErr) {
+        printf("Error: Failed to set output stream format (%d)\n", err);
+        AudioUnitUninitialize(audioUnit);
+        AudioComponentInstanceDispose(audioUnit);
+        return 1;
+    }
+    err = AudioUnitSetProperty(audioUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &asbd, sizeof(asbd));
+    if (err != noErr) {
+        printf("Error: Failed to set input stream format (%d)\n", err);
+        AudioUnitUninitialize(audioUnit);
+        AudioComponentInstanceDispose(audioUnit);
+        return 1;
+    }
+
+    backend->handle = audioUnit;
+    return 0;
+}
+
+static int coreaudio_start(OutputBackend *backend, PlaybackState *state) {
+    AudioComponentInstance audioUnit = (AudioComponentInstance)backend->handle;
+
+    // Set callback
+    AURenderCallbackStruct callback = { .inputProc = audioCallback, .inputProcRefCon = state };
+    OSStatus err = AudioUnitSetProperty(audioUnit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0,
+                                        &callback, sizeof(callback));
+    if (err != noErr) {
+        printf("Error: Failed to set render callback (%d)\n", err);
+        return 1;
+    }
+
+    // Start playback
+    err = AudioOutputUnitStart(audioUnit);
+    if (err != noErr) {
+        printf("Error: Failed to start audio unit (%d)\n", err);
+        return 1;
+    }
+    return 0;
+}
+
+static void coreaudio_close(OutputBackend *backend) {
+    AudioComponentInstance audioUnit = (AudioComponentInstance)backend->handle;
+    AudioOutputUnitStop(audioUnit);
+    AudioUnitUninitialize(audioUnit);
+    AudioComponentInstanceDispose(audioUnit);
+}
+#endif
+
+#ifdef HAVE_ALSA
+// ALSA: writes straight into the device buffer through snd_pcm_mmap_begin/commit
+typedef struct {
+    snd_pcm_t *pcm;
+    PlaybackState *state;
+    snd_pcm_uframes_t period_frames;
+    snd_pcm_uframes_t buffer_frames;
+    pthread_t thread;
+    int thread_running;
+    atomic_int stop;
+} AlsaOutput;
+
+#define ALSA_DEFAULT_PERIOD_FRAMES 1024
+#define ALSA_DEFAULT_PERIODS 4
+
+// Map an output format to the matching packed little-endian ALSA format
+static snd_pcm_format_t alsa_format_of(uint16_t bits_per_channel, uint16_t is_float) {
+    if (is_float) {
+        return bits_per_channel == 32 ? SND_PCM_FORMAT_FLOAT_LE : SND_PCM_FORMAT_UNKNOWN;
+    }
+    switch (bits_per_channel) {
+        case 16: return SND_PCM_FORMAT_S16_LE;
+        case 24: return SND_PCM_FORMAT_S24_3LE;
+        case 32: return SND_PCM_FORMAT_S32_LE;
+        default: return SND_PCM_FORMAT_UNKNOWN;
+    }
+}
+
+static int alsa_open(OutputBackend *backend, OutputFormat *format) {
+    const char *device = backend->path ? backend->path : "default";
+    snd_pcm_t *pcm;
+    int err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) {
+        printf("Error: Cannot open ALSA device %s (%s)\n", device, snd_strerror(err));
+        return 1;
+    }
+
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_hw_params_any(pcm, hw);
+    err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (err < 0) {
+        printf("Error: ALSA device %s does not support mmap interleaved access (%s)\n", device, snd_strerror(err));
+        snd_pcm_close(pcm);
+        return 1;
+    }
+
+    // Prefer the requested sample format, then fall back to whatever the device takes,
+    // widest first; all of these have encoders
+    static const struct { uint16_t bits; uint16_t is_float; } candidates[] = {
+        { 0, 0 }, { 32, 1 }, { 32, 0 }, { 24, 0 }, { 16, 0 }
+    };
+    snd_pcm_format_t pcm_format = SND_PCM_FORMAT_UNKNOWN;
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        uint16_t bits = i == 0 ? format->bits_per_channel : candidates[i].bits;
+        uint16_t is_float = i == 0 ? format->is_float : candidates[i].is_float;
+        snd_pcm_format_t candidate = alsa_format_of(bits, is_float);
+        if (candidate != SND_PCM_FORMAT_UNKNOWN && snd_pcm_hw_params_test_format(pcm, hw, candidate) == 0) {
+            pcm_format = candidate;
+            format->bits_per_channel = bits;
+            format->is_float = is_float;
+            break;
+        }
+    }
+    if (pcm_format == SND_PCM_FORMAT_UNKNOWN || snd_pcm_hw_params_set_format(pcm, hw, pcm_format) < 0) {
+        printf("Error: ALSA device %s supports none of s16, s24, s32 or f32\n", device);
+        snd_pcm_close(pcm);
+        return 1;
+    }
+
+    unsigned int channels = format->channels;
+    unsigned int rate = format->sample_rate;
+    snd_pcm_uframes_t period = backend->period_frames ? backend->period_frames : ALSA_DEFAULT_PERIOD_FRAMES;
+    snd_pcm_uframes_t buffer = backend->buffer_frames ? backend->buffer_frames : period * ALSA_DEFAULT_PERIODS;
+    if (snd_pcm_hw_params_set_channels_near(pcm, hw, &channels) < 0 ||
+        snd_pcm_hw_params_set_rate_near(pcm, hw, &rate, NULL) < 0 ||
+        snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, NULL) < 0 ||
+        snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer) < 0) {
+        printf("Error: ALSA device %s rejected the channel count, rate or buffer sizes\n", device);
+        snd_pcm_close(pcm);
+        return 1;
+    }
+    err = snd_pcm_hw_params(pcm, hw);
+    if (err < 0) {
+        printf("Error: Failed to set ALSA hardware parameters (%s)\n", snd_strerror(err));
+        snd_pcm_close(pcm);
+        return 1;
+    }
+    snd_pcm_hw_params_get_period_size(hw, &period, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &buffer);
+
+    // Start once the buffer is full, wake up when a period is free
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(pcm, sw);
+    snd_pcm_sw_params_set_start_threshold(pcm, sw, buffer);
+    snd_pcm_sw_params_set_avail_min(pcm, sw, period);
+    err = snd_pcm_sw_params(pcm, sw);
+    if (err < 0) {
+        printf("Error: Failed to set ALSA software parameters (%s)\n", snd_strerror(err));
+        snd_pcm_close(pcm);
+        return 1;
+    }
+
+    AlsaOutput *alsa = calloc(1, sizeof(AlsaOutput));
+    if (!alsa) {
+        printf("Error: Memory allocation failed\n");
+        snd_pcm_close(pcm);
+        return 1;
+    }
+    alsa->pcm = pcm;
+    alsa->period_frames = period;
+    alsa->buffer_frames = buffer;
+    backend->period_frames = (uint32_t)period;
+    backend->buffer_frames = (uint32_t)buffer;
+
+    format->channels = channels;
+    format->sample_rate = rate;
+    printf("ALSA: device=%s, format=%s, period=%lu frames, buffer=%lu frames (%.1f ms)\n", device,
+           snd_pcm_format_name(pcm_format), (unsigned long)period, (unsigned long)buffer, buffer * 1000.0 / rate);
+    backend->handle = alsa;
+    return 0;
+}
+
+// Recover from an xrun or suspend; returns nonzero if the device is unusable
+static int alsa_recover(AlsaOutput *alsa, int err) {
+    if (err == -EPIPE) {
+        atomic_fetch_add_explicit(&alsa->state->stats.xruns, 1, memory_order_relaxed);
+    }
+    err = snd_pcm_recover(alsa->pcm, err, 1);
+    if (err < 0) {
+        printf("Error: ALSA device failed (%s)\n", snd_strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
+// Device thread: render each free stretch of the ring buffer in place
+static void *alsa_thread(void *arg) {
+    AlsaOutput *alsa = (AlsaOutput *)arg;
+    snd_pcm_t *pcm = alsa->pcm;
+    while (!atomic_load(&alsa->stop) && !atomic_load(&alsa->state->finished)) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            if (alsa_recover(alsa, (int)avail) != 0) {
+                break;
+            }
+            continue;
+        }
+        if ((snd_pcm_uframes_t)avail < alsa->period_frames) {
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+                snd_pcm_start(pcm); // Buffer full but under the start threshold
+                continue;
+            }
+            int err = snd_pcm_wait(pcm, 100);
+            if (err < 0 && alsa_recover(alsa, err) != 0) {
+                break;
+            }
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = (snd_pcm_uframes_t)avail;
+        int err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+        if (err < 0) {
+            if (alsa_recover(alsa, err) != 0) {
+                break;
+            }
+            continue;
+        }
+        // Interleaved: every channel shares one area with a whole-frame step
+        uint8_t *dst = (uint8_t *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+        uint32_t rendered = render_device(alsa->state, dst, (uint32_t)frames);
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, rendered);
+        if (committed < 0 || (snd_pcm_uframes_t)committed != rendered) {
+            if (alsa_recover(alsa, committed < 0 ? (int)committed : -EPIPE) != 0) {
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int alsa_start(OutputBackend *backend, PlaybackState *state) {
+    AlsaOutput *alsa = (AlsaOutput *)backend->handle;
+    alsa->state = state;
+    atomic_store(&alsa->stop, 0);
+    if (pthread_create(&alsa->thread, NULL, alsa_thread, alsa) != 0) {
+        printf("Error: Failed to start ALSA thread\n");
+        return 1;
+    }
+    alsa->thread_running = 1;
+    return 0;
+}
+
+static void alsa_close(OutputBackend *backend) {
+    AlsaOutput *alsa = (AlsaOutput *)backend->handle;
+    if (alsa->thread_running) {
+        atomic_store(&alsa->stop, 1);
+        pthread_join(alsa->thread, NULL);
+        // Let the frames already in the device buffer play out, unless playback was stopped
+        if (atomic_load(&alsa->state->stopping)) {
+            snd_pcm_drop(alsa->pcm);
+        } else {
+            snd_pcm_drain(alsa->pcm);
+        }
+    }
+    unsigned xruns = alsa->state ? atomic_load(&alsa->state->stats.xruns) : 0;
+    if (xruns > 0) {
+        printf("Warning: %u ALSA xruns (try a larger --buffer-frames)\n", xruns);
+    }
+    snd_pcm_close(alsa->pcm);
+    free(alsa);
+}
+#endif
+
+// Null sink: takes any format and discards the frames, for timing the pipeline
+static int null_open(OutputBackend *backend, OutputFormat *format) {
+    (void)backend;
+    (void)format;
+    return 0;
+}
+
+static int null_write(OutputBackend *backend, const uint8_t *frames, uint32_t count) {
+    (void)backend;
+    (void)frames;
+    (void)count;
+    return 0;
+}
+
+static void null_close(OutputBackend *backend) {
+    (void)backend;
+}
+
+// Write a WAV_HEADER_BYTES header for the given format: plain RIFF with a JUNK chunk
+// while the sizes fit in 32 bits, RF64 with the JUNK turned into ds64 beyond that
+static int write_wav_header(FILE *file, const OutputFormat *format, uint64_t data_size) {
+    uint16_t block_align = format->channels * (format->bits_per_channel / 8);
+    uint64_t riff_size = WAV_HEADER_BYTES - 8 + data_size;
+    int rf64 = riff_size > UINT32_MAX;
+    uint32_t size32 = UINT32_MAX; // Placeholder pointing readers at ds64
+    uint8_t reserved[8 + DS64_SIZE] = { 'J', 'U', 'N', 'K', DS64_SIZE };
+    if (rf64) {
+        uint64_t sample_count = data_size / block_align;
+        memcpy(reserved, "ds64", 4);
+        memcpy(reserved + 8, &riff_size, 8);
+        memcpy(reserved + 16, &data_size, 8);
+        memcpy(reserved + 24, &sample_count, 8); // Table length stays 0
+    }
+    WavHeader header = {
+        .chunk_id = { 'R', 'I', 'F', 'F' },
+        .chunk_size = rf64 ? size32 : (uint32_t)riff_size,
+        .format = { 'W', 'A', 'V', 'E' },
+        .subchunk1_id = { 'f', 'm', 't', ' ' },
+        .subchunk1_size = 16,
+        .audio_format = format->is_float ? 3 : 1,
+        .num_channels = format->channels,
+        .sample_rate = format->sample_rate,
+        .byte_rate = format->sample_rate * block_align,
+        .block_align = block_align,
+        .bits_per_sample = format->bits_per_channel
+    };
+    if (rf64) {
+        memcpy(header.chunk_id, "RF64", 4);
+    }
+    uint32_t data_size32 = rf64 ? size32 : (uint32_t)data_size;
+    if (fwrite(&header, 12, 1, file) != 1 || fwrite(reserved, sizeof(reserved), 1, file) != 1 ||
+        fwrite((const uint8_t *)&header + 12, sizeof(header) - 12, 1, file) != 1 || fwrite("data", 4, 1, file) != 1 ||
+        fwrite(&data_size32, 4, 1, file) != 1) {
+        return 1;
+    }
+    return 0;
+}
+
+// WAV file sink: writes the converted stream to backend->path
+static int wav_sink_open(OutputBackend *backend, OutputFormat *format) {
+    if (!backend->path) {
+        printf("Error: The wav output needs a file name (--output wav:FILE)\n");
+        return 1;
+    }
+    FILE *file = fopen(backend->path, "wb");
+    if (!file) {
+        printf("Error: Cannot create file %s\n", backend->path);
+        return 1;
+    }
+    // Sizes are patched in on close
+    if (write_wav_header(file, format, 0) != 0) {
+        printf("Error: Failed to write WAV header to %s\n", backend->path);
+        fclose(file);
+        return 1;
+    }
+    backend->handle = file;
+    return 0;
+}
+
+static int wav_sink_write(OutputBackend *backend, const uint8_t *frames, uint32_t count) {
+    uint32_t frame_size = backend->format.channels * (backend->format.bits_per_channel / 8);
+    if (fwrite(frames, frame_size, count, (FILE *)backend->handle) != count) {
+        printf("Error: Failed to write to %s\n", backend->path);
+        return 1;
+    }
+    return 0;
+}
+
+static void wav_sink_close(OutputBackend *backend) {
+    FILE *file = (FILE *)backend->handle;
+    off_t end = ftello(file);
+    if (end >= WAV_HEADER_BYTES && fseeko(file, 0, SEEK_SET) == 0) {
+        write_wav_header(file, &backend->format, (uint64_t)(end - WAV_HEADER_BYTES));
+    }
+    fclose(file);
+}
+
+// Available outputs; the first one with a start function is the default
+static OutputBackend output_backends[] = {
+#ifdef __APPLE__
+    { .name = "coreaudio", .description = "Default Core Audio output device",
+      .open = coreaudio_open, .start = coreaudio_start, .close = coreaudio_close },
+#endif
+#ifdef HAVE_ALSA
+    { .name = "alsa", .description = "ALSA PCM device (alsa:DEVICE, default \"default\")",
+      .open = alsa_open, .start = alsa_start, .close = alsa_close },
+#endif
+    // TODO: WASAPI or DirectSound backend for Windows
+    { .name = "null", .description = "Discard frames, rendering as fast as possible",
+      .open = null_open, .write = null_write, .close = null_close },
+    { .name = "wav", .description = "Write frames to a WAV file (wav:FILE)",
+      .open = wav_sink_open, .write = wav_sink_write, .close = wav_sink_close },
+};
+
+#define OUTPUT_BACKEND_COUNT (sizeof(output_backends) / sizeof(output_backends[0]))
+
+// Look up an output by "name" or "name:path"; NULL spec picks the default device
+static OutputBackend *find_output_backend(const char *spec) {
+    for (size_t i = 0; i < OUTPUT_BACKEND_COUNT; i++) {
+        OutputBackend *backend = &output_backends[i];
+        if (!spec) {
+            if (backend->start) {
+                return backend;
+            }
+            continue;
+        }
+        size_t length = strlen(backend->name);
+        if (strncmp(spec, backend->name, length) == 0 && (spec[length] == '\0' || spec[length] == ':')) {
+            backend->path = spec[length] == ':' ? spec + length + 1 : NULL;
+            return backend;
+        }
+    }
+    return NULL;
+}
+
+// Push-model outputs: convert and write on this thread as fast as the CPU allows
+static int render_offline(PlaybackState *state, OutputBackend *backend) {
+    uint8_t *block = malloc((size_t)PRODUCER_CHUNK_FRAMES * state->ring.frame_size);
+    if (!block) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t total_frames = 0;
+    int err = 0;
+    while (!atomic_load(&state->finished)) {
+        if (!atomic_load(&state->input_done)) {
+            producer_fill(state);
+        }
+        uint32_t frames = render_output(state, block, PRODUCER_CHUNK_FRAMES);
+        if (frames > 0 && backend->write(backend, block, frames) != 0) {
+            err = 1;
+            break;
+        }
+        total_frames += frames;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(block);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double seconds = (double)total_frames / state->output_sample_rate;
+    printf("Rendered %llu frames (%.2f seconds) in %.3f seconds (%.0fx realtime)\n",
+           (unsigned long long)total_frames, seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0.0);
+    return err;
+}
+
+static void render_stats_read(RenderStats *stats, RenderStatsSnapshot *snap) {
+    snap->callbacks = atomic_load_explicit(&stats->callbacks, memory_order_relaxed);
+    snap->frames = atomic_load_explicit(&stats->frames, memory_order_relaxed);
+    snap->busy_ns = atomic_load_explicit(&stats->busy_ns, memory_order_relaxed);
+    snap->deadline_ns = atomic_load_explicit(&stats->deadline_ns, memory_order_relaxed);
+    snap->peak_load = atomic_load_explicit(&stats->peak_load, memory_order_relaxed);
+    snap->underruns = atomic_load_explicit(&stats->underruns, memory_order_relaxed);
+    snap->short_buffers = atomic_load_explicit(&stats->short_buffers, memory_order_relaxed);
+    snap->xruns = atomic_load_explicit(&stats->xruns, memory_order_relaxed);
+    for (int b = 0; b < RENDER_LOAD_BUCKETS; b++) {
+        snap->load_histogram[b] = atomic_load_explicit(&stats->load_histogram[b], memory_order_relaxed);
+    }
+}
+
+// Histogram bucket holding the given fraction of callbacks
+static int render_stats_percentile(const uint64_t *histogram, double fraction) {
+    uint64_t total = 0;
+    for (int b = 0; b < RENDER_LOAD_BUCKETS; b++) {
+        total += histogram[b];
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < RENDER_LOAD_BUCKETS - 1; b++) {
+        seen += histogram[b];
+        if (seen >= total * fraction) {
+            return b;
+        }
+    }
+    return RENDER_LOAD_BUCKETS - 1;
+}
+
+// One stats line for the callbacks between two snapshots
+static void render_stats_print(const RenderStatsSnapshot *now, const RenderStatsSnapshot *prev, double seconds) {
+    uint64_t histogram[RENDER_LOAD_BUCKETS];
+    for (int b = 0; b < RENDER_LOAD_BUCKETS; b++) {
+        histogram[b] = now->load_histogram[b] - prev->load_histogram[b];
+    }
+    uint64_t callbacks = now->callbacks - prev->callbacks;
+    uint64_t deadline = now->deadline_ns - prev->deadline_ns;
+    double load = deadline ? 100.0 * (now->busy_ns - prev->busy_ns) / deadline : 0.0;
+    int p99 = render_stats_percentile(histogram, 0.99);
+    char p99_text[16];
+    if (p99 < RENDER_LOAD_BUCKETS - 1) {
+        snprintf(p99_text, sizeof(p99_text), "<%g%%", render_load_limits[p99] / 10000.0);
+    } else {
+        snprintf(p99_text, sizeof(p99_text), "late");
+    }
+    printf("Stats: %.1fs %llu callbacks, load avg %.2f%% p99 %s peak %.2f%%, %llu late, %u underruns, "
+           "%u xruns\n", seconds, (unsigned long long)callbacks, load, p99_text, now->peak_load / 10000.0,
+           (unsigned long long)histogram[RENDER_LOAD_BUCKETS - 1], now->underruns - prev->underruns,
+           now->xruns - prev->xruns);
+}
+
+// Write the totals as JSON, through a temporary file so readers never see half of it
+static int render_stats_write_json(const char *path, const RenderStatsSnapshot *snap, uint32_t sample_rate,
+                                   double seconds) {
+    char temp_path[4096];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        printf("Error: Stats path too long\n");
+        return 1;
+    }
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        printf("Error: Cannot open stats file %s\n", temp_path);
+        return 1;
+    }
+    fprintf(file, "{\n  \"elapsed_seconds\": %.3f,\n  \"sample_rate\": %u,\n", seconds, sample_rate);
+    fprintf(file, "  \"callbacks\": %llu,\n  \"frames\": %llu,\n", (unsigned long long)snap->callbacks,
+            (unsigned long long)snap->frames);
+    fprintf(file, "  \"busy_ns\": %llu,\n  \"deadline_ns\": %llu,\n", (unsigned long long)snap->busy_ns,
+            (unsigned long long)snap->deadline_ns);
+    fprintf(file, "  \"average_load\": %.6f,\n  \"peak_load\": %.6f,\n",
+            snap->deadline_ns ? (double)snap->busy_ns / snap->deadline_ns : 0.0, snap->peak_load / 1e6);
+    fprintf(file, "  \"underruns\": %u,\n  \"short_buffers\": %u,\n  \"xruns\": %u,\n", snap->underruns,
+            snap->short_buffers, snap->xruns);
+    fprintf(file, "  \"load_histogram\": [\n");
+    for (int b = 0; b < RENDER_LOAD_BUCKETS; b++) {
+        if (b < RENDER_LOAD_BUCKETS - 1) {
+            fprintf(file, "    { \"below\": %g, ", render_load_limits[b] / 1e6);
+        } else {
+            fprintf(file, "    { \"below\": null, ");
+        }
+        fprintf(file, "\"count\": %llu }%s\n", (unsigned long long)snap->load_histogram[b],
+                b < RENDER_LOAD_BUCKETS - 1 ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    if (fclose(file) != 0 || rename(temp_path, path) != 0) {
+        printf("Error: Failed to write stats file %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// Transport control while a device plays: keys on a terminal, text commands on piped
+// stdin or as datagrams on a UNIX socket. The main thread sleeps in poll until one
+// arrives, the output finishes or a stats report is due
+#define TRANSPORT_SEEK_STEP 5.0 // Seconds per arrow key
+
+typedef struct {
+    struct pollfd fds[3]; // Wakeup pipe, stdin, control socket
+    uint32_t count;
+    int wake[2]; // Written once by the output when it finishes, and by signal handlers
+    int tty; // stdin is a terminal switched to single keys
+    struct termios saved_tty;
+    int escape; // Bytes of an arrow key sequence seen so far
+    char line[256]; // Command being read from piped stdin
+    size_t line_length;
+    const char *socket_path; // Bound control socket, removed on close (NULL for none)
+} Transport;
+
+static int transport_wake_fd = -1; // For the signal handler
+
+static void transport_signal(int sig) {
+    (void)sig;
+    ssize_t written = write(transport_wake_fd, "s", 1);
+    (void)written;
+}
+
+// Ask the producer to seek; it applies the request before its next chunk
+static void transport_seek(PlaybackState *state, double seconds, int relative) {
+    pthread_mutex_lock(&state->control_lock);
+    state->seek_seconds = seconds;
+    state->seek_relative = relative;
+    atomic_store_explicit(&state->seek_pending, 1, memory_order_release);
+    pthread_cond_signal(&state->control_cond);
+    pthread_mutex_unlock(&state->control_lock);
+}
+
+static void transport_pause(PlaybackState *state, int paused) {
+    if (atomic_exchange(&state->paused, paused) != paused) {
+        printf("%s\n", paused ? "Paused" : "Resumed");
+    }
+}
+
+// Mixer commands: play FILE [GAIN_DB [PAN]], stop VOICE, gain VOICE DB, pan VOICE PAN;
+// returns 0 if command is not one of them
+static int transport_mix_command(PlaybackState *state, const char *command) {
+    Mixer *mixer = state->mixer;
+    char filename[1024];
+    double first = 0.0, second = 0.0;
+    unsigned voice = 0;
+    int fields;
+    if (strncmp(command, "play ", 5) == 0 &&
+        (fields = sscanf(command + 5, "%1023s %lf %lf", filename, &first, &second)) >= 1) {
+        mixer_add(state, filename, (float)pow(10.0, (fields > 1 ? first : 0.0) / 20.0), (float)second);
+        return 1;
+    }
+    if (sscanf(command, "stop %u", &voice) == 1 || sscanf(command, "gain %u %lf", &voice, &first) == 2 ||
+        sscanf(command, "pan %u %lf", &voice, &first) == 2) {
+        int voice_state = voice >= 1 && voice <= MIXER_MAX_VOICES
+                              ? atomic_load(&mixer->voices[voice - 1].state)
+                              : VOICE_FREE;
+        if (voice_state != VOICE_QUEUED && voice_state != VOICE_PLAYING) {
+            printf("Warning: Voice %u is not playing\n", voice);
+            return 1;
+        }
+        MixerVoice *v = &mixer->voices[voice - 1];
+        MixerCommandType type = MIXER_GAIN;
+        if (command[0] == 's') {
+            type = MIXER_STOP;
+        } else if (command[0] == 'g') {
+            v->gain = (float)pow(10.0, first / 20.0);
+        } else {
+            v->pan = (float)first;
+        }
+        if (mixer_post(mixer, (MixerCommand){ type, voice - 1, v->gain, v->pan }) != 0) {
+            printf("Warning: Mixer command queue is full\n");
+        }
+        return 1;
+    }
+    if (strncmp(command, "seek", 4) == 0) {
+        printf("Warning: Voices cannot seek\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Apply one text command: pause, resume, toggle, stop, seek SECONDS or seek +/-SECONDS.
+// Returns 1 for stop
+static int transport_command(PlaybackState *state, const char *command) {
+    if (state->mixer && transport_mix_command(state, command)) {
+        return 0;
+    }
+    if (strncmp(command, "seek ", 5) == 0) {
+        const char *value = command + 5;
+        while (*value == ' ') {
+            value++;
+        }
+        char *end;
+        double seconds = strtod(value, &end);
+        if (end != value && *end == '\0') {
+            transport_seek(state, seconds, *value == '+' || *value == '-');
+            return 0;
+        }
+    }
+    if (strncmp(command, "gain ", 5) == 0 && state->effects) {
+        char *end;
+        double db = strtod(command + 5, &end);
+        if (end != command + 5 && *end == '\0' && db <= 24.0) {
+            // The producer ramps to it over its next blocks
+            atomic_store_explicit(&state->effects->gain_target, (float)pow(10.0, db / 20.0), memory_order_relaxed);
+            printf("Gain: %+.1f dB\n", db);
+            return 0;
+        }
+    }
+    if (strcmp(command, "pause") == 0) {
+        transport_pause(state, 1);
+    } else if (strcmp(command, "resume") == 0) {
+        transport_pause(state, 0);
+    } else if (strcmp(command, "toggle") == 0) {
+        transport_pause(state, !atomic_load(&state->paused));
+    } else if (strcmp(command, "stop") == 0 || strcmp(command, "quit") == 0) {
+        return 1;
+    } else if (command[0] != '\0') {
+        printf("Warning: Unknown command '%s' (pause, resume, toggle, stop, %s)\n", command,
+               state->mixer     ? "play FILE [DB [PAN]], stop VOICE, gain VOICE DB, pan VOICE PAN"
+               : state->effects ? "seek [+|-]SECONDS, gain DB"
+                                : "seek [+|-]SECONDS");
+    }
+    return 0;
+}
+
+// Single keys from a terminal: space pauses and resumes, arrows seek, q stops
+static int transport_key(Transport *t, PlaybackState *state, char key) {
+    if (t->escape == 1) {
+        t->escape = key == '[' ? 2 : 0;
+        return 0;
+    }
+    if (t->escape == 2) {
+        t->escape = 0;
+        if (key == 'C' || key == 'D') {
+            transport_seek(state, key == 'C' ? TRANSPORT_SEEK_STEP : -TRANSPORT_SEEK_STEP, 1);
+        }
+        return 0;
+    }
+    switch (key) {
+    case '\033':
+        t->escape = 1;
+        break;
+    case ' ':
+    case 'p':
+        transport_pause(state, !atomic_load(&state->paused));
+        break;
+    case 'q':
+        return 1;
+    }
+    return 0;
+}
+
+// Set up the wakeup pipe, stdin and the control socket; the output writes to the
+// pipe when it finishes, so wake_fd must be set before it starts
+static int transport_open(Transport *t, PlaybackState *state, const char *socket_path) {
+    *t = (Transport){ .wake = { -1, -1 } };
+    if (pipe(t->wake) != 0) {
+        printf("Error: Cannot create wakeup pipe\n");
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(t->wake[i], F_SETFL, fcntl(t->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(t->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    t->fds[t->count++] = (struct pollfd){ .fd = t->wake[0], .events = POLLIN };
+    t->fds[t->count++] = (struct pollfd){ .fd = state->stdin_input ? -1 : STDIN_FILENO, .events = POLLIN };
+
+    if (socket_path) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (strlen(socket_path) >= sizeof(address.sun_path) || fd < 0) {
+            printf("Error: Cannot create control socket %s\n", socket_path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            close(t->wake[0]);
+            close(t->wake[1]);
+            return 1;
+        }
+        strcpy(address.sun_path, socket_path);
+        unlink(socket_path); // Left behind by a player that was killed
+        if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            printf("Error: Cannot bind control socket %s\n", socket_path);
+            close(fd);
+            close(t->wake[0]);
+            close(t->wake[1]);
+            return 1;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        t->fds[t->count++] = (struct pollfd){ .fd = fd, .events = POLLIN };
+        t->socket_path = socket_path;
+        printf("Control socket: %s\n", socket_path);
+    }
+
+    if (!state->stdin_input && isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &t->saved_tty) == 0) {
+        struct termios keys = t->saved_tty;
+        keys.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+        keys.c_cc[VMIN] = 1;
+        keys.c_cc[VTIME] = 0;
+        t->tty = tcsetattr(STDIN_FILENO, TCSANOW, &keys) == 0;
+        if (t->tty) {
+            printf("Controls: space pause/resume, left/right seek %.0f seconds, q stop\n", TRANSPORT_SEEK_STEP);
+        }
+    }
+
+    // Interrupts stop playback through the pipe, so the terminal is always restored
+    transport_wake_fd = t->wake[1];
+    struct sigaction action = { .sa_handler = transport_signal };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    state->wake_fd = t->wake[1];
+    return 0;
+}
+
+static void transport_close(Transport *t, PlaybackState *state) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    transport_wake_fd = -1;
+    state->wake_fd = -1;
+    if (t->tty) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &t->saved_tty);
+    }
+    if (t->socket_path) {
+        close(t->fds[2].fd);
+        unlink(t->socket_path);
+    }
+    close(t->wake[0]);
+    close(t->wake[1]);
+}
+
+// Sleep until something happens, or at most timeout_ms (-1 for no limit), and
+// apply any commands that arrived. Returns 1 once playback should stop
+static int transport_wait(Transport *t, PlaybackState *state, int timeout_ms) {
+    if (poll(t->fds, t->count, timeout_ms) <= 0) {
+        return 0; // Timed out, or interrupted by a signal whose byte is now in the pipe
+    }
+    int stop = 0;
+    char buffer[256];
+    if (t->fds[0].revents & POLLIN) {
+        ssize_t n;
+        while ((n = read(t->wake[0], buffer, sizeof(buffer))) > 0) {
+            stop |= memchr(buffer, 's', (size_t)n) != NULL;
+        }
+    }
+    if (t->fds[1].revents & (POLLIN | POLLHUP)) {
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n <= 0) {
+            t->fds[1].fd = -1; // End of input: poll skips negative descriptors
+        }
+        for (ssize_t i = 0; i < n && !stop; i++) {
+            if (t->tty) {
+                stop = transport_key(t, state, buffer[i]);
+            } else if (buffer[i] == '\n') {
+                t->line[t->line_length] = '\0';
+                t->line_length = 0;
+                stop = transport_command(state, t->line);
+            } else if (t->line_length + 1 < sizeof(t->line)) {
+                t->line[t->line_length++] = buffer[i];
+            }
+        }
+    }
+    if (t->count > 2 && (t->fds[2].revents & POLLIN)) {
+        ssize_t n = recv(t->fds[2].fd, buffer, sizeof(buffer) - 1, 0);
+        if (n > 0) {
+            while (n > 0 && (buffer[n - 1] == '\n' || buffer[n - 1] == '\r')) {
+                n--;
+            }
+            buffer[n] = '\0';
+            stop |= transport_command(state, buffer);
+        }
+    }
+    return stop;
+}
+
+// Output format for a track: fields left at 0 in requested keep the track's own
+static OutputFormat output_format_for(const OutputFormat *requested, const Track *track) {
+    OutputFormat format = {
+        .sample_rate = requested->sample_rate ? requested->sample_rate : track->sample_rate,
+        .channels = requested->channels ? requested->channels : track->num_channels,
+        .bits_per_channel = requested->bits_per_channel ? requested->bits_per_channel : track->bits_per_sample,
+        .is_float = requested->bits_per_channel ? requested->is_float : track->is_float
+    };
+    if (format.bits_per_channel < 16) {
+        format.bits_per_channel = 16; // Converters write 16 bits or wider
+    }
+    return format;
+}
+
+// Play (or render) the opened playlist through one output stream, in the first
+// track's format unless requested says otherwise; device outputs may override all of it
+static int play_audio(PlaybackState *state, OutputBackend *backend, const OutputFormat *requested) {
+    float duration = state->track.duration;
+    state->wake_fd = -1;
+    OutputFormat format = output_format_for(requested, &state->track);
+    if (backend->open(backend, &format) != 0) {
+        release_audio_data(state);
+        return 1;
+    }
+    backend->format = format;
+    printf("Output: %s, %u Hz, %u channels, %u-bit %s\n", backend->name, format.sample_rate, format.channels,
+           format.bits_per_channel, format.is_float ? "float" : "integer");
+    if (state->track.num_channels > format.channels) {
+        printf("Warning: WAV has %u channels, downmixing to %u channels\n", state->track.num_channels,
+               format.channels);
+    }
+    state->output_channels = format.channels;
+    state->output_bits_per_channel = format.bits_per_channel;
+    state->output_is_float = format.is_float;
+    state->output_sample_rate = format.sample_rate;
+
+    // The device refills its whole buffer from the ring, so keep two buffers converted ahead
+    uint32_t ring_frames = state->ring_frames ? state->ring_frames : RING_DEFAULT_FRAMES;
+    if (ring_frames < 2 * backend->buffer_frames) {
+        state->ring_frames = 2 * backend->buffer_frames;
+    }
+
+    // Convert ahead of the output: on a producer thread for devices, inline for sinks
+    if (start_producer(state, backend->start != NULL) != 0) {
+        backend->close(backend);
+        release_audio_data(state);
+        return 1;
+    }
+
+    int err = 0;
+    if (backend->start) {
+        Transport transport;
+        if (transport_open(&transport, state, state->control_path) != 0) {
+            backend->close(backend);
+            release_audio_data(state);
+            return 1;
+        }
+        printf("Playing audio...\n");
+        if (backend->start(backend, state) != 0) {
+            transport_close(&transport, state);
+            backend->close(backend);
+            release_audio_data(state);
+            return 1;
+        }
+
+        // Wait for playback to finish or be stopped, applying commands and reporting
+        // the device thread's counters on the way
+        if (state->playlist.count > 1 && !state->mixer) {
+            printf("Playlist: %u files, first track %.2f seconds\n", state->playlist.count, duration);
+        } else if (!state->mixer && state->track.data_size == UINT64_MAX) {
+            printf("Expected duration: up to the end of the input\n");
+        } else if (!state->mixer) {
+            printf("Expected duration: %.2f seconds\n", duration);
+        }
+        float interval = state->stats_interval > 0 ? state->stats_interval : state->stats_path ? 1.0f : 0.0f;
+        RenderStatsSnapshot reported = {0}, snap;
+        struct timespec start, last, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        last = start;
+        int stopped = 0;
+        while (!atomic_load(&state->finished) && !stopped) {
+            int timeout_ms = -1; // Nothing to do until a command or the end
+            if (interval > 0) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                double due = interval - elapsed_ns(&last, &now) / 1e9;
+                timeout_ms = due > 0 ? (int)(due * 1e3) + 1 : 0;
+            }
+            stopped = transport_wait(&transport, state, timeout_ms);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (interval > 0 && elapsed_ns(&last, &now) >= interval * 1e9) {
+                render_stats_read(&state->stats, &snap);
+                if (state->stats_interval > 0) {
+                    render_stats_print(&snap, &reported, elapsed_ns(&last, &now) / 1e9);
+                }
+                if (state->stats_path) {
+                    render_stats_write_json(state->stats_path, &snap, format.sample_rate,
+                                            elapsed_ns(&start, &now) / 1e9);
+                }
+                reported = snap;
+                last = now;
+            }
+        }
+        if (stopped) {
+            atomic_store(&state->stopping, 1);
+            printf("Playback stopped\n");
+        } else {
+            printf("Playback finished\n");
+        }
+        transport_close(&transport, state);
+        if (interval > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            render_stats_read(&state->stats, &snap);
+            if (state->stats_interval > 0) {
+                RenderStatsSnapshot zero = {0};
+                render_stats_print(&snap, &zero, elapsed_ns(&start, &now) / 1e9);
+            }
+            if (state->stats_path && render_stats_write_json(state->stats_path, &snap, format.sample_rate,
+                                                             elapsed_ns(&start, &now) / 1e9) != 0) {
+                err = 1;
+            }
+        }
+        unsigned underruns = atomic_load(&state->stats.underruns);
+        if (underruns > 0) {
+            printf("Warning: %u callbacks underran the ring (try a larger --ring-frames)\n", underruns);
+        }
+    } else {
+        err = render_offline(state, backend);
+    }
+    if (state->mixer) {
+        printf("Mixer: %u voices played, at most %u at once\n", atomic_load(&state->mixer->started),
+               atomic_load(&state->mixer->peak_active));
+    }
+
+    // Cleanup
+    backend->close(backend);
+    release_audio_data(state);
+    if (state->prerender) {
+        printf("Pre-render cache: %u renders, %u replays, %.1f MB held\n", render_cache.renders,
+               render_cache.replays, render_cache.bytes / 1e6);
+    }
+    return err;
+}
+
+// Batch mode: convert a whole list of files to WAV files in parallel. Each file is
+// split into chunks of output frames that are independent tasks: a chunk rebuilds
+// the resampler state at its first frame from the input around it, so the result is
+// byte-identical to rendering the file through the wav sink
+#define BATCH_CHUNK_FRAMES 65536 // Output frames per task
+
+typedef struct {
+    Track track; // Mapped input, read-only once the workers start
+    char *output_path;
+    OutputFormat format;
+    uint64_t frames; // Output frames
+    atomic_ullong cpu_ns; // Worker CPU time, summed over the file's chunks
+    atomic_int failed;
+} BatchFile;
+
+typedef struct {
+    uint32_t file;
+    uint64_t first_frame; // First output frame of the chunk
+    uint32_t frames;
+} BatchTask;
+
+struct BatchJob;
+
+// A worker's share of the tasks. The owner takes from the front and idle workers
+// steal from the back; both ends live in one word, so either side claims a task
+// with a single compare-and-swap
+typedef struct {
+    atomic_ullong range; // Next task in the low 32 bits, end of the range in the high 32
+    struct BatchJob *job;
+    uint32_t index;
+    uint8_t *buffer; // One chunk of output frames
+    uint32_t tasks_run;
+    uint32_t tasks_stolen;
+    pthread_t thread;
+} BatchWorker;
+
+typedef struct BatchJob {
+    BatchFile *files;
+    uint32_t file_count;
+    BatchTask *tasks;
+    uint32_t task_count;
+    BatchWorker *workers;
+    uint32_t worker_count;
+    ResampleQuality quality;
+} BatchJob;
+
+static int batch_claim(BatchWorker *worker, int steal, uint32_t *task) {
+    uint64_t range = atomic_load_explicit(&worker->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t begin = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (begin >= end) {
+            return 0;
+        }
+        uint64_t claimed = steal ? ((uint64_t)(end - 1) << 32) | begin : ((uint64_t)end << 32) | (begin + 1);
+        if (atomic_compare_exchange_weak_explicit(&worker->range, &range, claimed, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            *task = steal ? end - 1 : begin;
+            return 1;
+        }
+    }
+}
+
+// Convert one chunk into buffer and write it at its place in the output file
+static int batch_chunk(BatchJob *job, const BatchTask *task, uint8_t *buffer) {
+    BatchFile *file = &job->files[task->file];
+    const Track *input = &file->track;
+    uint32_t in_frame_size = input->num_channels * (input->bits_per_sample / 8);
+    uint64_t in_frames = input->data_size / in_frame_size;
+
+    PlaybackState state = { 0 };
+    state.output_channels = file->format.channels;
+    state.output_bits_per_channel = file->format.bits_per_channel;
+    state.output_is_float = file->format.is_float;
+    state.output_sample_rate = file->format.sample_rate;
+    state.resample_quality = job->quality;
+    Track *track = &state.track;
+    *track = *input;
+    track->mapped_base = NULL; // Chunks run out of order, so no read-ahead advice
+
+    // Input frames the chunk reads: the same range without resampling, otherwise
+    // every frame under the filter windows of its outputs
+    uint64_t start = task->first_frame;
+    uint64_t end = task->first_frame + task->frames;
+    if (input->sample_rate != file->format.sample_rate) {
+        if (resampler_init(&state) != 0) {
+            return 1;
+        }
+        Resampler *rs = state.resampler;
+        const ResampleBank *bank = rs->bank;
+        uint32_t lead = bank->taps / 2 - 1; // Silence ahead of the first input frame
+        uint64_t position = task->first_frame * bank->down; // In 1/up input frames
+        uint64_t index = position / bank->up; // First window, counting the lead
+        rs->phase = (uint32_t)(position % bank->up);
+        rs->length = index < lead ? lead - (uint32_t)index : 0;
+        start = index < lead ? 0 : index - lead;
+        uint64_t last = (task->first_frame + task->frames - 1) * bank->down / bank->up;
+        end = last + bank->taps - lead;
+        if (end > in_frames) {
+            end = in_frames; // The usual trailing silence covers the rest
+        }
+    }
+    // FLAC input decodes just the frames under the chunk, so chunks of one file decode
+    // in parallel on whichever workers run them
+    uint8_t *decoded = NULL;
+    track->flac = NULL;
+    if (input->flac) {
+        int32_t *planar = malloc((size_t)input->flac->max_block * input->num_channels * sizeof(int32_t));
+        decoded = malloc((size_t)(end - start) * in_frame_size);
+        int failed = !planar || !decoded;
+        if (failed) {
+            printf("Error: Memory allocation failed\n");
+        } else {
+            failed = flac_decode_range(input->flac, start, end, planar, decoded) != 0;
+        }
+        free(planar);
+        if (failed) {
+            free(decoded);
+            resampler_free(state.resampler);
+            return 1;
+        }
+        track->audio_data = decoded;
+    } else {
+        track->audio_data = input->audio_data + start * in_frame_size;
+    }
+    track->data_size = (end - start) * in_frame_size;
+    track->offset = 0;
+
+    int err = converter_init(&track->converter, track, &state);
+    uint32_t out_frame_size = file->format.channels * (file->format.bits_per_channel / 8);
+    uint32_t done = 0;
+    while (!err && done < task->frames) {
+        uint32_t want = task->frames - done;
+        uint32_t frames = produce_frames(&state, buffer + (size_t)done * out_frame_size,
+                                         want < PRODUCER_CHUNK_FRAMES ? want : PRODUCER_CHUNK_FRAMES);
+        if (frames == 0) {
+            printf("Error: %s ended %u frames early\n", input->filename, task->frames - done);
+            err = 1;
+        }
+        done += frames;
+    }
+    resampler_free(state.resampler);
+    free(decoded);
+    if (err) {
+        return 1;
+    }
+
+    int fd = open(file->output_path, O_WRONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open %s\n", file->output_path);
+        return 1;
+    }
+    size_t length = (size_t)task->frames * out_frame_size;
+    off_t offset = WAV_HEADER_BYTES + (off_t)(task->first_frame * out_frame_size);
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = pwrite(fd, buffer + written, length - written, offset + (off_t)written);
+        if (n <= 0) {
+            printf("Error: Failed to write %s\n", file->output_path);
+            close(fd);
+            return 1;
+        }
+        written += (size_t)n;
+    }
+    close(fd);
+    return 0;
+}
+
+// Worker: run its own tasks front to back, then steal from the others' backs
+static void *batch_worker_thread(void *arg) {
+    BatchWorker *worker = (BatchWorker *)arg;
+    BatchJob *job = worker->job;
+    for (;;) {
+        uint32_t task;
+        int stolen = 0;
+        if (!batch_claim(worker, 0, &task)) {
+            for (uint32_t i = 1; i < job->worker_count && !stolen; i++) {
+                stolen = batch_claim(&job->workers[(worker->index + i) % job->worker_count], 1, &task);
+            }
+            if (!stolen) {
+                return NULL; // Tasks are never added, so every range is empty for good
+            }
+            worker->tasks_stolen++;
+        }
+        // Thread CPU time, so the totals stay honest when threads outnumber cores
+        struct timespec start, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        BatchFile *file = &job->files[job->tasks[task].file];
+        if (!atomic_load(&file->failed) && batch_chunk(job, &job->tasks[task], worker->buffer) != 0) {
+            atomic_store(&file->failed, 1);
+        }
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        atomic_fetch_add(&file->cpu_ns, elapsed_ns(&start, &end));
+        worker->tasks_run++;
+    }
+}
+
+// Open an input, size its output file and work out its chunks. Files found under a
+// directory argument keep their path below it (root bytes of input), others their name
+static int batch_add_file(BatchJob *job, BatchFile *file, const char *input, uint32_t root, const char *directory,
+                          const OutputFormat *requested) {
+    if (is_flac_file(input)) {
+        // Chunks start at arbitrary samples, so every frame's position is needed up front
+        if (open_flac_file(input, &file->track) != 0 || flac_index_frames(file->track.flac) != 0) {
+            return 1;
+        }
+        madvise(file->track.flac->base, file->track.flac->size, MADV_NORMAL);
+    } else {
+        if (map_wav_file(input, &file->track) != 0) {
+            return 1;
+        }
+        madvise(file->track.mapped_base, file->track.mapped_size, MADV_NORMAL); // Read in chunks, not in order
+    }
+    file->track.filename = input;
+    file->format = output_format_for(requested, &file->track);
+
+    const char *slash = strrchr(input, '/');
+    const char *name = root ? input + root : slash ? slash + 1 : input;
+    size_t path_size = strlen(directory) + strlen(name) + 2;
+    file->output_path = malloc(path_size);
+    if (!file->output_path) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    snprintf(file->output_path, path_size, "%s/%s", directory, name);
+    size_t path_length = strlen(file->output_path);
+    if (file->track.flac && path_length > 5 && strcasecmp(file->output_path + path_length - 5, ".flac") == 0) {
+        strcpy(file->output_path + path_length - 5, ".wav"); // The output is always WAV
+    }
+    for (uint32_t i = 0; i < job->file_count; i++) {
+        if (strcmp(job->files[i].output_path, file->output_path) == 0) {
+            printf("Error: %s and %s would both be written to %s\n", job->files[i].track.filename, input,
+                   file->output_path);
+            return 1;
+        }
+    }
+    for (char *sep = file->output_path + strlen(directory) + 1; (sep = strchr(sep, '/')) != NULL; sep++) {
+        *sep = '\0';
+        int made = mkdir(file->output_path, 0777) == 0 || errno == EEXIST;
+        *sep = '/';
+        if (!made) {
+            printf("Error: Cannot create directory for %s\n", file->output_path);
+            return 1;
+        }
+    }
+    struct stat in_stat, out_stat;
+    if (stat(input, &in_stat) == 0 && stat(file->output_path, &out_stat) == 0 &&
+        in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+        printf("Error: %s would overwrite its input\n", file->output_path);
+        return 1;
+    }
+
+    uint64_t in_frames = file->track.data_size / (file->track.num_channels * (file->track.bits_per_sample / 8));
+    uint64_t frames = in_frames;
+    if (file->track.sample_rate != file->format.sample_rate) {
+        // The resampler emits one frame per output step that starts inside the input
+        uint32_t g = gcd_u32(file->track.sample_rate, file->format.sample_rate);
+        uint64_t up = file->format.sample_rate / g, down = file->track.sample_rate / g;
+        frames = (in_frames * up + down - 1) / down;
+    }
+    uint32_t out_frame_size = file->format.channels * (file->format.bits_per_channel / 8);
+    file->frames = frames;
+    uint64_t data_size = file->frames * out_frame_size; // Past 4 GB the header switches to RF64
+
+    // Write the header and size the file now, so chunks can land anywhere in it
+    FILE *out = fopen(file->output_path, "wb");
+    if (!out) {
+        printf("Error: Cannot create file %s\n", file->output_path);
+        return 1;
+    }
+    int err = write_wav_header(out, &file->format, data_size) != 0 || fflush(out) != 0 ||
+              ftruncate(fileno(out), WAV_HEADER_BYTES + (off_t)data_size) != 0;
+    if (fclose(out) != 0 || err) {
+        printf("Error: Failed to write %s\n", file->output_path);
+        return 1;
+    }
+
+    uint32_t file_index = (uint32_t)(file - job->files);
+    for (uint64_t first = 0; first < file->frames; first += BATCH_CHUNK_FRAMES) {
+        if (job->task_count % 1024 == 0) {
+            BatchTask *tasks = realloc(job->tasks, (job->task_count + 1024) * sizeof(BatchTask));
+            if (!tasks) {
+                printf("Error: Memory allocation failed\n");
+                return 1;
+            }
+            job->tasks = tasks;
+        }
+        uint64_t frames_left = file->frames - first;
+        job->tasks[job->task_count++] = (BatchTask){
+            .file = file_index,
+            .first_frame = first,
+            .frames = frames_left < BATCH_CHUNK_FRAMES ? (uint32_t)frames_left : BATCH_CHUNK_FRAMES
+        };
+    }
+    return 0;
+}
+
+// Convert every playlist entry into directory on a pool of threads, one per core
+// unless threads says otherwise, and report the throughput
+static int run_batch(const Playlist *playlist, const char *directory, const OutputFormat *requested,
+                     ResampleQuality quality, uint32_t threads) {
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+        printf("Error: Cannot create directory %s\n", directory);
+        return 1;
+    }
+    BatchJob job = { .quality = quality };
+    job.files = calloc(playlist->count, sizeof(BatchFile));
+    if (!job.files) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    int err = 0;
+    int skipped = 0;
+    uint32_t max_frame_size = 0;
+    for (uint32_t i = 0; i < playlist->count; i++) {
+        BatchFile *file = &job.files[job.file_count];
+        if (batch_add_file(&job, file, playlist->files[i], playlist->roots[i], directory, requested) != 0) {
+            printf("Warning: Skipping %s\n", playlist->files[i]);
+            track_close(&file->track);
+            free(file->output_path);
+            *file = (BatchFile){0};
+            skipped = 1;
+            continue;
+        }
+        uint32_t frame_size = file->format.channels * (file->format.bits_per_channel / 8);
+        max_frame_size = frame_size > max_frame_size ? frame_size : max_frame_size;
+        job.file_count++;
+    }
+
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (uint32_t)cores : 1;
+    }
+    job.worker_count = threads < job.task_count ? threads : job.task_count;
+    job.workers = calloc(job.worker_count ? job.worker_count : 1, sizeof(BatchWorker));
+    if (!job.workers) {
+        printf("Error: Memory allocation failed\n");
+        err = 1;
+        job.worker_count = 0;
+    }
+    printf("Batch: %u files, %u chunks of up to %u frames, %u threads\n", job.file_count, job.task_count,
+           BATCH_CHUNK_FRAMES, job.worker_count);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t started = 0;
+    for (uint32_t w = 0; w < job.worker_count; w++) {
+        BatchWorker *worker = &job.workers[w];
+        // Contiguous ranges keep each worker on few files until it has to steal
+        uint64_t begin = (uint64_t)job.task_count * w / job.worker_count;
+        uint64_t stop = (uint64_t)job.task_count * (w + 1) / job.worker_count;
+        atomic_init(&worker->range, (stop << 32) | begin);
+        worker->job = &job;
+        worker->index = w;
+        worker->buffer = malloc((size_t)BATCH_CHUNK_FRAMES * max_frame_size);
+        if (!worker->buffer) {
+            printf("Error: Memory allocation failed\n");
+            err = 1;
+            break;
+        }
+    }
+    for (uint32_t w = 0; !err && w < job.worker_count; w++) {
+        if (pthread_create(&job.workers[w].thread, NULL, batch_worker_thread, &job.workers[w]) != 0) {
+            break; // The running workers steal the rest
+        }
+        started++;
+    }
+    if (!err && started == 0 && job.worker_count > 0) {
+        batch_worker_thread(&job.workers[0]); // No threads at all: run everything here
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        pthread_join(job.workers[w].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = elapsed_ns(&start, &end) / 1e9;
+
+    // Per-file and aggregate throughput; CPU time is summed over chunks, so the
+    // ratio of total CPU to elapsed time is the speedup the pool achieved
+    double total_seconds = 0.0, total_cpu = 0.0;
+    uint64_t total_frames = 0, total_in = 0, total_out = 0;
+    for (uint32_t i = 0; i < job.file_count; i++) {
+        BatchFile *file = &job.files[i];
+        double seconds = (double)file->frames / file->format.sample_rate;
+        double cpu = atomic_load(&file->cpu_ns) / 1e9;
+        uint64_t out_bytes = (uint64_t)file->frames * file->format.channels * (file->format.bits_per_channel / 8);
+        if (atomic_load(&file->failed)) {
+            printf("  %s: FAILED\n", file->track.filename);
+            err = 1;
+        } else {
+            printf("  %s -> %s: %.2f seconds, %.1f ms CPU (%.0fx realtime, %.1f MB/s)\n", file->track.filename,
+                   file->output_path, seconds, cpu * 1e3, cpu > 0 ? seconds / cpu : 0.0,
+                   cpu > 0 ? (file->track.data_size + out_bytes) / cpu / 1e6 : 0.0);
+        }
+        total_seconds += seconds;
+        total_cpu += cpu;
+        total_frames += file->frames;
+        total_in += file->track.data_size;
+        total_out += out_bytes;
+        track_close(&file->track);
+        free(file->output_path);
+    }
+    printf("Total: %.2f seconds of audio in %.3f seconds (%.0fx realtime, %.1f Mframe/s, %.1f MB/s read, "
+           "%.1f MB/s written)\n", total_seconds, elapsed, elapsed > 0 ? total_seconds / elapsed : 0.0,
+           elapsed > 0 ? total_frames / elapsed / 1e6 : 0.0, elapsed > 0 ? total_in / elapsed / 1e6 : 0.0,
+           elapsed > 0 ? total_out / elapsed / 1e6 : 0.0);
+    uint32_t stolen = 0;
+    for (uint32_t w = 0; w < job.worker_count; w++) {
+        stolen += job.workers[w].tasks_stolen;
+        free(job.workers[w].buffer);
+    }
+    printf("Pool: %.2fx speedup on %u threads (%.0f%% efficiency), %u of %u chunks stolen\n",
+           elapsed > 0 ? total_cpu / elapsed : 0.0, job.worker_count,
+           elapsed > 0 && job.worker_count ? 100.0 * total_cpu / elapsed / job.worker_count : 0.0, stolen,
+           job.task_count);
+    free(job.workers);
+    free(job.tasks);
+    free(job.files);
+    return err || skipped;
+}
+
+// Library probe: the header facts of many files at once, fanned out over a thread
+// pool, and kept in a cache file keyed by path, size and mtime so later scans only
+// stat each file
+#define PROBE_READ_BYTES 65536 // One read covers the header chunks of nearly every file
+#define PROBE_CACHE_VERSION 1
+
+typedef enum {
+    PROBE_OK,
+    PROBE_NOT_WAV,
+    PROBE_UNSUPPORTED,
+    PROBE_UNREADABLE, // Never cached: the file may be readable next time
+    PROBE_STATUS_COUNT
+} ProbeStatus;
+
+static const char *const probe_status_names[PROBE_STATUS_COUNT] = {
+    "ok", "not a WAV file", "unsupported format", "cannot read"
+};
+
+// LIST/INFO fields kept for each file
+typedef enum { TAG_TITLE, TAG_ARTIST, TAG_ALBUM, PROBE_TAG_COUNT } ProbeTag;
+
+static const char probe_tag_ids[PROBE_TAG_COUNT][5] = { "INAM", "IART", "IPRD" };
+
+// One file's header facts. This is also the cache's on-disk record, with strings
+// stored as offsets into the string table that follows the records
+typedef struct {
+    uint64_t file_size; // Cache key, with the path and mtime
+    int64_t mtime_ns;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t sample_rate;
+    uint32_t channel_mask;
+    uint32_t path; // String offsets; tags are UINT32_MAX when absent
+    uint32_t tags[PROBE_TAG_COUNT];
+    uint16_t channels;
+    uint16_t bits_per_sample;
+    uint16_t is_float;
+    uint16_t status; // ProbeStatus
+} ProbeRecord;
+
+typedef struct {
+    char magic[4]; // "APPC"
+    uint32_t version;
+    uint32_t count; // Records after the header
+    uint32_t strings_size; // Bytes of NUL-terminated strings after the records
+} ProbeCacheHeader;
+
+typedef struct {
+    ProbeRecord record;
+    const char *path;
+    const char *tags[PROBE_TAG_COUNT]; // NULL when absent
+    char *owned; // Tag storage for freshly parsed files
+    uint32_t cache_index; // Cache record with the same path, UINT32_MAX for none
+    int cached; // Record came from the cache without touching the file
+} ProbeEntry;
+
+// Open-addressing table from path to record number, UINT32_MAX for an empty slot
+typedef struct {
+    uint32_t *slots;
+    uint32_t mask;
+    const char **paths;
+} ProbeIndex;
+
+typedef struct {
+    uint8_t *data; // The whole cache file
+    const ProbeRecord *records;
+    const char *strings;
+    uint32_t count;
+    ProbeIndex index;
+    uint8_t *stale; // Records superseded by an earlier one with the same path
+} ProbeCache;
+
+typedef struct {
+    const Playlist *playlist;
+    ProbeEntry *entries;
+    const ProbeCache *cache;
+    atomic_uint next; // Next playlist entry to claim
+} ProbeJob;
+
+static uint32_t probe_hash(const char *path) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t probe_index_find(const ProbeIndex *index, const char *path) {
+    if (!index->slots) {
+        return UINT32_MAX;
+    }
+    for (uint32_t slot = probe_hash(path) & index->mask;; slot = (slot + 1) & index->mask) {
+        uint32_t record = index->slots[slot];
+        if (record == UINT32_MAX || strcmp(index->paths[record], path) == 0) {
+            return record;
+        }
+    }
+}
+
+// Index count paths, keeping the first of any duplicates and flagging the rest
+static int probe_index_build(ProbeIndex *index, const char **paths, uint32_t count, uint8_t *duplicate) {
+    uint32_t size = 16;
+    while (size < count * 2) {
+        size *= 2;
+    }
+    *index = (ProbeIndex){ .slots = malloc(size * sizeof(uint32_t)), .mask = size - 1, .paths = paths };
+    if (!index->slots) {
+        return 1;
+    }
+    memset(index->slots, 0xFF, size * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = probe_hash(paths[i]) & index->mask;
+        while (index->slots[slot] != UINT32_MAX && strcmp(paths[index->slots[slot]], paths[i]) != 0) {
+            slot = (slot + 1) & index->mask;
+        }
+        duplicate[i] = index->slots[slot] != UINT32_MAX;
+        if (!duplicate[i]) {
+            index->slots[slot] = i;
+        }
+    }
+    return 0;
+}
+
+static void probe_cache_free(ProbeCache *cache) {
+    free(cache->index.slots);
+    free(cache->index.paths);
+    free(cache->stale);
+    free(cache->data);
+    *cache = (ProbeCache){0};
+}
+
+// Load the cache with one read; a missing file is an empty cache, a damaged one is ignored
+static int probe_cache_load(ProbeCache *cache, const char *path) {
+    *cache = (ProbeCache){0};
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+    struct stat st;
+    ProbeCacheHeader header;
+    int valid = fstat(fileno(file), &st) == 0 && (uint64_t)st.st_size >= sizeof(header) &&
+                (cache->data = malloc((size_t)st.st_size)) != NULL &&
+                fread(cache->data, 1, (size_t)st.st_size, file) == (size_t)st.st_size;
+    fclose(file);
+    if (valid) {
+        memcpy(&header, cache->data, sizeof(header));
+        valid = memcmp(header.magic, "APPC", 4) == 0 && header.version == PROBE_CACHE_VERSION &&
+                header.strings_size > 0 &&
+                sizeof(header) + (uint64_t)header.count * sizeof(ProbeRecord) + header.strings_size ==
+                    (uint64_t)st.st_size;
+    }
+    if (valid) {
+        cache->records = (const ProbeRecord *)(cache->data + sizeof(header));
+        cache->strings = (const char *)(cache->records + header.count);
+        cache->count = header.count;
+        valid = cache->strings[header.strings_size - 1] == '\0';
+        for (uint32_t i = 0; valid && i < cache->count; i++) {
+            const ProbeRecord *record = &cache->records[i];
+            valid = record->path < header.strings_size && record->status < PROBE_UNREADABLE;
+            for (int t = 0; valid && t < PROBE_TAG_COUNT; t++) {
+                valid = record->tags[t] == UINT32_MAX || record->tags[t] < header.strings_size;
+            }
+        }
+    }
+    if (!valid) {
+        printf("Warning: Ignoring unreadable probe cache %s\n", path);
+        probe_cache_free(cache);
+        return 0;
+    }
+
+    const char **paths = malloc((cache->count ? cache->count : 1) * sizeof(char *));
+    cache->stale = calloc(cache->count ? cache->count : 1, 1);
+    if (!paths || !cache->stale) {
+        free(paths);
+        probe_cache_free(cache);
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < cache->count; i++) {
+        paths[i] = cache->strings + cache->records[i].path;
+    }
+    if (probe_index_build(&cache->index, paths, cache->count, cache->stale) != 0) {
+        free(paths);
+        probe_cache_free(cache);
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int probe_strings_add(char **strings, uint32_t *size, uint32_t *capacity, const char *text,
+                             uint32_t *offset) {
+    if (!text) {
+        *offset = UINT32_MAX;
+        return 0;
+    }
+    size_t length = strlen(text) + 1;
+    if (*size + length > UINT32_MAX - 1) {
+        return 1;
+    }
+    while (*size + length > *capacity) {
+        uint32_t grown = *capacity ? *capacity * 2 : 65536;
+        char *more = realloc(*strings, grown);
+        if (!more) {
+            return 1;
+        }
+        *strings = more;
+        *capacity = grown;
+    }
+    memcpy(*strings + *size, text, length);
+    *offset = *size;
+    *size += (uint32_t)length;
+    return 0;
+}
+
+// Write this run's results plus the old records of paths it did not cover, replacing
+// the cache in one rename
+static int probe_cache_write(const char *path, const ProbeEntry *entries, uint32_t entry_count,
+                             const ProbeCache *old) {
+    uint32_t total = entry_count + old->count;
+    ProbeRecord *records = malloc((total ? total : 1) * sizeof(ProbeRecord));
+    const char **paths = malloc((total ? total : 1) * sizeof(char *));
+    const char *(*tags)[PROBE_TAG_COUNT] = malloc((total ? total : 1) * sizeof(*tags));
+    uint8_t *duplicate = malloc(total ? total : 1);
+    uint8_t *covered = calloc(old->count ? old->count : 1, 1);
+    ProbeIndex index = {0};
+    char *strings = NULL;
+    uint32_t strings_size = 0, strings_capacity = 0;
+    int err = !records || !paths || !tags || !duplicate || !covered;
+
+    // Gather candidates: every cacheable entry first, then untouched old records
+    uint32_t count = 0;
+    for (uint32_t i = 0; !err && i < entry_count; i++) {
+        if (entries[i].cache_index != UINT32_MAX) {
+            covered[entries[i].cache_index] = 1;
+        }
+        if (entries[i].record.status == PROBE_UNREADABLE) {
+            continue;
+        }
+        records[count] = entries[i].record;
+        paths[count] = entries[i].path;
+        memcpy(tags[count], entries[i].tags, sizeof(tags[count]));
+        count++;
+    }
+    for (uint32_t i = 0; !err && i < old->count; i++) {
+        if (covered[i] || old->stale[i]) {
+            continue;
+        }
+        records[count] = old->records[i];
+        paths[count] = old->strings + old->records[i].path;
+        for (int t = 0; t < PROBE_TAG_COUNT; t++) {
+            tags[count][t] = old->records[i].tags[t] == UINT32_MAX ? NULL : old->strings + old->records[i].tags[t];
+        }
+        count++;
+    }
+    err = err || probe_index_build(&index, paths, count, duplicate) != 0;
+
+    // Pack the kept records and their strings
+    uint32_t kept = 0;
+    for (uint32_t i = 0; !err && i < count; i++) {
+        if (duplicate[i]) {
+            continue;
+        }
+        records[kept] = records[i];
+        err = probe_strings_add(&strings, &strings_size, &strings_capacity, paths[i], &records[kept].path);
+        for (int t = 0; !err && t < PROBE_TAG_COUNT; t++) {
+            err = probe_strings_add(&strings, &strings_size, &strings_capacity, tags[i][t], &records[kept].tags[t]);
+        }
+        kept++;
+    }
+    if (!err && strings_size == 0) {
+        err = probe_strings_add(&strings, &strings_size, &strings_capacity, "", &(uint32_t){0});
+    }
+    if (err) {
+        printf("Error: Memory allocation failed\n");
+    }
+
+    char temp_path[4096];
+    if (!err && snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        printf("Error: Probe cache path too long\n");
+        err = 1;
+    }
+    FILE *file = err ? NULL : fopen(temp_path, "wb");
+    if (!err && !file) {
+        printf("Error: Cannot create probe cache %s\n", temp_path);
+        err = 1;
+    }
+    if (file) {
+        ProbeCacheHeader header = { .magic = { 'A', 'P', 'P', 'C' }, .version = PROBE_CACHE_VERSION,
+                                    .count = kept, .strings_size = strings_size };
+        int failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+                     fwrite(records, sizeof(ProbeRecord), kept, file) != kept ||
+                     fwrite(strings, 1, strings_size, file) != strings_size;
+        if (fclose(file) != 0 || failed || rename(temp_path, path) != 0) {
+            printf("Error: Failed to write probe cache %s\n", path);
+            remove(temp_path);
+            err = 1;
+        } else {
+            printf("Cache: %s, %u entries written\n", path, kept);
+        }
+    }
+    free(index.slots);
+    free(strings);
+    free(covered);
+    free(duplicate);
+    free(tags);
+    free(paths);
+    free(records);
+    return err;
+}
+
+// Default cache location, under the XDG cache directory
+static void probe_cache_default(char *path, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && xdg[0] == '/') {
+        snprintf(path, size, "%s", xdg);
+    } else if (home && home[0]) {
+        snprintf(path, size, "%s/.cache", home);
+    } else {
+        snprintf(path, size, ".audioplayer-probe.cache");
+        return;
+    }
+    mkdir(path, 0777); // Usually exists already
+    size_t length = strlen(path);
+    snprintf(path + length, size - length, "/audioplayer-probe.cache");
+}
+
+// Parse a file's chunks out of PROBE_READ_BYTES reads: one for the usual layout, one
+// more for each chunk header or parsed payload (LIST after the data, say) beyond it
+static void probe_parse(int fd, uint8_t *buffer, ProbeEntry *entry) {
+    ProbeRecord *record = &entry->record;
+    uint64_t file_size = record->file_size;
+    record->status = PROBE_NOT_WAV;
+    ssize_t n = pread(fd, buffer, PROBE_READ_BYTES, 0);
+    uint64_t base = 0, length = n > 0 ? (uint64_t)n : 0;
+    if (length < 12 || memcmp(buffer + 8, "WAVE", 4) != 0) {
+        return;
+    }
+    int rf64 = memcmp(buffer, "RF64", 4) == 0 || memcmp(buffer, "BW64", 4) == 0;
+    if (!rf64 && memcmp(buffer, "RIFF", 4) != 0) {
+        return;
+    }
+
+    uint64_t ds64_data_size = 0;
+    uint16_t format_tag = 0, block_align = 0;
+    int have_fmt = 0, have_data = 0;
+    char tag_text[PROBE_TAG_COUNT][256] = { { 0 } };
+    uint64_t position = 12;
+    while (position + 8 <= file_size) {
+        if (position + 8 > base + length) {
+            n = pread(fd, buffer, PROBE_READ_BYTES, (off_t)position);
+            if (n < 8) {
+                break;
+            }
+            base = position;
+            length = (uint64_t)n;
+        }
+        const uint8_t *chunk = buffer + (position - base);
+        uint32_t size32;
+        memcpy(&size32, chunk + 4, 4);
+        uint64_t size = size32;
+        if (rf64 && size32 == UINT32_MAX && memcmp(chunk, "data", 4) == 0) {
+            size = ds64_data_size;
+        }
+        int parsed = memcmp(chunk, "ds64", 4) == 0 || memcmp(chunk, "fmt ", 4) == 0 || memcmp(chunk, "LIST", 4) == 0;
+        if (parsed && size <= PROBE_READ_BYTES - 8 && position + 8 + size > base + length &&
+            position + 8 + size <= file_size) {
+            // The payload straddles the end of the buffer: read again from this chunk
+            n = pread(fd, buffer, PROBE_READ_BYTES, (off_t)position);
+            if (n < (ssize_t)(8 + size)) {
+                break;
+            }
+            base = position;
+            length = (uint64_t)n;
+            chunk = buffer;
+        }
+        const uint8_t *payload = chunk + 8;
+        uint64_t available = base + length - (position + 8);
+        available = available < size ? available : size;
+
+        if (memcmp(chunk, "ds64", 4) == 0 && available >= 16) {
+            memcpy(&ds64_data_size, payload + 8, 8);
+        } else if (memcmp(chunk, "fmt ", 4) == 0 && available >= 16 && !have_fmt) {
+            memcpy(&format_tag, payload, 2);
+            memcpy(&record->channels, payload + 2, 2);
+            memcpy(&record->sample_rate, payload + 4, 4);
+            memcpy(&block_align, payload + 12, 2);
+            memcpy(&record->bits_per_sample, payload + 14, 2);
+            if (format_tag == 0xFFFE && available >= 40) {
+                memcpy(&record->channel_mask, payload + 20, 4);
+                memcpy(&format_tag, payload + 24, 2);
+            }
+            have_fmt = 1;
+        } else if (memcmp(chunk, "data", 4) == 0 && !have_data) {
+            record->data_offset = position + 8;
+            record->data_size = size < file_size - record->data_offset ? size : file_size - record->data_offset;
+            have_data = 1;
+        } else if (memcmp(chunk, "LIST", 4) == 0 && available >= 4 && memcmp(payload, "INFO", 4) == 0) {
+            for (uint64_t at = 4; at + 8 <= available;) {
+                uint32_t field_size;
+                memcpy(&field_size, payload + at + 4, 4);
+                uint64_t text_size = available - at - 8 < field_size ? available - at - 8 : field_size;
+                for (int t = 0; t < PROBE_TAG_COUNT; t++) {
+                    if (memcmp(payload + at, probe_tag_ids[t], 4) == 0) {
+                        size_t copy = text_size < sizeof(tag_text[t]) - 1 ? (size_t)text_size : sizeof(tag_text[t]) - 1;
+                        memcpy(tag_text[t], payload + at + 8, copy);
+                        tag_text[t][copy] = '\0';
+                    }
+                }
+                at += 8 + (uint64_t)field_size + (field_size & 1);
+            }
+        }
+        if (size > file_size) {
+            break;
+        }
+        position += 8 + size + (size & 1); // Chunks are padded to even sizes
+    }
+    if (!have_fmt || !have_data) {
+        return;
+    }
+
+    // The same formats read_wav_header accepts
+    record->is_float = format_tag == 3;
+    int supported = record->channels >= 1 && record->sample_rate >= 8000 && record->sample_rate <= 96000 &&
+                    ((format_tag == 1 && record->bits_per_sample % 8 == 0 && record->bits_per_sample > 0) ||
+                     (format_tag == 3 && record->bits_per_sample == 32)) &&
+                    block_align == record->channels * (record->bits_per_sample / 8);
+    record->status = supported ? PROBE_OK : PROBE_UNSUPPORTED;
+
+    size_t tags_size = 0;
+    for (int t = 0; t < PROBE_TAG_COUNT; t++) {
+        tags_size += tag_text[t][0] ? strlen(tag_text[t]) + 1 : 0;
+    }
+    entry->owned = tags_size ? malloc(tags_size) : NULL;
+    char *next = entry->owned;
+    for (int t = 0; next && t < PROBE_TAG_COUNT; t++) {
+        if (tag_text[t][0]) {
+            entry->tags[t] = strcpy(next, tag_text[t]);
+            next += strlen(next) + 1;
+        }
+    }
+}
+
+// Fill one entry from the cache when the file's size and mtime still match, else
+// from the file itself
+static void probe_file(ProbeJob *job, ProbeEntry *entry, const char *path, uint8_t *buffer) {
+    entry->path = path;
+    entry->cache_index = probe_index_find(&job->cache->index, path);
+    entry->record.status = PROBE_UNREADABLE;
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    entry->record.file_size = (uint64_t)st.st_size;
+    entry->record.mtime_ns = stat_mtime_ns(&st);
+    if (entry->cache_index != UINT32_MAX) {
+        const ProbeRecord *hit = &job->cache->records[entry->cache_index];
+        if (hit->file_size == entry->record.file_size && hit->mtime_ns == entry->record.mtime_ns) {
+            entry->record = *hit;
+            for (int t = 0; t < PROBE_TAG_COUNT; t++) {
+                entry->tags[t] = hit->tags[t] == UINT32_MAX ? NULL : job->cache->strings + hit->tags[t];
+            }
+            entry->cached = 1;
+            return;
+        }
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        entry->record.status = PROBE_UNREADABLE;
+        return;
+    }
+    probe_parse(fd, buffer, entry);
+    close(fd);
+}
+
+static void *probe_worker_thread(void *arg) {
+    ProbeJob *job = (ProbeJob *)arg;
+    uint8_t buffer[PROBE_READ_BYTES];
+    for (;;) {
+        uint32_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->playlist->count) {
+            return NULL;
+        }
+        probe_file(job, &job->entries[i], job->playlist->files[i], buffer);
+    }
+}
+
+// List every playlist entry's format, length and tags, probing files on a pool of
+// threads, one per core unless threads says otherwise
+static int run_probe(const Playlist *playlist, const char *cache_path, uint32_t threads) {
+    char default_path[4096];
+    if (!cache_path) {
+        probe_cache_default(default_path, sizeof(default_path));
+        cache_path = default_path;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ProbeCache cache;
+    if (probe_cache_load(&cache, cache_path) != 0) {
+        return 1;
+    }
+    ProbeJob job = { .playlist = playlist, .cache = &cache };
+    job.entries = calloc(playlist->count, sizeof(ProbeEntry));
+    if (!job.entries) {
+        printf("Error: Memory allocation failed\n");
+        probe_cache_free(&cache);
+        return 1;
+    }
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (uint32_t)cores : 1;
+    }
+    threads = threads < playlist->count ? threads : playlist->count;
+    pthread_t workers[256];
+    threads = threads < 256 ? threads : 256;
+    uint32_t started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, probe_worker_thread, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        probe_worker_thread(&job); // No threads at all: probe everything here
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        pthread_join(workers[w], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint32_t cached = 0, failed = 0;
+    double total_seconds = 0.0;
+    for (uint32_t i = 0; i < playlist->count; i++) {
+        const ProbeEntry *entry = &job.entries[i];
+        const ProbeRecord *record = &entry->record;
+        cached += entry->cached;
+        if (record->status != PROBE_OK) {
+            printf("  %s: %s\n", entry->path, probe_status_names[record->status]);
+            failed++;
+            continue;
+        }
+        double seconds = (double)record->data_size / (record->sample_rate * record->channels *
+                                                      (record->bits_per_sample / 8));
+        total_seconds += seconds;
+        printf("  %10.2f s  %5u Hz  %2u ch  %2u-bit %-5s  %s", seconds, record->sample_rate, record->channels,
+               record->bits_per_sample, record->is_float ? "float" : "int", entry->path);
+        if (entry->tags[TAG_ARTIST] || entry->tags[TAG_TITLE]) {
+            printf("  [%s - %s]", entry->tags[TAG_ARTIST] ? entry->tags[TAG_ARTIST] : "?",
+                   entry->tags[TAG_TITLE] ? entry->tags[TAG_TITLE] : "?");
+        }
+        if (entry->tags[TAG_ALBUM]) {
+            printf("  (%s)", entry->tags[TAG_ALBUM]);
+        }
+        printf("\n");
+    }
+    printf("Probe: %u files, %.2f hours of audio, in %.1f ms on %u threads: %u from cache, %u parsed, %u failed\n",
+           playlist->count, total_seconds / 3600, elapsed_ns(&start, &end) / 1e6, started ? started : 1, cached,
+           playlist->count - cached, failed);
+
+    // Rewrite the cache only when this run learned something
+    int err = 0;
+    int changed = 0;
+    for (uint32_t i = 0; i < playlist->count && !changed; i++) {
+        changed = !job.entries[i].cached && job.entries[i].record.status != PROBE_UNREADABLE;
+    }
+    for (uint32_t i = 0; i < cache.count && !changed; i++) {
+        changed = cache.stale[i];
+    }
+    if (changed) {
+        err = probe_cache_write(cache_path, job.entries, playlist->count, &cache);
+    }
+    for (uint32_t i = 0; i < playlist->count; i++) {
+        free(job.entries[i].owned);
+    }
+    free(job.entries);
+    probe_cache_free(&cache);
+    return err || failed;
+}
+
+// Loudness analysis: integrated loudness and loudness range after ITU-R BS.1770 and
+// EBU Tech 3342, true peak from an oversampled signal, and the ReplayGain 2.0 gain to
+// -18 LUFS, for many files at once on a pool of threads. Channels are K-weighted
+// side by side in vector lanes by the biquad kernels, and the oversampler is a
+// resampling bank
+#define LOUDNESS_BLOCK_FRAMES 4096
+#define LOUDNESS_REFERENCE -18.0 // ReplayGain 2.0 target, LUFS
+
+typedef struct {
+    Track track;
+    int err;
+    double *segments; // Weighted mean square of each whole 100 ms of K-weighted audio
+    uint32_t segment_count;
+    double integrated; // LUFS, -HUGE_VAL for silence
+    double range; // LU
+    float true_peak; // Linear
+    float sample_peak;
+} LoudnessFile;
+
+typedef struct {
+    LoudnessFile *files;
+    uint32_t count;
+    atomic_uint next;
+} LoudnessJob;
+
+// K-weighting for any rate: the BS.1770 high shelf and high pass, designed from their
+// analog prototypes so 48 kHz gives the coefficients in the standard
+static void loudness_k_weighting(BiquadCascade *eq, uint32_t rate) {
+    double k = tan(M_PI * 1681.974450955533 / rate);
+    double vh = pow(10.0, 3.999843853973347 / 20.0), vb = pow(vh, 0.4996667741545416);
+    double q = 0.7071752369554196;
+    double a0 = 1.0 + k / q + k * k;
+    eq->coeffs[0][0] = (float)((vh + vb * k / q + k * k) / a0);
+    eq->coeffs[0][1] = (float)(2.0 * (k * k - vh) / a0);
+    eq->coeffs[0][2] = (float)((vh - vb * k / q + k * k) / a0);
+    eq->coeffs[0][3] = (float)(2.0 * (k * k - 1.0) / a0);
+    eq->coeffs[0][4] = (float)((1.0 - k / q + k * k) / a0);
+    k = tan(M_PI * 38.13547087602444 / rate);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+    eq->coeffs[1][0] = 1.0f;
+    eq->coeffs[1][1] = -2.0f;
+    eq->coeffs[1][2] = 1.0f;
+    eq->coeffs[1][3] = (float)(2.0 * (k * k - 1.0) / a0);
+    eq->coeffs[1][4] = (float)((1.0 - k / q + k * k) / a0);
+    eq->bands = 2;
+}
+
+// Loudness in LUFS of a mean square, -HUGE_VAL for silence
+static double loudness_of(double mean_square) {
+    return mean_square > 0.0 ? -0.691 + 10.0 * log10(mean_square) : -HUGE_VAL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Gated loudness of blocks of length segments, one starting at every segment of
+// sums (prefix sums of the segments): the mean of the blocks above -70 LUFS and
+// above gate LU under their own mean. With values set, the gated blocks' loudness
+// is stored there and the count returned instead
+static double loudness_gated(const double *sums, uint32_t count, uint32_t length, double gate, double *values,
+                             uint32_t *kept) {
+    double total = 0.0;
+    uint32_t above = 0;
+    for (uint32_t i = 0; i + length <= count; i++) {
+        double z = (sums[i + length] - sums[i]) / length;
+        if (loudness_of(z) > -70.0) {
+            total += z;
+            above++;
+        }
+    }
+    if (above == 0) {
+        *kept = 0;
+        return -HUGE_VAL;
+    }
+    double threshold = loudness_of(total / above) - gate;
+    total = 0.0;
+    *kept = 0;
+    for (uint32_t i = 0; i + length <= count; i++) {
+        double z = (sums[i + length] - sums[i]) / length;
+        double l = loudness_of(z);
+        if (l > -70.0 && l > threshold) {
+            if (values) {
+                values[*kept] = l;
+            }
+            total += z;
+            (*kept)++;
+        }
+    }
+    return *kept ? loudness_of(total / *kept) : -HUGE_VAL;
+}
+
+// Integrated loudness (400 ms blocks, 75% overlap, -10 LU relative gate) and loudness
+// range (3 s blocks every 100 ms, -20 LU gate, 10th to 95th percentile)
+static int loudness_measure(LoudnessFile *file) {
+    uint32_t count = file->segment_count;
+    double *sums = malloc(((size_t)count + 1) * sizeof(double));
+    double *values = malloc(((size_t)count + 1) * sizeof(double));
+    if (!sums || !values) {
+        free(sums);
+        free(values);
+        return 1;
+    }
+    sums[0] = 0.0;
+    for (uint32_t i = 0; i < count; i++) {
+        sums[i + 1] = sums[i] + file->segments[i];
+    }
+    uint32_t kept;
+    file->integrated = loudness_gated(sums, count, 4, 10.0, NULL, &kept);
+    loudness_gated(sums, count, 30, 20.0, values, &kept);
+    file->range = 0.0;
+    if (kept > 0) {
+        qsort(values, kept, sizeof(double), compare_doubles);
+        file->range = values[(uint32_t)(0.95 * (kept - 1) + 0.5)] - values[(uint32_t)(0.10 * (kept - 1) + 0.5)];
+    }
+    free(sums);
+    free(values);
+    return 0;
+}
+
+// One pass over a track: peaks, K-weighting and 100 ms energies
+static int loudness_scan(LoudnessFile *file) {
+    Track *track = &file->track;
+    uint32_t channels = track->num_channels, rate = track->sample_rate;
+    int format = sample_format_of(track->bits_per_sample, track->is_float);
+    if (format < 0 || channels == 0 || channels > MIX_MAX_CHANNELS || rate < 8000) {
+        printf("Error: %s: Cannot analyse %u channels of %u-bit audio at %u Hz\n", track->filename, channels,
+               track->bits_per_sample, rate);
+        return 1;
+    }
+    // BS.1770 weights: surrounds +1.5 dB, LFE left out
+    float weights[MIX_MAX_CHANNELS];
+    uint32_t positions[MIX_MAX_CHANNELS];
+    channel_positions(track->channel_mask ? track->channel_mask : default_channel_mask(channels), channels, positions);
+    for (uint32_t c = 0; c < channels; c++) {
+        weights[c] = positions[c] == SPEAKER_LFE ? 0.0f
+                     : positions[c] & (SPEAKER_BL | SPEAKER_BR | SPEAKER_SL | SPEAKER_SR) ? 1.41f
+                                                                                            : 1.0f;
+    }
+
+    // True peak oversamples to at least 192 kHz, with taps close to the BS.1770 example filter
+    uint32_t up = rate < 96000 ? 4 : rate < 192000 ? 2 : 1;
+    Resampler rs = { .channels = channels };
+    rs.bank = up > 1 ? resample_bank_get(up, 1, RESAMPLE_LOW) : NULL;
+    rs.capacity = LOUDNESS_BLOCK_FRAMES + (rs.bank ? rs.bank->taps : 0);
+    rs.history = up > 1 ? calloc((size_t)rs.capacity * channels, sizeof(float)) : NULL;
+    rs.output = up > 1 ? malloc((size_t)LOUDNESS_BLOCK_FRAMES * up * channels * sizeof(float)) : NULL;
+    rs.length = rs.bank ? rs.bank->taps / 2 - 1 : 0;
+    float *block = malloc((size_t)LOUDNESS_BLOCK_FRAMES * channels * sizeof(float));
+    BiquadCascade *kw = calloc(1, sizeof(BiquadCascade));
+    uint32_t segment_frames = rate / 10;
+    uint32_t segment_capacity = (uint32_t)(track->data_size / track->block_align / segment_frames) + 1;
+    file->segments = malloc((size_t)segment_capacity * sizeof(double));
+    if (!block || !kw || !file->segments || (up > 1 && (!rs.bank || !rs.history || !rs.output))) {
+        printf("Error: Memory allocation failed\n");
+        free(block);
+        free(kw);
+        free(rs.history);
+        free(rs.output);
+        return 1;
+    }
+    loudness_k_weighting(kw, rate);
+    kw->channels = channels;
+
+    const DecodeFn decode = pcm_kernels->decode[format];
+    float true_peak = 0.0f, sample_peak = 0.0f;
+    double energy = 0.0;
+    uint32_t segment_fill = 0;
+    const uint8_t *src;
+    uint32_t frames;
+    while ((frames = track_next_block(track, &src, LOUDNESS_BLOCK_FRAMES)) > 0) {
+        size_t samples = (size_t)frames * channels;
+        decode(src, block, samples);
+        for (size_t i = 0; i < samples; i++) {
+            sample_peak = fabsf(block[i]) > sample_peak ? fabsf(block[i]) : sample_peak;
+        }
+        if (up > 1) {
+            resampler_append(&rs, block, frames);
+            uint32_t produced;
+            while ((produced = resampler_run(&rs, rs.output, LOUDNESS_BLOCK_FRAMES * up)) > 0) {
+                for (size_t i = 0; i < (size_t)produced * channels; i++) {
+                    true_peak = fabsf(rs.output[i]) > true_peak ? fabsf(rs.output[i]) : true_peak;
+                }
+            }
+            resampler_compact(&rs);
+        }
+
+        pcm_kernels->biquad(kw, block, frames);
+        for (uint32_t f = 0; f < frames; f++) {
+            const float *frame = block + (size_t)f * channels;
+            float sum = 0.0f;
+            for (uint32_t c = 0; c < channels; c++) {
+                sum += weights[c] * frame[c] * frame[c];
+            }
+            energy += sum;
+            if (++segment_fill == segment_frames) {
+                if (file->segment_count < segment_capacity) {
+                    file->segments[file->segment_count++] = energy / segment_frames;
+                }
+                energy = 0.0;
+                segment_fill = 0;
+            }
+        }
+    }
+    free(block);
+    free(kw);
+    free(rs.history);
+    free(rs.output);
+    file->sample_peak = sample_peak;
+    file->true_peak = true_peak > sample_peak ? true_peak : sample_peak;
+    return loudness_measure(file);
+}
+
+static void *loudness_worker_thread(void *arg) {
+    LoudnessJob *job = (LoudnessJob *)arg;
+    for (;;) {
+        uint32_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->count) {
+            return NULL;
+        }
+        LoudnessFile *file = &job->files[i];
+        if (!file->err) {
+            file->err = loudness_scan(file);
+        }
+        track_close(&file->track); // Frees the mapping as soon as the file is done
+    }
+}
+
+// Tags next to the file, as FILE.replaygain
+static int loudness_write_sidecar(const LoudnessFile *file) {
+    size_t size = strlen(file->track.filename) + sizeof(".replaygain");
+    char *path = malloc(size);
+    if (!path) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    snprintf(path, size, "%s.replaygain", file->track.filename);
+    FILE *out = fopen(path, "w");
+    int err = out == NULL;
+    if (out) {
+        fprintf(out, "REPLAYGAIN_TRACK_GAIN=%+.2f dB\n", LOUDNESS_REFERENCE - file->integrated);
+        fprintf(out, "REPLAYGAIN_TRACK_PEAK=%.6f\n", file->true_peak);
+        fprintf(out, "REPLAYGAIN_REFERENCE_LOUDNESS=%.1f LUFS\n", LOUDNESS_REFERENCE);
+        fprintf(out, "R128_INTEGRATED_LOUDNESS=%.1f LUFS\n", file->integrated);
+        fprintf(out, "R128_LOUDNESS_RANGE=%.1f LU\n", file->range);
+        fprintf(out, "R128_TRUE_PEAK=%.1f dBTP\n", file->true_peak > 0 ? 20.0 * log10(file->true_peak) : -HUGE_VAL);
+        err = fclose(out) != 0;
+    }
+    if (err) {
+        printf("Error: Failed to write %s\n", path);
+    }
+    free(path);
+    return err;
+}
+
+// Analyse every playlist entry on a pool of threads and print a line per file, then
+// the whole set as one album; with sidecar set, write FILE.replaygain for each
+static int run_loudness(const Playlist *playlist, int sidecar, uint32_t threads) {
+    LoudnessJob job = { .count = playlist->count };
+    job.files = calloc(playlist->count, sizeof(LoudnessFile));
+    if (!job.files) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t bytes = 0;
+    double seconds = 0.0;
+    for (uint32_t i = 0; i < playlist->count; i++) {
+        LoudnessFile *file = &job.files[i];
+        const char *path = playlist->files[i];
+        file->err = is_flac_file(path) ? open_flac_file(path, &file->track) : map_wav_file(path, &file->track);
+        file->track.filename = path;
+        if (!file->err) {
+            bytes += file->track.flac ? file->track.flac->size : file->track.data_size;
+            seconds += (double)file->track.data_size / file->track.block_align / file->track.sample_rate;
+        }
+    }
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (uint32_t)cores : 1;
+    }
+    threads = threads < playlist->count ? threads : playlist->count;
+    pthread_t workers[256];
+    threads = threads < 256 ? threads : 256;
+    uint32_t started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, loudness_worker_thread, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        loudness_worker_thread(&job);
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        pthread_join(workers[w], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // The album: every file's segments gated together, as if played back to back
+    LoudnessFile album = { 0 };
+    for (uint32_t i = 0; i < playlist->count; i++) {
+        album.segment_count += job.files[i].err ? 0 : job.files[i].segment_count;
+    }
+    album.segments = malloc(((size_t)album.segment_count + 1) * sizeof(double));
+    int err = 0;
+    uint32_t failed = 0, copied = 0;
+    printf("%8s %6s %8s %8s  %s\n", "LUFS", "LRA", "dBTP", "gain", "file");
+    for (uint32_t i = 0; i < playlist->count; i++) {
+        LoudnessFile *file = &job.files[i];
+        if (file->err) {
+            printf("%8s %6s %8s %8s  %s\n", "-", "-", "-", "-", file->track.filename);
+            free(file->segments);
+            failed++;
+            continue;
+        }
+        printf("%8.1f %6.1f %8.1f %+8.2f  %s\n", file->integrated, file->range, 20.0 * log10(file->true_peak),
+               LOUDNESS_REFERENCE - file->integrated, file->track.filename);
+        if (album.segments) {
+            memcpy(album.segments + copied, file->segments, (size_t)file->segment_count * sizeof(double));
+            copied += file->segment_count;
+        }
+        album.true_peak = file->true_peak > album.true_peak ? file->true_peak : album.true_peak;
+        if (sidecar) {
+            err |= loudness_write_sidecar(file);
+        }
+        free(file->segments);
+    }
+    if (playlist->count > failed + 1 && album.segments && loudness_measure(&album) == 0) {
+        printf("%8.1f %6.1f %8.1f %+8.2f  (album)\n", album.integrated, album.range, 20.0 * log10(album.true_peak),
+               LOUDNESS_REFERENCE - album.integrated);
+    }
+    free(album.segments);
+    free(job.files);
+
+    double elapsed = elapsed_ns(&start, &end) / 1e9;
+    printf("Loudness: %u files, %.2f hours of audio, %.1f MB in %.2f s on %u threads (%.0fx realtime, %.0f MB/s), "
+           "%u failed\n", playlist->count, seconds / 3600, bytes / 1e6, elapsed, started ? started : 1,
+           elapsed > 0 ? seconds / elapsed : 0.0, elapsed > 0 ? bytes / 1e6 / elapsed : 0.0, failed);
+    return err || failed;
+}
+
+// Waveform overviews: per channel minimum, maximum and RMS of every 256, 4096 and
+// 65536 frames, built in one pass by the peak kernels and kept next to the file as
+// FILE.peaks. A display zoomed out to any width reads the coarsest level with a
+// bucket per column, so drawing never touches the audio. A file that has grown since
+// (a recording still being written) is extended from its last whole coarse bucket
+#define PEAK_LEVELS 3
+#define PEAK_BLOCK_FRAMES 4096
+#define PEAK_CACHE_VERSION 1
+#define PEAK_COLUMNS 64 // Width of the printed overview
+
+static const uint32_t peak_bucket_frames[PEAK_LEVELS] = { 256, 4096, 65536 };
+
+// Full scale is 32767; a bucket's channels are stored side by side
+typedef struct {
+    int16_t min;
+    int16_t max;
+    int16_t rms;
+} PeakBucket;
+
+typedef struct {
+    uint32_t channels;
+    uint64_t frames; // Frames covered; the last bucket of each level may be partial
+    PeakBucket *buckets[PEAK_LEVELS];
+    uint64_t count[PEAK_LEVELS]; // Buckets, whole and partial
+    uint64_t capacity[PEAK_LEVELS];
+} PeakPyramid;
+
+// FILE.peaks: this header, then every level's buckets in order
+typedef struct {
+    char magic[4]; // "APPK"
+    uint32_t version;
+    uint64_t file_size; // With the mtime, the file the buckets were computed from
+    int64_t mtime_ns;
+    uint64_t data_offset;
+    uint64_t frames;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits_per_sample;
+    uint16_t is_float;
+    uint16_t reserved[3];
+} PeakCacheHeader;
+
+static void peaks_free(PeakPyramid *pyramid) {
+    for (int l = 0; l < PEAK_LEVELS; l++) {
+        free(pyramid->buckets[l]);
+    }
+    *pyramid = (PeakPyramid){0};
+}
+
+static uint64_t peaks_count_for(uint64_t frames, int level) {
+    return (frames + peak_bucket_frames[level] - 1) / peak_bucket_frames[level];
+}
+
+static int peaks_reserve(PeakPyramid *pyramid, int level, uint64_t count) {
+    if (count <= pyramid->capacity[level]) {
+        return 0;
+    }
+    uint64_t capacity = pyramid->capacity[level] ? pyramid->capacity[level] : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    PeakBucket *buckets = realloc(pyramid->buckets[level], (size_t)capacity * pyramid->channels * sizeof(PeakBucket));
+    if (!buckets) {
+        return 1;
+    }
+    pyramid->buckets[level] = buckets;
+    pyramid->capacity[level] = capacity;
+    return 0;
+}
+
+static int16_t peak_value(float x) {
+    x *= 32767.0f;
+    return (int16_t)(x >= 32767.0f ? 32767 : x <= -32767.0f ? -32767 : lrintf(x));
+}
+
+static void peaks_bucket_of(PeakBucket *bucket, const float *min, const float *max, const double *squares,
+                            uint32_t channels, uint32_t frames) {
+    for (uint32_t c = 0; c < channels; c++) {
+        bucket[c].min = peak_value(min[c]);
+        bucket[c].max = peak_value(max[c]);
+        bucket[c].rms = peak_value((float)sqrt(squares[c] / frames));
+    }
+}
+
+// Rebuild every level from frame from, a multiple of the coarsest bucket, to the end
+// of the track; buckets before it are kept
+static int peaks_scan(PeakPyramid *pyramid, Track *track, uint64_t from) {
+    uint32_t channels = pyramid->channels;
+    float *block = malloc((size_t)PEAK_BLOCK_FRAMES * channels * sizeof(float));
+    if (!block) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    if (track_seek(track, from) != 0) {
+        printf("Error: Cannot seek in %s\n", track->filename);
+        free(block);
+        return 1;
+    }
+    pyramid->frames = from;
+    for (int l = 0; l < PEAK_LEVELS; l++) {
+        pyramid->count[l] = from / peak_bucket_frames[l];
+    }
+
+    const DecodeFn decode = pcm_kernels->decode[sample_format_of(track->bits_per_sample, track->is_float)];
+    float low[PEAK_LEVELS][MIX_MAX_CHANNELS], high[PEAK_LEVELS][MIX_MAX_CHANNELS];
+    double squares[PEAK_LEVELS][MIX_MAX_CHANNELS];
+    uint32_t fill[PEAK_LEVELS] = {0};
+    for (int l = 0; l < PEAK_LEVELS; l++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            low[l][c] = INFINITY;
+            high[l][c] = -INFINITY;
+            squares[l][c] = 0.0;
+        }
+    }
+    int err = 0;
+    const uint8_t *src;
+    uint32_t frames;
+    while (!err && (frames = track_next_block(track, &src, PEAK_BLOCK_FRAMES)) > 0) {
+        decode(src, block, (size_t)frames * channels);
+        // Each piece lies inside one bucket of every level
+        for (uint32_t done = 0; !err && done < frames;) {
+            uint32_t n = frames - done < peak_bucket_frames[0] - fill[0] ? frames - done
+                                                                         : peak_bucket_frames[0] - fill[0];
+            float min[MIX_MAX_CHANNELS], max[MIX_MAX_CHANNELS], sums[MIX_MAX_CHANNELS];
+            pcm_kernels->peaks(block + (size_t)done * channels, channels, n, min, max, sums);
+            for (int l = 0; !err && l < PEAK_LEVELS; l++) {
+                for (uint32_t c = 0; c < channels; c++) {
+                    low[l][c] = min[c] < low[l][c] ? min[c] : low[l][c];
+                    high[l][c] = max[c] > high[l][c] ? max[c] : high[l][c];
+                    squares[l][c] += sums[c];
+                }
+                fill[l] += n;
+                if (fill[l] == peak_bucket_frames[l]) {
+                    err = peaks_reserve(pyramid, l, pyramid->count[l] + 1);
+                    if (!err) {
+                        peaks_bucket_of(pyramid->buckets[l] + pyramid->count[l]++ * channels, low[l], high[l],
+                                        squares[l], channels, fill[l]);
+                    }
+                    for (uint32_t c = 0; c < channels; c++) {
+                        low[l][c] = INFINITY;
+                        high[l][c] = -INFINITY;
+                        squares[l][c] = 0.0;
+                    }
+                    fill[l] = 0;
+                }
+            }
+            done += n;
+        }
+        pyramid->frames += frames;
+    }
+    for (int l = 0; !err && l < PEAK_LEVELS; l++) {
+        if (fill[l] > 0) {
+            err = peaks_reserve(pyramid, l, pyramid->count[l] + 1);
+            if (!err) {
+                peaks_bucket_of(pyramid->buckets[l] + pyramid->count[l]++ * channels, low[l], high[l], squares[l],
+                                channels, fill[l]);
+            }
+        }
+    }
+    free(block);
+    if (err) {
+        printf("Error: Memory allocation failed\n");
+    }
+    return err;
+}
+
+// Whether the finest bucket before frame end (a whole one) still matches the file
+static int peaks_bucket_matches(const PeakPyramid *pyramid, Track *track, uint64_t end) {
+    uint32_t channels = pyramid->channels;
+    uint64_t index = end / peak_bucket_frames[0] - 1;
+    const uint8_t *src;
+    float block[MIX_MAX_CHANNELS * 256]; // One finest bucket
+    if (track_seek(track, end - peak_bucket_frames[0]) != 0 ||
+        track_next_block(track, &src, peak_bucket_frames[0]) != peak_bucket_frames[0]) {
+        return 0;
+    }
+    pcm_kernels->decode[sample_format_of(track->bits_per_sample, track->is_float)](
+        src, block, (size_t)peak_bucket_frames[0] * channels);
+    float min[MIX_MAX_CHANNELS], max[MIX_MAX_CHANNELS], sums[MIX_MAX_CHANNELS];
+    double squares[MIX_MAX_CHANNELS];
+    pcm_kernels->peaks(block, channels, peak_bucket_frames[0], min, max, sums);
+    for (uint32_t c = 0; c < channels; c++) {
+        squares[c] = sums[c];
+    }
+    PeakBucket bucket[MIX_MAX_CHANNELS];
+    peaks_bucket_of(bucket, min, max, squares, channels, peak_bucket_frames[0]);
+    return memcmp(bucket, pyramid->buckets[0] + index * channels, channels * sizeof(PeakBucket)) == 0;
+}
+
+// Read FILE.peaks into pyramid; header->version is 0 when there is none to use
+static void peaks_load(PeakPyramid *pyramid, const char *path, PeakCacheHeader *header) {
+    *header = (PeakCacheHeader){0};
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return;
+    }
+    struct stat st;
+    uint64_t expected = sizeof(*header);
+    int valid = fstat(fileno(file), &st) == 0 && fread(header, sizeof(*header), 1, file) == 1 &&
+                memcmp(header->magic, "APPK", 4) == 0 && header->version == PEAK_CACHE_VERSION &&
+                header->channels == pyramid->channels;
+    for (int l = 0; valid && l < PEAK_LEVELS; l++) {
+        pyramid->count[l] = peaks_count_for(header->frames, l);
+        expected += pyramid->count[l] * header->channels * sizeof(PeakBucket);
+    }
+    valid = valid && expected == (uint64_t)st.st_size;
+    for (int l = 0; valid && l < PEAK_LEVELS; l++) {
+        uint64_t count = pyramid->count[l];
+        valid = peaks_reserve(pyramid, l, count) == 0 &&
+                fread(pyramid->buckets[l], sizeof(PeakBucket) * pyramid->channels, (size_t)count, file) == count;
+    }
+    fclose(file);
+    if (!valid) {
+        header->version = 0;
+        pyramid->frames = 0;
+        memset(pyramid->count, 0, sizeof(pyramid->count));
+        return;
+    }
+    pyramid->frames = header->frames;
+}
 
-    // Validate device format
-    if (device_asbd.mFormatID != kAudioFormatLinearPCM) {
-        printf("Error: Device format is not linear PCM\n");
-        AudioUnitUninitialize(audioUnit);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
+static int peaks_save(const PeakPyramid *pyramid, const char *path, const PeakCacheHeader *header) {
+    FILE *file = fopen(path, "wb");
+    int err = file == NULL || fwrite(header, sizeof(*header), 1, file) != 1;
+    for (int l = 0; !err && l < PEAK_LEVELS; l++) {
+        err = fwrite(pyramid->buckets[l], sizeof(PeakBucket) * pyramid->channels, (size_t)pyramid->count[l],
+                     file) != pyramid->count[l];
+    }
+    if (file) {
+        err |= fclose(file) != 0;
+    }
+    return err;
+}
+
+// The overview at a width of columns: for each column the largest magnitude of any
+// channel as a character on a dB scale, from the coarsest level with a bucket for
+// every column
+static void peaks_view(const PeakPyramid *pyramid, uint32_t columns, char *line) {
+    static const char shades[] = " .:-=+*#%@";
+    int level = PEAK_LEVELS - 1;
+    while (level > 0 && pyramid->count[level] < columns) {
+        level--;
+    }
+    uint64_t count = pyramid->count[level];
+    for (uint32_t x = 0; x < columns; x++) {
+        uint64_t first = x * count / columns, last = (x + 1) * count / columns;
+        last = last > first ? last : first + 1;
+        int peak = 0;
+        for (uint64_t b = first; b < last && b < count; b++) {
+            for (uint32_t c = 0; c < pyramid->channels; c++) {
+                const PeakBucket *bucket = &pyramid->buckets[level][b * pyramid->channels + c];
+                peak = -bucket->min > peak ? -bucket->min : peak;
+                peak = bucket->max > peak ? bucket->max : peak;
+            }
+        }
+        // 6 dB a step, from -54 dBFS
+        double db = peak > 0 ? 20.0 * log10(peak / 32767.0) : -HUGE_VAL;
+        int shade = db > -60.0 ? (int)((db + 60.0) / 6.0) : 0;
+        line[x] = count ? shades[shade < 9 ? shade : 9] : ' ';
+    }
+    line[columns] = '\0';
+}
+
+// Bring the pyramid for an opened track up to date, from FILE.peaks where it can be
+static int peaks_update(PeakPyramid *pyramid, Track *track, const char *cache_path, const char **how) {
+    struct stat st;
+    if (stat(track->filename, &st) != 0) {
+        printf("Error: Cannot stat file %s\n", track->filename);
         return 1;
     }
-    if (!(device_asbd.mFormatFlags & kAudioFormatFlagIsFloat) &&
-        !(device_asbd.mFormatFlags & kAudioFormatFlagIsSignedInteger)) {
-        printf("Error: Device format must be float or signed integer\n");
-        AudioUnitUninitialize(audioUnit);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
+    PeakCacheHeader cached;
+    PeakCacheHeader header = { .magic = "APPK", .version = PEAK_CACHE_VERSION, .file_size = (uint64_t)st.st_size,
+                               .mtime_ns = stat_mtime_ns(&st), .data_offset = track->data_offset,
+                               .sample_rate = track->sample_rate, .channels = track->num_channels,
+                               .bits_per_sample = track->bits_per_sample, .is_float = track->is_float };
+    uint64_t frames = track->data_size / track->block_align;
+    peaks_load(pyramid, cache_path, &cached);
+    int same_format = cached.version && cached.data_offset == header.data_offset &&
+                      cached.sample_rate == header.sample_rate && cached.bits_per_sample == header.bits_per_sample &&
+                      cached.is_float == header.is_float;
+    uint64_t from = 0;
+    *how = "computed";
+    if (same_format && cached.file_size == header.file_size && cached.mtime_ns == header.mtime_ns &&
+        cached.frames == frames) {
+        *how = "loaded";
+        return 0;
+    }
+    if (same_format && !track->flac && cached.file_size < header.file_size && cached.frames <= frames) {
+        // Grown: keep the whole coarse buckets if the audio before them is unchanged
+        from = cached.frames / peak_bucket_frames[PEAK_LEVELS - 1] * peak_bucket_frames[PEAK_LEVELS - 1];
+        if (from > 0 && peaks_bucket_matches(pyramid, track, from)) {
+            *how = "extended";
+        } else {
+            from = 0;
+        }
+    }
+    if (peaks_scan(pyramid, track, from) != 0) {
         return 1;
     }
-    if (device_asbd.mBitsPerChannel != 16 && device_asbd.mBitsPerChannel != 24 && device_asbd.mBitsPerChannel != 32) {
-        printf("Error: Unsupported device bit depth %u\n", device_asbd.mBitsPerChannel);
-        AudioUnitUninitialize(audioUnit);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
+    header.frames = pyramid->frames;
+    if (peaks_save(pyramid, cache_path, &header) != 0) {
+        printf("Warning: Cannot write %s\n", cache_path);
+    }
+    return 0;
+}
+
+// Map whatever has been appended to a growing WAV file since it was mapped, up to
+// the declared end of its data chunk; 1 when there is nothing new
+static int peaks_remap(Track *track) {
+    uint64_t declared = UINT64_MAX;
+    for (uint32_t i = 0; i < track->chunk_count; i++) {
+        if (strncmp(track->chunks[i].id, "data", 4) == 0) {
+            // Recorders leave 0 or 0xFFFFFFFF in the header until they finish
+            uint64_t size = track->chunks[i].size;
+            declared = size == 0 || size == UINT32_MAX ? UINT64_MAX : size;
+            break;
+        }
+    }
+    int fd = open(track->filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size <= track->mapped_size) {
+        if (fd >= 0) {
+            close(fd);
+        }
         return 1;
     }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return 1;
+    }
+    munmap(track->mapped_base, track->mapped_size);
+    track->mapped_base = base;
+    track->mapped_size = (size_t)st.st_size;
+    track->audio_data = track->mapped_base + track->data_offset;
+    uint64_t present = (uint64_t)st.st_size - track->data_offset;
+    present = present < declared ? present : declared;
+    track->data_size = present / track->block_align * track->block_align;
+    track->duration = (float)track->data_size / track->block_align / track->sample_rate;
+    return 0;
+}
 
-    // Set stream format to match device
-    AudioStreamBasicDescription asbd = {
-        .mSampleRate = device_asbd.mSampleRate,
-        .mFormatID = kAudioFormatLinearPCM,
-        .mFormatFlags = device_asbd.mFormatFlags,
-        .mBitsPerChannel = device_asbd.mBitsPerChannel,
-        .mChannelsPerFrame = device_asbd.mChannelsPerFrame,
-        .mFramesPerPacket = 1,
-        .mBytesPerFrame = device_asbd.mChannelsPerFrame * (device_asbd.mBitsPerChannel / 8),
-        .mBytesPerPacket = device_asbd.mChannelsPerFrame * (device_asbd.mBitsPerChannel / 8)
-    };
-    if (state->num_channels > device_asbd.mChannelsPerFrame) {
-        printf("Warning: WAV has %u channels, downmixing to %u channels\n",
-               state->num_channels, device_asbd.mChannelsPerFrame);
+static void peaks_print(const PeakPyramid *pyramid, const Track *track, const char *how, double ms) {
+    char line[PEAK_COLUMNS + 1];
+    peaks_view(pyramid, PEAK_COLUMNS, line);
+    printf("Peaks: %s: %.2f s, %llu/%llu/%llu buckets of %u/%u/%u frames, %s in %.1f ms\n", track->filename,
+           (double)pyramid->frames / track->sample_rate, (unsigned long long)pyramid->count[0],
+           (unsigned long long)pyramid->count[1], (unsigned long long)pyramid->count[2], peak_bucket_frames[0],
+           peak_bucket_frames[1], peak_bucket_frames[2], how, ms);
+    printf("  |%s|\n", line);
+}
+
+// Build or refresh FILE.peaks for every playlist entry. With follow set, keep
+// extending the one file while it grows, until it has not for that many seconds
+static int run_peaks(const Playlist *playlist, double follow) {
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < playlist->count; i++) {
+        const char *path = playlist->files[i];
+        Track track = { .filename = path };
+        int err = is_flac_file(path) ? open_flac_file(path, &track) : map_wav_file(path, &track);
+        track.filename = path;
+        if (!err && (track.num_channels == 0 || track.num_channels > MIX_MAX_CHANNELS ||
+                     sample_format_of(track.bits_per_sample, track.is_float) < 0)) {
+            printf("Error: %s: Cannot read %u channels of %u-bit audio\n", path, track.num_channels,
+                   track.bits_per_sample);
+            err = 1;
+        }
+        size_t size = strlen(path) + sizeof(".peaks");
+        char *cache_path = err ? NULL : malloc(size);
+        if (!err && !cache_path) {
+            printf("Error: Memory allocation failed\n");
+            err = 1;
+        }
+        PeakPyramid pyramid = { .channels = track.num_channels };
+        if (!err) {
+            snprintf(cache_path, size, "%s.peaks", path);
+            const char *how;
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            err = peaks_update(&pyramid, &track, cache_path, &how);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (!err) {
+                peaks_print(&pyramid, &track, how, elapsed_ns(&start, &end) / 1e6);
+            }
+        }
+        // Poll for growth; a pass only rescans from the last whole coarse bucket
+        double idle = 0.0;
+        while (!err && follow > 0 && !track.flac && idle < follow) {
+            struct timespec pause = { 0, 250000000 };
+            nanosleep(&pause, NULL);
+            idle += 0.25;
+            if (peaks_remap(&track) != 0 || track.data_size / track.block_align == pyramid.frames) {
+                continue;
+            }
+            idle = 0.0;
+            const char *how;
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            err = peaks_update(&pyramid, &track, cache_path, &how);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (!err) {
+                peaks_print(&pyramid, &track, how, elapsed_ns(&start, &end) / 1e6);
+            }
+        }
+        peaks_free(&pyramid);
+        free(cache_path);
+        track_close(&track);
+        failed += err != 0;
     }
-    state->output_channels = asbd.mChannelsPerFrame;
-    state->output_bits_per_channel = asbd.mBitsPerChannel;
-    state->output_is_float = (asbd.mFormatFlags & kAudioFormatFlagIsFloat) ? 1 : 0;
-    printf("ASBD: sample_rate=%.0f, channels=%u, bits=%u, bytes_per_frame=%u, format=%s\n",
-           asbd.mSampleRate, asbd.mChannelsPerFrame, asbd.mBitsPerChannel, asbd.mBytesPerFrame,
-           state->output_is_float ? "float" : "signed integer");
+    return failed != 0;
+}
 
-    err = AudioUnitSetProperty(audioUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Output, 0, &asbd, sizeof(asbd));
-    if (err != noErr) {
-        printf("Error: Failed to set output stream format (%d)\n", err);
-        AudioUnitUninitialize(audioUnit);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
-        return 1;
+// Benchmark: time the producer's conversion stage (decode, mix, resample, encode)
+// on synthetic signals, with every kernel set this CPU can run
+#define BENCH_SECONDS 1 // Length of each generated input
+#define BENCH_REPEATS 5 // Each case reports its best run
+
+typedef enum {
+    SIGNAL_SINE,
+    SIGNAL_NOISE,
+    SIGNAL_SILENCE,
+    SIGNAL_COUNT
+} BenchSignal;
+
+static const char *const bench_signal_names[SIGNAL_COUNT] = { "sine", "noise", "silence" };
+
+typedef struct {
+    SampleFormat in_format;
+    SampleFormat out_format;
+    uint16_t in_channels;
+    uint16_t out_channels;
+    uint32_t in_rate;
+    uint32_t out_rate;
+    BenchSignal signal;
+    ResampleQuality quality;
+} BenchCase;
+
+// Generate frames of a test signal, packed in the given sample format
+static uint8_t *bench_signal(const BenchCase *bc, uint32_t frames) {
+    size_t samples = (size_t)frames * bc->in_channels;
+    float *values = malloc(samples * sizeof(float));
+    uint8_t *packed = malloc(samples * sample_format_bytes[bc->in_format]);
+    if (!values || !packed) {
+        free(values);
+        free(packed);
+        return NULL;
     }
-    err = AudioUnitSetProperty(audioUnit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &asbd, sizeof(asbd));
-    if (err != noErr) {
-        printf("Error: Failed to set input stream format (%d)\n", err);
-        AudioUnitUninitialize(audioUnit);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < samples; i++) {
+        uint32_t frame = (uint32_t)(i / bc->in_channels);
+        uint32_t channel = (uint32_t)(i % bc->in_channels);
+        switch (bc->signal) {
+        case SIGNAL_SINE:
+            values[i] = 0.9f * sinf(2.0f * (float)M_PI * 997.0f * frame / bc->in_rate + channel * 0.5f);
+            break;
+        case SIGNAL_NOISE:
+            seed = seed * 1664525u + 1013904223u;
+            values[i] = 0.9f * ((float)(int32_t)seed / 2147483648.0f);
+            break;
+        default:
+            values[i] = 0.0f;
+            break;
+        }
+    }
+    if (bc->in_format == SAMPLE_U8) {
+        for (size_t i = 0; i < samples; i++) {
+            packed[i] = (uint8_t)(128 + (int)lrintf(values[i] * 127.0f));
+        }
+    } else {
+        pcm_kernels_scalar.encode[bc->in_format](values, packed, samples);
+    }
+    free(values);
+    return packed;
+}
+
+// Convert the whole input with the current kernels, best of BENCH_REPEATS;
+// returns the output frame count (0 on failure) and the time per output frame.
+// With flac set the input is decoded from it instead of read from input
+static uint32_t bench_run(const BenchCase *bc, const uint8_t *input, uint32_t in_frames, FlacFile *flac,
+                          uint8_t *output, double *ns_per_frame) {
+    PlaybackState state = { 0 };
+    Track *track = &state.track;
+    track->audio_data = (uint8_t *)input;
+    track->flac = flac;
+    track->data_size = in_frames * bc->in_channels * sample_format_bytes[bc->in_format];
+    track->sample_rate = bc->in_rate;
+    track->num_channels = bc->in_channels;
+    track->bits_per_sample = bc->in_format == SAMPLE_U8 ? 8 : sample_format_bytes[bc->in_format] * 8;
+    track->is_float = bc->in_format == SAMPLE_F32;
+    state.output_channels = bc->out_channels;
+    state.output_bits_per_channel = sample_format_bytes[bc->out_format] * 8;
+    state.output_is_float = bc->out_format == SAMPLE_F32;
+    state.output_sample_rate = bc->out_rate;
+    state.resample_quality = bc->quality;
+    uint32_t out_frame_size = bc->out_channels * sample_format_bytes[bc->out_format];
+
+    double best = 0.0;
+    uint32_t total = 0;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        track->offset = 0;
+        if ((flac && flac_seek(flac, 0) != 0) || (bc->in_rate != bc->out_rate && resampler_init(&state) != 0) ||
+            converter_init(&track->converter, track, &state) != 0) {
+            return 0;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint32_t frames;
+        total = 0;
+        while ((frames = produce_frames(&state, output + (size_t)total * out_frame_size, PRODUCER_CHUNK_FRAMES)) > 0) {
+            total += frames;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        resampler_free(state.resampler);
+        state.resampler = NULL;
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (repeat == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    *ns_per_frame = total > 0 ? best * 1e9 / total : 0.0;
+    return total;
+}
+
+// Run one case with every kernel set and print a row; returns 1 if a vector set's
+// output differs from scalar (bit for bit, or beyond rounding when resampling)
+static int bench_case(const BenchCase *bc, const PcmKernels *const *sets) {
+    uint32_t in_frames = bc->in_rate * BENCH_SECONDS;
+    uint64_t max_out = (uint64_t)in_frames * bc->out_rate / bc->in_rate + PRODUCER_CHUNK_FRAMES;
+    size_t out_bytes = (size_t)max_out * bc->out_channels * sample_format_bytes[bc->out_format];
+    uint8_t *input = bench_signal(bc, in_frames);
+    uint8_t *reference = malloc(out_bytes);
+    uint8_t *output = malloc(out_bytes);
+    if (!input || !reference || !output) {
+        printf("Error: Memory allocation failed\n");
+        free(input);
+        free(reference);
+        free(output);
         return 1;
     }
 
-    // Set callback
-    AURenderCallbackStruct callback = { .inputProc = audioCallback, .inputProcRefCon = state };
-    err = AudioUnitSetProperty(audioUnit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &callback, sizeof(callback));
-    if (err != noErr) {
-        printf("Error: Failed to set render callback (%d)\n", err);
-        AudioUnitUninitialize(audioUnit);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
+    printf("%-4s %-4s %2u->%-2u %6u->%-6u %-7s %-6s", sample_format_names[bc->in_format],
+           sample_format_names[bc->out_format], bc->in_channels, bc->out_channels, bc->in_rate, bc->out_rate,
+           bench_signal_names[bc->signal], bc->in_rate != bc->out_rate ? resample_quality_names[bc->quality] : "-");
+    const PcmKernels *saved = pcm_kernels;
+    double scalar_ns = 0.0, best_ns = 0.0;
+    uint32_t reference_frames = 0;
+    int mismatch = 0;
+    for (int s = 0; sets[s]; s++) {
+        pcm_kernels = sets[s];
+        double ns = 0.0;
+        uint32_t frames = bench_run(bc, input, in_frames, NULL, s == 0 ? reference : output, &ns);
+        printf(" %8.2f", ns);
+        if (s == 0) {
+            reference_frames = frames;
+            scalar_ns = best_ns = ns;
+            continue;
+        }
+        best_ns = ns < best_ns ? ns : best_ns;
+        if (frames != reference_frames) {
+            mismatch = 1;
+        } else if (bc->in_rate == bc->out_rate) {
+            mismatch |= memcmp(reference, output, (size_t)frames * bc->out_channels *
+                                                      sample_format_bytes[bc->out_format]) != 0;
+        } else {
+            // Vector inner products round differently; allow a few float ulps (-120 dBFS)
+            const float *a = (const float *)reference, *b = (const float *)output;
+            for (size_t i = 0; i < (size_t)frames * bc->out_channels; i++) {
+                mismatch |= fabsf(a[i] - b[i]) > 1e-6f;
+            }
+        }
+    }
+    pcm_kernels = saved;
+    printf(" %8.1f %5.1fx %s\n", best_ns > 0 ? 1e3 / best_ns : 0.0, best_ns > 0 ? scalar_ns / best_ns : 0.0,
+           mismatch ? "MISMATCH" : "ok");
+    free(input);
+    free(reference);
+    free(output);
+    return mismatch;
+}
+
+// FLAC decode benchmark: synthetic signals are encoded with a small fixed-predictor
+// encoder, then decoded and converted next to the same PCM read as WAV, and decoded
+// frame-parallel on one thread and on every core
+#define FLAC_BENCH_SECONDS 30 // Long enough to give every core a share of frames
+#define FLAC_BENCH_BLOCK 4096
+
+typedef struct {
+    uint8_t *data;
+    size_t pos;
+    uint64_t cache; // Pending bits in the low count bits
+    uint32_t count;
+} BenchBits;
+
+static void bench_put(BenchBits *b, uint32_t value, uint32_t n) {
+    b->cache = (b->cache << n) | ((uint64_t)value & ((1ull << n) - 1));
+    b->count += n;
+    while (b->count >= 8) {
+        b->count -= 8;
+        b->data[b->pos++] = (uint8_t)(b->cache >> b->count);
+    }
+}
+
+// Fixed predictor residual of sample i, folded to unsigned as Rice coding wants it
+static inline uint32_t bench_residual(const int32_t *s, uint32_t channels, uint32_t order, uint32_t i) {
+    int32_t r = s[(size_t)i * channels];
+    if (order == 2) {
+        r += s[(size_t)(i - 2) * channels] - 2 * s[(size_t)(i - 1) * channels];
+    } else if (order == 1) {
+        r -= s[(size_t)(i - 1) * channels];
+    }
+    return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+// Encode one frame of n interleaved samples per channel at out, returning its size.
+// Each channel is a constant, verbatim or fixed order-2 subframe with one Rice
+// partition, much like a reference encoder at its fastest setting
+static size_t bench_flac_frame(const int32_t *samples, uint32_t channels, uint32_t bits, uint32_t n,
+                               uint32_t number, uint8_t *out) {
+    BenchBits b = { .data = out };
+    bench_put(&b, 0xFFF8, 16);
+    bench_put(&b, n == FLAC_BENCH_BLOCK ? 12 : 7, 4); // 256 << 4, or 16 bits at the end
+    bench_put(&b, 0, 4); // Sample rate from STREAMINFO
+    bench_put(&b, channels - 1, 4);
+    bench_put(&b, bits == 16 ? 4 : 6, 3);
+    bench_put(&b, 0, 1);
+    if (number < 0x80) {
+        bench_put(&b, number, 8);
+    } else if (number < 0x800) {
+        bench_put(&b, 0xC0 | number >> 6, 8);
+        bench_put(&b, 0x80 | (number & 0x3F), 8);
+    } else {
+        bench_put(&b, 0xE0 | number >> 12, 8);
+        bench_put(&b, 0x80 | ((number >> 6) & 0x3F), 8);
+        bench_put(&b, 0x80 | (number & 0x3F), 8);
+    }
+    if (n != FLAC_BENCH_BLOCK) {
+        bench_put(&b, n - 1, 16);
+    }
+    uint8_t crc8 = 0;
+    for (size_t i = 0; i < b.pos; i++) {
+        crc8 ^= out[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc8 = (uint8_t)((crc8 << 1) ^ (crc8 & 0x80 ? 0x07 : 0));
+        }
+    }
+    bench_put(&b, crc8, 8);
+
+    uint32_t order = n < 2 ? n : 2;
+    for (uint32_t ch = 0; ch < channels; ch++) {
+        const int32_t *s = samples + ch;
+        // Rice parameter near the mean residual, but large enough to keep quotients short
+        uint64_t sum = 0, size = 0;
+        uint32_t max = 0, k = 0;
+        int constant = 1;
+        for (uint32_t i = order; i < n; i++) {
+            uint32_t u = bench_residual(s, channels, order, i);
+            sum += u;
+            max = u > max ? u : max;
+        }
+        for (uint32_t i = 1; i < n && constant; i++) {
+            constant = s[(size_t)i * channels] == s[0];
+        }
+        uint64_t mean = sum / (n - order + (n == order));
+        while (k < 30 && ((1ull << (k + 1)) <= mean || (max >> k) > 32)) {
+            k++;
+        }
+        for (uint32_t i = order; i < n; i++) {
+            size += 1 + k + (bench_residual(s, channels, order, i) >> k);
+        }
+
+        // Constant, verbatim or fixed predictor, whichever is smallest; zero pad bit
+        // and type, then no wasted bits
+        if (constant) {
+            bench_put(&b, 0, 8);
+            bench_put(&b, (uint32_t)s[0], bits);
+            continue;
+        }
+        if (order * bits + 11 + size >= (uint64_t)n * bits) {
+            bench_put(&b, 1 << 1, 8);
+            for (uint32_t i = 0; i < n; i++) {
+                bench_put(&b, (uint32_t)s[(size_t)i * channels], bits);
+            }
+            continue;
+        }
+        bench_put(&b, (8 + order) << 1, 8);
+        for (uint32_t i = 0; i < order; i++) {
+            bench_put(&b, (uint32_t)s[(size_t)i * channels], bits);
+        }
+        bench_put(&b, 1, 2); // 5-bit Rice parameters
+        bench_put(&b, 0, 4); // Partition order 0
+        bench_put(&b, k, 5);
+        for (uint32_t i = order; i < n; i++) {
+            uint32_t u = bench_residual(s, channels, order, i);
+            for (uint32_t q = u >> k; q > 0; q -= q < 32 ? q : 32) {
+                bench_put(&b, 0, q < 32 ? q : 32);
+            }
+            bench_put(&b, 1, 1);
+            bench_put(&b, u, k);
+        }
+    }
+    if (b.count) {
+        bench_put(&b, 0, 8 - b.count);
+    }
+    pthread_once(&flac_crc16_once, flac_crc16_init);
+    uint16_t crc = 0;
+    for (size_t i = 0; i < b.pos; i++) {
+        crc = (uint16_t)(crc << 8) ^ flac_crc16_table[(crc >> 8) ^ out[i]];
+    }
+    bench_put(&b, crc, 16);
+    return b.pos;
+}
+
+// Encode frames of packed s16 or s24 input into a FLAC stream in an anonymous
+// mapping, opened for decoding as if it had been read from a file
+static FlacFile *bench_flac_encode(const BenchCase *bc, const uint8_t *input, uint32_t frames) {
+    uint32_t channels = bc->in_channels;
+    uint32_t bytes = sample_format_bytes[bc->in_format];
+    size_t samples = (size_t)frames * channels;
+    int32_t *values = malloc(samples * sizeof(int32_t));
+    size_t capacity = 42 + samples * 8 + (frames / FLAC_BENCH_BLOCK + 1) * 32; // Past any frame this encoder makes
+    uint8_t *stream = malloc(capacity);
+    FlacFile *flac = calloc(1, sizeof(FlacFile));
+    if (!values || !stream || !flac) {
+        free(values);
+        free(stream);
+        free(flac);
+        return NULL;
+    }
+    for (size_t i = 0; i < samples; i++) {
+        const uint8_t *p = input + i * bytes;
+        values[i] = bytes == 2 ? (int16_t)(p[0] | p[1] << 8) : (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+                                                                         (uint32_t)p[2] << 24) >> 8;
+    }
+
+    uint32_t bits = bytes * 8;
+    uint64_t packed = (uint64_t)bc->in_rate << 44 | (uint64_t)(channels - 1) << 41 | (uint64_t)(bits - 1) << 36 |
+                      frames;
+    memcpy(stream, "fLaC\x80\x00\x00\x22", 8); // One metadata block, the last: STREAMINFO
+    memset(stream + 8, 0, 34);
+    for (int i = 0; i < 2; i++) {
+        stream[8 + i * 2] = FLAC_BENCH_BLOCK >> 8; // Minimum and maximum block size
+        stream[9 + i * 2] = FLAC_BENCH_BLOCK & 0xFF;
+    }
+    for (int i = 0; i < 8; i++) {
+        stream[18 + i] = (uint8_t)(packed >> (56 - i * 8));
+    }
+    size_t size = 42;
+    for (uint32_t first = 0, number = 0; first < frames; first += FLAC_BENCH_BLOCK, number++) {
+        uint32_t n = frames - first < FLAC_BENCH_BLOCK ? frames - first : FLAC_BENCH_BLOCK;
+        size += bench_flac_frame(values + (size_t)first * channels, channels, bits, n, number, stream + size);
+    }
+    free(values);
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        free(stream);
+        free(flac);
+        return NULL;
+    }
+    memcpy(base, stream, size);
+    free(stream);
+    flac->base = base;
+    flac->size = size;
+    if (flac_parse(flac, 0) != 0) {
+        flac_close(flac);
+        return NULL;
+    }
+    return flac;
+}
+
+// Time frame-parallel decoding of the whole stream on threads threads, best of
+// BENCH_REPEATS; returns 1 on failure or if the output differs from expected
+static int bench_flac_parallel(FlacFile *flac, uint32_t threads, const uint8_t *expected, uint8_t *output,
+                               double *ns_per_frame) {
+    double best = 0.0;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (flac_decode_parallel(flac, output, threads) != 0) {
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = elapsed_ns(&start, &end) / 1e9;
+        best = repeat == 0 || elapsed < best ? elapsed : best;
+    }
+    *ns_per_frame = best * 1e9 / flac->total_samples;
+    return memcmp(output, expected, flac->total_samples * flac->channels * flac->container_bytes) != 0;
+}
+
+// Run one FLAC case and print a row; returns 1 if decoding does not reproduce the input
+static int bench_flac_case(const BenchCase *bc, uint32_t threads) {
+    uint32_t in_frames = bc->in_rate * FLAC_BENCH_SECONDS;
+    size_t in_bytes = (size_t)in_frames * bc->in_channels * sample_format_bytes[bc->in_format];
+    size_t out_bytes = ((size_t)in_frames + PRODUCER_CHUNK_FRAMES) * bc->out_channels *
+                       sample_format_bytes[bc->out_format];
+    uint8_t *input = bench_signal(bc, in_frames);
+    FlacFile *flac = input ? bench_flac_encode(bc, input, in_frames) : NULL;
+    uint8_t *reference = malloc(out_bytes);
+    uint8_t *output = malloc(out_bytes > in_bytes ? out_bytes : in_bytes);
+    if (!input || !flac || !reference || !output) {
+        printf("Error: Memory allocation failed\n");
+        free(input);
+        if (flac) {
+            flac_close(flac);
+        }
+        free(reference);
+        free(output);
         return 1;
     }
 
-    // Start playback
-    printf("Playing audio...\n");
-    err = AudioOutputUnitStart(audioUnit);
-    if (err != noErr) {
-        printf("Error: Failed to start audio unit (%d)\n", err);
-        AudioUnitUninitialize(audioUnit);
-        AudioComponentInstanceDispose(audioUnit);
-        free(state->audio_data);
+    printf("%-4s %2u %-7s %6.1f%%", sample_format_names[bc->in_format], bc->in_channels,
+           bench_signal_names[bc->signal], 100.0 * flac->size / in_bytes);
+    // Playback path: sequential decode then conversion, against converting the PCM directly
+    double wav_ns = 0.0, flac_ns = 0.0, one_ns = 0.0, all_ns = 0.0;
+    uint32_t wav_frames = bench_run(bc, input, in_frames, NULL, reference, &wav_ns);
+    uint32_t flac_frames = bench_run(bc, NULL, in_frames, flac, output, &flac_ns);
+    int mismatch = wav_frames != in_frames || flac_frames != wav_frames ||
+                   memcmp(reference, output, (size_t)wav_frames * bc->out_channels *
+                                                 sample_format_bytes[bc->out_format]) != 0;
+    // Offline path: decode only, frame-parallel
+    mismatch |= bench_flac_parallel(flac, 1, input, output, &one_ns);
+    mismatch |= bench_flac_parallel(flac, threads, input, output, &all_ns);
+    printf(" %8.2f %8.2f %8.1f %8.1f %6.1fx %s\n", wav_ns, flac_ns, one_ns > 0 ? 1e3 / one_ns : 0.0,
+           all_ns > 0 ? 1e3 / all_ns : 0.0, all_ns > 0 ? one_ns / all_ns : 0.0, mismatch ? "MISMATCH" : "ok");
+    free(input);
+    flac_close(flac);
+    free(reference);
+    free(output);
+    return mismatch;
+}
+
+static int run_flac_benchmark(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = cores > 0 ? (uint32_t)cores : 1;
+    BenchCase cases[8];
+    int count = 0;
+    for (int signal = 0; signal < SIGNAL_COUNT; signal++) {
+        cases[count++] = (BenchCase){ SAMPLE_S16, SAMPLE_F32, 2, 2, 48000, 48000, signal, RESAMPLE_MEDIUM };
+        cases[count++] = (BenchCase){ SAMPLE_S24, SAMPLE_F32, 2, 2, 48000, 48000, signal, RESAMPLE_MEDIUM };
+    }
+    cases[count++] = (BenchCase){ SAMPLE_S16, SAMPLE_F32, 6, 6, 48000, 48000, SIGNAL_SINE, RESAMPLE_MEDIUM };
+
+    printf("\nFLAC decode benchmark: best of %d over %d s of audio, %s kernels, %u threads\n", BENCH_REPEATS,
+           FLAC_BENCH_SECONDS, pcm_kernels->name, threads);
+    printf("  wav, flac: ns per frame to f32 through the playback path; 1 thread, all: decode Mframe/s\n");
+    printf("%-4s %2s %-7s %7s %8s %8s %8s %8s %7s %s\n", "in", "ch", "signal", "size", "wav", "flac", "1 thread",
+           "all", "speed", "check");
+    int mismatches = 0;
+    for (int c = 0; c < count; c++) {
+        mismatches += bench_flac_case(&cases[c], threads);
+    }
+    if (mismatches > 0) {
+        printf("%d cases where FLAC decoding does not reproduce the input\n", mismatches);
+    }
+    return mismatches;
+}
+
+// Effects benchmark: a 10-band stereo EQ and the limiter at 96 kHz, as share of one
+// core, for each kernel set against the scalar output
+#define EFFECTS_BENCH_SECONDS 10
+
+static int run_effects_benchmark(const PcmKernels *const *sets) {
+    static const double centres[10] = { 31, 62, 125, 250, 500, 1000, 2000, 4000, 8000, 16000 };
+    EffectsConfig config = { .gain_db = 3.0, .bands = 10, .limiter = 1, .ceiling_db = -1.0,
+                             .lookahead_ms = 5.0, .release_ms = 50.0 };
+    for (uint32_t b = 0; b < config.bands; b++) {
+        config.eq[b].type = b == 0 ? EQ_LOWSHELF : b == 9 ? EQ_HIGHSHELF : EQ_PEAK;
+        config.eq[b].hz = centres[b];
+        config.eq[b].db = b % 2 ? -4.0 : 5.0;
+        config.eq[b].q = 1.4;
+    }
+    BenchCase bc = { SAMPLE_F32, SAMPLE_F32, 2, 2, 96000, 96000, SIGNAL_NOISE, RESAMPLE_MEDIUM };
+    uint32_t frames = bc.in_rate * EFFECTS_BENCH_SECONDS;
+    size_t samples = (size_t)frames * bc.in_channels;
+    float *input = (float *)bench_signal(&bc, frames);
+    float *reference = malloc(samples * sizeof(float));
+    float *output = malloc(samples * sizeof(float));
+    if (!input || !reference || !output) {
+        printf("Error: Memory allocation failed\n");
+        free(input);
+        free(reference);
+        free(output);
         return 1;
     }
 
-    // Wait for playback to finish
-    printf("Expected duration: %.2f seconds\n", duration);
-    while (state->offset < state->data_size) {
-        usleep(100000); // Sleep 100ms
+    printf("\nEffects benchmark: gain, %u-band EQ and limiter, %u channels at %u Hz, best of %d over %d s\n",
+           config.bands, bc.out_channels, bc.out_rate, BENCH_REPEATS, EFFECTS_BENCH_SECONDS);
+    printf("%-6s %8s %8s %s\n", "kernel", "ns/frame", "% core", "check");
+    const PcmKernels *saved = pcm_kernels;
+    int mismatches = 0;
+    for (int s = 0; sets[s]; s++) {
+        pcm_kernels = sets[s];
+        PlaybackState state = { 0 };
+        state.output_channels = bc.out_channels;
+        state.output_bits_per_channel = 32;
+        state.output_is_float = 1;
+        state.output_sample_rate = bc.out_rate;
+        state.effects_config = &config;
+        if (effects_init(&state) != 0) {
+            break;
+        }
+        EffectChain *fx = state.effects;
+        float *dst = s == 0 ? reference : output;
+        double best = 0.0;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            effects_reset(fx);
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            size_t done = 0, out = 0;
+            for (;;) {
+                uint32_t count = frames - done < PRODUCER_CHUNK_FRAMES ? (uint32_t)(frames - done)
+                                                                        : PRODUCER_CHUNK_FRAMES;
+                uint32_t ready;
+                if (count > 0) {
+                    memcpy(fx->block, input + done * bc.in_channels, (size_t)count * bc.in_channels * sizeof(float));
+                    ready = effects_process(fx, count);
+                    done += count;
+                } else if ((ready = effects_drain(fx, PRODUCER_CHUNK_FRAMES)) == 0) {
+                    break;
+                }
+                memcpy(dst + out * bc.out_channels, fx->block, (size_t)ready * bc.out_channels * sizeof(float));
+                out += ready;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            best = repeat == 0 || elapsed < best ? elapsed : best;
+        }
+        effects_free(fx);
+        // Recursive filters carry rounding differences along, so allow -100 dBFS
+        int mismatch = 0;
+        for (size_t i = 0; s > 0 && i < samples; i++) {
+            mismatch |= !(fabsf(output[i] - reference[i]) <= 1e-5f);
+        }
+        printf("%-6s %8.2f %7.2f%% %s\n", sets[s]->name, best * 1e9 / frames, best * 100.0 / EFFECTS_BENCH_SECONDS,
+               s == 0 ? "-" : mismatch ? "MISMATCH" : "ok");
+        mismatches += mismatch;
     }
-    printf("Playback finished\n");
+    pcm_kernels = saved;
+    free(input);
+    free(reference);
+    free(output);
+    return mismatches;
+}
 
-    // Cleanup
-    AudioOutputUnitStop(audioUnit);
-    AudioUnitUninitialize(audioUnit);
-    AudioComponentInstanceDispose(audioUnit);
-    free(state->audio_data);
-    return 0;
-
-#elif defined(_WIN32)
-    // TODO: Implement Windows audio playback using DirectSound or WASAPI
-    // Steps:
-    // 1. Query device format (e.g., WASAPI: GetMixFormat for sample rate, bits per channel, channels).
-    // 2. Initialize device with queried format (e.g., 16-bit integer, 44.1 kHz, stereo).
-    // 3. Create a buffer for audio data.
-    // 4. Convert state->audio_data to device format (any bit depth, channel count).
-    // 5. Play the buffer and wait for completion.
-    // 6. Clean up resources.
-    printf("Error: Windows playback not implemented yet\n");
-    free(state->audio_data);
-    return 1;
+// Mixer benchmark: MIXER_MAX_VOICES voices from staggered positions in one signal,
+// summed into a stereo float bus in device-sized buffers; reports how many voices
+// one core keeps up with at 48 kHz, for each kernel set against the scalar bus
+#define MIXER_BENCH_BUFFER 512
 
-#elif defined(__linux__)
-    // TODO: Implement Linux audio playback using ALSA or PulseAudio
-    // Steps:
-    // 1. Query device format (e.g., ALSA: snd_pcm_hw_params_get_format, PulseAudio: pa_get_sample_spec).
-    // 2. Open device with queried format (e.g., 24-bit integer, 48 kHz, 2 channels).
-    // 3. Configure playback parameters (sample rate, channels, bit depth).
-    // 4. Convert state->audio_data to device format (any bit depth, channel count).
-    // 5. Write to device and wait for completion.
-    // 6. Close device and free resources.
-    printf("Error: Linux playback not implemented yet\n");
-    free(state->audio_data);
-    return 1;
+static int mixer_bench_case(const BenchCase *bc, const PcmKernels *const *sets) {
+    uint32_t frames = bc->in_rate * BENCH_SECONDS;
+    uint32_t block_align = bc->in_channels * sample_format_bytes[bc->in_format];
+    size_t out_samples = ((size_t)frames + MIXER_BENCH_BUFFER) * bc->out_channels;
+    uint8_t *input = bench_signal(bc, frames);
+    float *reference = malloc(out_samples * sizeof(float));
+    float *output = malloc(out_samples * sizeof(float));
+    if (!input || !reference || !output) {
+        printf("Error: Memory allocation failed\n");
+        free(input);
+        free(reference);
+        free(output);
+        return 1;
+    }
+    printf("%-4s %2u->%-2u %-7s", sample_format_names[bc->in_format], bc->in_channels, bc->out_channels,
+           bench_signal_names[bc->signal]);
+    const PcmKernels *saved = pcm_kernels;
+    int mismatch = 0;
+    for (int s = 0; sets[s]; s++) {
+        pcm_kernels = sets[s];
+        PlaybackState state = { 0 };
+        state.output_channels = bc->out_channels;
+        state.output_bits_per_channel = 32;
+        state.output_is_float = 1;
+        state.output_sample_rate = bc->out_rate;
+        if (mixer_init(&state) != 0) {
+            mismatch = 1;
+            break;
+        }
+        Mixer *mixer = state.mixer;
+        uint64_t voice_frames = 0;
+        for (uint32_t v = 0; v < MIXER_MAX_VOICES; v++) {
+            Track *track = &mixer->voices[v].track;
+            track->audio_data = input; // Shared, so detached again before mixer_free
+            track->data_size = (uint64_t)frames * block_align;
+            track->offset = (uint64_t)(v * 7919u % frames) * block_align;
+            track->block_align = block_align;
+            track->sample_rate = bc->in_rate;
+            track->num_channels = bc->in_channels;
+            track->bits_per_sample = bc->in_format == SAMPLE_U8 ? 8 : sample_format_bytes[bc->in_format] * 8;
+            track->is_float = bc->in_format == SAMPLE_F32;
+            converter_init(&track->converter, track, &state);
+            voice_frames += frames - track->offset / block_align;
+        }
+        float *bus = s == 0 ? reference : output;
+        uint32_t frame_size = bc->out_channels * sizeof(float);
+        double best = 0.0;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            for (uint32_t v = 0; v < MIXER_MAX_VOICES; v++) {
+                mixer_start(mixer, v, 1.0f / MIXER_MAX_VOICES, (float)v / (MIXER_MAX_VOICES - 1) * 2.0f - 1.0f);
+            }
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            size_t at = 0;
+            while (mixer_render(mixer, (uint8_t *)(bus + at), MIXER_BENCH_BUFFER, frame_size) > 0) {
+                at += (size_t)MIXER_BENCH_BUFFER * bc->out_channels;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            best = repeat == 0 || elapsed < best ? elapsed : best;
+        }
+        for (uint32_t v = 0; v < MIXER_MAX_VOICES; v++) {
+            mixer->voices[v].track.audio_data = NULL;
+        }
+        mixer_free(mixer);
+        double ns_per_voice_frame = best * 1e9 / voice_frames;
+        printf(" %8.0f", ns_per_voice_frame > 0 ? 1e9 / (ns_per_voice_frame * 48000) : 0.0);
+        // Summing order is the same, only the decoders differ, and those match exactly
+        for (size_t i = 0; s > 0 && i < (size_t)frames * bc->out_channels; i++) {
+            mismatch |= !(fabsf(output[i] - reference[i]) <= 1e-6f);
+        }
+    }
+    pcm_kernels = saved;
+    printf(" %s\n", mismatch ? "MISMATCH" : "ok");
+    free(input);
+    free(reference);
+    free(output);
+    return mismatch;
+}
 
-#else
-    // TODO: Implement playback for other platforms (e.g., BSD, etc.)
-    printf("Error: Unsupported platform\n");
-    free(state->audio_data);
-    return 1;
-#endif
+static int run_mixer_benchmark(const PcmKernels *const *sets) {
+    const BenchCase cases[] = {
+        { SAMPLE_S16, SAMPLE_F32, 2, 2, 48000, 48000, SIGNAL_NOISE, RESAMPLE_MEDIUM },
+        { SAMPLE_S24, SAMPLE_F32, 1, 2, 48000, 48000, SIGNAL_NOISE, RESAMPLE_MEDIUM },
+        { SAMPLE_F32, SAMPLE_F32, 2, 2, 48000, 48000, SIGNAL_NOISE, RESAMPLE_MEDIUM },
+        { SAMPLE_S16, SAMPLE_F32, 6, 2, 48000, 48000, SIGNAL_NOISE, RESAMPLE_MEDIUM },
+    };
+    printf("\nMixer benchmark: voices one core sustains at 48 kHz, from %d in %d-frame buffers, best of %d\n",
+           MIXER_MAX_VOICES, MIXER_BENCH_BUFFER, BENCH_REPEATS);
+    printf("%-4s %-6s %-7s", "in", "ch", "signal");
+    for (int s = 0; sets[s]; s++) {
+        printf(" %8s", sets[s]->name);
+    }
+    printf(" check\n");
+    int mismatches = 0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        mismatches += mixer_bench_case(&cases[c], sets);
+    }
+    return mismatches;
+}
+
+// Time every format pair, signal, channel layout and resampling ratio of interest
+static int run_benchmark(void) {
+    const PcmKernels *sets[PCM_KERNEL_SETS_MAX + 1];
+    pcm_kernel_sets(sets);
+    BenchCase cases[64];
+    int count = 0;
+    for (int in = SAMPLE_U8; in < SAMPLE_FORMAT_COUNT; in++) {
+        for (int out = SAMPLE_S16; out < SAMPLE_FORMAT_COUNT; out++) {
+            cases[count++] = (BenchCase){ in, out, 2, 2, 48000, 48000, SIGNAL_SINE, RESAMPLE_MEDIUM };
+        }
+    }
+    for (int signal = SIGNAL_NOISE; signal < SIGNAL_COUNT; signal++) {
+        cases[count++] = (BenchCase){ SAMPLE_S16, SAMPLE_S16, 2, 2, 48000, 48000, signal, RESAMPLE_MEDIUM };
+        cases[count++] = (BenchCase){ SAMPLE_F32, SAMPLE_S16, 2, 2, 48000, 48000, signal, RESAMPLE_MEDIUM };
+    }
+    static const uint16_t layouts[][2] = { { 1, 2 }, { 2, 1 }, { 2, 6 }, { 6, 2 }, { 6, 6 }, { 8, 2 }, { 8, 8 } };
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        cases[count++] = (BenchCase){ SAMPLE_S16, SAMPLE_S16, layouts[l][0], layouts[l][1], 48000, 48000,
+                                      SIGNAL_SINE, RESAMPLE_MEDIUM };
+    }
+    static const uint32_t rates[][2] = { { 44100, 48000 }, { 48000, 44100 }, { 48000, 96000 }, { 96000, 48000 } };
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (int quality = 0; quality < RESAMPLE_QUALITY_COUNT; quality++) {
+            cases[count++] = (BenchCase){ SAMPLE_S16, SAMPLE_F32, 2, 2, rates[r][0], rates[r][1], SIGNAL_SINE, quality };
+        }
+    }
+
+    printf("Conversion benchmark: ns per output frame, best of %d over %d s of audio\n", BENCH_REPEATS, BENCH_SECONDS);
+    printf("%-4s %-4s %-6s %-13s %-7s %-6s", "in", "out", "ch", "rate", "signal", "resamp");
+    for (int s = 0; sets[s]; s++) {
+        printf(" %8s", sets[s]->name);
+    }
+    printf(" %8s %6s %s\n", "Mframe/s", "speed", "check");
+    int mismatches = 0;
+    for (int c = 0; c < count; c++) {
+        mismatches += bench_case(&cases[c], sets);
+    }
+    if (mismatches > 0) {
+        printf("%d cases where a vector kernel set disagrees with scalar\n", mismatches);
+    }
+    return mismatches + run_effects_benchmark(sets) + run_mixer_benchmark(sets) + run_flac_benchmark();
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <wav_file>\n", argv[0]);
+    int stream = 0;
+    int map = 0;
+    uint32_t ring_frames = 0;
+    const char *kernels = NULL;
+    int check_kernels = 0;
+    int bench = 0;
+    const char *output = NULL;
+    OutputFormat requested = {0};
+    uint32_t period_frames = 0;
+    uint32_t buffer_frames = 0;
+    float stats_interval = 0.0f;
+    const char *stats_path = NULL;
+    const char *control_path = NULL;
+    const char *effects_path = NULL;
+    int mix = 0;
+    int prerender = 0;
+    const char *batch_dir = NULL;
+    uint32_t jobs = 0;
+    double start_seconds = 0;
+    int probe = 0;
+    const char *probe_cache = NULL;
+    int loudness = 0;
+    int loudness_sidecar = 0;
+    int peaks = 0;
+    double peaks_follow = 0;
+    WavHeader raw = {0};
+    int raw_input = 0;
+    ResampleQuality resample_quality = RESAMPLE_MEDIUM;
+    Playlist playlist = {0};
+    int usage = 0;
+    for (int i = 1; i < argc && !usage; i++) {
+        if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            map = 1;
+        } else if (strcmp(argv[i], "--ring-frames") == 0 && i + 1 < argc) {
+            ring_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--kernels") == 0 && i + 1 < argc) {
+            kernels = argv[++i];
+        } else if (strcmp(argv[i], "--check-kernels") == 0) {
+            check_kernels = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--output-format") == 0 && i + 1 < argc) {
+            SampleFormat format = SAMPLE_FORMAT_COUNT;
+            for (int f = SAMPLE_S16; f < SAMPLE_FORMAT_COUNT; f++) {
+                if (strcmp(argv[i + 1], sample_format_names[f]) == 0) {
+                    format = (SampleFormat)f;
+                }
+            }
+            if (format == SAMPLE_FORMAT_COUNT) {
+                usage = 1;
+            } else {
+                requested.bits_per_channel = sample_format_bytes[format] * 8;
+                requested.is_float = format == SAMPLE_F32;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--output-channels") == 0 && i + 1 < argc) {
+            requested.channels = (uint16_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--output-rate") == 0 && i + 1 < argc) {
+            requested.sample_rate = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--resample-quality") == 0 && i + 1 < argc) {
+            resample_quality = RESAMPLE_QUALITY_COUNT;
+            for (int q = 0; q < RESAMPLE_QUALITY_COUNT; q++) {
+                if (strcmp(argv[i + 1], resample_quality_names[q]) == 0) {
+                    resample_quality = (ResampleQuality)q;
+                }
+            }
+            usage = resample_quality == RESAMPLE_QUALITY_COUNT;
+            i++;
+        } else if (strcmp(argv[i], "--period-frames") == 0 && i + 1 < argc) {
+            period_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--buffer-frames") == 0 && i + 1 < argc) {
+            buffer_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_interval = strtof(argv[++i], NULL);
+            usage = !(stats_interval > 0);
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            control_path = argv[++i];
+        } else if (strcmp(argv[i], "--effects") == 0 && i + 1 < argc) {
+            effects_path = argv[++i];
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            mix = 1;
+        } else if (strcmp(argv[i], "--prerender") == 0) {
+            prerender = 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_dir = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--probe") == 0) {
+            probe = 1;
+        } else if (strcmp(argv[i], "--probe-cache") == 0 && i + 1 < argc) {
+            probe_cache = argv[++i];
+        } else if (strcmp(argv[i], "--loudness") == 0) {
+            loudness = 1;
+        } else if (strcmp(argv[i], "--loudness-tags") == 0) {
+            loudness = loudness_sidecar = 1;
+        } else if (strcmp(argv[i], "--peaks") == 0) {
+            peaks = 1;
+        } else if (strcmp(argv[i], "--peaks-follow") == 0 && i + 1 < argc) {
+            peaks = 1;
+            peaks_follow = strtod(argv[++i], NULL);
+            usage = !(peaks_follow > 0);
+        } else if (strcmp(argv[i], "--raw") == 0 && i + 1 < argc) {
+            // FMT:CHANNELS:RATE
+            char name[8] = "";
+            unsigned channels = 0, rate = 0;
+            int format = SAMPLE_FORMAT_COUNT;
+            if (sscanf(argv[++i], "%7[^:]:%u:%u", name, &channels, &rate) == 3) {
+                for (int f = SAMPLE_U8; f < SAMPLE_FORMAT_COUNT; f++) {
+                    format = strcmp(name, sample_format_names[f]) == 0 ? f : format;
+                }
+            }
+            usage = format == SAMPLE_FORMAT_COUNT || channels == 0 || channels > UINT16_MAX;
+            if (!usage) {
+                raw.audio_format = format == SAMPLE_F32 ? 3 : 1;
+                raw.num_channels = (uint16_t)channels;
+                raw.sample_rate = rate;
+                raw.bits_per_sample = (uint16_t)(sample_format_bytes[format] * 8);
+                raw.block_align = (uint16_t)(raw.num_channels * sample_format_bytes[format]);
+                raw.byte_rate = raw.sample_rate * raw.block_align;
+                raw_input = 1;
+            }
+        } else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) {
+            start_seconds = strtod(argv[++i], NULL);
+            usage = !(start_seconds >= 0);
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage = 1;
+        } else if (playlist_add_argument(&playlist, argv[i]) != 0) {
+            return 1;
+        }
+    }
+    if (usage || (playlist.count == 0 && !check_kernels && !bench) || (stream && map) ||
+        (mix && (stream || effects_path)) || (peaks_follow > 0 && playlist.count != 1)) {
+        printf("Usage: %s [--stream | --mmap] [--ring-frames N] [--kernels NAME]\n"
+               "       [--output NAME[:FILE]] [--output-format FMT] [--output-channels N] [--output-rate HZ]\n"
+               "       [--resample-quality Q] [--period-frames N] [--buffer-frames N]\n"
+               "       [--stats SECONDS] [--stats-json FILE] [--start SECONDS] [--control SOCKET]\n"
+               "       [--effects FILE | --mix] [--prerender] [--raw FMT:CHANNELS:RATE]\n"
+               "       <audio_file | playlist.m3u | directory | ->...\n",
+               argv[0]);
+        printf("       %s --batch DIR [--jobs N] [--output-format FMT] [--output-channels N] [--output-rate HZ]\n"
+               "       [--resample-quality Q] <audio_file | playlist.m3u | directory>...\n", argv[0]);
+        printf("       %s --probe [--jobs N] [--probe-cache FILE] <audio_file | playlist.m3u | directory>...\n",
+               argv[0]);
+        printf("       %s --loudness | --loudness-tags [--jobs N] <audio_file | playlist.m3u | directory>...\n",
+               argv[0]);
+        printf("       %s --peaks <audio_file | playlist.m3u | directory>... | --peaks-follow SECONDS <audio_file>\n",
+               argv[0]);
+        printf("       %s --check-kernels | --bench\n", argv[0]);
+        printf("  --stream         Prefetch the data chunk in the background instead of loading it whole\n");
+        printf("  --mmap           Play straight from a shared memory mapping of the file\n");
+        printf("  --ring-frames N  Frames converted ahead of the device (default %u)\n", RING_DEFAULT_FRAMES);
+        printf("  --kernels NAME   Force the sample conversion kernels (scalar, sse2, avx2, neon)\n");
+        printf("  --check-kernels  Compare every vector kernel with the scalar reference and exit\n");
+        printf("  --bench          Time conversion, effects and mixing for every kernel set, and FLAC decoding\n");
+        printf("  --output NAME    Output backend (default: the audio device):\n");
+        for (size_t i = 0; i < OUTPUT_BACKEND_COUNT; i++) {
+            printf("                     %-10s %s\n", output_backends[i].name, output_backends[i].description);
+        }
+        printf("  --output-format FMT  Sample format for file, null and batch outputs (s16, s24, s32, f32)\n");
+        printf("  --output-channels N  Channel count for file, null and batch outputs\n");
+        printf("  --output-rate HZ     Sample rate for file, null and batch outputs, resampling if it differs\n");
+        printf("  --resample-quality Q Resampler quality against CPU cost (low, medium, high; default medium)\n");
+        printf("  --period-frames N    Device period: frames per wakeup (ALSA)\n");
+        printf("  --buffer-frames N    Device buffer size in frames, bounds output latency (ALSA)\n");
+        printf("  --stats SECONDS      Print device callback load, underruns and xruns at this interval\n");
+        printf("  --stats-json FILE    Keep FILE updated with the device callback counters as JSON\n");
+        printf("  --batch DIR          Convert every file into DIR in parallel instead of playing; files found\n"
+               "                       under a directory argument keep their subdirectories below it\n");
+        printf("  --jobs N             Worker threads for --batch, --probe and --loudness (default: one per core)\n");
+        printf("  --probe              List the format, length and tags of every file instead of playing\n");
+        printf("  --probe-cache FILE   Cache for --probe (default ~/.cache/audioplayer-probe.cache)\n");
+        printf("  --loudness           Measure EBU R128 loudness, loudness range, true peak and the ReplayGain\n"
+               "                       gain of every file, and of all of them as an album, instead of playing\n");
+        printf("  --loudness-tags      As --loudness, also writing the values as tags to FILE.replaygain\n");
+        printf("  --peaks              Build the waveform overview of every file (min, max and RMS of every 256,\n"
+               "                       4096 and 65536 frames) into FILE.peaks, or bring it up to date\n");
+        printf("  --peaks-follow SECONDS  As --peaks for one file being recorded, extending the overview as it\n"
+               "                       grows until it has not for SECONDS\n");
+        printf("  -                    Play standard input as it arrives: a WAV stream (its data size may be\n"
+               "                       unknown) or, with --raw, headerless PCM. Commands then come only\n"
+               "                       from --control, and nothing can seek\n");
+        printf("  --raw FMT:CHANNELS:RATE  Format of headerless PCM on standard input (u8, s16, s24, s32, f32)\n");
+        printf("  --start SECONDS      Start the first track this far in\n");
+        printf("  --control SOCKET     Take commands as datagrams on a UNIX socket while a device plays:\n"
+               "                       pause, resume, toggle, stop, seek SECONDS, seek +/-SECONDS.\n"
+               "                       stdin takes the same commands one per line, or keys on a terminal\n");
+        printf("  --effects FILE       Process the output through the effects in FILE, one per line, in order\n"
+               "                       gain, EQ bands, limiter:\n"
+               "                         gain DB\n"
+               "                         eq peak HZ DB Q | eq lowshelf|highshelf HZ DB [Q] | eq lowpass|highpass HZ [Q]\n"
+               "                         limiter CEILING_DB [LOOKAHEAD_MS (5) [RELEASE_MS (50)]]\n"
+               "                       Adds the command gain DB to --control\n");
+        printf("  --mix                Play every file at once, each on its own mixer voice (up to %d), from\n"
+               "                       memory at the rate of the first. Replaces seek in --control with\n"
+               "                       play FILE [DB [PAN]], stop VOICE, gain VOICE DB, pan VOICE PAN\n",
+               MIXER_MAX_VOICES);
+        printf("  --prerender          Convert each file whole into the output format before it plays, and keep\n"
+               "                       the result for replays (up to %llu MB), so playing it again or on another\n"
+               "                       --mix voice converts nothing. Only files up to %llu MB converted are held;\n"
+               "                       longer ones, streams, stdin and, outside --mix, files at another rate\n"
+               "                       than the output (so they stay gapless) play as usual. With --mix, files\n"
+               "                       at another rate are resampled to the mix rate\n",
+               RENDER_CACHE_BYTES >> 20, RENDER_ASSET_BYTES >> 20);
         return 1;
     }
 
-    PlaybackState state = {0};
-    float duration = 0.0f;
+    // Pick the conversion kernels for this CPU
+    int err;
+    if (pcm_kernels_init(kernels) != 0) {
+        return 1;
+    }
+    if (check_kernels) {
+        printf("Checking conversion kernels against scalar reference:\n");
+        return pcm_kernels_check() == 0 ? 0 : 1;
+    }
+    if (bench) {
+        return run_benchmark() == 0 ? 0 : 1;
+    }
+    if (loudness) {
+        err = run_loudness(&playlist, loudness_sidecar, jobs);
+        playlist_free(&playlist);
+        return err != 0 ? 1 : 0;
+    }
+    if (peaks) {
+        err = run_peaks(&playlist, peaks_follow);
+        playlist_free(&playlist);
+        return err != 0 ? 1 : 0;
+    }
+    if (probe) {
+        err = run_probe(&playlist, probe_cache, jobs);
+        playlist_free(&playlist);
+        return err != 0 ? 1 : 0;
+    }
+    if (batch_dir) {
+        err = run_batch(&playlist, batch_dir, &requested, resample_quality, jobs);
+        playlist_free(&playlist);
+        return err != 0 ? 1 : 0;
+    }
+    printf("Conversion kernels: %s\n", pcm_kernels->name);
 
-    // Read WAV file
-    if (read_wav_file(argv[1], &state, &duration) != 0) {
+    OutputBackend *backend = find_output_backend(output);
+    if (!backend) {
+        if (output) {
+            printf("Error: Unknown output '%s'\n", output);
+        } else {
+            printf("Error: No audio device backend on this platform, use --output null or --output wav:FILE\n");
+        }
         return 1;
     }
+    backend->period_frames = period_frames;
+    backend->buffer_frames = buffer_frames;
 
-    // Play audio (platform-specific)
-    if (play_audio(&state, duration) != 0) {
+    EffectsConfig effects;
+    if (effects_path && effects_load(effects_path, &effects) != 0) {
+        playlist_free(&playlist);
         return 1;
     }
 
-    return 0;
+    PlaybackState state = {0};
+    state.ring_frames = ring_frames;
+    state.effects_config = effects_path ? &effects : NULL;
+    state.mix = mix;
+    state.prerender = prerender;
+    state.resample_quality = resample_quality;
+    state.stats_interval = stats_interval;
+    state.stats_path = stats_path;
+    state.control_path = control_path;
+    state.playlist = playlist;
+    state.source = stream ? SOURCE_STREAM : map ? SOURCE_MAP : SOURCE_LOAD;
+    state.raw_input = raw_input ? &raw : NULL;
+    for (uint32_t i = 0; i < playlist.count; i++) {
+        state.stdin_input |= strcmp(playlist.files[i], "-") == 0;
+    }
+
+    // Read the first WAV file, or just its headers when streaming or mapping; the
+    // rest of the playlist is opened in the background as each track plays
+    if (open_next_track(&state, &state.track) != 0) {
+        playlist_free(&state.playlist);
+        return 1;
+    }
+    if (state.playlist.count > 1 && !mix) {
+        printf("Track %u/%u: %s (%.2f seconds)\n", state.track.index + 1, state.playlist.count,
+               state.track.filename, state.track.duration);
+    }
+    if (start_seconds > 0) {
+        struct timespec seek_start, seek_end;
+        clock_gettime(CLOCK_MONOTONIC, &seek_start);
+        err = track_seek(&state.track, (uint64_t)(start_seconds * state.track.sample_rate));
+        clock_gettime(CLOCK_MONOTONIC, &seek_end);
+        if (err) {
+            printf("Error: Cannot seek in %s\n", state.track.filename);
+            track_close(&state.track);
+            playlist_free(&state.playlist);
+            return 1;
+        }
+        printf("Seek: frame %llu of %llu in %.1f us\n",
+               (unsigned long long)(state.track.offset / state.track.block_align),
+               (unsigned long long)(state.track.data_size / state.track.block_align),
+               elapsed_ns(&seek_start, &seek_end) / 1e3);
+    }
+
+    // Play every track through the chosen output
+    err = play_audio(&state, backend, &requested);
+    playlist_free(&state.playlist);
+    return err != 0 ? 1 : 0;
 }